@@ -548,6 +548,7 @@ enum {
     MSTORE_LARGE_OBJECTS,
     MSTORE_DA_MERGE,
     MSTORE_STATS,
+    MSTORE_RANGE_TOMBSTONES,
 };
 
 
@@ -663,8 +664,24 @@ struct castle_btree_type {
 
 #define MTREE_NODE_SIZE     (10) /* In blocks */
 
+#define BLOOM_FORMAT_BLOCKS     (0)     /**< Bits of a key spread over a disk block.          */
+#define BLOOM_FORMAT_LINES      (1)     /**< Bits of a key in one cache line of a page.       */
+
+/**
+ * Bloom filter effectiveness counters, one set per CPU.
+ */
+struct castle_bloom_stats {
+    uint64_t                  queries;           /**< Lookups that consulted the filter.     */
+    uint64_t                  negatives;         /**< Lookups the filter ruled out.          */
+    uint64_t                  false_positives;   /**< Let through, but not in the tree.      */
+    uint64_t                  ios_saved;         /**< Btree node reads avoided by negatives. */
+    uint64_t                  lookup_ns;         /**< Time spent answering queries.          */
+};
+
 typedef struct castle_bloom_filter {
     uint8_t                   num_hashes;
+    uint8_t                   bits_per_element;
+    uint8_t                   format;
     uint32_t                  block_size_pages;
     uint32_t                  num_chunks;
     uint32_t                  num_blocks_last_chunk;
@@ -673,10 +690,13 @@ typedef struct castle_bloom_filter {
     struct castle_btree_type *btree;
     c_ext_id_t                ext_id;
     void                     *private; /* used for builds */
-#ifdef CASTLE_BLOOM_FP_STATS
-    atomic64_t                queries;
-    atomic64_t                false_positives;
-#endif
+    struct castle_bloom_stats *stats;            /**< Per-CPU counters, may be NULL.         */
+    struct castle_bloom_resident *resident;      /**< In-memory copy, RCU protected.         */
+    struct list_head          resident_list;     /**< Position on the residency list.        */
+    uint8_t                   resident_registered;
+    uint8_t                   resident_busy;     /**< Resident copy being loaded or evicted. */
+    uint64_t                  resident_score;    /**< Decayed negatives, ranks residency.    */
+    uint64_t                  resident_negatives;/**< Negatives at the last rebalance.       */
 } castle_bloom_t;
 
 struct castle_bbp_entry
@@ -701,6 +721,7 @@ struct castle_component_tree {
     atomic_t            ref_count;
     atomic_t            write_ref_count;
     atomic64_t          item_count;        /**< Number of items in the tree.                    */
+    uint64_t            nr_tombstones;     /**< Tombstones in the tree (RO trees only).         */
     btree_t             btree_type;
     uint8_t             dynamic;           /**< 1 - dynamic modlist btree, 0 - merge result.    */
     c_da_t              da;
@@ -721,6 +742,12 @@ struct castle_component_tree {
     struct list_head    da_list;
     struct list_head    hash_list;
     struct list_head    large_objs;
+    struct list_head    value_exts;        /**< Data extents of other CTs holding some of this
+                                                CT's medium objects. Immutable once the CT is
+                                                added to the DA.                                */
+    struct list_head    range_tombstones;  /**< Range tombstones, @see castle_range_tombstone.
+                                                Only added to T0s, under the DA lock and within
+                                                CASTLE_TRANSACTION.                             */
     struct mutex        lo_mutex;          /**< Protects Large Object List. When working with
                                                 the output CT of a serialisable merge, never
                                                 take this lock before serdes.mutex or there will
@@ -731,6 +758,12 @@ struct castle_component_tree {
     atomic64_t          large_ext_chk_cnt;
     uint8_t             bloom_exists;
     castle_bloom_t      bloom;
+    c_ext_pos_t         first_leaf;        /**< Leaf holding the smallest key (RO trees only).  */
+    c_ext_pos_t         last_leaf;         /**< Leaf holding the largest key (RO trees only).   */
+    void               *min_key;           /**< Cached smallest key, read from first_leaf.      */
+    void               *max_key;           /**< Cached largest key, read from last_leaf.        */
+    struct castle_memtable *memtable;      /**< In-memory index of a T0 whose tree extent holds
+                                                its write-ahead log instead of btree nodes.     */
 #ifdef CASTLE_PERF_DEBUG
     u64                 bt_c2bsync_ns;
     u64                 data_c2bsync_ns;
@@ -745,14 +778,53 @@ struct castle_large_obj_entry {
     struct list_head    list;
 };
 
+/**
+ * Data extent referenced by a merged CT, for medium objects which were left in place by
+ * the merge (value-log mode). The CT holds a reference on the extent.
+ */
+struct castle_value_ext_entry {
+    c_ext_id_t          ext_id;
+    uint64_t            size;              /**< Bytes of medium objects in the extent.          */
+    uint64_t            live;              /**< Of which referenced by the CT.                  */
+    struct list_head    list;
+};
+
+/**
+ * Range tombstone, deletes in one go all the keys of a hypercube visible in a version.
+ *
+ * It is added to the T0s current when the range was removed (its origin). It hides the
+ * matching entries from its version and its ancestors in all older CTs, and in its origin
+ * T0, which gets replaced before a covered key is written to it again in that version.
+ * Keys are hashed to T0s by CPU, so one range tombstone is added per T0, each only covering
+ * the keys of its CPU. Merges turn the entries it covers into tombstones and carry it to
+ * the output tree, where entries from its version were all written after the remove. The
+ * last level drops it, unless entries from strict ancestors still need hiding.
+ */
+struct castle_range_tombstone {
+    c_ver_t             version;           /**< Removes the range in this version.              */
+    tree_seq_t          origin_seq;        /**< Seq of the T0 the range was removed in.         */
+    uint16_t            cpu_index;         /**< Only covers keys hashing to this CPU index, ... */
+    uint16_t            nr_cpus;           /**< ... out of this many.                           */
+    c_vl_bkey_t        *start_key;         /**< -inf on dimensions left empty by the client.   */
+    c_vl_bkey_t        *end_key;           /**< +inf on dimensions left empty by the client.   */
+    struct list_head    list;
+};
+
 struct castle_dlist_entry {
     /* align:   4 */
     /* offset:  0 */ c_da_t      id;
     /*          4 */ c_ver_t     root_version;
-    /*          8 */ uint8_t     _unused[248];
+    /*          8 */ uint8_t     compaction_policy;
+    /*          9 */ uint8_t     _pad[3];
+    /*         12 */ uint32_t    magic;         /**< DLIST_ENTRY_MAGIC if the fields past
+                                                     root_version are valid.           */
+    /*         16 */ uint8_t     _unused[240];
     /*        256 */
 } PACKED;
 
+/* Older filesystems left the fields past root_version uninitialised. */
+#define DLIST_ENTRY_MAGIC 0x0001d1e5
+
 struct castle_clist_entry {
     /* align:   8 */
     /* offset:  0 */ c_da_t          da_id;
@@ -776,10 +848,24 @@ struct castle_clist_entry {
     /*        268 */ uint8_t         bloom_exists;
     /*        269 */ uint8_t         bloom_num_hashes;
     /*        270 */ uint16_t        node_sizes[MAX_BTREE_DEPTH];
-    /*        290 */ uint8_t         _unused[222];
+    /*        290 */ uint8_t         leaf_bounds_exist;
+    /*        291 */ uint8_t         _pad[5];
+    /*        296 */ c_ext_pos_t     first_leaf;
+    /*        312 */ c_ext_pos_t     last_leaf;
+    /*        328 */ uint64_t        nr_tombstones;
+    /*        336 */ uint8_t         memtable;
+    /*        337 */ uint8_t         bloom_bits_per_element;
+    /*        338 */ uint8_t         bloom_format;
+    /*        339 */ uint8_t         _pad2[1];
+    /*        340 */ uint32_t        magic;         /**< CLIST_ENTRY_MAGIC if the fields past
+                                                         node_sizes are valid.             */
+    /*        344 */ uint8_t         _unused[168];
     /*        512 */
 } PACKED;
 
+/* Older filesystems left the fields past node_sizes uninitialised. */
+#define CLIST_ENTRY_MAGIC 0x0001c1e5
+
 /** DA merge SERDES on-disk structure.
  *
  *  @note Assumes 2 input trees, both c_immut_iter_t, and max of 10 DA levels
@@ -842,7 +928,8 @@ struct castle_dmserlist_entry {
 
     /*       1024 */ struct castle_bbp_entry     out_tree_bbp;
     /*       1094 */ uint8_t                     have_bbp;
-    /*       1095 */ uint8_t                     pad[441];
+    /*       1095 */ uint8_t                     range_tombstones_kept;
+    /*       1096 */ uint8_t                     pad[440];
     /*       1536 */
 
 } PACKED;
@@ -896,10 +983,28 @@ struct castle_lolist_entry {
     /* offset:  0 */ c_ext_id_t  ext_id;
     /*          8 */ uint64_t    length;
     /*         16 */ tree_seq_t  ct_seq;
-    /*         20 */ uint8_t     _unused[12];
+    /*         20 */ uint32_t    value_ext;     /**< LOLIST_VALUE_EXT_MAGIC if the entry
+                                                     describes a value extent, length is its
+                                                     size.                                  */
+    /*         24 */ uint64_t    live;          /**< Only valid for value extents.          */
     /*         32 */
 } PACKED;
 
+/* Older filesystems left the fields past ct_seq uninitialised, so a flag isn't enough. */
+#define LOLIST_VALUE_EXT_MAGIC 0x0001e1e5
+
+struct castle_rtlist_entry {
+    /* align:   4 */
+    /* offset:  0 */ tree_seq_t  ct_seq;
+    /*          4 */ c_ver_t     version;
+    /*          8 */ uint16_t    cpu_index;
+    /*         10 */ uint16_t    nr_cpus;
+    /*         12 */ tree_seq_t  origin_seq;
+    /*         16 */ uint8_t     start_key[VLBA_TREE_MAX_KEY_SIZE + 4];
+    /*        532 */ uint8_t     end_key[VLBA_TREE_MAX_KEY_SIZE + 4];
+    /*       1048 */
+} PACKED;
+
 enum {
     STATS_MSTORE_REBUILD_PROGRESS,
 };
@@ -950,12 +1055,17 @@ struct castle_request_timeline;
 #define CBV_CHILD_WRITE_LOCKED        (4)
 /* Temporary variable used to set the above correctly, at the right point in time */
 #define CBV_C2B_WRITE_LOCKED          (5)
+/* Key belongs to the client, it mustn't be freed on completion. */
+#define CBV_KEY_BORROWED              (6)
+/* Read has to check for DA write batches, once it is done with its T0. */
+#define CBV_DA_BATCH_CHECK            (7)
 
 typedef struct castle_bio_vec {
     c_bio_t                      *c_bio;        /**< Where this IO originated                   */
 
     void                         *key;          /**< Key we want to read                        */
     c_ver_t                       version;      /**< Version of key we want to read             */
+    c_ver_t                       found_version;/**< Version of the entry the read found        */
     int                           cpu;          /**< CPU id for this request                    */
     int                           cpu_index;    /**< CPU index (for determining correct CT)     */
     struct castle_component_tree *tree;         /**< CT to search                               */
@@ -973,9 +1083,8 @@ typedef struct castle_bio_vec {
 
     /* Bloom filters. */
     struct castle_cache_block *bloom_c2b;
-#ifdef CASTLE_BLOOM_FP_STATS
-    int bloom_positive;
-#endif
+    int bloom_positive;                         /**< Bloom let the lookup through.             */
+    struct timespec bloom_start;                /**< When the current filter was consulted.    */
 
     struct work_struct               work;      /**< Used to thread this bvec onto a workqueue  */
     union {
@@ -995,6 +1104,8 @@ typedef struct castle_bio_vec {
     void                           (*orig_complete)   (struct castle_bio_vec *, int, c_val_tup_t);
     atomic_t                         reserv_nodes;
     struct list_head                 io_list;
+    unsigned long                    queue_time; /**< When write got queued (jiffies).        */
+    int                              batch_seq;  /**< DA batch_seq the read started at.       */
 #ifdef CASTLE_DEBUG
     unsigned long                    state;
     struct castle_cache_block       *locking;
@@ -1215,12 +1326,36 @@ typedef struct castle_rq_enumerator {
     int                           sync_call; /* TODO: Cleanup, not requried */
 } c_rq_enum_t;
 
+/**
+ * Memtable iterator. Entries are copied out of the memtable into node buffers, a batch at
+ * a time.
+ *
+ * @also castle_memtable_iter_init()
+ */
+typedef struct castle_memtable_iterator {
+    struct castle_component_tree *tree;
+    int                           err;
+    c_ver_t                       version;   /**< Only return the entry visible in version,
+                                                  or all entries for INVAL_VERSION.       */
+    void                         *start_key;
+    void                         *end_key;
+    struct castle_btree_node     *bufs[2];   /**< Double buffered, so that the last key
+                                                  returned stays valid over a refill.     */
+    int                           cur_buf;   /**< Buffer entries are returned from.       */
+    int                           cur_idx;   /**< Next entry in the current buffer.       */
+    int                           completed; /**< Nothing left in the memtable.           */
+    castle_iterator_end_io_t      end_io;
+    void                         *private;
+} c_mt_iter_t;
+
 struct castle_merged_iterator;
 struct component_iterator;
 
 typedef void (*castle_merged_iterator_each_skip) (struct castle_merged_iterator *,
                                                   struct component_iterator *,
                                                   struct component_iterator *);
+typedef int  (*castle_merged_iterator_hidden)    (struct castle_merged_iterator *,
+                                                  struct component_iterator *);
 
 typedef struct castle_merged_iterator {
     int nr_iters;
@@ -1243,6 +1378,8 @@ typedef struct castle_merged_iterator {
     struct rb_root                   rb_root;
     cv_nonatomic_stats_t             stats;         /**< Stat changes during last _next().  */
     castle_merged_iterator_each_skip each_skip;
+    castle_merged_iterator_hidden    hidden;        /**< Drops cached entries, may be NULL.  */
+    int                              last_idx;      /**< Iterator of the last _next() entry. */
     castle_iterator_end_io_t         end_io;
     void                            *private;
 } c_merged_iter_t;
@@ -1254,8 +1391,16 @@ typedef struct castle_da_rq_iterator {
 
     struct ct_rq {
         struct castle_component_tree *ct;
-        c_rq_enum_t                   ct_rq_iter;
+        union {
+            c_rq_enum_t               ct_rq_iter;
+            c_mt_iter_t               mt_iter;   /**< For memtable CTs.                  */
+        };
     } *ct_rqs;
+    struct rq_range_tombstone {
+        int                            ct_idx;   /**< Index of the CT holding it.        */
+        struct castle_range_tombstone *rt;
+    } *rts;                                      /**< Range tombstones visible in version. */
+    int                       nr_rts;
     castle_iterator_end_io_t  end_io;
     void                     *private;
 } c_da_rq_iter_t;
@@ -1493,6 +1638,18 @@ struct castle_object_replace {
                                     void                         *buffer,
                                     uint32_t                      str_length,
                                     int                           partial);
+
+    /* Optional. Whole value, valid until the replace completes. Inline values are inserted
+       straight from it, rather than from a private copy. */
+    void       *(*data_get)        (struct castle_object_replace *op);
+
+    /* Replaces applied as one batch, @see castle_object_replace_batch_queue(). */
+    struct castle_object_replace *next;             /**< Next replace of the batch going to the
+                                                         same T0, space for the whole chain is
+                                                         reserved at once.                      */
+    /* Called once space has been reserved and the value written out, in place of inserting
+       the key. The key is inserted later, by castle_object_replace_insert(). */
+    void        (*prepared)        (struct castle_object_replace *op);
 };
 
 struct castle_object_get {
@@ -1556,9 +1713,11 @@ typedef struct castle_object_iterator {
     c_ver_t             version;
     c_vl_okey_t        *start_okey;
     c_vl_okey_t        *end_okey;
+    castle_iter_filter_t *filter;       /**< Optional, checked by castle_object_iter_start() */
 
     /* Rest */
     int                 err;
+    c_vl_okey_t        *lower_okey;     /**< start_okey raised to the prefix filters          */
     c_vl_bkey_t        *start_bkey;
     c_vl_bkey_t        *end_bkey;
     int                 completed;
@@ -1576,6 +1735,27 @@ typedef struct castle_object_iterator {
     struct work_struct  work;
 } castle_object_iterator_t;
 
+/**
+ * Number of entries in a key range, and the total length of their values, worked out by
+ * walking the range query iterator in the kernel.
+ */
+typedef struct castle_object_range_stats {
+    /* Filled in by the client */
+    int                 keys;           /**< Save the first and last keys                     */
+    void              (*complete)(struct castle_object_range_stats *stats, int err);
+
+    /* Results, the keys are only valid in complete() */
+    uint64_t            nr_entries;
+    uint64_t            nr_bytes;
+    c_vl_bkey_t        *first_key;      /**< NULL if !keys or there are no entries            */
+    c_vl_bkey_t        *last_key;
+
+    /* Rest */
+    void               *key_buf;        /**< Room for the first and last keys                 */
+    castle_object_iterator_t *iter;
+    struct work_struct  work;
+} castle_object_range_stats_t;
+
 int castle_superblocks_writeback(uint32_t version);
 
 void castle_ctrl_lock               (void);
@@ -1673,10 +1853,13 @@ struct castle_double_array {
     struct kobject              kobj;
     unsigned long               flags;
     int                         nr_trees;           /**< Total number of CTs in the da          */
+    atomic_t                    nr_range_tombstones;/**< Held by CTs in the da, changes under
+                                                         lock. Read without it to skip checks.  */
     struct {
         int                     nr_trees;           /**< Number of CTs at level                 */
         int                     nr_compac_trees;    /**< #trees that need to be merged          */
         struct list_head        trees;              /**< List of (nr_trees) at level            */
+        atomic64_t              size;               /**< Bytes used by RO CTs at level          */
         /* Merge related variables. */
         struct {
             unsigned long       flags;              /**< Flags on level merge.                  */
@@ -1686,7 +1869,13 @@ struct castle_double_array {
             struct castle_merge_token
                                *driver_token;
             uint32_t            units_commited;
-            struct task_struct *thread;
+            struct castle_da_merge
+                               *sched_merge;        /**< In-flight merge, parked between units
+                                                         so any scheduler worker can resume it. */
+            int                 sched_claimed;      /**< Slot currently owned by a worker.      */
+            uint32_t            sched_round;        /**< Last scheduler round that tried slot.  */
+            unsigned long       sched_retry;        /**< Don't restart failed merge before this
+                                                         (jiffies).                             */
             int                 deamortize;
             /* Merge serialisation/deserialisation */
             struct {
@@ -1766,6 +1955,7 @@ struct castle_double_array {
     struct list_head            merge_tokens;
     struct list_head            hash_list;
     int                         driver_merge;
+    c_compaction_policy_t       compaction_policy;  /**< Merge policy for levels 1+.            */
     atomic_t                    ongoing_merges;     /**< Number of ongoing merges.              */
     atomic_t                    ref_cnt;
     uint32_t                    attachment_cnt;
@@ -1779,22 +1969,44 @@ struct castle_double_array {
         struct list_head        list;               /**< List of pending write IOs              */
         struct castle_double_array *da;             /**< Back pointer to parent DA              */
         struct work_struct      work;               /**< For queue kicks                        */
+        uint64_t                next_admit;         /**< Earliest admission time (us) of the
+                                                         next write on the queue                */
+        struct timer_list       timer;              /**< Kicks the queue once a delayed write
+                                                         is due                                 */
     } *ios_waiting;                                 /**< Array of pending write IO queues,
                                                          1 queue per request-handling CPU       */
     atomic_t                    ios_waiting_cnt;    /**< Total number of pending write IOs      */
+    atomic_t                    batches;            /**< Write batches inserting their keys     */
+    atomic_t                    batch_seq;          /**< Bumped as each write batch starts      */
+    spinlock_t                  batch_waiting_lock; /**< Protects batch_waiting                 */
+    struct list_head            batch_waiting;      /**< Point lookups waiting for write batches
+                                                         to finish                              */
     atomic_t                    ios_budget;         /**< Remaining number of write IOs that can
                                                          hit T0 before they get queued          */
     int                         ios_rate;           /**< ios_budget initialiser; for throttling
                                                          writes to the btrees                   */
 
-    wait_queue_head_t           merge_waitq;        /**< Merge deamortisation wait queue        */
-    /* Merge throttling. DISABLED ATM. */
-    atomic_t                    epoch_ios;
-    atomic_t                    merge_budget;
-    wait_queue_head_t           merge_budget_waitq;
+    struct list_head            merge_sched_list;   /**< Link on merge scheduler DA list.       */
+    /* Merge and insert rate control. */
+    atomic_t                    epoch_ios;          /**< Writes admitted in current epoch.      */
+    atomic_t                    epoch_ios_wait;     /**< Admission delay of these (jiffies).    */
+    atomic_t                    merge_budget;       /**< Entries merges may do in this epoch.   */
+    struct {
+        int                     error;              /**< Backlog error in last epoch.           */
+        int                     ios_rate;           /**< Insert admission, writes per epoch.    */
+        int                     merge_pace;         /**< Merged entries per epoch.              */
+        int                     write_wait_us;      /**< Average write admission delay.         */
+        int                     write_delay_us;     /**< Per-insert delay, per write queue.     */
+    } rate_ctrl;                                    /**< @see castle_da_rate_ctrl_update()      */
+    /* Amplification stats, since DA was loaded. */
+    atomic64_t                  inserted_entries;   /**< Entries written to T0s.                */
+    atomic64_t                  merged_entries;     /**< Entries written by merges.             */
+    atomic64_t                  moved_trees;        /**< Trees moved up without a rewrite.      */
     /* Compaction (Big-merge) */
     int                         top_level;          /**< Levels in the doubling array.          */
     atomic_t                    nr_del_versions;    /**< Versions deleted since last compaction.*/
+    unsigned long               tombstones_merge;   /**< When tombstones last triggered a
+                                                         compaction (jiffies), 0 if never.      */
 
     /* General purpose structure for placing DA on a workqueue.
      * @TODO Currently used only by castle_da_levle0_modified_promote(), hence
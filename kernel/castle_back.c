@@ -11,6 +11,7 @@
 #include <linux/rbtree.h>
 #include <linux/list.h>
 #include <linux/vmalloc.h>
+#include <linux/sort.h>
 #include <asm/pgtable.h>
 
 #include "castle_public.h"
@@ -51,12 +52,55 @@ atomic_t                        conn_count;         /**< Number of active castle
 spinlock_t                      conns_lock;         /**< Protects castle_back_conns list        */
 static                LIST_HEAD(castle_back_conns); /**< List of all active castle_back_conns   */
 
+#define CASTLE_BACK_UPDATES_HASH_SIZE       (256)
+static spinlock_t               castle_back_updates_lock; /**< Protects castle_back_updates     */
+static struct list_head         castle_back_updates[CASTLE_BACK_UPDATES_HASH_SIZE];
+                                                    /**< Updates in flight, by key hash         */
+static atomic_t                 castle_back_updates_nr;   /**< Ops in castle_back_updates       */
+
+static unsigned int castle_back_dispatchers = 1;
+module_param(castle_back_dispatchers, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_back_dispatchers, "Number of threads taking requests off each connection's ring, extra ones only take range ops");
+
+static unsigned int castle_back_poll_max_us = 1000;
+module_param(castle_back_poll_max_us, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_back_poll_max_us, "Upper bound on the ring polling window connections may ask for (us)");
+
+static unsigned int castle_back_iter_readahead = 1;
+module_param(castle_back_iter_readahead, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_back_iter_readahead, "Number of buffers iterators read ahead of the client, 0-2");
+
+#define CASTLE_BACK_MAX_DISPATCHERS         (8)
+#define CASTLE_BACK_OP_KEY_SIZE             (128)   /**< Btree keys up to this size are built
+                                                         in the op.                         */
+#define CASTLE_BACK_POLL_MIN_US             (10)    /**< Polling window never shrinks below. */
+#define CASTLE_BACK_ITER_READAHEAD_MAX      (2)     /**< Max buffers read ahead per iterator. */
+
 struct castle_back_op;
+struct castle_back_conn;
+
+/**
+ * Takes requests off a connection's ring and hands them to the request CPUs.
+ *
+ * Dispatcher 0 is the ring thread, it copies requests off the ring and passes range ops on
+ * to the other dispatchers by ring index.  It processes everything else itself, so that ops
+ * on the same key reach their CPU in ring order.
+ */
+struct castle_back_dispatcher
+{
+    struct castle_back_conn *conn;
+    struct task_struct      *thread;
+    spinlock_t               lock;          /**< Protects ops                       */
+    struct list_head         ops;           /**< Requests waiting to be processed   */
+    int                      cpu_index;     /**< Round-robin CPU index for requests */
+};
 
 #define CASTLE_BACK_CONN_INITIALISED_BIT    (0)
 #define CASTLE_BACK_CONN_INITIALISED_FLAG   (1 << CASTLE_BACK_CONN_INITIALISED_BIT)
 #define CASTLE_BACK_CONN_NOTIFY_BIT         (1)
 #define CASTLE_BACK_CONN_NOTIFY_FLAG        (1 << CASTLE_BACK_CONN_NOTIFY_BIT)
+#define CASTLE_BACK_CONN_FLAT_KEYS_BIT      (2)     /**< Client uses CASTLE_KEY_FORMAT_FLAT */
+#define CASTLE_BACK_CONN_FLAT_KEYS_FLAG     (1 << CASTLE_BACK_CONN_FLAT_KEYS_BIT)
 
 struct castle_back_conn
 {
@@ -66,12 +110,14 @@ struct castle_back_conn
     unsigned long           rings_vstart;   /**< Where is the ring mapped in?       */
     castle_back_ring_t      back_ring;
     wait_queue_head_t       wait;
-    struct task_struct     *work_thread;
     struct list_head        list;           /**< Position on castle_back_conns list */
     spinlock_t              response_lock;
     atomic_t                ref_count;
-    int                     cpu;            /**< CPU id for this conn               */
-    int                     cpu_index;      /**< CPU index for this conn            */
+
+    int                     nr_dispatchers;
+    struct castle_back_dispatcher dispatchers[CASTLE_BACK_MAX_DISPATCHERS];
+    unsigned int            poll_max_us;    /**< Max ring polling window, 0 if off  */
+    unsigned int            poll_us;        /**< Current ring polling window        */
 
     /*
      * in kernel state for each operation
@@ -102,6 +148,28 @@ struct castle_back_buffer
     void              *buffer;      /**< Pointer to buffer in kernel address space          */
 };
 
+/* Read-modify-write of a key, @see castle_request_update_t. */
+struct castle_back_update
+{
+    struct castle_object_get         get;
+    struct castle_object_replace     replace;
+    void                            *arg;           /**< Copy of the request's value.       */
+    uint8_t                         *value;         /**< Current value, then the new one.   */
+    uint64_t                         value_len;
+    uint64_t                         copied;
+    uint64_t                         result;        /**< Response length.                   */
+    int                              found;
+    int                              err;
+};
+
+/* Ops that walk a key range in the kernel. */
+struct castle_back_range
+{
+    castle_object_range_stats_t      stats;
+    c_vl_okey_t                     *start_key;
+    c_vl_okey_t                     *end_key;
+};
+
 struct castle_back_op
 {
     struct list_head                 list;
@@ -118,10 +186,23 @@ struct castle_back_op
     uint64_t value_length;
     uint32_t buffer_offset;
 
+    /* Btree key of point ops, built straight from the shared buffer when the request is
+       taken off the ring.  Either points at key_buf, or is allocated if it doesn't fit. */
+    c_vl_bkey_t                     *btree_key;
+    int                              key_err;       /**< Why the key couldn't be built      */
+    uint8_t                          key_buf[CASTLE_BACK_OP_KEY_SIZE];
+
+    /* Writes ordered against updates of their key (@see castle_back_update_queue()). */
+    struct list_head                 key_list;      /**< In flight, or waiting behind one.  */
+    struct list_head                 key_waiting;   /**< Writes of the key queued behind.   */
+    int                              key_queued;    /**< On castle_back_updates.            */
+
     union
     {
         struct castle_object_replace replace;
         struct castle_object_get     get;
+        struct castle_back_range     range;
+        struct castle_back_update    update;
     };
 };
 
@@ -131,9 +212,15 @@ struct castle_back_iterator
     c_collection_id_t             collection_id;
     c_vl_okey_t                  *start_key;
     c_vl_okey_t                  *end_key;
-    /* saved key and value that couldn't fit in the buffer this time */
-    c_vl_okey_t                  *saved_key;
-    c_val_tup_t                   saved_val;
+    castle_iter_filter_t         *filter;           /**< NULL if the client gave none        */
+    /* keys and values that didn't fit in the buffer last time, or were read ahead */
+    struct list_head              queued;
+    uint32_t                      queued_bytes;
+    int                           ended;            /**< No more keys, queued aside          */
+    int                           err;              /**< Why the iterator ended early        */
+    int                           readahead_running;
+    int                           readahead_cancelled; /**< Expired while reading ahead      */
+    struct work_struct            readahead_work;
     castle_object_iterator_t     *iterator;
     /* the tail of the kv_list being built by this iterator */
     struct castle_key_value_list *kv_list_tail;
@@ -141,11 +228,25 @@ struct castle_back_iterator
     uint32_t                      kv_list_size;
     /* the amount of buffer the kv_list can fill */
     uint32_t                      buf_len;
+    /* flat key connections get a castle_iter_reply instead of a kv_list */
+    int                           flat_keys;
+    struct castle_iter_reply     *reply;
     /* Stats */
     uint64_t                      nr_keys;
     uint64_t                      nr_bytes;
 };
 
+/**
+ * Key and value queued on an iterator.
+ */
+struct castle_back_iter_kv
+{
+    struct list_head              list;
+    c_vl_okey_t                  *key;
+    c_val_tup_t                   val;
+    uint32_t                      size;             /**< Memory used, for queued_bytes      */
+};
+
 typedef void (*castle_back_stateful_op_expire_t) (struct castle_back_stateful_op *stateful_op);
 
 struct castle_back_stateful_op
@@ -893,6 +994,10 @@ static int castle_back_reply(struct castle_back_op *op, int err,
     resp.token = token;
     resp.length = length;
 
+    if (op->btree_key && op->btree_key != (c_vl_bkey_t *)op->key_buf)
+        castle_free(op->btree_key);
+    op->btree_key = NULL;
+
     debug("castle_back_reply op=%p, call_id=%d, err=%d, token=0x%x, length=%llu\n",
         op, op->req.call_id, err, token, length);
 
@@ -918,12 +1023,26 @@ static int castle_back_reply(struct castle_back_op *op, int err,
     return 0;
 }
 
-static int castle_back_key_copy_get(struct castle_back_conn *conn, c_vl_okey_t *user_key,
-                                    uint32_t key_len, c_vl_okey_t **key_out)
+static int castle_back_key_len_check(uint32_t key_len)
+{
+    if (key_len < sizeof(c_vl_okey_t) || key_len > VLBA_TREE_MAX_KEY_SIZE)
+    {
+        error("Bad key length %u\n", key_len);
+        return -ENAMETOOLONG;
+    }
+
+    return 0;
+}
+
+/**
+ * Copy a key out of a shared buffer into key, which has room for key_len bytes, checking
+ * it is a valid key.  key_len must have passed castle_back_key_len_check().
+ */
+static int castle_back_key_copy(struct castle_back_conn *conn, c_vl_okey_t *user_key,
+                                uint32_t key_len, c_vl_okey_t *key)
 {
     struct castle_back_buffer *buf;
     unsigned long user_key_start, user_key_end, buf_end;
-    c_vl_okey_t *key;
     int i, err;
 
     /*
@@ -932,13 +1051,6 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn, c_vl_okey_t *
      * a valid key
      */
 
-    if (key_len < sizeof(c_vl_okey_t) || key_len > VLBA_TREE_MAX_KEY_SIZE)
-    {
-        error("Bad key length %u\n", key_len);
-        err = -ENAMETOOLONG;
-        goto err0;
-    }
-
     /* Work out the start (inclusive), and the end point (exclusive) of the key block
        in user memory. */
     user_key_start = (unsigned long)user_key;
@@ -960,28 +1072,20 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn, c_vl_okey_t *
         goto err1;
     }
 
-    key = castle_malloc(key_len, GFP_KERNEL);
-    if (key == NULL)
-    {
-        error("Could not kmalloc for key copy!\n");
-        err = -ENOMEM;
-        goto err1;
-    }
-
     memcpy(key, castle_back_user_to_kernel(buf, user_key), key_len);
 
     if (sizeof(c_vl_okey_t) + (key->nr_dims * sizeof(c_vl_key_t *)) > key_len)
     {
         error("Too many dimensions %d\n", key->nr_dims);
         err = -EINVAL;
-        goto err2;
+        goto err1;
     }
 
     if (key->nr_dims == 0)
     {
         error("Zero-dimensional key\n");
         err = -EINVAL;
-        goto err2;
+        goto err1;
     }
 
     debug("Original key pointer %p\n", user_key);
@@ -1000,7 +1104,7 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn, c_vl_okey_t *
             error("Bad pointer 0x%lx (out of key, start=0x%lx, length=%u)\n",
                 dim_i, user_key_start, key_len);
             err = -EINVAL;
-            goto err2;
+            goto err1;
         }
 
         /* dim_i - user_key_start is the offset of the dimension within (both of) the buffers. */
@@ -1014,7 +1118,7 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn, c_vl_okey_t *
         {
             error("Dimension %d goes beyond end of buffer\n", i);
             err = -EINVAL;
-            goto err2;
+            goto err1;
         }
     }
 
@@ -1024,239 +1128,462 @@ static int castle_back_key_copy_get(struct castle_back_conn *conn, c_vl_okey_t *
     vl_okey_print(LOG_DEBUG, key);
 #endif
 
-    *key_out = key;
-
     return 0;
 
-err2: castle_free(key);
 err1: castle_back_buffer_put(conn, buf);
 err0: return err;
 }
 
 /**
- * if doesn't fit into the buffer, *buf_used will be set to 0
+ * Copy a flat key out of a shared buffer into btree_key, which has room for key_len bytes,
+ * and check it is a valid key.  key_len must have passed castle_back_key_len_check().
+ *
+ * The key is checked once copied, so it can't change under us.
  */
-static void castle_back_key_kernel_to_user(c_vl_okey_t *key, struct castle_back_buffer *buf,
-                                           unsigned long user_buf, uint32_t buf_len,
-                                           uint32_t *buf_used)
+static int castle_back_flat_key_copy(struct castle_back_conn *conn, c_vl_fkey_t *user_key,
+                                     uint32_t key_len, c_vl_bkey_t *btree_key, int empty_dims_ok)
 {
-    uint32_t i;
-    c_vl_okey_t *key_copy;
-    uint32_t total_size;
-
-#ifdef DEBUG
-    debug("castle_back_key_kernel_to_user copying key:\n");
-    vl_okey_print(LOG_DEBUG, key);
-    debug("user_buf = %p\n", (void *)user_buf);
-#endif
+    struct castle_back_buffer *buf;
+    int err;
 
-    total_size = sizeof(c_vl_okey_t) + sizeof(c_vl_key_t *) * key->nr_dims;
-    if (total_size > buf_len)
+    buf = castle_back_buffer_get(conn, (unsigned long)user_key);
+    if (!buf)
     {
-        *buf_used = 0;
-        return;
+        error("Bad user pointer %p\n", user_key);
+        return -EINVAL;
     }
-    key_copy = (c_vl_okey_t *)castle_back_user_to_kernel(buf, user_buf);
-
-    key_copy->nr_dims = key->nr_dims;
 
-    for (i = 0; i < key->nr_dims; i++)
+    if ((unsigned long)user_key + key_len > buf->user_addr + buf->size)
     {
-        uint32_t sub_key_size;
-        c_vl_key_t *vlk;
-
-        sub_key_size = sizeof(c_vl_key_t) + key->dims[i]->length;
-
-        key_copy->dims[i] = (c_vl_key_t *)(user_buf + total_size);
-        total_size += sub_key_size;
-        if (total_size > buf_len)
-        {
-            *buf_used = 0;
-            return;
-        }
-
-        vlk = castle_back_user_to_kernel(buf, key_copy->dims[i]);
-
-        vlk->length = key->dims[i]->length;
-        memcpy(vlk->key, key->dims[i]->key, key->dims[i]->length);
+        error("Key too big for buffer! (key_len = %u)\n", key_len);
+        castle_back_buffer_put(conn, buf);
+        return -EINVAL;
     }
 
-    *buf_used = total_size;
+    memcpy(btree_key, castle_back_user_to_kernel(buf, user_key), key_len);
+    castle_back_buffer_put(conn, buf);
 
-    return;
+    err = castle_object_flat_key_import(btree_key, key_len, empty_dims_ok);
+    if (err)
+        error("Bad flat key at %p, length %u\n", user_key, key_len);
+
+    return err;
 }
 
 /**
- * if doesn't fit into the buffer, *buf_used will be set to 0
+ * Object key for a flat key in a shared buffer, allocated in one piece like the keys
+ * castle_back_key_copy_get() returns.
  */
-static uint32_t castle_back_val_kernel_to_user(c_val_tup_t *val, struct castle_back_buffer *buf,
-                                           unsigned long user_buf, uint32_t buf_len,
-                                           uint32_t *buf_used, c_collection_id_t collection_id)
+static int castle_back_flat_key_copy_get(struct castle_back_conn *conn, c_vl_fkey_t *user_key,
+                                         uint32_t key_len, c_vl_okey_t **key_out)
 {
-    uint32_t length, val_length;
-    struct castle_iter_val *val_copy;
-
-    if (val->type & CVT_TYPE_INLINE)
-        val_length = val->length;
-    else
-        val_length = 0;
-
-    length = sizeof(struct castle_iter_val) + val_length;
+    c_vl_bkey_t *btree_key;
+    c_vl_okey_t *key;
+    int err;
 
-    if (buf_len < length)
-    {
-        *buf_used = 0;
-        return 0;
-    }
+    btree_key = castle_malloc(key_len, GFP_KERNEL);
+    if (btree_key == NULL)
+        return -ENOMEM;
 
-    val_copy = (struct castle_iter_val *)castle_back_user_to_kernel(buf, user_buf);
+    err = castle_back_flat_key_copy(conn, user_key, key_len, btree_key, 1 /*empty_dims_ok*/);
+    if (err)
+        goto out;
 
-    val_copy->type = val->type;
-    val_copy->length = val->length;
-    if (val->type & CVT_TYPE_INLINE)
+    key = castle_object_btree_key_okey_build(btree_key);
+    if (key == NULL)
     {
-        val_copy->val = (uint8_t *)(user_buf + sizeof(struct castle_iter_val));
-        memcpy((uint8_t *)castle_back_user_to_kernel(buf, val_copy->val), val->val, val->length);
-    } else {
-        val_copy->collection_id = collection_id;
+        err = -ENOMEM;
+        goto out;
     }
+    *key_out = key;
 
-    *buf_used = length;
+out:
+    castle_free(btree_key);
 
-    return val_length;
+    return err;
 }
 
-static void castle_back_replace_complete(struct castle_object_replace *replace, int err)
+static int castle_back_key_copy_get(struct castle_back_conn *conn, c_vl_okey_t *user_key,
+                                    uint32_t key_len, c_vl_okey_t **key_out)
 {
-    struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
+    c_vl_okey_t *key;
+    int err;
 
-    debug("castle_back_replace_complete\n");
+    err = castle_back_key_len_check(key_len);
+    if (err)
+        return err;
 
-    if (op->replace.value_len > 0)
-        castle_back_buffer_put(op->conn, op->buf);
+    if (test_bit(CASTLE_BACK_CONN_FLAT_KEYS_BIT, &conn->flags))
+        return castle_back_flat_key_copy_get(conn, (c_vl_fkey_t *)user_key, key_len, key_out);
 
-    /* Update stats. */
-    if (!err)
+    key = castle_malloc(key_len, GFP_KERNEL);
+    if (key == NULL)
     {
-        atomic64_inc(&op->attachment->put.ios);
-        atomic64_add(op->replace.value_len, &op->attachment->put.bytes);
+        error("Could not kmalloc for key copy!\n");
+        return -ENOMEM;
     }
 
-    castle_attachment_put(op->attachment);
+    err = castle_back_key_copy(conn, user_key, key_len, key);
+    if (err)
+    {
+        castle_free(key);
+        return err;
+    }
 
-    castle_back_reply(op, err, 0, 0);
+    *key_out = key;
+
+    return 0;
 }
 
-static uint32_t castle_back_replace_data_length_get(struct castle_object_replace *replace)
+/**
+ * Copy an iterator filter out of a shared buffer.  The length is read once, so the filter
+ * can't grow under us, the rest is checked by castle_object_iter_start().
+ */
+static int castle_back_iter_filter_copy_get(struct castle_back_conn *conn,
+                                            castle_iter_filter_t *user_filter,
+                                            castle_iter_filter_t **filter_out)
 {
-    struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
+    struct castle_back_buffer *buf;
+    castle_iter_filter_t *filter;
+    uint32_t filter_len;
 
-    return op->req.replace.value_len;
-}
+    buf = castle_back_buffer_get(conn, (unsigned long)user_filter);
+    if (!buf)
+    {
+        error("Bad user pointer %p\n", user_filter);
+        return -EINVAL;
+    }
 
-static void castle_back_replace_data_copy(struct castle_object_replace *replace,
-                                          void *buffer, uint32_t buffer_length, int not_last)
-{
-    struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
+    if ((unsigned long)user_filter + sizeof(castle_iter_filter_t) > buf->user_addr + buf->size)
+    {
+        error("Filter header goes beyond end of buffer\n");
+        goto err0;
+    }
 
-    debug("castle_back_replace_data_copy buffer=%p, buffer_length=%u, not_last=%d, value_len=%u\n",
-        buffer, buffer_length, not_last, op->req.replace.value_len);
+    filter_len = ((castle_iter_filter_t *)castle_back_user_to_kernel(buf, user_filter))->length
+                    + sizeof(filter->length);
+    if (filter_len < sizeof(castle_iter_filter_t) || filter_len > CASTLE_ITER_FILTER_MAX_LEN)
+    {
+        error("Bad filter length %u\n", filter_len);
+        goto err0;
+    }
 
-    if (op->req.replace.value_len == 0)
-        return;
+    if ((unsigned long)user_filter + filter_len > buf->user_addr + buf->size)
+    {
+        error("Filter too big for buffer! (filter_len = %u)\n", filter_len);
+        goto err0;
+    }
 
-    /* @TODO: actual zero copy! */
+    filter = castle_malloc(filter_len, GFP_KERNEL);
+    if (!filter)
+    {
+        castle_back_buffer_put(conn, buf);
+        return -ENOMEM;
+    }
 
-    BUG_ON(op->buffer_offset + buffer_length > op->req.replace.value_len);
+    memcpy(filter, castle_back_user_to_kernel(buf, user_filter), filter_len);
+    filter->length = filter_len - sizeof(filter->length);
+    castle_back_buffer_put(conn, buf);
 
-    memcpy(buffer, castle_back_user_to_kernel(op->buf, op->req.replace.value_ptr) + op->buffer_offset,
-        buffer_length);
+    *filter_out = filter;
 
-    op->buffer_offset += buffer_length;
+    return 0;
+
+err0: castle_back_buffer_put(conn, buf);
+    return -EINVAL;
 }
 
 /**
- * Insert/replace value at specified key,version in DA.
+ * Build the btree key for a key in a shared buffer, straight from the buffer, without
+ * copying the object key out first.
  *
- * @also castle_object_replace()
- * @also castle_back_remove()
+ * The key is built in key_buf if it is guaranteed to fit in key_buf_len bytes, otherwise in
+ * newly allocated memory.  The buffer may be changing under us, so every field of the key
+ * is read only once.  Flat keys are already btree keys, and are just copied and checked.
+ *
+ * @param empty_dims_ok Whether zero length (-inf) dimensions are allowed
+ * @param btree_key_out Set to the btree key, key_buf or allocated
+ *
+ * @also castle_back_key_copy()
  */
-static void castle_back_replace(void *data)
+static int castle_back_bkey_build(struct castle_back_conn *conn, c_vl_okey_t *user_key,
+                                  uint32_t key_len, void *key_buf, uint32_t key_buf_len,
+                                  int empty_dims_ok, c_vl_bkey_t **btree_key_out)
 {
-    struct castle_back_op *op = data;
-    struct castle_back_conn *conn = op->conn;
-    int err;
+    struct castle_back_buffer *buf;
+    unsigned long user_key_start, user_key_end;
     c_vl_okey_t *key;
+    c_vl_bkey_t *btree_key;
+    uint32_t nr_dims, size;
+    int i, err;
 
-    op->attachment = castle_attachment_get(op->req.replace.collection_id, WRITE);
-    if (op->attachment == NULL)
-    {
-        error("Collection not found id=0x%x\n", op->req.replace.collection_id);
-        err = -ENOTCONN;
-        goto err0;
-    }
-
-    err = castle_back_key_copy_get(conn, op->req.replace.key_ptr, op->req.replace.key_len, &key);
+    err = castle_back_key_len_check(key_len);
     if (err)
-        goto err1;
+        return err;
 
-    /*
-     * Get buffer with value in it and save it
-     */
-    if (op->req.replace.value_len > 0)
+    if (test_bit(CASTLE_BACK_CONN_FLAT_KEYS_BIT, &conn->flags))
     {
-        op->buf = castle_back_buffer_get(conn, (unsigned long) op->req.replace.value_ptr);
-        if (op->buf == NULL)
+        if (key_len <= key_buf_len)
+            btree_key = key_buf;
+        else if (!(btree_key = castle_malloc(key_len, GFP_KERNEL)))
+            return -ENOMEM;
+
+        err = castle_back_flat_key_copy(conn, (c_vl_fkey_t *)user_key, key_len, btree_key,
+                                        empty_dims_ok);
+        if (err)
         {
-            error("Could not get buffer for pointer=%p\n", op->req.replace.value_ptr);
-            err = -EINVAL;
-            goto err2;
+            if (btree_key != key_buf)
+                castle_free(btree_key);
+            return err;
         }
+        *btree_key_out = btree_key;
 
-        if (!castle_back_user_addr_in_buffer(op->buf,
-                    op->req.replace.value_ptr + op->req.replace.value_len - 1))
-        {
-            error("Invalid value length %u (ptr=%p)\n",
-                    op->req.replace.value_len, op->req.replace.value_ptr);
+        return 0;
+    }
+
+    user_key_start = (unsigned long)user_key;
+    user_key_end = user_key_start + (unsigned long)key_len;
+    buf = castle_back_buffer_get(conn, user_key_start);
+    if (!buf)
+    {
+        error("Bad user pointer %p\n", user_key);
+        return -EINVAL;
+    }
+
+    if (user_key_end > buf->user_addr + buf->size)
+    {
+        error("Key too big for buffer! (key_len = %u)\n", key_len);
+        err = -EINVAL;
+        goto err0;
+    }
+    key = castle_back_user_to_kernel(buf, user_key);
+
+    nr_dims = key->nr_dims;
+    if (nr_dims == 0 || sizeof(c_vl_okey_t) + (nr_dims * sizeof(c_vl_key_t *)) > key_len)
+    {
+        error("Bad number of dimensions %u\n", nr_dims);
+        err = -EINVAL;
+        goto err0;
+    }
+
+    /* Unless dimensions overlap, a btree key takes less room than the object key plus a
+       btree key header.  Overlapping dimensions fail to fit, and are rejected below. */
+    size = key_len + sizeof(c_vl_bkey_t);
+    if (size <= key_buf_len)
+        btree_key = key_buf;
+    else if (!(btree_key = castle_malloc(size, GFP_KERNEL)))
+    {
+        err = -ENOMEM;
+        goto err0;
+    }
+
+    err = castle_object_btree_key_init(btree_key, size, nr_dims);
+    if (err)
+        goto err1;
+
+    for (i = 0; i < nr_dims; i++)
+    {
+        unsigned long dim_i = (unsigned long) key->dims[i];
+        c_vl_key_t *dim;
+        uint32_t dim_len;
+
+        if ((dim_i < user_key_start) || (dim_i + sizeof(c_vl_key_t) > user_key_end))
+        {
+            error("Bad pointer 0x%lx (out of key, start=0x%lx, length=%u)\n",
+                dim_i, user_key_start, key_len);
             err = -EINVAL;
-            goto err3;
+            goto err1;
+        }
+        dim = castle_back_user_to_kernel(buf, dim_i);
+
+        dim_len = dim->length;
+        if (dim_len > user_key_end - dim_i - sizeof(c_vl_key_t))
+        {
+            error("Dimension %d goes beyond end of buffer\n", i);
+            err = -EINVAL;
+            goto err1;
+        }
+        if (dim_len == 0 && !empty_dims_ok)
+        {
+            err = -EINVAL;
+            goto err1;
         }
+
+        err = castle_object_btree_key_dim_append(btree_key, size, i, dim->key, dim_len);
+        if (err)
+            goto err1;
     }
-    else
-        op->buf = NULL;
 
-    op->buffer_offset = 0;
+    castle_back_buffer_put(conn, buf);
+    *btree_key_out = btree_key;
 
-    op->replace.value_len = op->req.replace.value_len;
-    op->replace.replace_continue = NULL;
-    op->replace.complete = castle_back_replace_complete;
-    op->replace.data_length_get = castle_back_replace_data_length_get;
-    op->replace.data_copy = castle_back_replace_data_copy;
+    return 0;
 
-    err = castle_object_replace(&op->replace, op->attachment, key, op->cpu_index, 0);
-    if (err)
-        goto err3;
+err1: if (btree_key != key_buf) castle_free(btree_key);
+err0: castle_back_buffer_put(conn, buf);
+      return err;
+}
+
+/**
+ * Build the btree key of a point op into the op, and pick the op's CPU from it.
+ *
+ * Errors are saved in op->key_err, for the op to return once it runs.
+ */
+static void castle_back_op_key_build(struct castle_back_op *op, c_vl_okey_t *user_key,
+                                     uint32_t key_len, int empty_dims_ok)
+{
+    op->key_err = castle_back_bkey_build(op->conn, user_key, key_len, op->key_buf,
+                                         CASTLE_BACK_OP_KEY_SIZE, empty_dims_ok, &op->btree_key);
+    if (!op->key_err)
+        op->cpu_index = castle_double_array_bkey_cpu_index(op->btree_key);
+}
+
+/**
+ * if doesn't fit into the buffer, *buf_used will be set to 0
+ */
+static void castle_back_key_kernel_to_user(c_vl_okey_t *key, struct castle_back_buffer *buf,
+                                           unsigned long user_buf, uint32_t buf_len,
+                                           uint32_t *buf_used)
+{
+    uint32_t i;
+    c_vl_okey_t *key_copy;
+    uint32_t total_size;
+
+#ifdef DEBUG
+    debug("castle_back_key_kernel_to_user copying key:\n");
+    vl_okey_print(LOG_DEBUG, key);
+    debug("user_buf = %p\n", (void *)user_buf);
+#endif
+
+    total_size = sizeof(c_vl_okey_t) + sizeof(c_vl_key_t *) * key->nr_dims;
+    if (total_size > buf_len)
+    {
+        *buf_used = 0;
+        return;
+    }
+    key_copy = (c_vl_okey_t *)castle_back_user_to_kernel(buf, user_buf);
+
+    key_copy->nr_dims = key->nr_dims;
+
+    for (i = 0; i < key->nr_dims; i++)
+    {
+        uint32_t sub_key_size;
+        c_vl_key_t *vlk;
+
+        sub_key_size = sizeof(c_vl_key_t) + key->dims[i]->length;
+
+        key_copy->dims[i] = (c_vl_key_t *)(user_buf + total_size);
+        total_size += sub_key_size;
+        if (total_size > buf_len)
+        {
+            *buf_used = 0;
+            return;
+        }
+
+        vlk = castle_back_user_to_kernel(buf, key_copy->dims[i]);
+
+        vlk->length = key->dims[i]->length;
+        memcpy(vlk->key, key->dims[i]->key, key->dims[i]->length);
+    }
+
+    *buf_used = total_size;
 
-    castle_free(key);
     return;
+}
 
-err3: if (op->buf) castle_back_buffer_put(conn, op->buf);
-err2: castle_free(key);
-err1: castle_attachment_put(op->attachment);
-err0: castle_back_reply(op, err, 0, 0);
+/**
+ * Length of the flat key for an object key.
+ */
+static uint32_t castle_back_flat_key_len(c_vl_okey_t *key)
+{
+    uint32_t key_len;
+    int i;
+
+    key_len = sizeof(c_vl_fkey_t) + key->nr_dims * sizeof(uint32_t);
+    for (i = 0; i < key->nr_dims; i++)
+        key_len += key->dims[i]->length;
+
+    return key_len;
 }
 
-static void castle_back_remove_complete(struct castle_object_replace *replace, int err)
+/**
+ * Write the flat key for an object key to fkey, which has room for key_len bytes, as given
+ * by castle_back_flat_key_len().
+ */
+static void castle_back_flat_key_write(c_vl_okey_t *key, c_vl_fkey_t *fkey, uint32_t key_len)
+{
+    uint32_t offset;
+    int i;
+
+    memset(fkey, 0, sizeof(c_vl_fkey_t));
+    fkey->length  = key_len - sizeof(fkey->length);
+    fkey->nr_dims = key->nr_dims;
+    offset = sizeof(c_vl_fkey_t) + key->nr_dims * sizeof(uint32_t);
+    for (i = 0; i < key->nr_dims; i++)
+    {
+        fkey->dim_head[i] = CASTLE_FKEY_DIM_HEADER(offset);
+        memcpy((uint8_t *)fkey + offset, key->dims[i]->key, key->dims[i]->length);
+        offset += key->dims[i]->length;
+    }
+    BUG_ON(offset != key_len);
+}
+
+/**
+ * if doesn't fit into the buffer, *buf_used will be set to 0
+ */
+static uint32_t castle_back_val_kernel_to_user(c_val_tup_t *val, struct castle_back_buffer *buf,
+                                           unsigned long user_buf, uint32_t buf_len,
+                                           uint32_t *buf_used, c_collection_id_t collection_id)
+{
+    uint32_t length, val_length;
+    struct castle_iter_val *val_copy;
+
+    if (val->type & CVT_TYPE_INLINE)
+        val_length = val->length;
+    else
+        val_length = 0;
+
+    length = sizeof(struct castle_iter_val) + val_length;
+
+    if (buf_len < length)
+    {
+        *buf_used = 0;
+        return 0;
+    }
+
+    val_copy = (struct castle_iter_val *)castle_back_user_to_kernel(buf, user_buf);
+
+    val_copy->type = val->type;
+    val_copy->length = val->length;
+    if (val->type & CVT_TYPE_INLINE)
+    {
+        val_copy->val = (uint8_t *)(user_buf + sizeof(struct castle_iter_val));
+        memcpy((uint8_t *)castle_back_user_to_kernel(buf, val_copy->val), val->val, val->length);
+    } else {
+        val_copy->collection_id = collection_id;
+    }
+
+    *buf_used = length;
+
+    return val_length;
+}
+
+static void castle_back_replace_complete(struct castle_object_replace *replace, int err)
 {
     struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
 
-    debug("castle_back_remove_complete\n");
+    debug("castle_back_replace_complete\n");
+
+    castle_back_update_next(op);
+
+    if (op->replace.value_len > 0)
+        castle_back_buffer_put(op->conn, op->buf);
 
     /* Update stats. */
     if (!err)
     {
         atomic64_inc(&op->attachment->put.ios);
-        /* Replacing with Tomb Stone. Dont increment bytes. */
+        atomic64_add(op->replace.value_len, &op->attachment->put.bytes);
     }
 
     castle_attachment_put(op->attachment);
@@ -1264,194 +1591,1863 @@ static void castle_back_remove_complete(struct castle_object_replace *replace, i
     castle_back_reply(op, err, 0, 0);
 }
 
+static uint32_t castle_back_replace_data_length_get(struct castle_object_replace *replace)
+{
+    struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
+
+    return op->req.replace.value_len;
+}
+
+static void castle_back_replace_data_copy(struct castle_object_replace *replace,
+                                          void *buffer, uint32_t buffer_length, int not_last)
+{
+    struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
+
+    debug("castle_back_replace_data_copy buffer=%p, buffer_length=%u, not_last=%d, value_len=%u\n",
+        buffer, buffer_length, not_last, op->req.replace.value_len);
+
+    if (op->req.replace.value_len == 0)
+        return;
+
+    /* Medium values go straight from the shared buffer into their c2b, inline values don't
+       come through here (@see castle_back_replace_data_get()). */
+
+    BUG_ON(op->buffer_offset + buffer_length > op->req.replace.value_len);
+
+    memcpy(buffer, castle_back_user_to_kernel(op->buf, op->req.replace.value_ptr) + op->buffer_offset,
+        buffer_length);
+
+    op->buffer_offset += buffer_length;
+}
+
+static void *castle_back_replace_data_get(struct castle_object_replace *replace)
+{
+    struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
+
+    return castle_back_user_to_kernel(op->buf, op->req.replace.value_ptr);
+}
+
+static int castle_back_update_queue(struct castle_back_op *op, int update);
+static void castle_back_update_next(struct castle_back_op *op);
+
 /**
- * Remove (tombstone) value at specified key,version in DA.
+ * Insert the value of a replace, once no update of the key is in flight.
+ */
+static void castle_back_replace_apply(void *data)
+{
+    struct castle_back_op *op = data;
+    int err;
+
+    /* The key and the value buffer are held until the replace completes. */
+    err = castle_object_bkey_replace(&op->replace, op->attachment, op->btree_key,
+                                     1 /*key_borrowed*/, op->cpu_index, 0);
+    if (err)
+    {
+        castle_back_update_next(op);
+        if (op->buf)
+            castle_back_buffer_put(op->conn, op->buf);
+        castle_attachment_put(op->attachment);
+        castle_back_reply(op, err, 0, 0);
+    }
+}
+
+/**
+ * Insert/replace value at specified key,version in DA.
  *
  * @also castle_object_replace()
- * @also castle_back_replace()
+ * @also castle_back_remove()
  */
-static void castle_back_remove(void *data)
+static void castle_back_replace(void *data)
 {
     struct castle_back_op *op = data;
     struct castle_back_conn *conn = op->conn;
     int err;
-    c_vl_okey_t *key;
 
-    op->attachment = castle_attachment_get(op->req.remove.collection_id, WRITE);
+    op->attachment = castle_attachment_get(op->req.replace.collection_id, WRITE);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", op->req.replace.collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    err = op->key_err;
+    if (err)
+        goto err1;
+
+    /*
+     * Get buffer with value in it and save it
+     */
+    if (op->req.replace.value_len > 0)
+    {
+        op->buf = castle_back_buffer_get(conn, (unsigned long) op->req.replace.value_ptr);
+        if (op->buf == NULL)
+        {
+            error("Could not get buffer for pointer=%p\n", op->req.replace.value_ptr);
+            err = -EINVAL;
+            goto err1;
+        }
+
+        if (!castle_back_user_addr_in_buffer(op->buf,
+                    op->req.replace.value_ptr + op->req.replace.value_len - 1))
+        {
+            error("Invalid value length %u (ptr=%p)\n",
+                    op->req.replace.value_len, op->req.replace.value_ptr);
+            err = -EINVAL;
+            goto err3;
+        }
+    }
+    else
+        op->buf = NULL;
+
+    op->buffer_offset = 0;
+
+    op->replace.value_len = op->req.replace.value_len;
+    op->replace.replace_continue = NULL;
+    op->replace.complete = castle_back_replace_complete;
+    op->replace.data_length_get = castle_back_replace_data_length_get;
+    op->replace.data_copy = castle_back_replace_data_copy;
+    op->replace.data_get = op->buf ? castle_back_replace_data_get : NULL;
+
+    if (castle_back_update_queue(op, 0 /*update*/))
+        castle_back_replace_apply(op);
+
+    return;
+
+err3: if (op->buf) castle_back_buffer_put(conn, op->buf);
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0);
+}
+
+static void castle_back_remove_complete(struct castle_object_replace *replace, int err)
+{
+    struct castle_back_op *op = container_of(replace, struct castle_back_op, replace);
+
+    debug("castle_back_remove_complete\n");
+
+    castle_back_update_next(op);
+
+    /* Update stats. */
+    if (!err)
+    {
+        atomic64_inc(&op->attachment->put.ios);
+        /* Replacing with Tomb Stone. Dont increment bytes. */
+    }
+
+    castle_attachment_put(op->attachment);
+
+    castle_back_reply(op, err, 0, 0);
+}
+
+/**
+ * Insert the tombstone of a remove, once no update of the key is in flight.
+ */
+static void castle_back_remove_apply(void *data)
+{
+    struct castle_back_op *op = data;
+    int err;
+
+    err = castle_object_bkey_replace(&op->replace, op->attachment, op->btree_key,
+                                     1 /*key_borrowed*/, op->cpu_index, 1 /*tombstone*/);
+    if (err)
+    {
+        castle_back_update_next(op);
+        castle_attachment_put(op->attachment);
+        castle_back_reply(op, err, 0, 0);
+    }
+}
+
+/**
+ * Remove (tombstone) value at specified key,version in DA.
+ *
+ * @also castle_object_replace()
+ * @also castle_back_replace()
+ */
+static void castle_back_remove(void *data)
+{
+    struct castle_back_op *op = data;
+    int err;
+
+    op->attachment = castle_attachment_get(op->req.remove.collection_id, WRITE);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", op->req.remove.collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    err = op->key_err;
+    if (err)
+        goto err1;
+
+    op->buf = NULL;
+    op->replace.value_len = 0;
+    op->replace.replace_continue = NULL;
+    op->replace.complete = castle_back_remove_complete;
+    op->replace.data_length_get = NULL;
+    op->replace.data_copy = NULL;
+    op->replace.data_get = NULL;
+
+    if (castle_back_update_queue(op, 0 /*update*/))
+        castle_back_remove_apply(op);
+
+    return;
+
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0);
+}
+
+int castle_back_get_reply_continue(struct castle_object_get *get,
+                                   int err,
+                                   void *buffer,
+                                   uint32_t buffer_len,
+                                   int last)
+{
+    struct castle_back_op *op = container_of(get, struct castle_back_op, get);
+    void *dest = castle_back_user_to_kernel(op->buf, op->req.get.value_ptr + op->buffer_offset);
+    uint32_t to_copy = min(buffer_len, (uint32_t) (op->req.get.value_len - op->buffer_offset));
+
+    if (err)
+    {
+        castle_back_buffer_put(op->conn, op->buf);
+        castle_attachment_put(op->attachment);
+        castle_back_reply(op, err, 0, 0);
+    }
+
+    BUG_ON(!buffer);
+
+    if (to_copy > 0)
+    {
+        memcpy(dest, buffer, to_copy);
+        op->buffer_offset += to_copy;
+    }
+
+    BUG_ON(op->req.get.value_len < op->buffer_offset);
+    /* We should finish if that's the last bit of data we are going to get,
+       or if there is no more space in the shared buffer. */
+    last = last || (op->req.get.value_len == op->buffer_offset);
+
+    if (last)
+    {
+        castle_back_buffer_put(op->conn, op->buf);
+
+        /* Update stats. */
+        if (!err)
+        {
+            atomic64_inc(&op->attachment->get.ios);
+            atomic64_add(op->req.get.value_len, &op->attachment->get.bytes);
+        }
+
+        castle_attachment_put(op->attachment);
+        castle_back_reply(op, 0, 0, op->value_length);
+    }
+
+    return last;
+}
+
+int castle_back_get_reply_start(struct castle_object_get *get,
+                                int err,
+                                uint64_t data_length,
+                                void *buffer,
+                                uint32_t buffer_length)
+{
+    struct castle_back_op *op = container_of(get, struct castle_back_op, get);
+    int err_prime;
+
+    BUG_ON(buffer_length > data_length);
+
+    if (!buffer)
+    {
+        BUG_ON((data_length != 0) || (buffer_length != 0));
+        err_prime = -ENOENT;
+        goto err;
+    }
+
+    if (err)
+    {
+        err_prime = err;
+        goto err;
+    }
+
+    op->value_length = data_length;
+    op->buffer_offset = 0;
+
+    return castle_back_get_reply_continue(get,
+                                          0,
+                                          buffer,
+                                          buffer_length,
+                                          buffer_length == data_length);
+
+err:
+    castle_back_buffer_put(op->conn, op->buf);
+    castle_attachment_put(op->attachment);
+    castle_back_reply(op, err_prime, 0, 0);
+
+    /* Return value ignored if there was an error. */
+    return 0;
+}
+
+/**
+ * Look for specified key,version in DA.
+ *
+ * @also castle_object_get()
+ */
+static void castle_back_get(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_conn *conn = op->conn;
+    int err;
+
+    op->attachment = castle_attachment_get(op->req.get.collection_id, READ);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", op->req.get.collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    err = op->key_err;
+    if (err)
+        goto err1;
+
+    /*
+     * Get buffer with value in it and save it
+     */
+    op->buf = castle_back_buffer_get(conn, (unsigned long) op->req.get.value_ptr);
+    if (op->buf == NULL)
+    {
+        error("Invalid value ptr %p\n", op->req.get.value_ptr);
+        err = -EINVAL;
+        goto err1;
+    }
+
+    if (!castle_back_user_addr_in_buffer(op->buf, op->req.get.value_ptr + op->req.get.value_len - 1))
+    {
+        error("Invalid value length %d (ptr=%p)\n", op->req.get.value_len, op->req.get.value_ptr);
+        err = -EINVAL;
+        goto err3;
+    }
+
+    op->get.reply_start = castle_back_get_reply_start;
+    op->get.reply_continue = castle_back_get_reply_continue;
+
+    err = castle_object_bkey_get(&op->get, op->attachment, op->btree_key, 1 /*key_borrowed*/,
+                                 op->cpu_index);
+    if (err)
+        goto err3;
+
+    return;
+
+err3: castle_back_buffer_put(conn, op->buf);
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0);
+}
+
+/**** MULTI GET ****/
+
+/* Batch state up to this size is kmalloc()ed, only bigger batches fall back to vmalloc(). */
+#define CASTLE_BACK_BATCH_KMALLOC_MAX   (2 * PAGE_SIZE)
+
+/**
+ * Allocate memory for the state of a multi key (batch) request.
+ *
+ * Most batches are small, don't pay for vmalloc() (and its TLB flushes on free) for them.
+ */
+static void *castle_back_batch_alloc(size_t size)
+{
+    if (size <= CASTLE_BACK_BATCH_KMALLOC_MAX)
+        return castle_malloc(size, GFP_KERNEL);
+
+    return castle_vmalloc(size);
+}
+
+/**
+ * Free memory allocated by castle_back_batch_alloc() for size bytes.
+ */
+static void castle_back_batch_free(void *ptr, size_t size)
+{
+    if (size <= CASTLE_BACK_BATCH_KMALLOC_MAX)
+        castle_free(ptr);
+    else
+        castle_vfree(ptr);
+}
+
+/*
+ * A multi get answers many keys with one ring slot, one work item per request CPU and one
+ * response.  Keys are grouped by the CPU (and so the T0) that owns them, then submitted in
+ * btree key order, so that lookups of neighbouring keys go down the same btree nodes and
+ * bloom filter blocks one after the other, while they are hot in the cache.
+ */
+
+struct castle_back_multi_get;
+
+struct castle_back_multi_get_key {
+    struct castle_object_get          get;
+    struct castle_back_multi_get     *mget;
+    uint32_t                          idx;          /**< Position of the key in the request. */
+    int                               cpu_index;
+    c_vl_bkey_t                      *btree_key;
+    uint32_t                          offset;       /**< Of the value in the buffer.         */
+    uint64_t                          length;       /**< Of the value.                       */
+    uint64_t                          copied;
+};
+
+struct castle_back_multi_get_group {
+    struct castle_back_multi_get     *mget;
+    uint32_t                          start;        /**< First key of the group, sorted.     */
+    uint32_t                          end;
+    struct work_struct                work;
+};
+
+struct castle_back_multi_get {
+    struct castle_back_op             *op;
+    struct castle_back_multi_get_key  *keys;        /**< In request order.                   */
+    struct castle_back_multi_get_key **sorted;      /**< By CPU, then btree key.             */
+    struct castle_back_multi_get_group *groups;     /**< One per CPU with keys.              */
+    castle_key_ptr_t                  *key_ptrs;    /**< Copy of the request's key array.    */
+    void                              *key_arena;   /**< Holds the btree keys.               */
+    size_t                             size;        /**< Of this structure and its arrays.   */
+    size_t                             arena_size;
+    spinlock_t                         lock;        /**< Protects used.                      */
+    uint32_t                           used;        /**< Bytes of the buffer handed out.     */
+    atomic_t                           remaining;   /**< Keys not answered yet.              */
+    atomic_t                           found;
+    atomic64_t                         bytes;
+};
+
+static void castle_back_multi_get_complete(struct castle_back_multi_get *mget)
+{
+    struct castle_back_op *op = mget->op;
+    uint32_t used = mget->used;
+
+    /* Update stats. */
+    atomic64_add(atomic_read(&mget->found), &op->attachment->get.ios);
+    atomic64_add(atomic64_read(&mget->bytes), &op->attachment->get.bytes);
+
+    castle_back_buffer_put(op->conn, op->buf);
+    castle_attachment_put(op->attachment);
+    castle_back_batch_free(mget->key_arena, mget->arena_size);
+    castle_back_batch_free(mget, mget->size);
+
+    castle_back_reply(op, 0, 0, used);
+}
+
+/**
+ * Record the result of a key, completing the multi get if it was the last one.
+ */
+static void castle_back_multi_get_key_done(struct castle_back_multi_get_key *key,
+                                           int err,
+                                           uint64_t length)
+{
+    struct castle_back_multi_get *mget = key->mget;
+    castle_request_multi_get_t *req = &mget->op->req.multi_get;
+    struct castle_multi_get_val *val;
+
+    val = castle_back_user_to_kernel(mget->op->buf,
+                (struct castle_multi_get_val *)req->buffer_ptr + key->idx);
+    val->err    = err;
+    val->length = length;
+    val->val    = err ? NULL : (uint8_t *)(req->buffer_ptr + key->offset);
+
+    if (!err)
+    {
+        atomic_inc(&mget->found);
+        atomic64_add(length, &mget->bytes);
+    }
+
+    if (atomic_dec_and_test(&mget->remaining))
+        castle_back_multi_get_complete(mget);
+}
+
+static int castle_back_multi_get_reply_continue(struct castle_object_get *get,
+                                                int err,
+                                                void *buffer,
+                                                uint32_t buffer_len,
+                                                int last)
+{
+    struct castle_back_multi_get_key *key =
+                container_of(get, struct castle_back_multi_get_key, get);
+    castle_request_multi_get_t *req = &key->mget->op->req.multi_get;
+    uint64_t to_copy;
+
+    if (err)
+    {
+        castle_back_multi_get_key_done(key, err, 0);
+        return 1;
+    }
+
+    to_copy = min((uint64_t)buffer_len, key->length - key->copied);
+    if (to_copy > 0)
+    {
+        memcpy(castle_back_user_to_kernel(key->mget->op->buf,
+                                          req->buffer_ptr + key->offset + key->copied),
+               buffer, to_copy);
+        key->copied += to_copy;
+    }
+
+    last = last || (key->copied == key->length);
+    if (last)
+        castle_back_multi_get_key_done(key, 0, key->length);
+
+    return last;
+}
+
+static int castle_back_multi_get_reply_start(struct castle_object_get *get,
+                                             int err,
+                                             uint64_t data_length,
+                                             void *buffer,
+                                             uint32_t buffer_length)
+{
+    struct castle_back_multi_get_key *key =
+                container_of(get, struct castle_back_multi_get_key, get);
+    struct castle_back_multi_get *mget = key->mget;
+    uint32_t buffer_len = mget->op->req.multi_get.buffer_len;
+    int fits;
+
+    BUG_ON(buffer_length > data_length);
+
+    if (err || !buffer)
+    {
+        castle_back_multi_get_key_done(key, err ? err : -ENOENT, 0);
+        /* Return value ignored if there was an error. */
+        return 0;
+    }
+
+    /* Values are packed in the order they arrive. */
+    spin_lock(&mget->lock);
+    fits = (data_length <= buffer_len - mget->used);
+    if (fits)
+    {
+        key->offset = mget->used;
+        mget->used  = min((uint64_t)buffer_len, mget->used + ALIGN(data_length, 8));
+    }
+    spin_unlock(&mget->lock);
+
+    if (!fits)
+    {
+        castle_back_multi_get_key_done(key, -ENOSPC, data_length);
+        return 1;
+    }
+
+    key->length = data_length;
+    key->copied = 0;
+
+    return castle_back_multi_get_reply_continue(get,
+                                                0,
+                                                buffer,
+                                                buffer_length,
+                                                buffer_length == data_length);
+}
+
+/**
+ * Submit the lookups of the keys of one CPU.
+ */
+static void castle_back_multi_get_group_do(struct work_struct *work)
+{
+    struct castle_back_multi_get_group *group =
+                container_of(work, struct castle_back_multi_get_group, work);
+    struct castle_back_multi_get *mget = group->mget;
+    struct castle_back_multi_get_key *key;
+    uint32_t i, end = group->end;
+    int err;
+
+    /* The multi get may complete, and go away, as soon as the last key is submitted. */
+    for (i = group->start; i < end; i++)
+    {
+        key = mget->sorted[i];
+        key->get.reply_start    = castle_back_multi_get_reply_start;
+        key->get.reply_continue = castle_back_multi_get_reply_continue;
+
+        err = castle_object_bkey_get(&key->get, mget->op->attachment, key->btree_key,
+                                     1 /*key_borrowed*/, key->cpu_index);
+        if (err)
+            castle_back_multi_get_key_done(key, err, 0);
+    }
+}
+
+static int castle_back_multi_get_key_compare(const void *a, const void *b)
+{
+    struct castle_back_multi_get_key *key_a = *(struct castle_back_multi_get_key **)a;
+    struct castle_back_multi_get_key *key_b = *(struct castle_back_multi_get_key **)b;
+
+    if (key_a->cpu_index != key_b->cpu_index)
+        return key_a->cpu_index < key_b->cpu_index ? -1 : 1;
+
+    return castle_object_btree_key_compare(key_a->btree_key, key_b->btree_key);
+}
+
+/**
+ * Look up a batch of keys, @see castle_request_multi_get_t.
+ *
+ * @also castle_back_get()
+ */
+static void castle_back_multi_get(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_conn *conn = op->conn;
+    castle_request_multi_get_t *req = &op->req.multi_get;
+    struct castle_back_buffer *keys_buf;
+    struct castle_back_multi_get *mget;
+    struct castle_back_multi_get_key *key;
+    castle_key_ptr_t *key_ptrs;
+    uint32_t i, nr_keys, nr_groups, arena_size;
+    size_t size;
+    void *arena;
+    int err;
+
+    nr_keys = req->nr_keys;
+    if (nr_keys == 0 || nr_keys > CASTLE_MULTI_GET_MAX_KEYS)
+    {
+        error("Bad number of keys %u\n", nr_keys);
+        err = -EINVAL;
+        goto err0;
+    }
+
+    op->attachment = castle_attachment_get(req->collection_id, READ);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", req->collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    keys_buf = castle_back_buffer_get(conn, (unsigned long) req->keys_ptr);
+    if (keys_buf == NULL)
+    {
+        error("Invalid keys ptr %p\n", req->keys_ptr);
+        err = -EINVAL;
+        goto err1;
+    }
+    op->buf = NULL;
+    mget = NULL;
+    if (!castle_back_user_addr_in_buffer(keys_buf, (void *)(req->keys_ptr + nr_keys) - 1))
+    {
+        error("Keys array of %u keys at %p overruns its buffer\n", nr_keys, req->keys_ptr);
+        err = -EINVAL;
+        goto err2;
+    }
+    key_ptrs = castle_back_user_to_kernel(keys_buf, req->keys_ptr);
+
+    /* The buffer must at least hold the results. */
+    op->buf = castle_back_buffer_get(conn, (unsigned long) req->buffer_ptr);
+    if (op->buf == NULL
+            || req->buffer_len < nr_keys * sizeof(struct castle_multi_get_val)
+            || !castle_back_user_addr_in_buffer(op->buf, req->buffer_ptr + req->buffer_len - 1))
+    {
+        error("Invalid buffer ptr %p, length %u\n", req->buffer_ptr, req->buffer_len);
+        err = -EINVAL;
+        goto err2;
+    }
+
+    size = sizeof(struct castle_back_multi_get)
+                + nr_keys * (sizeof(struct castle_back_multi_get_key)
+                                + sizeof(struct castle_back_multi_get_key *)
+                                + sizeof(castle_key_ptr_t))
+                + castle_double_array_request_cpus() * sizeof(struct castle_back_multi_get_group);
+    mget = castle_back_batch_alloc(size);
+    if (!mget)
+    {
+        err = -ENOMEM;
+        goto err2;
+    }
+    mget->size      = size;
+    mget->op        = op;
+    mget->keys      = (struct castle_back_multi_get_key *)(mget + 1);
+    mget->sorted    = (struct castle_back_multi_get_key **)(mget->keys + nr_keys);
+    mget->key_ptrs  = (castle_key_ptr_t *)(mget->sorted + nr_keys);
+    mget->groups    = (struct castle_back_multi_get_group *)(mget->key_ptrs + nr_keys);
+    mget->key_arena = NULL;
+
+    /* Work off a copy of the key array, userspace may still be changing it. */
+    memcpy(mget->key_ptrs, key_ptrs, nr_keys * sizeof(castle_key_ptr_t));
+    castle_back_buffer_put(conn, keys_buf);
+    keys_buf = NULL;
+
+    /* All btree keys are built straight from the shared buffers into one arena. */
+    arena_size = 0;
+    for (i = 0; i < nr_keys; i++)
+    {
+        err = castle_back_key_len_check(mget->key_ptrs[i].key_len);
+        if (err)
+            goto err3;
+        arena_size += ALIGN(mget->key_ptrs[i].key_len + sizeof(c_vl_bkey_t), 8);
+    }
+    mget->arena_size = arena_size;
+    arena = mget->key_arena = castle_back_batch_alloc(arena_size);
+    if (!arena)
+    {
+        err = -ENOMEM;
+        goto err3;
+    }
+
+    for (i = 0; i < nr_keys; i++)
+    {
+        key = &mget->keys[i];
+        memset(key, 0, sizeof(struct castle_back_multi_get_key));
+        key->mget = mget;
+        key->idx  = i;
+
+        err = castle_back_bkey_build(conn,
+                                     mget->key_ptrs[i].key_ptr,
+                                     mget->key_ptrs[i].key_len,
+                                     arena,
+                                     mget->key_ptrs[i].key_len + sizeof(c_vl_bkey_t),
+                                     1 /*empty_dims_ok*/,
+                                     &key->btree_key);
+        if (err)
+            goto err3;
+        BUG_ON(key->btree_key != arena);
+        arena += ALIGN(mget->key_ptrs[i].key_len + sizeof(c_vl_bkey_t), 8);
+
+        key->cpu_index = castle_double_array_bkey_cpu_index(key->btree_key);
+        mget->sorted[i] = key;
+    }
+
+    sort(mget->sorted, nr_keys, sizeof(struct castle_back_multi_get_key *),
+         castle_back_multi_get_key_compare, NULL);
+
+    nr_groups = 0;
+    for (i = 0; i < nr_keys; i++)
+    {
+        if (i == 0 || mget->sorted[i]->cpu_index != mget->sorted[i-1]->cpu_index)
+        {
+            mget->groups[nr_groups].mget  = mget;
+            mget->groups[nr_groups].start = i;
+            nr_groups++;
+        }
+        mget->groups[nr_groups-1].end = i + 1;
+    }
+
+    spin_lock_init(&mget->lock);
+    mget->used = nr_keys * sizeof(struct castle_multi_get_val);
+    atomic_set(&mget->remaining, nr_keys);
+    atomic_set(&mget->found, 0);
+    atomic64_set(&mget->bytes, 0);
+
+    /* mget stays around until the last group is queued, its keys are outstanding till then. */
+    for (i = 0; i < nr_groups; i++)
+    {
+        CASTLE_INIT_WORK(&mget->groups[i].work, castle_back_multi_get_group_do);
+        queue_work_on(castle_double_array_request_cpu(mget->sorted[mget->groups[i].start]->cpu_index),
+                      castle_back_wq, &mget->groups[i].work);
+    }
+
+    return;
+
+err3: if (mget->key_arena) castle_back_batch_free(mget->key_arena, mget->arena_size);
+      castle_back_batch_free(mget, mget->size);
+err2: if (op->buf) castle_back_buffer_put(conn, op->buf);
+      if (keys_buf) castle_back_buffer_put(conn, keys_buf);
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0);
+}
+
+/**** WRITE BATCH ****/
+
+/*
+ * A write batch applies many replaces and removes from one shared buffer with one ring slot
+ * and one response, atomically.
+ *
+ * Entries are grouped by the CPU (and so the T0) that owns them and sorted by btree key.  Space
+ * is reserved for each group at once and all the values are written out first; if anything
+ * fails up to that point, the whole batch is abandoned before any key is visible.  Keys are then
+ * inserted in btree key order, so that consecutive inserts land in the same, cache hot, T0
+ * leaves, with the DA batch lock held: point lookups see either all of the batch or none of it.
+ */
+
+struct castle_back_write_batch;
+
+struct castle_back_write_batch_entry {
+    struct castle_object_replace      replace;
+    struct castle_back_write_batch   *batch;
+    uint32_t                          idx;          /**< Position of the entry in the request. */
+    int                               cpu_index;
+    int                               tombstone;
+    int                               prepared;     /**< Value written out, key not inserted.  */
+    c_vl_bkey_t                      *btree_key;
+    void                             *value;        /**< Kernel address of the value.          */
+    uint32_t                          value_len;
+    uint32_t                          value_offset; /**< Amount of the value copied so far.    */
+};
+
+struct castle_back_write_batch {
+    struct castle_back_op                 *op;
+    struct castle_back_write_batch_entry  *entries;     /**< In request order.                */
+    struct castle_back_write_batch_entry **sorted;      /**< By CPU, then btree key.          */
+    castle_write_batch_entry_t            *user_entries; /**< Copy of the request's entries. */
+    void                                  *key_arena;   /**< Holds the btree keys.            */
+    size_t                                 size;        /**< Of this structure and its arrays. */
+    size_t                                 arena_size;
+    uint32_t                               nr_inserts;  /**< Entries left after superseded ones
+                                                             are dropped, first in sorted[].  */
+    uint32_t                               nr_superseded; /**< Entries overwritten in the batch. */
+    spinlock_t                             lock;        /**< Protects err, err_idx.           */
+    int                                    err;         /**< Of the first entry that failed.  */
+    uint32_t                               err_idx;
+    int                                    inserting;   /**< Keys are being inserted (or the
+                                                             batch abandoned).                */
+    int                                    locked;      /**< Holds the DA batch lock.         */
+    atomic_t                               remaining;   /**< Entries not prepared (or inserted)
+                                                             yet.                             */
+    atomic_t                               applied;
+    atomic64_t                             bytes;
+    struct work_struct                     work;
+};
+
+static void castle_back_write_batch_complete(struct castle_back_write_batch *batch)
+{
+    struct castle_back_op *op = batch->op;
+    uint32_t applied = atomic_read(&batch->applied);
+    int err = batch->err;
+
+    /* Let lookups back into the T0s before anything else. */
+    if (batch->locked)
+        castle_double_array_batch_unlock(op->attachment);
+
+    /* Update stats. */
+    atomic64_add(applied, &op->attachment->put.ios);
+    atomic64_add(atomic64_read(&batch->bytes), &op->attachment->put.bytes);
+
+    castle_back_buffer_put(op->conn, op->buf);
+    castle_attachment_put(op->attachment);
+    if (!err)
+        applied += batch->nr_superseded;
+    castle_back_batch_free(batch->key_arena, batch->arena_size);
+    castle_back_batch_free(batch, batch->size);
+
+    castle_back_reply(op, err, 0, applied);
+}
+
+static void castle_back_write_batch_apply(struct work_struct *work);
+
+/**
+ * Account for an entry that got prepared, or failed, before any key was inserted.
+ * The last one schedules the inserts (or abandons the batch).
+ */
+static void castle_back_write_batch_entry_ready(struct castle_back_write_batch *batch)
+{
+    if (atomic_dec_and_test(&batch->remaining))
+    {
+        /* Taking the DA batch lock may block, don't do it from the DA or btree workqueues. */
+        CASTLE_INIT_WORK(&batch->work, castle_back_write_batch_apply);
+        queue_work(castle_back_wq, &batch->work);
+    }
+}
+
+static void castle_back_write_batch_entry_prepared(struct castle_object_replace *replace)
+{
+    struct castle_back_write_batch_entry *entry =
+                container_of(replace, struct castle_back_write_batch_entry, replace);
+
+    entry->prepared = 1;
+    castle_back_write_batch_entry_ready(entry->batch);
+}
+
+static void castle_back_write_batch_entry_complete(struct castle_object_replace *replace,
+                                                   int err)
+{
+    struct castle_back_write_batch_entry *entry =
+                container_of(replace, struct castle_back_write_batch_entry, replace);
+    struct castle_back_write_batch *batch = entry->batch;
+
+    /* Entries abandoned because of another entry's failure don't change the error. */
+    if (err && !(batch->inserting && batch->err))
+    {
+        spin_lock(&batch->lock);
+        if (!batch->err || entry->idx < batch->err_idx)
+        {
+            batch->err     = err;
+            batch->err_idx = entry->idx;
+        }
+        spin_unlock(&batch->lock);
+    }
+    else if (!err)
+    {
+        atomic_inc(&batch->applied);
+        atomic64_add(entry->value_len, &batch->bytes);
+    }
+
+    if (!batch->inserting)
+    {
+        /* Failed before its value was written out. */
+        castle_back_write_batch_entry_ready(batch);
+        return;
+    }
+
+    if (atomic_dec_and_test(&batch->remaining))
+        castle_back_write_batch_complete(batch);
+}
+
+static uint32_t castle_back_write_batch_data_length_get(struct castle_object_replace *replace)
+{
+    struct castle_back_write_batch_entry *entry =
+                container_of(replace, struct castle_back_write_batch_entry, replace);
+
+    return entry->value_len;
+}
+
+static void castle_back_write_batch_data_copy(struct castle_object_replace *replace,
+                                              void *buffer, uint32_t buffer_length, int not_last)
+{
+    struct castle_back_write_batch_entry *entry =
+                container_of(replace, struct castle_back_write_batch_entry, replace);
+
+    if (entry->value_len == 0)
+        return;
+
+    BUG_ON(entry->value_offset + buffer_length > entry->value_len);
+
+    memcpy(buffer, entry->value + entry->value_offset, buffer_length);
+
+    entry->value_offset += buffer_length;
+}
+
+static void *castle_back_write_batch_data_get(struct castle_object_replace *replace)
+{
+    struct castle_back_write_batch_entry *entry =
+                container_of(replace, struct castle_back_write_batch_entry, replace);
+
+    return entry->value;
+}
+
+/**
+ * Insert the keys of all the entries, once every value has been written out.  If any entry
+ * failed, abandon the others instead.
+ */
+static void castle_back_write_batch_apply(struct work_struct *work)
+{
+    struct castle_back_write_batch *batch =
+                container_of(work, struct castle_back_write_batch, work);
+    struct castle_back_write_batch_entry *entry;
+    uint32_t i, nr_prepared;
+    int err = batch->err;
+
+    nr_prepared = 0;
+    for (i = 0; i < batch->nr_inserts; i++)
+        if (batch->sorted[i]->prepared)
+            nr_prepared++;
+    BUG_ON(!err && (nr_prepared != batch->nr_inserts));
+
+    /* One extra, so that the batch can't complete before all entries are handed off. */
+    atomic_set(&batch->remaining, nr_prepared + 1);
+    batch->inserting = 1;
+    if (!err)
+    {
+        castle_double_array_batch_lock(batch->op->attachment);
+        batch->locked = 1;
+    }
+
+    for (i = 0; i < batch->nr_inserts; i++)
+    {
+        entry = batch->sorted[i];
+        if (!entry->prepared)
+            continue;
+        if (err)
+            castle_object_replace_abort(&entry->replace, err);
+        else
+            castle_object_replace_insert(&entry->replace);
+    }
+
+    if (atomic_dec_and_test(&batch->remaining))
+        castle_back_write_batch_complete(batch);
+}
+
+static int castle_back_write_batch_entry_compare(const void *a, const void *b)
+{
+    struct castle_back_write_batch_entry *entry_a = *(struct castle_back_write_batch_entry **)a;
+    struct castle_back_write_batch_entry *entry_b = *(struct castle_back_write_batch_entry **)b;
+    int ret;
+
+    if (entry_a->cpu_index != entry_b->cpu_index)
+        return entry_a->cpu_index < entry_b->cpu_index ? -1 : 1;
+
+    ret = castle_object_btree_key_compare(entry_a->btree_key, entry_b->btree_key);
+    if (ret)
+        return ret;
+
+    /* Later entries for the same key overwrite earlier ones. */
+    return entry_a->idx < entry_b->idx ? -1 : 1;
+}
+
+/**
+ * Apply a batch of replaces and removes atomically, @see castle_request_write_batch_t.
+ *
+ * The whole batch is validated before anything is inserted, a malformed batch is not
+ * applied at all.
+ *
+ * @also castle_back_replace()
+ * @also castle_back_remove()
+ */
+static void castle_back_write_batch(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_conn *conn = op->conn;
+    castle_request_write_batch_t *req = &op->req.write_batch;
+    struct castle_back_write_batch *batch;
+    struct castle_back_write_batch_entry *entry;
+    castle_write_batch_entry_t *user_entries, *user_entry;
+    uint32_t i, j, nr_entries, nr_inserts, arena_size;
+    size_t size;
+    void *arena;
+    int err;
+
+    nr_entries = req->nr_entries;
+    if (nr_entries == 0 || nr_entries > CASTLE_WRITE_BATCH_MAX_ENTRIES)
+    {
+        error("Bad number of entries %u\n", nr_entries);
+        err = -EINVAL;
+        goto err0;
+    }
+
+    op->attachment = castle_attachment_get(req->collection_id, WRITE);
+    if (op->attachment == NULL)
+    {
+        error("Collection not found id=0x%x\n", req->collection_id);
+        err = -ENOTCONN;
+        goto err0;
+    }
+
+    /* Entries and values all live in one buffer, held until the batch completes. */
+    op->buf = castle_back_buffer_get(conn, (unsigned long) req->entries_ptr);
+    if (op->buf == NULL)
+    {
+        error("Invalid entries ptr %p\n", req->entries_ptr);
+        err = -EINVAL;
+        goto err1;
+    }
+    batch = NULL;
+    if (!castle_back_user_addr_in_buffer(op->buf, (void *)(req->entries_ptr + nr_entries) - 1))
+    {
+        error("Entries array of %u entries at %p overruns its buffer\n",
+                nr_entries, req->entries_ptr);
+        err = -EINVAL;
+        goto err2;
+    }
+    user_entries = castle_back_user_to_kernel(op->buf, req->entries_ptr);
+
+    size = sizeof(struct castle_back_write_batch)
+                + nr_entries * (sizeof(struct castle_back_write_batch_entry)
+                                  + sizeof(struct castle_back_write_batch_entry *)
+                                  + sizeof(castle_write_batch_entry_t));
+    batch = castle_back_batch_alloc(size);
+    if (!batch)
+    {
+        err = -ENOMEM;
+        goto err2;
+    }
+    batch->size         = size;
+    batch->op           = op;
+    batch->entries      = (struct castle_back_write_batch_entry *)(batch + 1);
+    batch->sorted       = (struct castle_back_write_batch_entry **)(batch->entries + nr_entries);
+    batch->user_entries = (castle_write_batch_entry_t *)(batch->sorted + nr_entries);
+    batch->key_arena    = NULL;
+
+    /* Work off a copy of the entries, userspace may still be changing them. */
+    memcpy(batch->user_entries, user_entries, nr_entries * sizeof(castle_write_batch_entry_t));
+
+    /* All btree keys are built straight from the shared buffers into one arena. */
+    arena_size = 0;
+    for (i = 0; i < nr_entries; i++)
+    {
+        err = castle_back_key_len_check(batch->user_entries[i].key_len);
+        if (err)
+            goto err2;
+        arena_size += ALIGN(batch->user_entries[i].key_len + sizeof(c_vl_bkey_t), 8);
+    }
+    batch->arena_size = arena_size;
+    arena = batch->key_arena = castle_back_batch_alloc(arena_size);
+    if (!arena)
+    {
+        err = -ENOMEM;
+        goto err2;
+    }
+
+    for (i = 0; i < nr_entries; i++)
+    {
+        entry = &batch->entries[i];
+        memset(entry, 0, sizeof(struct castle_back_write_batch_entry));
+        entry->batch = batch;
+        entry->idx   = i;
+
+        user_entry = &batch->user_entries[i];
+        entry->tombstone = !!(user_entry->flags & CASTLE_WRITE_BATCH_REMOVE);
+        if (!entry->tombstone && user_entry->value_len > 0)
+        {
+            if ((unsigned long) user_entry->value_ptr < op->buf->user_addr
+                    || !castle_back_user_addr_in_buffer(op->buf,
+                                user_entry->value_ptr + user_entry->value_len - 1))
+            {
+                error("Invalid value ptr %p, length %u\n",
+                        user_entry->value_ptr, user_entry->value_len);
+                err = -EINVAL;
+                goto err2;
+            }
+            entry->value     = castle_back_user_to_kernel(op->buf, user_entry->value_ptr);
+            entry->value_len = user_entry->value_len;
+        }
+
+        err = castle_back_bkey_build(conn,
+                                     user_entry->key_ptr,
+                                     user_entry->key_len,
+                                     arena,
+                                     user_entry->key_len + sizeof(c_vl_bkey_t),
+                                     0 /*empty_dims_ok*/,
+                                     &entry->btree_key);
+        if (err)
+            goto err2;
+        BUG_ON(entry->btree_key != arena);
+        arena += ALIGN(user_entry->key_len + sizeof(c_vl_bkey_t), 8);
+
+        entry->cpu_index = castle_double_array_bkey_cpu_index(entry->btree_key);
+        batch->sorted[i] = entry;
+    }
+
+    sort(batch->sorted, nr_entries, sizeof(struct castle_back_write_batch_entry *),
+         castle_back_write_batch_entry_compare, NULL);
+
+    /* Drop entries overwritten later in the batch. */
+    nr_inserts = 0;
+    batch->nr_superseded = 0;
+    for (i = 0; i < nr_entries; i++)
+    {
+        entry = batch->sorted[i];
+        if (i + 1 < nr_entries
+                && batch->sorted[i+1]->cpu_index == entry->cpu_index
+                && castle_object_btree_key_compare(batch->sorted[i+1]->btree_key,
+                                                   entry->btree_key) == 0)
+        {
+            batch->nr_superseded++;
+            continue;
+        }
+        batch->sorted[nr_inserts++] = entry;
+    }
+    batch->nr_inserts = nr_inserts;
+
+    spin_lock_init(&batch->lock);
+    batch->err = 0;
+    batch->err_idx = 0;
+    batch->inserting = 0;
+    batch->locked = 0;
+    atomic_set(&batch->applied, 0);
+    atomic64_set(&batch->bytes, 0);
+
+    /* Set up all the replaces before anything is queued, nothing is reserved yet if one fails. */
+    for (i = 0; i < nr_inserts; i++)
+    {
+        entry = batch->sorted[i];
+        err = castle_object_bkey_replace_init(&entry->replace, op->attachment, entry->btree_key,
+                                              1 /*key_borrowed*/, entry->cpu_index,
+                                              entry->tombstone);
+        if (err)
+        {
+            /* Abandon the replaces set up so far, the last one completes the batch. */
+            batch->err = err;
+            batch->inserting = 1;
+            atomic_set(&batch->remaining, i + 1);
+            for (j = 0; j < i; j++)
+                castle_object_replace_abort(&batch->sorted[j]->replace, err);
+            if (atomic_dec_and_test(&batch->remaining))
+                castle_back_write_batch_complete(batch);
+            return;
+        }
+        entry->replace.value_len        = entry->value_len;
+        entry->replace.replace_continue = NULL;
+        entry->replace.complete         = castle_back_write_batch_entry_complete;
+        entry->replace.data_length_get  = castle_back_write_batch_data_length_get;
+        entry->replace.data_copy        = castle_back_write_batch_data_copy;
+        entry->replace.data_get         = entry->value ? castle_back_write_batch_data_get : NULL;
+        entry->replace.prepared         = castle_back_write_batch_entry_prepared;
+        /* Chain the entries of each T0 together, their space gets reserved at once. */
+        if (i > 0 && batch->sorted[i-1]->cpu_index == entry->cpu_index)
+            batch->sorted[i-1]->replace.next = &entry->replace;
+    }
+
+    /* One extra, so that the inserts can't start before all the chains are queued. */
+    atomic_set(&batch->remaining, nr_inserts + 1);
+
+    for (i = 0; i < nr_inserts; i++)
+        if (i == 0 || batch->sorted[i-1]->cpu_index != batch->sorted[i]->cpu_index)
+            castle_object_replace_batch_queue(&batch->sorted[i]->replace);
+    castle_back_write_batch_entry_ready(batch);
+
+    return;
+
+err2: if (batch && batch->key_arena) castle_back_batch_free(batch->key_arena, batch->arena_size);
+      if (batch) castle_back_batch_free(batch, batch->size);
+      castle_back_buffer_put(conn, op->buf);
+err1: castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0);
+}
+
+/**** UPDATES ****/
+
+/*
+ * An update reads the value of a key, works out the new one and writes it back.  Point ops of
+ * a key all run on the key's request CPU, but they interleave there while they wait for IO, so
+ * that alone doesn't make an update atomic.  Updates of a key are serialised here instead: one
+ * is in flight at a time, the rest wait behind it, in order.  Plain replaces and removes of a
+ * key with an update in flight wait behind it too, so they can't land between its read and its
+ * write.  Keys of different collections are told apart.
+ */
+
+static void castle_back_update_read(void *data);
+
+static struct list_head *castle_back_update_bucket(struct castle_back_op *op)
+{
+    return &castle_back_updates[(castle_object_btree_key_dims_hash(op->btree_key)
+                                    + op->attachment->col.id) % CASTLE_BACK_UPDATES_HASH_SIZE];
+}
+
+/**
+ * Queue a write behind the update in flight for its key, or behind the write queued behind
+ * one, if there is one.
+ *
+ * Updates which can go ahead are put in flight.  Plain replaces and removes which can go
+ * ahead aren't, they only wait for updates.
+ *
+ * @param update    [in] op is an update
+ *
+ * @return 1 if the write can go ahead
+ */
+static int castle_back_update_queue(struct castle_back_op *op, int update)
+{
+    struct list_head *bucket;
+    struct castle_back_op *other;
+
+    INIT_LIST_HEAD(&op->key_waiting);
+    op->key_queued = 0;
+
+    /* No updates in flight, nothing to wait for. */
+    if (!update && !atomic_read(&castle_back_updates_nr))
+        return 1;
+
+    bucket = castle_back_update_bucket(op);
+    spin_lock(&castle_back_updates_lock);
+    list_for_each_entry(other, bucket, key_list)
+    {
+        if ((other->attachment == op->attachment) &&
+            (castle_object_btree_key_compare(other->btree_key, op->btree_key) == 0))
+        {
+            list_add_tail(&op->key_list, &other->key_waiting);
+            op->key_queued = 1;
+            spin_unlock(&castle_back_updates_lock);
+            return 0;
+        }
+    }
+    if (update)
+    {
+        list_add_tail(&op->key_list, bucket);
+        atomic_inc(&castle_back_updates_nr);
+        op->key_queued = 1;
+    }
+    spin_unlock(&castle_back_updates_lock);
+
+    return 1;
+}
+
+/**
+ * Let a write queued by castle_back_update_queue() go ahead.
+ */
+static void castle_back_update_resume(void *data)
+{
+    struct castle_back_op *op = data;
+
+    switch (op->req.tag)
+    {
+        case CASTLE_RING_UPDATE:
+            castle_back_update_read(op);
+            break;
+        case CASTLE_RING_REPLACE:
+            castle_back_replace_apply(op);
+            break;
+        case CASTLE_RING_REMOVE:
+            castle_back_remove_apply(op);
+            break;
+        default:
+            BUG();
+    }
+}
+
+/**
+ * Take a write out of flight, and let the next one for the key go ahead.
+ */
+static void castle_back_update_next(struct castle_back_op *op)
+{
+    struct castle_back_op *next = NULL;
+
+    if (!op->key_queued)
+        return;
+
+    spin_lock(&castle_back_updates_lock);
+    list_del(&op->key_list);
+    if (!list_empty(&op->key_waiting))
+    {
+        next = list_first_entry(&op->key_waiting, struct castle_back_op, key_list);
+        list_del(&next->key_list);
+        list_splice(&op->key_waiting, &next->key_waiting);
+        list_add_tail(&next->key_list, castle_back_update_bucket(next));
+    }
+    else
+        atomic_dec(&castle_back_updates_nr);
+    spin_unlock(&castle_back_updates_lock);
+
+    if (next)
+    {
+        INIT_WORK(&next->work, castle_back_update_resume, next);
+        queue_work_on(next->cpu, castle_back_wq, &next->work);
+    }
+}
+
+/**
+ * Finish an update, and let the next write of the key go ahead.
+ */
+static void castle_back_update_done(struct castle_back_op *op, int err)
+{
+    struct castle_back_update *update = &op->update;
+
+    castle_back_update_next(op);
+
+    /* Update stats. */
+    if (!err)
+    {
+        atomic64_inc(&op->attachment->put.ios);
+        atomic64_add(update->value_len, &op->attachment->put.bytes);
+    }
+
+    if (update->arg)
+        castle_free(update->arg);
+    if (update->value)
+        castle_free(update->value);
+    castle_attachment_put(op->attachment);
+
+    castle_back_reply(op, err, 0, err ? 0 : update->result);
+}
+
+static void castle_back_update_replace_complete(struct castle_object_replace *replace, int err)
+{
+    struct castle_back_update *update = container_of(replace, struct castle_back_update, replace);
+
+    castle_back_update_done(container_of(update, struct castle_back_op, update), err);
+}
+
+static uint32_t castle_back_update_data_length_get(struct castle_object_replace *replace)
+{
+    struct castle_back_update *update = container_of(replace, struct castle_back_update, replace);
+
+    return update->value_len;
+}
+
+static void castle_back_update_data_copy(struct castle_object_replace *replace,
+                                         void *buffer, uint32_t buffer_length, int not_last)
+{
+    struct castle_back_update *update = container_of(replace, struct castle_back_update, replace);
+
+    if (update->value_len == 0)
+        return;
+
+    BUG_ON(update->copied + buffer_length > update->value_len);
+
+    memcpy(buffer, update->value + update->copied, buffer_length);
+
+    update->copied += buffer_length;
+}
+
+static void *castle_back_update_data_get(struct castle_object_replace *replace)
+{
+    struct castle_back_update *update = container_of(replace, struct castle_back_update, replace);
+
+    return update->value;
+}
+
+/**
+ * Work out the new value from the current one, if found, and the request's value.
+ */
+static int castle_back_update_value_build(struct castle_back_op *op)
+{
+    castle_request_update_t *req = &op->req.update;
+    struct castle_back_update *update = &op->update;
+    uint8_t *new_value = NULL;
+    uint64_t new_len = 0;
+    int64_t counter = 0;
+
+    switch (req->type)
+    {
+        case CASTLE_UPDATE_COMPARE_AND_SET:
+            if (req->flags & CASTLE_UPDATE_FLAG_ABSENT)
+            {
+                if (update->found)
+                    return -ECANCELED;
+            }
+            else if (!update->found
+                    || murmur_hash_64(update->value, update->value_len, 0) != req->expected_hash)
+                return -ECANCELED;
+            new_len = req->value_len;
+            break;
+
+        case CASTLE_UPDATE_ADD:
+            if (update->found && update->value_len != sizeof(int64_t))
+                return -EINVAL;
+            counter  = update->found ? *(int64_t *)update->value : 0;
+            counter += *(int64_t *)update->arg;
+            new_len  = sizeof(int64_t);
+            update->result = (uint64_t)counter;
+            break;
+
+        case CASTLE_UPDATE_APPEND:
+            new_len = (update->found ? update->value_len : 0) + req->value_len;
+            if (new_len > CASTLE_UPDATE_MAX_VALUE_LEN)
+                return -EFBIG;
+            break;
+
+        default:
+            BUG();
+    }
+
+    if (new_len)
+    {
+        new_value = castle_malloc(new_len, GFP_KERNEL);
+        if (!new_value)
+            return -ENOMEM;
+    }
+
+    switch (req->type)
+    {
+        case CASTLE_UPDATE_COMPARE_AND_SET:
+            if (new_len)
+                memcpy(new_value, update->arg, new_len);
+            update->result = new_len;
+            break;
+
+        case CASTLE_UPDATE_ADD:
+            memcpy(new_value, &counter, sizeof(int64_t));
+            break;
+
+        case CASTLE_UPDATE_APPEND:
+            if (update->found && update->value_len)
+                memcpy(new_value, update->value, update->value_len);
+            memcpy(new_value + new_len - req->value_len, update->arg, req->value_len);
+            update->result = new_len;
+            break;
+    }
+
+    if (update->value)
+        castle_free(update->value);
+    update->value     = new_value;
+    update->value_len = new_len;
+
+    return 0;
+}
+
+/**
+ * Write the new value, once the current one has been read.
+ */
+static void castle_back_update_apply(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_update *update = &op->update;
+    int err;
+
+    err = update->err;
+    if (err)
+        goto err0;
+
+    err = castle_back_update_value_build(op);
+    if (err)
+        goto err0;
+
+    update->copied                   = 0;
+    update->replace.value_len        = update->value_len;
+    update->replace.replace_continue = NULL;
+    update->replace.complete         = castle_back_update_replace_complete;
+    update->replace.data_length_get  = castle_back_update_data_length_get;
+    update->replace.data_copy        = castle_back_update_data_copy;
+    update->replace.data_get         = update->value ? castle_back_update_data_get : NULL;
+
+    err = castle_object_bkey_replace(&update->replace, op->attachment, op->btree_key,
+                                     1 /*key_borrowed*/, op->cpu_index, 0 /*tombstone*/);
+    if (err)
+        goto err0;
+
+    return;
+
+err0: castle_back_update_done(op, err);
+}
+
+/**
+ * Carry on from the get callbacks, which may run with the value's cache block locked.
+ */
+static void castle_back_update_apply_queue(struct castle_back_op *op, int err)
+{
+    if (err && !op->update.err)
+        op->update.err = err;
+
+    INIT_WORK(&op->work, castle_back_update_apply, op);
+    queue_work_on(op->cpu, castle_back_wq, &op->work);
+}
+
+static int castle_back_update_reply_continue(struct castle_object_get *get,
+                                             int err,
+                                             void *buffer,
+                                             uint32_t buffer_len,
+                                             int last)
+{
+    struct castle_back_update *update = container_of(get, struct castle_back_update, get);
+    struct castle_back_op *op = container_of(update, struct castle_back_op, update);
+    uint64_t to_copy;
+
+    if (err)
+    {
+        castle_back_update_apply_queue(op, err);
+        return 1;
+    }
+
+    to_copy = min((uint64_t)buffer_len, update->value_len - update->copied);
+    if (to_copy > 0)
+    {
+        memcpy(update->value + update->copied, buffer, to_copy);
+        update->copied += to_copy;
+    }
+
+    last = last || (update->copied == update->value_len);
+    if (last)
+        castle_back_update_apply_queue(op, 0);
+
+    return last;
+}
+
+static int castle_back_update_reply_start(struct castle_object_get *get,
+                                          int err,
+                                          uint64_t data_length,
+                                          void *buffer,
+                                          uint32_t buffer_length)
+{
+    struct castle_back_update *update = container_of(get, struct castle_back_update, get);
+    struct castle_back_op *op = container_of(update, struct castle_back_op, update);
+
+    BUG_ON(buffer_length > data_length);
+
+    if (err || !buffer)
+    {
+        /* Not found is fine, the update works off an absent value. */
+        castle_back_update_apply_queue(op, err);
+        /* Return value ignored if there was an error. */
+        return 0;
+    }
+
+    if (data_length > CASTLE_UPDATE_MAX_VALUE_LEN)
+    {
+        castle_back_update_apply_queue(op, -EFBIG);
+        return 1;
+    }
+
+    update->value = castle_malloc(data_length ? data_length : 1, GFP_KERNEL);
+    if (!update->value)
+    {
+        castle_back_update_apply_queue(op, -ENOMEM);
+        return 1;
+    }
+    update->found     = 1;
+    update->value_len = data_length;
+    update->copied    = 0;
+
+    return castle_back_update_reply_continue(get,
+                                             0,
+                                             buffer,
+                                             buffer_length,
+                                             buffer_length == data_length);
+}
+
+/**
+ * Read the current value, once the update is at the front of the queue for its key.
+ */
+static void castle_back_update_read(void *data)
+{
+    struct castle_back_op *op = data;
+    struct castle_back_update *update = &op->update;
+    int err;
+
+    update->get.reply_start    = castle_back_update_reply_start;
+    update->get.reply_continue = castle_back_update_reply_continue;
+
+    err = castle_object_bkey_get(&update->get, op->attachment, op->btree_key,
+                                 1 /*key_borrowed*/, op->cpu_index);
+    if (err)
+        castle_back_update_done(op, err);
+}
+
+/**
+ * Apply a read-modify-write update to a key, @see castle_request_update_t.
+ */
+static void castle_back_update(void *data)
+{
+    struct castle_back_op *op = data;
+    castle_request_update_t *req = &op->req.update;
+    struct castle_back_update *update = &op->update;
+    struct castle_back_buffer *buf;
+    int err;
+
+    update->arg       = NULL;
+    update->value     = NULL;
+    update->value_len = 0;
+    update->result    = 0;
+    update->found     = 0;
+    update->err       = 0;
+
+    op->attachment = castle_attachment_get(req->collection_id, WRITE);
     if (op->attachment == NULL)
     {
-        error("Collection not found id=0x%x\n", op->req.remove.collection_id);
+        error("Collection not found id=0x%x\n", req->collection_id);
         err = -ENOTCONN;
         goto err0;
     }
 
-    err = castle_back_key_copy_get(conn, op->req.remove.key_ptr, op->req.remove.key_len, &key);
+    err = op->key_err;
     if (err)
         goto err1;
 
+    if (req->type > CASTLE_UPDATE_APPEND
+            || req->value_len > CASTLE_UPDATE_MAX_VALUE_LEN
+            || (req->type == CASTLE_UPDATE_ADD && req->value_len != sizeof(int64_t)))
+    {
+        error("Bad update type %u, value length %u\n", req->type, req->value_len);
+        err = -EINVAL;
+        goto err1;
+    }
+
+    /* Work off a copy of the value, userspace may still be changing it. */
     op->buf = NULL;
-    op->replace.value_len = 0;
-    op->replace.replace_continue = NULL;
-    op->replace.complete = castle_back_remove_complete;
-    op->replace.data_length_get = NULL;
-    op->replace.data_copy = NULL;
+    if (req->value_len)
+    {
+        buf = castle_back_buffer_get(op->conn, (unsigned long)req->value_ptr);
+        if (buf == NULL
+                || !castle_back_user_addr_in_buffer(buf, req->value_ptr + req->value_len - 1))
+        {
+            error("Invalid value ptr %p, length %u\n", req->value_ptr, req->value_len);
+            if (buf)
+                castle_back_buffer_put(op->conn, buf);
+            err = -EINVAL;
+            goto err1;
+        }
 
-    err = castle_object_replace(&op->replace, op->attachment, key, op->cpu_index, 1 /*tombstone*/);
-    if (err)
-        goto err2;
+        update->arg = castle_malloc(req->value_len, GFP_KERNEL);
+        if (!update->arg)
+        {
+            castle_back_buffer_put(op->conn, buf);
+            err = -ENOMEM;
+            goto err1;
+        }
+        memcpy(update->arg, castle_back_user_to_kernel(buf, req->value_ptr), req->value_len);
+        castle_back_buffer_put(op->conn, buf);
+    }
+
+    if (castle_back_update_queue(op, 1 /*update*/))
+        castle_back_update_read(op);
 
-    castle_free(key);
     return;
 
-err2: castle_free(key);
 err1: castle_attachment_put(op->attachment);
 err0: castle_back_reply(op, err, 0, 0);
 }
 
-int castle_back_get_reply_continue(struct castle_object_get *get,
-                                   int err,
-                                   void *buffer,
-                                   uint32_t buffer_len,
-                                   int last)
+/**** RANGE OPS ****/
+
+/**
+ * Copy the keys of a range op.  They stay around until the range has been walked.
+ */
+static int castle_back_range_keys_get(struct castle_back_conn *conn,
+                                      struct castle_back_range *range,
+                                      c_vl_okey_t *start_key_ptr, uint32_t start_key_len,
+                                      c_vl_okey_t *end_key_ptr, uint32_t end_key_len)
 {
-    struct castle_back_op *op = container_of(get, struct castle_back_op, get);
-    void *dest = castle_back_user_to_kernel(op->buf, op->req.get.value_ptr + op->buffer_offset);
-    uint32_t to_copy = min(buffer_len, (uint32_t) (op->req.get.value_len - op->buffer_offset));
+    int err;
 
+    err = castle_back_key_copy_get(conn, start_key_ptr, start_key_len, &range->start_key);
+    if (err)
+        return err;
+
+    err = castle_back_key_copy_get(conn, end_key_ptr, end_key_len, &range->end_key);
     if (err)
     {
-        castle_back_buffer_put(op->conn, op->buf);
-        castle_attachment_put(op->attachment);
-        castle_back_reply(op, err, 0, 0);
+        castle_free(range->start_key);
+        return err;
     }
 
-    BUG_ON(!buffer);
+    return 0;
+}
 
-    if (to_copy > 0)
-    {
-        memcpy(dest, buffer, to_copy);
-        op->buffer_offset += to_copy;
-    }
+static void castle_back_range_keys_free(struct castle_back_range *range)
+{
+    castle_free(range->start_key);
+    castle_free(range->end_key);
+}
 
-    BUG_ON(op->req.get.value_len < op->buffer_offset);
-    /* We should finish if that's the last bit of data we are going to get,
-       or if there is no more space in the shared buffer. */
-    last = last || (op->req.get.value_len == op->buffer_offset);
+/**
+ * Save a key of the range stats at offset bytes into the results buffer, in the key format
+ * of the connection.
+ *
+ * @return Length of the key, 0 if it doesn't fit
+ */
+static uint32_t castle_back_range_stats_key_save(struct castle_back_op *op,
+                                                 c_vl_bkey_t *btree_key,
+                                                 uint32_t offset)
+{
+    castle_request_range_stats_t *req = &op->req.range_stats;
+    c_vl_okey_t *key;
+    uint32_t key_len = 0;
 
-    if (last)
-    {
-        castle_back_buffer_put(op->conn, op->buf);
+    if (offset >= req->buffer_len)
+        return 0;
 
-        /* Update stats. */
-        if (!err)
-        {
-            atomic64_inc(&op->attachment->get.ios);
-            atomic64_add(op->req.get.value_len, &op->attachment->get.bytes);
-        }
+    key = castle_object_btree_key_convert(btree_key);
+    if (!key)
+        return 0;
 
-        castle_attachment_put(op->attachment);
-        castle_back_reply(op, 0, 0, op->value_length);
+    if (test_bit(CASTLE_BACK_CONN_FLAT_KEYS_BIT, &op->conn->flags))
+    {
+        key_len = castle_back_flat_key_len(key);
+        if (key_len <= req->buffer_len - offset)
+            castle_back_flat_key_write(key,
+                    castle_back_user_to_kernel(op->buf, req->buffer_ptr + offset), key_len);
+        else
+            key_len = 0;
     }
+    else
+        castle_back_key_kernel_to_user(key, op->buf, (unsigned long)req->buffer_ptr + offset,
+                                       req->buffer_len - offset, &key_len);
+    castle_object_okey_free(key);
 
-    return last;
+    return key_len;
 }
 
-int castle_back_get_reply_start(struct castle_object_get *get,
-                                int err,
-                                uint64_t data_length,
-                                void *buffer,
-                                uint32_t buffer_length)
+static void castle_back_range_stats_complete(castle_object_range_stats_t *stats, int err)
 {
-    struct castle_back_op *op = container_of(get, struct castle_back_op, get);
-    int err_prime;
+    struct castle_back_range *range = container_of(stats, struct castle_back_range, stats);
+    struct castle_back_op *op = container_of(range, struct castle_back_op, range);
+    struct castle_range_stats *result;
+    uint32_t used = 0;
 
-    BUG_ON(buffer_length > data_length);
+    if (err)
+        goto out;
 
-    if (!buffer)
+    result = castle_back_user_to_kernel(op->buf, op->req.range_stats.buffer_ptr);
+    memset(result, 0, sizeof(struct castle_range_stats));
+    result->nr_entries = stats->nr_entries;
+    result->nr_bytes   = stats->nr_bytes;
+    used = sizeof(struct castle_range_stats);
+
+    if (stats->first_key)
     {
-        BUG_ON((data_length != 0) || (buffer_length != 0));
-        err_prime = -ENOENT;
-        goto err;
+        result->first_key_len = castle_back_range_stats_key_save(op, stats->first_key, used);
+        if (result->first_key_len)
+        {
+            result->first_key_offset = used;
+            used = ALIGN(used + result->first_key_len, 8);
+        }
     }
-
-    if (err)
+    if (stats->last_key)
     {
-        err_prime = err;
-        goto err;
+        result->last_key_len = castle_back_range_stats_key_save(op, stats->last_key, used);
+        if (result->last_key_len)
+        {
+            result->last_key_offset = used;
+            used = ALIGN(used + result->last_key_len, 8);
+        }
     }
+    /* Padding after the last key may not be in the buffer. */
+    used = min(used, op->req.range_stats.buffer_len);
 
-    op->value_length = data_length;
-    op->buffer_offset = 0;
-
-    return castle_back_get_reply_continue(get,
-                                          0,
-                                          buffer,
-                                          buffer_length,
-                                          buffer_length == data_length);
+    /* Update stats. */
+    atomic64_inc(&op->attachment->rq.ios);
+    atomic64_add(stats->nr_entries, &op->attachment->rq_nr_keys);
 
-err:
+out:
+    castle_back_range_keys_free(range);
     castle_back_buffer_put(op->conn, op->buf);
     castle_attachment_put(op->attachment);
-    castle_back_reply(op, err_prime, 0, 0);
 
-    /* Return value ignored if there was an error. */
-    return 0;
+    castle_back_reply(op, err, 0, used);
 }
 
 /**
- * Look for specified key,version in DA.
+ * Count the entries of a key range, without sending them over to userspace.
  *
- * @also castle_object_get()
+ * @also castle_object_range_stats()
  */
-static void castle_back_get(void *data)
+static void castle_back_range_stats(void *data)
 {
     struct castle_back_op *op = data;
     struct castle_back_conn *conn = op->conn;
+    castle_request_range_stats_t *req = &op->req.range_stats;
+    struct castle_back_range *range = &op->range;
     int err;
-    c_vl_okey_t *key;
 
-    op->attachment = castle_attachment_get(op->req.get.collection_id, READ);
+    op->attachment = castle_attachment_get(req->collection_id, READ);
     if (op->attachment == NULL)
     {
-        error("Collection not found id=0x%x\n", op->req.get.collection_id);
+        error("Collection not found id=0x%x\n", req->collection_id);
         err = -ENOTCONN;
         goto err0;
     }
 
-    err = castle_back_key_copy_get(conn, op->req.get.key_ptr, op->req.get.key_len, &key);
+    op->buf = castle_back_buffer_get(conn, (unsigned long) req->buffer_ptr);
+    if (op->buf == NULL
+            || req->buffer_len < sizeof(struct castle_range_stats)
+            || !castle_back_user_addr_in_buffer(op->buf, req->buffer_ptr + req->buffer_len - 1))
+    {
+        error("Invalid buffer ptr %p, length %u\n", req->buffer_ptr, req->buffer_len);
+        err = -EINVAL;
+        goto err1;
+    }
+
+    err = castle_back_range_keys_get(conn, range, req->start_key_ptr, req->start_key_len,
+                                     req->end_key_ptr, req->end_key_len);
     if (err)
         goto err1;
 
-    /*
-     * Get buffer with value in it and save it
-     */
-    op->buf = castle_back_buffer_get(conn, (unsigned long) op->req.get.value_ptr);
-    if (op->buf == NULL)
-    {
-        error("Invalid value ptr %p\n", op->req.get.value_ptr);
-        err = -EINVAL;
+    range->stats.keys     = !!(req->flags & CASTLE_RANGE_STATS_FLAG_KEYS);
+    range->stats.complete = castle_back_range_stats_complete;
+    err = castle_object_range_stats(&range->stats, op->attachment,
+                                    range->start_key, range->end_key);
+    if (err)
         goto err2;
-    }
 
-    if (!castle_back_user_addr_in_buffer(op->buf, op->req.get.value_ptr + op->req.get.value_len - 1))
+    return;
+
+err2: castle_back_range_keys_free(range);
+err1: if (op->buf) castle_back_buffer_put(conn, op->buf);
+      castle_attachment_put(op->attachment);
+err0: castle_back_reply(op, err, 0, 0);
+}
+
+/**
+ * Remove all keys of a range, without sending them over to userspace and back.
+ *
+ * @also castle_object_range_remove()
+ */
+static void castle_back_remove_range(void *data)
+{
+    struct castle_back_op *op = data;
+    castle_request_remove_range_t *req = &op->req.remove_range;
+    struct castle_back_range *range = &op->range;
+    int err;
+
+    op->attachment = castle_attachment_get(req->collection_id, WRITE);
+    if (op->attachment == NULL)
     {
-        error("Invalid value length %d (ptr=%p)\n", op->req.get.value_len, op->req.get.value_ptr);
-        err = -EINVAL;
-        goto err3;
+        error("Collection not found id=0x%x\n", req->collection_id);
+        err = -ENOTCONN;
+        goto err0;
     }
 
-    op->get.reply_start = castle_back_get_reply_start;
-    op->get.reply_continue = castle_back_get_reply_continue;
-
-    err = castle_object_get(&op->get, op->attachment, key, op->cpu_index);
+    op->buf = NULL;
+    err = castle_back_range_keys_get(op->conn, range, req->start_key_ptr, req->start_key_len,
+                                     req->end_key_ptr, req->end_key_len);
     if (err)
-        goto err3;
+        goto err1;
 
-    castle_free(key);
-    return;
+    err = castle_object_range_remove(op->attachment, range->start_key, range->end_key);
 
-err3: castle_back_buffer_put(conn, op->buf);
-err2: castle_free(key);
+    castle_back_range_keys_free(range);
 err1: castle_attachment_put(op->attachment);
 err0: castle_back_reply(op, err, 0, 0);
 }
@@ -1470,6 +3466,16 @@ static void castle_back_iter_expire(struct castle_back_stateful_op *stateful_op)
     BUG_ON(!list_empty(&stateful_op->op_queue));
     BUG_ON(stateful_op->curr_op != NULL);
 
+    /* Read ahead finishes the iterator off once it stops. */
+    spin_lock(&stateful_op->lock);
+    if (stateful_op->iterator.readahead_running)
+    {
+        stateful_op->iterator.readahead_cancelled = 1;
+        spin_unlock(&stateful_op->lock);
+        return;
+    }
+    spin_unlock(&stateful_op->lock);
+
     castle_object_iter_finish(stateful_op->iterator.iterator);
 
     spin_lock(&stateful_op->lock);
@@ -1480,6 +3486,10 @@ static void castle_back_iter_call_queued(struct castle_back_stateful_op *statefu
 {
     BUG_ON(!spin_is_locked(&stateful_op->lock));
 
+    /* Queued ops are called once read ahead stops. */
+    if (stateful_op->iterator.readahead_running)
+        return;
+
     if (castle_back_stateful_op_prod(stateful_op))
     {
         debug_iter("castle_back_iter_call_queued add next op to work queue, token = 0x%x.\n",
@@ -1490,16 +3500,176 @@ static void castle_back_iter_call_queued(struct castle_back_stateful_op *statefu
                 BUG_ON(!queue_work_on(stateful_op->cpu, castle_back_wq, &stateful_op->work[0]));
                 break;
 
-            case CASTLE_RING_ITER_FINISH:
-                BUG_ON(!queue_work_on(stateful_op->cpu, castle_back_wq, &stateful_op->work[1]));
-                break;
+            case CASTLE_RING_ITER_FINISH:
+                BUG_ON(!queue_work_on(stateful_op->cpu, castle_back_wq, &stateful_op->work[1]));
+                break;
+
+            default:
+                error("Invalid tag %d in castle_back_iter_call_queued.\n",
+                        stateful_op->curr_op->req.tag);
+                BUG();
+        }
+    }
+}
+
+/**
+ * Bytes of keys and values the iterator may queue up reading ahead.
+ */
+static uint32_t castle_back_iter_readahead_bytes(struct castle_back_iterator *iter)
+{
+    return min(castle_back_iter_readahead, (unsigned int)CASTLE_BACK_ITER_READAHEAD_MAX)
+                * iter->buf_len;
+}
+
+static void castle_back_iter_kv_free(struct castle_back_iter_kv *kv)
+{
+    castle_object_okey_free(kv->key);
+    if (kv->val.val && (kv->val.type & CVT_TYPE_INLINE))
+        castle_free(kv->val.val);
+    castle_free(kv);
+}
+
+/**
+ * Queue a copy of a key and value on the iterator, to go in the next iter_next buffer.
+ *
+ * @param head  Queue ahead of keys already queued
+ */
+static int castle_back_iter_kv_queue(struct castle_back_stateful_op *stateful_op,
+                                     c_vl_okey_t *key, c_val_tup_t *val, int head)
+{
+    struct castle_back_iter_kv *kv;
+    int i;
+
+    kv = castle_malloc(sizeof(struct castle_back_iter_kv), GFP_KERNEL);
+    if (!kv)
+        return -ENOMEM;
+
+    kv->key = castle_object_okey_copy(key);
+    if (!kv->key)
+    {
+        castle_free(kv);
+        return -ENOMEM;
+    }
+
+    kv->val = *val;
+    kv->val.val = NULL;
+    kv->size = sizeof(struct castle_back_iter_kv) + sizeof(c_vl_okey_t);
+    for (i = 0; i < key->nr_dims; i++)
+        kv->size += sizeof(c_vl_key_t *) + sizeof(c_vl_key_t) + key->dims[i]->length;
+    if ((val->type & CVT_TYPE_INLINE) && val->length)
+    {
+        /* copy the value since it may get removed from the cache */
+        kv->val.val = castle_malloc(val->length, GFP_KERNEL);
+        if (!kv->val.val)
+        {
+            castle_back_iter_kv_free(kv);
+            return -ENOMEM;
+        }
+        memcpy(kv->val.val, val->val, val->length);
+        kv->size += val->length;
+    }
+
+    if (head)
+        list_add(&kv->list, &stateful_op->iterator.queued);
+    else
+        list_add_tail(&kv->list, &stateful_op->iterator.queued);
+    stateful_op->iterator.queued_bytes += kv->size;
+
+    return 0;
+}
+
+static void castle_back_iter_readahead_cancel(void *data)
+{
+    castle_back_iter_expire(data);
+}
+
+/**
+ * Stop reading ahead, and call ops queued in the meantime.
+ */
+static void castle_back_iter_readahead_done(struct castle_back_stateful_op *stateful_op)
+{
+    spin_lock(&stateful_op->lock);
+
+    BUG_ON(!stateful_op->iterator.readahead_running);
+    stateful_op->iterator.readahead_running = 0;
+
+    /* Expired while we were reading ahead, finish the iterator off outside of its callback. */
+    if (stateful_op->iterator.readahead_cancelled)
+    {
+        BUG_ON(!stateful_op->expiring);
+        spin_unlock(&stateful_op->lock);
+        INIT_WORK(&stateful_op->iterator.readahead_work, castle_back_iter_readahead_cancel,
+                  stateful_op);
+        queue_work_on(stateful_op->cpu, castle_back_wq, &stateful_op->iterator.readahead_work);
+        return;
+    }
+
+    castle_back_iter_call_queued(stateful_op);
+
+    spin_unlock(&stateful_op->lock);
+}
+
+static int castle_back_iter_readahead_callback(struct castle_object_iterator *iterator,
+        c_vl_okey_t *key,
+        c_val_tup_t *val,
+        int err,
+        void *data)
+{
+    struct castle_back_stateful_op *stateful_op = data;
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+
+    if (!err && key)
+        err = castle_back_iter_kv_queue(stateful_op, key, val, 0 /*head*/);
+
+    if (err || !key)
+    {
+        debug_iter("Read ahead hit the end of the iterator, err=%d.\n", err);
+        iter->ended = 1;
+        iter->err = err;
+    }
+    else if (iter->queued_bytes < castle_back_iter_readahead_bytes(iter))
+        return 1;
+
+    castle_back_iter_readahead_done(stateful_op);
+
+    return 0;
+}
+
+static void castle_back_iter_readahead(void *data)
+{
+    struct castle_back_stateful_op *stateful_op = data;
+
+    castle_object_iter_next(stateful_op->iterator.iterator,
+                            castle_back_iter_readahead_callback,
+                            stateful_op);
+}
+
+/**
+ * Start filling the iterator's queue for the next iter_next, if there is nothing waiting
+ * to be done and the queue isn't full.
+ *
+ * Read ahead is bounded to castle_back_iter_readahead times the client's buffer size.  Ops
+ * queued in the meantime are held back until it stops.
+ *
+ * @return 1 if reading ahead
+ */
+static int castle_back_iter_readahead_start(struct castle_back_stateful_op *stateful_op)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+
+    BUG_ON(!spin_is_locked(&stateful_op->lock));
+    BUG_ON(iter->readahead_running);
 
-            default:
-                error("Invalid tag %d in castle_back_iter_call_queued.\n",
-                        stateful_op->curr_op->req.tag);
-                BUG();
-        }
-    }
+    if (iter->ended
+            || !list_empty(&stateful_op->op_queue)
+            || iter->queued_bytes >= castle_back_iter_readahead_bytes(iter))
+        return 0;
+
+    iter->readahead_running = 1;
+    castle_back_stateful_op_disable_expire(stateful_op);
+    queue_work_on(stateful_op->cpu, castle_back_wq, &iter->readahead_work);
+
+    return 1;
 }
 
 /*
@@ -1520,6 +3690,13 @@ static void castle_back_iter_reply(struct castle_back_stateful_op *stateful_op,
     if (castle_back_stateful_op_completed_op(stateful_op))
         return;
 
+    /* Get the next buffer ready while the client deals with this one. */
+    if (!err && castle_back_iter_readahead_start(stateful_op))
+    {
+        spin_unlock(&stateful_op->lock);
+        return;
+    }
+
     castle_back_iter_call_queued(stateful_op);
 
     spin_unlock(&stateful_op->lock);
@@ -1538,6 +3715,7 @@ static void castle_back_iter_start(void *data)
     int err;
     c_vl_okey_t *start_key;
     c_vl_okey_t *end_key;
+    castle_iter_filter_t *filter = NULL;
     castle_interface_token_t token;
     struct castle_attachment *attachment;
     struct castle_back_stateful_op *stateful_op;
@@ -1575,6 +3753,13 @@ static void castle_back_iter_start(void *data)
     if (err)
         goto err3;
 
+    if (op->req.iter_start.filter_ptr)
+    {
+        err = castle_back_iter_filter_copy_get(conn, op->req.iter_start.filter_ptr, &filter);
+        if (err)
+            goto err4;
+    }
+
 #ifdef DEBUG
     debug_iter("start_key: \n");
     vl_okey_print(LOG_DEBUG, start_key);
@@ -1587,20 +3772,30 @@ static void castle_back_iter_start(void *data)
     stateful_op->curr_op = NULL;
 
     stateful_op->iterator.flags = op->req.iter_start.flags;
+    stateful_op->iterator.flat_keys = test_bit(CASTLE_BACK_CONN_FLAT_KEYS_BIT, &conn->flags);
     stateful_op->iterator.collection_id = op->req.iter_start.collection_id;
-    stateful_op->iterator.saved_key = NULL;
+    INIT_LIST_HEAD(&stateful_op->iterator.queued);
+    stateful_op->iterator.queued_bytes = 0;
+    stateful_op->iterator.ended = 0;
+    stateful_op->iterator.err = 0;
+    stateful_op->iterator.readahead_running = 0;
+    stateful_op->iterator.readahead_cancelled = 0;
+    stateful_op->iterator.buf_len = 0;
     stateful_op->iterator.start_key = start_key;
     stateful_op->iterator.end_key = end_key;
+    stateful_op->iterator.filter = filter;
     stateful_op->iterator.nr_keys = 0;
     stateful_op->iterator.nr_bytes = 0;
     stateful_op->attachment = attachment;
 
     INIT_WORK(&stateful_op->work[0], _castle_back_iter_next, stateful_op);
     INIT_WORK(&stateful_op->work[1], _castle_back_iter_finish, stateful_op);
+    INIT_WORK(&stateful_op->iterator.readahead_work, castle_back_iter_readahead, stateful_op);
 
-    err = castle_object_iter_start(attachment, start_key, end_key, &stateful_op->iterator.iterator);
+    err = castle_object_iter_start(attachment, start_key, end_key, filter,
+                                   &stateful_op->iterator.iterator);
     if (err)
-        goto err4;
+        goto err5;
 
     /* get the lock, since castle_back_stateful_op_enable_expire requires it */
     spin_lock(&stateful_op->lock);
@@ -1611,6 +3806,7 @@ static void castle_back_iter_start(void *data)
 
     return;
 
+err5: if (filter) castle_free(filter);
 err4: castle_free(end_key);
 err3: castle_free(start_key);
 err2: castle_attachment_put(attachment);
@@ -1681,6 +3877,138 @@ err0:
     return buf_used;
 }
 
+/**
+ * Append a key and value to the castle_iter_reply of a flat key iterator, at dst.
+ *
+ * @return Bytes of the buffer used, 0 if they don't fit in buf_len
+ */
+static uint32_t castle_back_save_key_value_to_array(struct castle_back_stateful_op *stateful_op,
+        void *dst,
+        c_vl_okey_t *key, c_val_tup_t *val,
+        uint32_t buf_len, /* space left in the buffer */
+        int save_val /* should values be saved too? */)
+{
+    struct castle_iter_item *item = dst;
+    c_vl_fkey_t *fkey;
+    uint32_t key_len, val_len, length;
+
+    key_len = castle_back_flat_key_len(key);
+    val_len = (save_val && (val->type & CVT_TYPE_INLINE)) ? val->length : 0;
+
+    length = ALIGN(sizeof(struct castle_iter_item) + key_len + val_len, 8);
+    if (length > buf_len)
+        return 0;
+
+    memset(item, 0, sizeof(struct castle_iter_item));
+    item->key_len = key_len;
+    if (save_val)
+    {
+        item->val_type = val->type;
+        item->val_len  = val->length;
+    }
+
+    fkey = (c_vl_fkey_t *)(item + 1);
+    castle_back_flat_key_write(key, fkey, key_len);
+    if (val_len)
+        memcpy((uint8_t *)fkey + key_len, val->val, val_len);
+
+    stateful_op->iterator.nr_keys++;
+    stateful_op->iterator.nr_bytes += val_len;
+
+    return length;
+}
+
+/**
+ * Add a key and value to the iter_next buffer, in the format of the connection.
+ *
+ * @return Bytes of the buffer used, 0 if they don't fit
+ */
+static uint32_t castle_back_iter_buffer_add(struct castle_back_stateful_op *stateful_op,
+                                            struct castle_back_op *op,
+                                            c_vl_okey_t *key,
+                                            c_val_tup_t *val)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+    int save_val = !(iter->flags & CASTLE_RING_ITER_FLAG_NO_VALUES);
+    struct castle_key_value_list *kv_list_cur;
+    uint32_t cur_len;
+
+    if (iter->flat_keys)
+    {
+        cur_len = castle_back_save_key_value_to_array(stateful_op,
+                        (uint8_t *)iter->reply + iter->kv_list_size,
+                        key,
+                        val,
+                        iter->buf_len - iter->kv_list_size,
+                        save_val);
+        if (cur_len)
+        {
+            iter->reply->nr_items++;
+            iter->kv_list_size += cur_len;
+        }
+
+        return cur_len;
+    }
+
+    if (iter->kv_list_size == 0)
+        kv_list_cur = iter->kv_list_tail;
+    else
+        kv_list_cur = castle_back_user_to_kernel(op->buf, iter->kv_list_tail->next);
+
+    cur_len = castle_back_save_key_value_to_list(stateful_op,
+                        kv_list_cur,
+                        key,
+                        val,
+                        iter->collection_id,
+                        op->buf,
+                        iter->buf_len - iter->kv_list_size,
+                        save_val);
+    if (cur_len == 0)
+        return 0;
+
+    kv_list_cur->next = (struct castle_key_value_list *)
+            castle_back_kernel_to_user(op->buf, ((unsigned long)kv_list_cur + cur_len));
+    iter->kv_list_tail = kv_list_cur;
+    iter->kv_list_size += cur_len;
+
+    return cur_len;
+}
+
+/**
+ * Terminate the kv_list in the iter_next buffer.  Flat key replies are always complete.
+ */
+static void castle_back_iter_buffer_end(struct castle_back_stateful_op *stateful_op)
+{
+    if (!stateful_op->iterator.flat_keys)
+        stateful_op->iterator.kv_list_tail->next = NULL;
+}
+
+/**
+ * Move keys queued by an earlier iter_next or read ahead into the iter_next buffer.
+ *
+ * @return 1 if they all fit, 0 if the buffer filled up
+ */
+static int castle_back_iter_queued_add(struct castle_back_stateful_op *stateful_op,
+                                       struct castle_back_op *op)
+{
+    struct castle_back_iterator *iter = &stateful_op->iterator;
+    struct castle_back_iter_kv *kv;
+
+    while (!list_empty(&iter->queued))
+    {
+        kv = list_first_entry(&iter->queued, struct castle_back_iter_kv, list);
+        if (!castle_back_iter_buffer_add(stateful_op, op, kv->key, &kv->val))
+            return 0;
+
+        list_del(&kv->list);
+        iter->queued_bytes -= kv->size;
+        castle_back_iter_kv_free(kv);
+    }
+    BUG_ON(iter->queued_bytes != 0);
+
+    return 1;
+}
+
 static int castle_back_iter_next_callback(struct castle_object_iterator *iterator,
         c_vl_okey_t *key,
         c_val_tup_t *val,
@@ -1690,9 +4018,6 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
     struct castle_back_stateful_op *stateful_op;
     struct castle_back_conn *conn;
     struct castle_back_op *op;
-    uint32_t cur_len;
-    struct castle_key_value_list *kv_list_cur;
-    uint32_t buf_len, buf_used;
 
     BUG_ON(!data);
     stateful_op = (struct castle_back_stateful_op *)data;
@@ -1703,81 +4028,37 @@ static int castle_back_iter_next_callback(struct castle_object_iterator *iterato
     if (err)
         goto err0;
 
-    if (stateful_op->iterator.kv_list_size == 0)
-    {
-        kv_list_cur = stateful_op->iterator.kv_list_tail;
-        /* set the key to NULL to signify empty list if there
-         * are no values
-         */
-        stateful_op->iterator.kv_list_tail->key = NULL;
-    }
-    else
-        kv_list_cur = castle_back_user_to_kernel(op->buf,
-                stateful_op->iterator.kv_list_tail->next);
-
     /* if no more values */
     if (key == NULL)
     {
-        stateful_op->iterator.kv_list_tail->next = NULL;
-
         debug_iter("Iterator has no more values, replying. kv_list_size=%u.\n",
                 stateful_op->iterator.kv_list_size);
 
-        castle_back_buffer_put(conn, op->buf);
-        castle_back_iter_reply(stateful_op, op, 0);
-
-        return 0;
+        stateful_op->iterator.ended = 1;
+        goto reply;
     }
 
-    buf_len = stateful_op->iterator.buf_len;
-    buf_used = stateful_op->iterator.kv_list_size;
-
-    cur_len = castle_back_save_key_value_to_list(stateful_op,
-                        kv_list_cur,
-                        key,
-                        val,
-                        stateful_op->iterator.collection_id,
-                        op->buf,
-                        buf_len - buf_used,
-                        !(stateful_op->iterator.flags & CASTLE_RING_ITER_FLAG_NO_VALUES));
-
-    if (cur_len == 0)
+    if (castle_back_iter_buffer_add(stateful_op, op, key, val) == 0)
     {
-        stateful_op->iterator.kv_list_tail->next = NULL;
-
         debug_iter("Not enough space on buffer, saving a key for next time.\n");
 
-        stateful_op->iterator.saved_key = castle_object_okey_copy(key);
-        if (!stateful_op->iterator.saved_key)
-        {
-            err = -ENOMEM;
+        err = castle_back_iter_kv_queue(stateful_op, key, val, 1 /*head*/);
+        if (err)
             goto err0;
-        }
-        stateful_op->iterator.saved_val = *val;
-        if (val->type & CVT_TYPE_INLINE)
-        {
-            /* copy the value since it may get removed from the cache */
-            stateful_op->iterator.saved_val.val =
-                castle_malloc(val->length, GFP_KERNEL);
-            memcpy(stateful_op->iterator.saved_val.val, val->val, val->length);
-        }
-        else
-            stateful_op->iterator.saved_val.val = NULL;
 
-        castle_back_buffer_put(conn, op->buf);
-        castle_back_iter_reply(stateful_op, op, 0);
-
-        return 0;
+        goto reply;
     }
 
-    kv_list_cur->next = (struct castle_key_value_list *)
-            castle_back_kernel_to_user(op->buf, ((unsigned long)kv_list_cur + cur_len));
-    stateful_op->iterator.kv_list_tail = kv_list_cur;
-    stateful_op->iterator.kv_list_size += cur_len;
-
     /* we have space for more so request it */
     return 1;
 
+reply:
+    castle_back_iter_buffer_end(stateful_op);
+    castle_back_buffer_put(conn, op->buf);
+    castle_back_iter_reply(stateful_op, op, 0);
+
+    return 0;
+
 err0:
     castle_back_buffer_put(conn, op->buf);
     castle_back_iter_reply(stateful_op, op, err);
@@ -1791,8 +4072,7 @@ static void _castle_back_iter_next(void *data)
     struct castle_back_op          *op;
     struct castle_key_value_list   *kv_list_head;
     castle_object_iterator_t       *iterator;
-    uint32_t                        buf_used;
-    uint32_t                        buf_len;
+    uint32_t                        buf_empty;
     int                             err;
     struct castle_back_stateful_op *stateful_op = data;
 
@@ -1810,11 +4090,22 @@ static void _castle_back_iter_next(void *data)
     stateful_op->iterator.kv_list_size = 0;
     stateful_op->iterator.buf_len = op->req.iter_next.buffer_len;
 
-    kv_list_head = stateful_op->iterator.kv_list_tail;
-    kv_list_head->next = NULL;
-    kv_list_head->key = NULL;
-    buf_used = 0;
-    buf_len = op->req.iter_next.buffer_len;
+    if (stateful_op->iterator.flat_keys)
+    {
+        /* kv_list_size is the part of the buffer used by the reply. */
+        stateful_op->iterator.reply = castle_back_user_to_kernel(op->buf,
+                op->req.iter_next.buffer_ptr);
+        stateful_op->iterator.reply->nr_items = 0;
+        stateful_op->iterator.reply->_unused = 0;
+        stateful_op->iterator.kv_list_size = sizeof(struct castle_iter_reply);
+    }
+    else
+    {
+        kv_list_head = stateful_op->iterator.kv_list_tail;
+        kv_list_head->next = NULL;
+        kv_list_head->key = NULL;
+    }
+    buf_empty = stateful_op->iterator.kv_list_size;
 
 #ifdef DEBUG
     debug_iter("iter_next start_key\n");
@@ -1824,46 +4115,38 @@ static void _castle_back_iter_next(void *data)
     vl_okey_print(LOG_DEBUG, iterator->end_okey);
 #endif
 
-    /* if we have a saved key and value from the last call, add them to the buffer */
-    if (stateful_op->iterator.saved_key != NULL)
+    /* Keys saved from the last call, or read ahead since, go in first. */
+    if (!castle_back_iter_queued_add(stateful_op, op))
     {
-        debug_iter("iter_next found saved key, adding to buffer\n");
-
-        buf_used = castle_back_save_key_value_to_list(stateful_op,
-                kv_list_head,
-                stateful_op->iterator.saved_key,
-                &stateful_op->iterator.saved_val,
-                stateful_op->iterator.collection_id,
-                op->buf,
-                buf_len,
-                !(stateful_op->iterator.flags & CASTLE_RING_ITER_FLAG_NO_VALUES));
-
-        if (buf_used == 0)
+        if (stateful_op->iterator.kv_list_size == buf_empty)
         {
             error("iterator buffer too small\n");
             err = -EINVAL;
             goto err0;
         }
+        goto reply;
+    }
 
-        castle_object_okey_free(stateful_op->iterator.saved_key);
-        /* we copied it so free it */
-        if (stateful_op->iterator.saved_val.type & CVT_TYPE_INLINE)
-            castle_free(stateful_op->iterator.saved_val.val);
-
-        debug_iter("iter_next added saved key\n");
-
-        stateful_op->iterator.saved_key = NULL;
-
-        stateful_op->iterator.kv_list_size = buf_used;
-
-        kv_list_head->next = (struct castle_key_value_list *)
-                    castle_back_kernel_to_user(op->buf, ((unsigned long)kv_list_head + buf_used));
+    /* Read ahead got to the end, nothing to get from the iterator. */
+    if (stateful_op->iterator.ended)
+    {
+        err = stateful_op->iterator.err;
+        if (err)
+            goto err0;
+        goto reply;
     }
 
     castle_object_iter_next(iterator, castle_back_iter_next_callback, stateful_op);
 
     return;
 
+reply:
+    castle_back_iter_buffer_end(stateful_op);
+    castle_back_buffer_put(conn, op->buf);
+    castle_back_iter_reply(stateful_op, op, 0);
+
+    return;
+
 err0:
     castle_back_buffer_put(conn, op->buf);
     castle_back_iter_reply(stateful_op, op, err);
@@ -1935,18 +4218,20 @@ static void castle_back_iter_cleanup(struct castle_back_stateful_op *stateful_op
     BUG_ON(!list_empty(&stateful_op->op_queue));
     BUG_ON(stateful_op->curr_op != NULL);
 
-    if (stateful_op->iterator.saved_key != NULL)
+    BUG_ON(stateful_op->iterator.readahead_running);
+    while (!list_empty(&stateful_op->iterator.queued))
     {
-        castle_object_okey_free(stateful_op->iterator.saved_key);
-        if (stateful_op->iterator.saved_val.type & CVT_TYPE_INLINE)
-        {
-            BUG_ON(!stateful_op->iterator.saved_val.val);
-            castle_free(stateful_op->iterator.saved_val.val);
-        }
+        struct castle_back_iter_kv *kv;
+
+        kv = list_first_entry(&stateful_op->iterator.queued, struct castle_back_iter_kv, list);
+        list_del(&kv->list);
+        castle_back_iter_kv_free(kv);
     }
 
     castle_free(stateful_op->iterator.start_key);
     castle_free(stateful_op->iterator.end_key);
+    if (stateful_op->iterator.filter)
+        castle_free(stateful_op->iterator.filter);
     attachment = stateful_op->attachment;
     stateful_op->attachment = NULL;
 
@@ -2279,6 +4564,7 @@ static void castle_back_big_put(void *data)
 
     /* Copy data from interface buffers into given cache buffers(C2B). */
     stateful_op->replace.data_copy = castle_back_big_put_data_copy;
+    stateful_op->replace.data_get = NULL;
 
     /* Work structure to run every queued op. Every put_chunk gets queued. */
     INIT_WORK(&stateful_op->work[0], castle_back_put_chunk_continue, stateful_op);
@@ -2694,16 +4980,16 @@ unsigned int castle_back_poll(struct file *file, poll_table *wait)
 /**
  * Get cpu_index for a given stateful op.
  */
-static int castle_back_get_stateful_op_cpu_index(struct castle_back_conn *conn,
+static int castle_back_get_stateful_op_cpu_index(struct castle_back_dispatcher *dispatcher,
                                                  castle_interface_token_t token,
                                                  uint32_t tag)
 {
     struct castle_back_stateful_op *stateful_op;
 
-    stateful_op = castle_back_find_stateful_op(conn, token, tag);
+    stateful_op = castle_back_find_stateful_op(dispatcher->conn, token, tag);
     if (!stateful_op)
-        /* Error later, queue on current conn CPU for now. */
-        return conn->cpu_index;
+        /* Error later, queue on current dispatcher CPU for now. */
+        return dispatcher->cpu_index;
     else
         return stateful_op->cpu_index;
 }
@@ -2714,17 +5000,22 @@ static int castle_back_get_stateful_op_cpu_index(struct castle_back_conn *conn,
  * - Hash okey and select appropriate CPU to queue request onto
  * - Stateful ops maintain CPU affinity
  */
-static void castle_back_request_process(struct castle_back_conn *conn, struct castle_back_op *op)
+static void castle_back_request_process(struct castle_back_dispatcher *dispatcher,
+                                        struct castle_back_op *op)
 {
+    struct castle_back_conn *conn = dispatcher->conn;
     c_vl_okey_t *key = NULL;
     uint32_t key_len = 0;
 
     debug("Got a request call=%d tag=%d\n", op->req.call_id, op->req.tag);
 
+    op->btree_key = NULL;
+    op->key_err = 0;
+
     /* Required in case castle_back_key_copy_get() fails to return a key.
      * It won't matter that the op ends up on the wrong CPU because it will
      * return before hitting the DA. */
-    op->cpu_index = conn->cpu_index;
+    op->cpu_index = dispatcher->cpu_index;
 
     switch (op->req.tag)
     {
@@ -2735,20 +5026,54 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
 
         case CASTLE_RING_REMOVE:
             INIT_WORK(&op->work, castle_back_remove, op);
-            key_len = op->req.remove.key_len;
-            castle_back_key_copy_get(conn, op->req.remove.key_ptr, key_len, &key);
+            castle_back_op_key_build(op, op->req.remove.key_ptr, op->req.remove.key_len,
+                                     0 /*empty_dims_ok*/);
+            break;
+
+        case CASTLE_RING_UPDATE:
+            INIT_WORK(&op->work, castle_back_update, op);
+            castle_back_op_key_build(op, op->req.update.key_ptr, op->req.update.key_len,
+                                     0 /*empty_dims_ok*/);
             break;
 
         case CASTLE_RING_REPLACE:
             INIT_WORK(&op->work, castle_back_replace, op);
-            key_len = op->req.replace.key_len;
-            castle_back_key_copy_get(conn, op->req.replace.key_ptr, key_len, &key);
+            castle_back_op_key_build(op, op->req.replace.key_ptr, op->req.replace.key_len,
+                                     0 /*empty_dims_ok*/);
             break;
 
         case CASTLE_RING_GET:
             INIT_WORK(&op->work, castle_back_get, op);
-            key_len = op->req.get.key_len;
-            castle_back_key_copy_get(conn, op->req.get.key_ptr, key_len, &key);
+            castle_back_op_key_build(op, op->req.get.key_ptr, op->req.get.key_len,
+                                     1 /*empty_dims_ok*/);
+            break;
+
+        /* Batched point ops
+         *
+         * Keys are sent on to their own CPUs once the batch has been taken apart. */
+
+        case CASTLE_RING_MULTI_GET:
+            INIT_WORK(&op->work, castle_back_multi_get, op);
+            op->cpu_index = dispatcher->cpu_index;
+            break;
+
+        case CASTLE_RING_WRITE_BATCH:
+            INIT_WORK(&op->work, castle_back_write_batch, op);
+            op->cpu_index = dispatcher->cpu_index;
+            break;
+
+        /* Range ops
+         *
+         * Walk a range in one go, round-robin CPU selection as for iterators. */
+
+        case CASTLE_RING_RANGE_STATS:
+            INIT_WORK(&op->work, castle_back_range_stats, op);
+            op->cpu_index = dispatcher->cpu_index;
+            break;
+
+        case CASTLE_RING_REMOVE_RANGE:
+            INIT_WORK(&op->work, castle_back_remove_range, op);
+            op->cpu_index = dispatcher->cpu_index;
             break;
 
         /* Stateful op initialisers
@@ -2777,7 +5102,7 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
         case CASTLE_RING_ITER_START: /* iterator, round-robin CPU selection */
             INIT_WORK(&op->work, castle_back_iter_start, op);
             key_len = op->req.iter_start.end_key_len;
-            op->cpu_index = conn->cpu_index;
+            op->cpu_index = dispatcher->cpu_index;
             break;
 
         /* Stateful op continuations
@@ -2786,28 +5111,28 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
 
         case CASTLE_RING_ITER_NEXT:
             INIT_WORK(&op->work, castle_back_iter_next, op);
-            op->cpu_index = castle_back_get_stateful_op_cpu_index(conn,
+            op->cpu_index = castle_back_get_stateful_op_cpu_index(dispatcher,
                                                                   op->req.iter_next.token,
                                                                   CASTLE_RING_ITER_START);
             break;
 
         case CASTLE_RING_ITER_FINISH:
             INIT_WORK(&op->work, castle_back_iter_finish, op);
-            op->cpu_index = castle_back_get_stateful_op_cpu_index(conn,
+            op->cpu_index = castle_back_get_stateful_op_cpu_index(dispatcher,
                                                                   op->req.iter_finish.token,
                                                                   CASTLE_RING_ITER_START);
             break;
 
         case CASTLE_RING_PUT_CHUNK:
             INIT_WORK(&op->work, castle_back_put_chunk, op);
-            op->cpu_index = castle_back_get_stateful_op_cpu_index(conn,
+            op->cpu_index = castle_back_get_stateful_op_cpu_index(dispatcher,
                                                                   op->req.put_chunk.token,
                                                                   CASTLE_RING_BIG_PUT);
             break;
 
         case CASTLE_RING_GET_CHUNK:
             INIT_WORK(&op->work, castle_back_get_chunk, op);
-            op->cpu_index = castle_back_get_stateful_op_cpu_index(conn,
+            op->cpu_index = castle_back_get_stateful_op_cpu_index(dispatcher,
                                                                   op->req.get_chunk.token,
                                                                   CASTLE_RING_BIG_GET);
             break;
@@ -2832,20 +5157,95 @@ static void castle_back_request_process(struct castle_back_conn *conn, struct ca
     op->cpu = castle_double_array_request_cpu(op->cpu_index);
     queue_work_on(op->cpu, castle_back_wq, &op->work);
 
-    /* Bump conn cpu_index/cpu for next op (might be used by stateful ops). */
-    if (++conn->cpu_index >= castle_double_array_request_cpus())
-        conn->cpu_index = 0;
-    conn->cpu = castle_double_array_request_cpu(conn->cpu_index);
+    /* Bump dispatcher cpu_index for next op (might be used by stateful ops). */
+    if (++dispatcher->cpu_index >= castle_double_array_request_cpus())
+        dispatcher->cpu_index = 0;
+}
+
+/**
+ * Pick the dispatcher for a request taken off the ring at index idx.
+ */
+static struct castle_back_dispatcher *castle_back_dispatcher_get(struct castle_back_conn *conn,
+                                                                 struct castle_back_op *op,
+                                                                 RING_IDX idx)
+{
+    switch (op->req.tag)
+    {
+        /* Range ops don't depend on the order of other requests, spread them. */
+        case CASTLE_RING_ITER_START:
+        case CASTLE_RING_RANGE_STATS:
+            return &conn->dispatchers[idx % conn->nr_dispatchers];
+
+        /* Keyed ops and stateful op continuations must be processed in ring order.  Their
+           CPU isn't known before the key has been copied, which is the dispatcher's job. */
+        default:
+            return &conn->dispatchers[0];
+    }
+}
+
+/**
+ * Spin on the ring for up to the connection's polling window, waiting for new requests.
+ *
+ * The window adapts: it doubles every time requests turn up while polling (up to
+ * poll_max_us) and halves every time they don't (down to CASTLE_BACK_POLL_MIN_US).
+ *
+ * @return 1 if there are new requests on the ring
+ */
+static int castle_back_ring_poll(struct castle_back_conn *conn)
+{
+    castle_back_ring_t *back_ring = &conn->back_ring;
+    unsigned int window, poll_max_us = conn->poll_max_us;
+    struct timespec ts;
+    int64_t start, now;
+    int found = 0;
+
+    if (poll_max_us == 0)
+        return 0;
+
+    window = min(max(conn->poll_us, (unsigned int)CASTLE_BACK_POLL_MIN_US), poll_max_us);
+
+    /* Tell the client it doesn't need to poke the ring. */
+    back_ring->sring->private.castle.polling = 1;
+    xen_mb();
+
+    getnstimeofday(&ts);
+    start = now = timespec_to_ns(&ts);
+    while (now - start < (int64_t)window * NSEC_PER_USEC)
+    {
+        if (RING_HAS_UNCONSUMED_REQUESTS(back_ring))
+        {
+            found = 1;
+            break;
+        }
+        if (kthread_should_stop() || need_resched())
+            break;
+        cpu_relax();
+
+        getnstimeofday(&ts);
+        now = timespec_to_ns(&ts);
+    }
+
+    if (found)
+        conn->poll_us = min(window * 2, poll_max_us);
+    else
+        conn->poll_us = max(window / 2, (unsigned int)CASTLE_BACK_POLL_MIN_US);
+
+    return found;
 }
 
 /**
  * This is called once per connection and lives for as long as the connection is alive.
+ *
+ * Takes requests off the ring, processing those for dispatcher 0 and queueing the rest on
+ * their dispatchers.  If the connection is in polling mode, polls the ring before sleeping.
  */
 static int castle_back_work_do(void *data)
 {
     struct castle_back_conn *conn = data;
     castle_back_ring_t *back_ring = &conn->back_ring;
-    int more;
+    struct castle_back_dispatcher *dispatcher;
+    int more, i;
+    unsigned long kick;
     RING_IDX cons, rp;
     struct castle_back_op *op;
     uint32_t ring_size = __RING_SIZE(back_ring->sring, CASTLE_RING_SIZE);
@@ -2859,6 +5259,7 @@ static int castle_back_work_do(void *data)
 
         //debug("castle_back: rp=%d\n", rp);
 
+        kick = 0;
         while ((cons = back_ring->req_cons) != rp)
         {
             if (rp - cons > ring_size)
@@ -2880,13 +5281,31 @@ static int castle_back_work_do(void *data)
             /* this is put in castle_back_reply */
             castle_back_conn_get(conn);
 
-            castle_back_request_process(conn, op);
+            dispatcher = castle_back_dispatcher_get(conn, op, cons);
+            if (dispatcher == &conn->dispatchers[0])
+                castle_back_request_process(dispatcher, op);
+            else
+            {
+                spin_lock(&dispatcher->lock);
+                list_add_tail(&op->list, &dispatcher->ops);
+                spin_unlock(&dispatcher->lock);
+                kick |= 1UL << (dispatcher - conn->dispatchers);
+            }
         }
 
+        for (i = 1; i < conn->nr_dispatchers; i++)
+            if (kick & (1UL << i))
+                wake_up_process(conn->dispatchers[i].thread);
+
+        if (castle_back_ring_poll(conn))
+            continue;
+
         /* this ensures that if we get an ioctl in between checking the ring
          * for more and calling schedule, we don't sleep and miss it
          */
         set_current_state(TASK_INTERRUPTIBLE);
+        /* Client must poke from now on, the final check orders this against req_prod. */
+        back_ring->sring->private.castle.polling = 0;
         xen_rmb();
         RING_FINAL_CHECK_FOR_REQUESTS(back_ring, more);
 
@@ -2903,6 +5322,47 @@ static int castle_back_work_do(void *data)
     return 0;
 }
 
+/**
+ * Processes requests queued by the ring thread for one of the other dispatchers.
+ *
+ * Only exits once all queued requests have been processed.
+ */
+static int castle_back_dispatch_do(void *data)
+{
+    struct castle_back_dispatcher *dispatcher = data;
+    struct castle_back_op *op;
+    int more;
+
+    while(1)
+    {
+        spin_lock(&dispatcher->lock);
+        while (!list_empty(&dispatcher->ops))
+        {
+            op = list_entry(dispatcher->ops.next, struct castle_back_op, list);
+            list_del(&op->list);
+            spin_unlock(&dispatcher->lock);
+
+            castle_back_request_process(dispatcher, op);
+
+            spin_lock(&dispatcher->lock);
+        }
+        set_current_state(TASK_INTERRUPTIBLE);
+        more = !list_empty(&dispatcher->ops);
+        spin_unlock(&dispatcher->lock);
+
+        if (more)
+        {
+            set_current_state(TASK_RUNNING);
+            continue;
+        }
+        if (kthread_should_stop())
+            break;
+        schedule();
+    }
+
+    return 0;
+}
+
 long castle_back_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
     struct castle_back_conn *conn = file->private_data;
@@ -2917,7 +5377,21 @@ long castle_back_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned lo
     switch (cmd)
     {
         case CASTLE_IOCTL_POKE_RING:
-            wake_up_process(conn->work_thread);
+            wake_up_process(conn->dispatchers[0].thread);
+            break;
+
+        case CASTLE_IOCTL_POLL:
+            conn->poll_max_us = min(arg, (unsigned long)castle_back_poll_max_us);
+            conn->poll_us = conn->poll_max_us;
+            break;
+
+        case CASTLE_IOCTL_KEY_FORMAT:
+            if (arg == CASTLE_KEY_FORMAT_FLAT)
+                set_bit(CASTLE_BACK_CONN_FLAT_KEYS_BIT, &conn->flags);
+            else if (arg == CASTLE_KEY_FORMAT_OKEY)
+                clear_bit(CASTLE_BACK_CONN_FLAT_KEYS_BIT, &conn->flags);
+            else
+                return -EINVAL;
             break;
 
         default:
@@ -2951,8 +5425,17 @@ int castle_back_open(struct inode *inode, struct file *file)
     }
 
     conn->flags = 0;
-    conn->cpu_index = 0;
-    conn->cpu = castle_double_array_request_cpu(conn->cpu_index);
+    conn->poll_max_us = conn->poll_us = 0;
+    conn->nr_dispatchers = min(max(castle_back_dispatchers, 1U), (unsigned int)CASTLE_BACK_MAX_DISPATCHERS);
+    for (i = 0; i < conn->nr_dispatchers; i++)
+    {
+        conn->dispatchers[i].conn = conn;
+        conn->dispatchers[i].thread = NULL;
+        spin_lock_init(&conn->dispatchers[i].lock);
+        INIT_LIST_HEAD(&conn->dispatchers[i].ops);
+        /* Spread the dispatchers' round-robin over the request CPUs. */
+        conn->dispatchers[i].cpu_index = i % castle_double_array_request_cpus();
+    }
     atomic_set(&conn->ref_count, 1);
 
     init_waitqueue_head(&conn->wait);
@@ -3018,11 +5501,23 @@ int castle_back_open(struct inode *inode, struct file *file)
     /* Don't increase the reference count here, since we hold a reference count and won't
      * release it until kthread_stop has returned.
      */
-    conn->work_thread = kthread_run(castle_back_work_do, conn, "castle_client");
-    if (!conn->work_thread)
+    for (i = 1; i < conn->nr_dispatchers; i++)
+    {
+        conn->dispatchers[i].thread = kthread_run(castle_back_dispatch_do, &conn->dispatchers[i],
+                                                  "castle_client/%d", i);
+        if (IS_ERR(conn->dispatchers[i].thread))
+        {
+            error("Could not start dispatch thread\n");
+            err = PTR_ERR(conn->dispatchers[i].thread);
+            goto err4;
+        }
+    }
+    conn->dispatchers[0].thread = kthread_run(castle_back_work_do, conn, "castle_client");
+    if (IS_ERR(conn->dispatchers[0].thread))
     {
         error("Could not start work thread\n");
-        goto err3;
+        err = PTR_ERR(conn->dispatchers[0].thread);
+        goto err4;
     }
 
     INIT_WORK(&conn->timeout_check_work, _castle_back_stateful_op_timeout_check, conn);
@@ -3040,6 +5535,9 @@ int castle_back_open(struct inode *inode, struct file *file)
 
     return 0;
 
+err4:
+    while (--i > 0)
+        kthread_stop(conn->dispatchers[i].thread);
 err3:
     castle_vfree(conn->stateful_ops);
 err2:
@@ -3125,7 +5623,10 @@ int castle_back_release(struct inode *inode, struct file *file)
     }
 
     file->private_data = NULL;
-    kthread_stop(conn->work_thread);
+    /* Ring thread first, dispatchers drain the requests it queued them before exiting. */
+    kthread_stop(conn->dispatchers[0].thread);
+    for (i = 1; i < conn->nr_dispatchers; i++)
+        kthread_stop(conn->dispatchers[i].thread);
     wake_up(&conn->wait);
 
     stateful_ops = conn->stateful_ops;
@@ -3330,7 +5831,7 @@ err_out:
 
 int castle_back_init(void)
 {
-    int err;
+    int i, err;
 
     debug("castle_back initing...");
 
@@ -3346,6 +5847,11 @@ int castle_back_init(void)
     spin_lock_init(&conns_lock);
     atomic_set(&conn_count, 0);
 
+    spin_lock_init(&castle_back_updates_lock);
+    atomic_set(&castle_back_updates_nr, 0);
+    for (i = 0; i < CASTLE_BACK_UPDATES_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&castle_back_updates[i]);
+
     debug("done!\n");
 
     return 0;
@@ -1,4 +1,5 @@
 #include <linux/bitops.h>
+#include <linux/percpu.h>
 
 #include "castle.h"
 #include "castle_da.h"
@@ -33,16 +34,24 @@ MODULE_PARM_DESC(castle_bloom_use, "Use bloom filters");
 #define BLOOM_CHUNK_SIZE_PAGES        (BLOOM_CHUNK_SIZE / PAGE_SIZE)
 #define BLOOM_BLOCK_SIZE_HDD_PAGES    64
 #define BLOOM_BLOCK_SIZE_SSD_PAGES    2
+#define BLOOM_BLOCK_SIZE_LINES_PAGES  1
 #define BLOOM_BLOCK_SIZE(_bf)         (uint32_t)(_bf->block_size_pages * PAGE_SIZE)
 #define BLOOM_MAX_HASHES              opt_hashes_per_bit[BLOOM_MAX_BITS_PER_ELEMENT-1]
 #define BLOOM_CHUNK_SIZE_BITS         (BLOOM_CHUNK_SIZE * 8)
 #define BLOOM_BLOCK_SIZE_BITS(_bf)    (BLOOM_BLOCK_SIZE(_bf) * 8)
-#define BLOOM_ELEMENTS_PER_CHUNK      (BLOOM_CHUNK_SIZE_BITS / BLOOM_BITS_PER_ELEMENT)
-#define BLOOM_ELEMENTS_PER_BLOCK(_bf) (BLOOM_BLOCK_SIZE_BITS(_bf) / BLOOM_BITS_PER_ELEMENT)
+#define BLOOM_ELEMENTS_PER_CHUNK(_bf) (BLOOM_CHUNK_SIZE_BITS / _bf->bits_per_element)
+#define BLOOM_ELEMENTS_PER_BLOCK(_bf) (BLOOM_BLOCK_SIZE_BITS(_bf) / _bf->bits_per_element)
 #define BLOOM_BLOCKS_PER_CHUNK(_bf)   (BLOOM_CHUNK_SIZE / BLOOM_BLOCK_SIZE(_bf))
 /* The seed to use when calculating the hash for the block ID. Should be different to the
  * seed (which is 0) given to the first hash function for within the block. */
 #define BLOOM_BLOCK_HASH_SEED         1
+/* Cache line blocked filters: all bits of a key are set in one line of its block, picked
+ * with another seed. */
+#define BLOOM_LINE_SIZE               64
+#define BLOOM_LINE_SIZE_BITS          (BLOOM_LINE_SIZE * 8)
+#define BLOOM_LINE_WORDS              (BLOOM_LINE_SIZE / sizeof(uint64_t))
+#define BLOOM_LINES_PER_BLOCK(_bf)    (BLOOM_BLOCK_SIZE(_bf) / BLOOM_LINE_SIZE)
+#define BLOOM_LINE_HASH_SEED          2
 #define BLOOM_INDEX_NODE_SIZE         (uint32_t)(BLOOM_INDEX_NODE_SIZE_PAGES * PAGE_SIZE)
 #define BLOOM_INDEX_NODE_SIZE_PAGES   256
 
@@ -55,8 +64,155 @@ MODULE_PARM_DESC(castle_bloom_use, "Use bloom filters");
 uint32_t opt_hashes_per_bit[] =
 { 0, 1, 2, 3, 3, 4, 5, 5, 6, 7, 7, 8, 9, 10, 10, 11, 12 };
 
+/* (1 - e^{-k/b})^k for b bits per element and k = opt_hashes_per_bit[b], in parts per million. */
+static uint32_t fp_ppm_per_bit[] =
+{ 1000000, 632121, 399576, 252580, 146892, 91954, 57781, 34658, 21577,
+  13489, 8194, 5086, 3170, 1980, 1201, 747, 466 };
+
+/* Same for cache line blocked filters, averaged over the (Poisson) number of keys per line. */
+static uint32_t fp_ppm_per_bit_lines[] =
+{ 1000000, 632121, 399652, 253223, 147863, 93535, 59816, 36403, 23420,
+  15295, 9571, 6334, 4264, 2918, 1875, 1307, 927 };
+
+static int castle_bloom_cache_lines = 0;
+module_param(castle_bloom_cache_lines, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_bloom_cache_lines, "Build new bloom filters with all bits of a key in one cache line");
+
+static int castle_bloom_bits_per_key = BLOOM_BITS_PER_ELEMENT;
+module_param(castle_bloom_bits_per_key, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_bloom_bits_per_key, "Bloom filter memory/SSD budget, in bits per key over all trees of a DA");
+
 #define ceiling(_a, _b)         ((_a - 1) / _b + 1)
 
+static void castle_bloom_resident_reset(castle_bloom_t *bf);
+static void castle_bloom_resident_drop(castle_bloom_t *bf);
+static void castle_bloom_build_batches_free(castle_bloom_t *bf);
+
+/**
+ * log2(n) in 1/16ths, interpolating linearly between powers of two.
+ */
+static uint32_t castle_bloom_log2(uint64_t n)
+{
+    int msb;
+
+    if (n == 0)
+        return 0;
+    msb = fls64(n) - 1;
+    if (msb >= 4)
+        return msb * 16 + ((n >> (msb - 4)) & 0xf);
+    return msb * 16 + ((n << (4 - msb)) & 0xf);
+}
+
+/**
+ * Account for a filter of num_elements sharing the bloom budget.
+ *
+ * @also castle_bloom_budget_bits()
+ */
+void castle_bloom_budget_add(struct castle_bloom_budget *budget, uint64_t num_elements)
+{
+    budget->elements += num_elements;
+    budget->log2_sum += num_elements * castle_bloom_log2(num_elements);
+}
+
+/**
+ * Work out bits per element for a new filter of num_elements.
+ *
+ * The expected number of false positive IOs for a lookup is the sum of the false positive
+ * rates of all filters.  Minimising it for a fixed total of bits gives each filter a false
+ * positive rate proportional to its number of elements (see Dayan et al., "Monkey", SIGMOD
+ * 2017), i.e.
+ *
+ *      bits = budget + (mean log2(n) - log2(num_elements)) / ln 2
+ *
+ * with the mean weighted by elements.  Small (upper level) trees get more bits per element,
+ * the biggest ones fewer.
+ *
+ * @param   budget          Filters sharing the budget, including the new one
+ * @param   num_elements    Expected number of elements in the new filter
+ */
+uint32_t castle_bloom_budget_bits(struct castle_bloom_budget *budget, uint64_t num_elements)
+{
+    int64_t mean, bits;
+
+    bits = castle_bloom_bits_per_key;
+    if (budget->elements && num_elements)
+    {
+        mean = budget->log2_sum / budget->elements;
+        /* 1/ln 2 ~= 1477/1024, log2s are in 1/16ths. */
+        bits = bits * 16 + (mean - castle_bloom_log2(num_elements)) * 1477 / 1024;
+        bits = (bits + 8) / 16;
+    }
+
+    if (bits < 1)
+        bits = 1;
+    if (bits > BLOOM_MAX_BITS_PER_ELEMENT)
+        bits = BLOOM_MAX_BITS_PER_ELEMENT;
+
+    return bits;
+}
+
+/**
+ * Expected false positive rate of a bloom filter, in parts per million.
+ */
+uint32_t castle_bloom_fp_expected(castle_bloom_t *bf)
+{
+    BUG_ON(bf->bits_per_element > BLOOM_MAX_BITS_PER_ELEMENT);
+    if (bf->format == BLOOM_FORMAT_LINES)
+        return fp_ppm_per_bit_lines[bf->bits_per_element];
+    return fp_ppm_per_bit[bf->bits_per_element];
+}
+
+/**
+ * Measured false positive rate of a bloom filter since it was created or read
+ * from disk, in parts per million.
+ *
+ * A false positive is a lookup the filter let through that the tree didn't
+ * find the key for.
+ */
+uint32_t castle_bloom_fp_measured(castle_bloom_t *bf)
+{
+    struct castle_bloom_stats stats;
+
+    castle_bloom_stats_get(bf, &stats);
+    if (stats.queries == 0)
+        return 0;
+    return stats.false_positives * 1000000 / stats.queries;
+}
+
+/**
+ * Sum the per-CPU counters of a bloom filter.
+ */
+void castle_bloom_stats_get(castle_bloom_t *bf, struct castle_bloom_stats *sum)
+{
+    struct castle_bloom_stats *stats;
+    int cpu;
+
+    memset(sum, 0, sizeof(struct castle_bloom_stats));
+    if (!bf->stats)
+        return;
+
+    for_each_possible_cpu(cpu)
+    {
+        stats = per_cpu_ptr(bf->stats, cpu);
+        sum->queries         += stats->queries;
+        sum->negatives       += stats->negatives;
+        sum->false_positives += stats->false_positives;
+        sum->ios_saved       += stats->ios_saved;
+        sum->lookup_ns       += stats->lookup_ns;
+    }
+}
+
+/**
+ * Initialise in-memory state of a new or just read filter: counters, residency.
+ */
+static int castle_bloom_stats_init(castle_bloom_t *bf)
+{
+    castle_bloom_resident_reset(bf);
+    bf->stats = alloc_percpu(struct castle_bloom_stats);
+
+    return bf->stats ? 0 : -ENOMEM;
+}
+
 /**
  * Initialize a bloom filter.  Call castle_bloom_add to add a key and
  * castle_bloom_complete when all keys are added.  Call castle_bloom_destory
@@ -66,11 +222,12 @@ uint32_t opt_hashes_per_bit[] =
  * @param   da_id   The doubling array the bloom filter belongs to
  * @param   num_elements    Expected number of elements.  The actual number of elements added
  *                          can be less, but not more.
+ * @param   bits_per_element    Size of the filter, @see castle_bloom_budget_bits()
  */
-int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements)
+int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements,
+                        uint32_t bits_per_element)
 {
-    uint32_t bits_per_element = BLOOM_BITS_PER_ELEMENT;
-    uint32_t num_hashes = opt_hashes_per_bit[bits_per_element];
+    uint32_t num_hashes;
     uint32_t num_blocks, blocks_remainder;
     uint64_t nodes_size, chunks_size, size;
     int ret = 0;
@@ -78,10 +235,15 @@ int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements)
     struct castle_btree_type *btree = castle_btree_type_get(RO_VLBA_TREE_TYPE);
 
     BUG_ON(num_elements == 0);
+    BUG_ON(bits_per_element == 0 || bits_per_element > BLOOM_MAX_BITS_PER_ELEMENT);
 
     if (!castle_bloom_use)
         return -ENOSYS;
 
+    num_hashes = opt_hashes_per_bit[bits_per_element];
+    bf->bits_per_element = bits_per_element;
+    bf->format = castle_bloom_cache_lines ? BLOOM_FORMAT_LINES : BLOOM_FORMAT_BLOCKS;
+
     bf->private = castle_malloc(sizeof(struct castle_bloom_build_params), GFP_KERNEL);
     if (!bf->private)
     {
@@ -92,9 +254,16 @@ int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements)
     bf_bp = bf->private;
     memset(bf_bp, 0, sizeof(struct castle_bloom_build_params));
 
+    if (castle_bloom_stats_init(bf))
+    {
+        castle_printk(LOG_WARN, "Failed to alloc bloom filter stats\n");
+        ret = -ENOMEM;
+        goto err1;
+    }
+
     /* The given number of elements may be less so this is a maximum.
      * bf->num_chunks is updated to the actual number in castle_bloom_complete */
-    bf->num_chunks = ceiling(num_elements, BLOOM_ELEMENTS_PER_CHUNK);
+    bf->num_chunks = ceiling(num_elements, BLOOM_ELEMENTS_PER_CHUNK(bf));
 
     /* Again this is estimated, will be updated to correct number in castle_bloom_complete */
     bf->num_btree_nodes = ceiling(bf->num_chunks,
@@ -121,11 +290,15 @@ int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements)
         {
             castle_printk(LOG_WARN, "Failed to create extent for bloom\n");
             ret = -ENOSPC;
-            goto err1;
+            goto err2;
         }
     } else
         bf->block_size_pages = BLOOM_BLOCK_SIZE_SSD_PAGES;
 
+    /* A probe reads a single page, whatever the extent is on. */
+    if (bf->format == BLOOM_FORMAT_LINES)
+        bf->block_size_pages = BLOOM_BLOCK_SIZE_LINES_PAGES;
+
 #ifdef DEBUG
     bf_bp->elements_inserted_per_block = castle_malloc(sizeof(uint32_t) * BLOOM_BLOCKS_PER_CHUNK(bf), GFP_KERNEL);
 #endif
@@ -152,15 +325,13 @@ int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements)
     bf_bp->chunk_cep.ext_id = bf->ext_id;
     bf_bp->chunk_cep.offset = bf->chunks_offset;
 
-#ifdef CASTLE_BLOOM_FP_STATS
-    atomic64_set(&bf->queries, 0);
-    atomic64_set(&bf->false_positives, 0);
-#endif
-
     BUG_ON(bf->num_blocks_last_chunk == 0);
 
     return 0;
 
+err2:
+    free_percpu(bf->stats);
+    bf->stats = NULL;
 err1:
     castle_free(bf->private);
     bf->private = NULL;
@@ -200,7 +371,10 @@ static void castle_bloom_complete_btree_node(castle_bloom_t *bf)
 
     dirty_c2b(bf_bp->node_c2b);
     write_unlock_c2b(bf_bp->node_c2b);
-    put_c2b(bf_bp->node_c2b);
+    if (bf_bp->stream)
+        castle_cache_stream_add(bf_bp->stream, bf_bp->node_c2b);
+    else
+        put_c2b(bf_bp->node_c2b);
 
     debug("btree_node completed, offset was %llu, ", bf_bp->node_cep.offset);
 
@@ -257,7 +431,10 @@ static void castle_bloom_complete_chunk(castle_bloom_t *bf)
 
     dirty_c2b(bf_bp->chunk_c2b);
     write_unlock_c2b(bf_bp->chunk_c2b);
-    put_c2b(bf_bp->chunk_c2b);
+    if (bf_bp->stream)
+        castle_cache_stream_add(bf_bp->stream, bf_bp->chunk_c2b);
+    else
+        put_c2b(bf_bp->chunk_c2b);
 
     bf_bp->chunks_complete++;
     debug("chunk completed, offset was %llu, ", bf_bp->chunk_cep.offset);
@@ -276,7 +453,11 @@ static void castle_bloom_next_chunk(castle_bloom_t *bf)
     BUG_ON(bf->num_chunks == 1 && bf_bp->chunks_complete > 0);
 
     if (bf_bp->chunk_c2b != NULL)
+    {
+        /* All bits of the chunk must be set before it is written. */
+        castle_bloom_build_sync(bf);
         castle_bloom_complete_chunk(bf);
+    }
 
     bf_bp->cur_chunk_num_blocks = BLOCKS_IN_CHUNK(bf, bf_bp->chunks_complete);
 
@@ -328,6 +509,9 @@ void castle_bloom_complete(castle_bloom_t *bf)
         return;
     }
 
+    castle_bloom_build_sync(bf);
+    castle_bloom_build_batches_free(bf);
+
     /* if got less elements than expected, we will need to add in the key into the index here
      * we don't have a copy of the key here, so insert the largest key
      */
@@ -362,6 +546,9 @@ void castle_bloom_abort(castle_bloom_t *bf)
 
     debug("Aborting bloom filter %p\n", bf);
 
+    castle_bloom_build_sync(bf);
+    castle_bloom_build_batches_free(bf);
+
     if(bf_bp->cur_node != NULL)
     {
         debug("Completing node for bloom_filter %p\n", bf);
@@ -385,6 +572,20 @@ void castle_bloom_abort(castle_bloom_t *bf)
     bf->private = NULL;
 }
 
+/**
+ * Write completed chunks and index nodes of a bloom filter under construction
+ * through a write stream, rather than leaving them for the flush thread.
+ *
+ * The stream must be drained before it goes away.
+ */
+void castle_bloom_stream_set(castle_bloom_t *bf, struct castle_cache_stream *stream)
+{
+    struct castle_bloom_build_params *bf_bp = bf->private;
+
+    BUG_ON(!bf_bp);
+    bf_bp->stream = stream;
+}
+
 /**
  * Remove a bloom filter from disk.
  */
@@ -393,11 +594,25 @@ void castle_bloom_destroy(castle_bloom_t *bf)
     debug("castle_bloom_destroy.\n");
     BUG_ON(bf->private);
 
+    castle_bloom_release(bf);
+
     castle_cache_advise_clear((c_ext_pos_t){bf->ext_id, 0}, C2_ADV_EXTENT|C2_ADV_SOFTPIN, -1,-1,0);
 
     castle_extent_free(bf->ext_id);
 }
 
+/**
+ * Free in-memory state of a bloom filter, leaving it on disk.
+ */
+void castle_bloom_release(castle_bloom_t *bf)
+{
+    castle_bloom_resident_drop(bf);
+
+    if (bf->stats)
+        free_percpu(bf->stats);
+    bf->stats = NULL;
+}
+
 /**
  * Get the block ID for a given key
  *
@@ -415,6 +630,200 @@ static uint32_t castle_bloom_get_block_id(castle_bloom_t *bf, void *key, uint32_
     return block_hash % num_blocks;
 }
 
+/**
+ * Get the line within a block for a given key, for cache line blocked filters.
+ *
+ * @return              Byte offset of the line in the block.
+ */
+static uint32_t castle_bloom_get_line_offset(castle_bloom_t *bf,
+                                             struct castle_btree_type *btree,
+                                             void *key)
+{
+    return (btree->key_hash(key, BLOOM_LINE_HASH_SEED) % BLOOM_LINES_PER_BLOCK(bf))
+                * BLOOM_LINE_SIZE;
+}
+
+/**
+ * Work out which bits of a cache line a key maps to.
+ *
+ * @param   mask    [out] Bits to set/test, one word per 64 bits of the line
+ */
+static void castle_bloom_line_mask(castle_bloom_t *bf, uint32_t hash1, uint32_t hash2,
+                                   uint64_t *mask)
+{
+    uint32_t hash, i;
+
+    memset(mask, 0, BLOOM_LINE_SIZE);
+    for (i = 0; i < bf->num_hashes; i++)
+    {
+        hash = (hash1 + i * hash2) % BLOOM_LINE_SIZE_BITS;
+        mask[hash / 64] |= 1ULL << (hash % 64);
+    }
+}
+
+/**** Bloom filter build pipeline ****/
+
+/*
+ * Setting the bits of a key touches random cache lines of a 1MB chunk buffer, which makes it
+ * the most expensive part of adding a key.  The merge thread hashes keys while they are hot in
+ * its cache and hands them over in batches to a helper on another CPU, which sets the bits.
+ *
+ * There are two batches per filter: one being filled, one being set.  Bits are set without
+ * atomics, so only one batch is ever in flight.  The merge thread waits for it at chunk
+ * boundaries, when the filter is parked or serialised, and when it completes.
+ */
+#define BLOOM_BUILD_BATCH_SIZE  (1024)  /* Keys handed over at once. */
+
+static int castle_bloom_async_build = 1;
+module_param(castle_bloom_async_build, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_bloom_async_build, "Set bloom filter bits of merged keys on another CPU");
+
+struct castle_bloom_build_batch {
+    castle_bloom_t           *bf;
+    void                     *chunk_buffer; /* Chunk all the keys of the batch belong to.   */
+    uint32_t                  nr;
+    struct work_struct        work;
+    struct {
+        uint32_t              offset;       /* Bit offset of the block, or byte offset of
+                                               the line for cache line blocked filters.     */
+        uint32_t              hash1;
+        uint32_t              hash2;
+    } keys[BLOOM_BUILD_BATCH_SIZE];
+};
+
+static struct workqueue_struct      *castle_bloom_build_wqueue;
+static       DECLARE_WAIT_QUEUE_HEAD(castle_bloom_build_wq);    /* Waiters for batches.    */
+
+/**
+ * Set the bits of a hashed key in a chunk buffer.
+ */
+static void castle_bloom_bits_set(castle_bloom_t *bf, void *chunk_buffer, uint32_t offset,
+                                  uint32_t hash1, uint32_t hash2)
+{
+    uint32_t hash, i;
+
+    if (bf->format == BLOOM_FORMAT_LINES)
+    {
+        uint64_t mask[BLOOM_LINE_WORDS], *line;
+
+        line = chunk_buffer + offset;
+        castle_bloom_line_mask(bf, hash1, hash2, mask);
+        for (i = 0; i < BLOOM_LINE_WORDS; i++)
+            line[i] |= mask[i];
+        return;
+    }
+
+    for (i = 0; i < bf->num_hashes; i++)
+    {
+        hash = hash1 + i * hash2;
+        __set_bit(hash % BLOOM_BLOCK_SIZE_BITS(bf) + offset, chunk_buffer);
+    }
+}
+
+static void castle_bloom_build_batch_do(struct work_struct *work)
+{
+    struct castle_bloom_build_batch *batch =
+                container_of(work, struct castle_bloom_build_batch, work);
+    struct castle_bloom_build_params *bf_bp = batch->bf->private;
+    uint32_t i;
+
+    for (i = 0; i < batch->nr; i++)
+        castle_bloom_bits_set(batch->bf, batch->chunk_buffer, batch->keys[i].offset,
+                              batch->keys[i].hash1, batch->keys[i].hash2);
+    batch->nr = 0;
+
+    /* bf_bp may go away as soon as this drops. */
+    atomic_dec(&bf_bp->batches_in_flight);
+    wake_up(&castle_bloom_build_wq);
+}
+
+/**
+ * Allocate the batches of a filter under construction, on first use.
+ *
+ * @return  0 if keys should be set inline
+ */
+static int castle_bloom_build_batches_get(castle_bloom_t *bf)
+{
+    struct castle_bloom_build_params *bf_bp = bf->private;
+    int i;
+
+    if (bf_bp->batches[0])
+        return 1;
+    if (!castle_bloom_async_build || num_online_cpus() < 2)
+        return 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        bf_bp->batches[i] = castle_zalloc(sizeof(struct castle_bloom_build_batch), GFP_KERNEL);
+        if (!bf_bp->batches[i])
+        {
+            castle_bloom_build_batches_free(bf);
+            return 0;
+        }
+        bf_bp->batches[i]->bf = bf;
+    }
+    bf_bp->cur_batch = 0;
+
+    /* Any other CPU will do, the next one is as good as any. */
+    bf_bp->cpu = next_cpu(raw_smp_processor_id(), cpu_online_map);
+    if (bf_bp->cpu >= NR_CPUS)
+        bf_bp->cpu = first_cpu(cpu_online_map);
+
+    return 1;
+}
+
+static void castle_bloom_build_batches_free(castle_bloom_t *bf)
+{
+    struct castle_bloom_build_params *bf_bp = bf->private;
+    int i;
+
+    BUG_ON(atomic_read(&bf_bp->batches_in_flight));
+    for (i = 0; i < 2; i++)
+    {
+        if (bf_bp->batches[i])
+            castle_free(bf_bp->batches[i]);
+        bf_bp->batches[i] = NULL;
+    }
+}
+
+/**
+ * Hand the batch being filled over to the helper, once the previous one is done.
+ */
+static void castle_bloom_build_batch_submit(castle_bloom_t *bf)
+{
+    struct castle_bloom_build_params *bf_bp = bf->private;
+    struct castle_bloom_build_batch *batch = bf_bp->batches[bf_bp->cur_batch];
+
+    if (batch->nr == 0)
+        return;
+
+    wait_event(castle_bloom_build_wq, atomic_read(&bf_bp->batches_in_flight) == 0);
+
+    batch->chunk_buffer = bf_bp->cur_chunk_buffer;
+    atomic_inc(&bf_bp->batches_in_flight);
+    CASTLE_INIT_WORK(&batch->work, castle_bloom_build_batch_do);
+    queue_work_on(bf_bp->cpu, castle_bloom_build_wqueue, &batch->work);
+
+    bf_bp->cur_batch = 1 - bf_bp->cur_batch;
+    BUG_ON(bf_bp->batches[bf_bp->cur_batch]->nr);
+}
+
+/**
+ * Wait until bits of all the keys added so far are set in the chunk buffer.
+ *
+ * Must be called by the thread adding keys.
+ */
+void castle_bloom_build_sync(castle_bloom_t *bf)
+{
+    struct castle_bloom_build_params *bf_bp = bf->private;
+
+    if (!bf_bp || !bf_bp->batches[0])
+        return;
+
+    castle_bloom_build_batch_submit(bf);
+    wait_event(castle_bloom_build_wq, atomic_read(&bf_bp->batches_in_flight) == 0);
+}
+
 /**
  * Add a key to the bloom filter
  *
@@ -423,22 +832,21 @@ static uint32_t castle_bloom_get_block_id(castle_bloom_t *bf, void *key, uint32_
 void castle_bloom_add(castle_bloom_t *bf, struct castle_btree_type *btree, void *key)
 {
     uint32_t block_id;
-    uint32_t hash1, hash2, hash;
-    uint64_t bit_offset;
-    uint32_t i;
+    uint32_t hash1, hash2, offset;
+    struct castle_bloom_build_batch *batch;
     struct castle_bloom_build_params *bf_bp = bf->private;
 
     BUG_ON(bf_bp->elements_inserted == bf_bp->expected_num_elements);
 
     /* the last element of this chunk */
-    if (bf_bp->elements_inserted % BLOOM_ELEMENTS_PER_CHUNK == BLOOM_ELEMENTS_PER_CHUNK - 1 ||
+    if (bf_bp->elements_inserted % BLOOM_ELEMENTS_PER_CHUNK(bf) == BLOOM_ELEMENTS_PER_CHUNK(bf) - 1 ||
             bf_bp->elements_inserted == bf_bp->expected_num_elements - 1)
     {
         castle_bloom_add_index_key(bf, key);
     }
 
     /* start a new chunk */
-    if (bf_bp->elements_inserted % BLOOM_ELEMENTS_PER_CHUNK == 0)
+    if (bf_bp->elements_inserted % BLOOM_ELEMENTS_PER_CHUNK(bf) == 0)
     {
         BUG_ON(bf_bp->chunks_complete >= bf->num_chunks);
         castle_bloom_next_chunk(bf);
@@ -448,7 +856,7 @@ void castle_bloom_add(castle_bloom_t *bf, struct castle_btree_type *btree, void
 
     /* insert value into filter */
     block_id = castle_bloom_get_block_id(bf, key, bf_bp->cur_chunk_num_blocks);
-    bit_offset = block_id * BLOOM_BLOCK_SIZE_BITS(bf);
+    offset = block_id * BLOOM_BLOCK_SIZE_BITS(bf);
 
 #ifdef DEBUG
     bf_bp->elements_inserted_per_block[block_id]++;
@@ -457,11 +865,21 @@ void castle_bloom_add(castle_bloom_t *bf, struct castle_btree_type *btree, void
     hash1 = bf->btree->key_hash(key, 0);
     hash2 = bf->btree->key_hash(key, hash1);
 
-    for (i = 0; i < bf->num_hashes; i++)
+    if (bf->format == BLOOM_FORMAT_LINES)
+        offset = offset / 8 + castle_bloom_get_line_offset(bf, bf->btree, key);
+
+    if (!castle_bloom_build_batches_get(bf))
     {
-        hash = hash1 + i * hash2;
-        __set_bit(hash % BLOOM_BLOCK_SIZE_BITS(bf) + bit_offset, bf_bp->cur_chunk_buffer);
+        castle_bloom_bits_set(bf, bf_bp->cur_chunk_buffer, offset, hash1, hash2);
+        return;
     }
+
+    batch = bf_bp->batches[bf_bp->cur_batch];
+    batch->keys[batch->nr].offset = offset;
+    batch->keys[batch->nr].hash1  = hash1;
+    batch->keys[batch->nr].hash2  = hash2;
+    if (++batch->nr == BLOOM_BUILD_BATCH_SIZE)
+        castle_bloom_build_batch_submit(bf);
 }
 
 /**
@@ -592,24 +1010,20 @@ static int castle_bloom_get_chunk_id(castle_bloom_t *bf, void *key,
  */
 
 /**
- * Lookup a key in the bloom filter
+ * Lookup a key in a block of the bloom filter
  *
- * @param   c2b         Cache block for the Bloom filter block to query
+ * @param   block       Bloom filter block to query
  * @param   btree       The btree type for the key we are querying. NB this is not necessarily
  *                      the same as bf->btree
  *
  * @return  0           if not found
  * @return  non-zero    if found
  */
-static int castle_bloom_lookup(castle_bloom_t *bf, c2_block_t *c2b, struct castle_btree_type *btree, void *key)
+static int castle_bloom_block_lookup(castle_bloom_t *bf, void *block,
+                                     struct castle_btree_type *btree, void *key)
 {
     uint32_t hash1, hash2, hash;
     uint32_t i;
-#ifdef CASTLE_BLOOM_FP_STATS
-    uint64_t queries, false_positives;
-#endif
-
-    BUG_ON(!c2b_uptodate(c2b));
 
     /*
      * See Kirsch and Mitzenmacher, ESA 2006, LNCS 4168, pp 456-467, 2006 for why this works.
@@ -625,21 +1039,23 @@ static int castle_bloom_lookup(castle_bloom_t *bf, c2_block_t *c2b, struct castl
     hash1 = btree->key_hash(key, 0);
     hash2 = btree->key_hash(key, hash1);
 
-#ifdef CASTLE_BLOOM_FP_STATS
-    queries = atomic64_inc_return(&bf->queries);
-
-    if (queries % 10000 == 0 && queries > 0)
+    if (bf->format == BLOOM_FORMAT_LINES)
     {
-        false_positives = atomic64_read(&bf->false_positives);
-        castle_printk(LOG_INFO, "******** bf %p, false positive rate is %llu%% for %llu queries.\n",
-                bf, 100 * false_positives / queries, queries);
+        uint64_t mask[BLOOM_LINE_WORDS], *line, missing = 0;
+
+        /* Test the whole line at once, word by word with no early exit. */
+        line = block + castle_bloom_get_line_offset(bf, btree, key);
+        castle_bloom_line_mask(bf, hash1, hash2, mask);
+        for (i = 0; i < BLOOM_LINE_WORDS; i++)
+            missing |= mask[i] & ~line[i];
+
+        return missing == 0;
     }
-#endif
 
     for (i = 0; i < bf->num_hashes; i++)
     {
         hash = hash1 + i * hash2;
-        if (!test_bit(hash % BLOOM_BLOCK_SIZE_BITS(bf), c2b_buffer(c2b)))
+        if (!test_bit(hash % BLOOM_BLOCK_SIZE_BITS(bf), block))
             return 0;
     }
 
@@ -647,9 +1063,66 @@ static int castle_bloom_lookup(castle_bloom_t *bf, c2_block_t *c2b, struct castl
 }
 
 /**
- * Used to advance the search to the next tree.  If none left, report not found.
+ * Lookup a key in the bloom filter
+ *
+ * @param   c2b         Cache block for the Bloom filter block to query
+ *
+ * @also castle_bloom_block_lookup()
  */
-static void castle_bloom_lookup_next_ct(c_bvec_t *c_bvec)
+static int castle_bloom_lookup(castle_bloom_t *bf, c2_block_t *c2b, struct castle_btree_type *btree, void *key)
+{
+    BUG_ON(!c2b_uptodate(c2b));
+
+    return castle_bloom_block_lookup(bf, c2b_buffer(c2b), btree, key);
+}
+
+/**
+ * Account for the answer of c_bvec->tree's filter.  Must be called before the tree is put.
+ *
+ * @param   found       Whether the filter let the lookup through
+ */
+static void castle_bloom_lookup_done(c_bvec_t *c_bvec, int found)
+{
+    castle_bloom_t *bf = &c_bvec->tree->bloom;
+    struct castle_bloom_stats *stats;
+    struct timespec now;
+#ifdef CASTLE_BLOOM_FP_STATS
+    struct castle_bloom_stats sum;
+#endif
+
+    if (!bf->stats)
+        return;
+
+    getnstimeofday(&now);
+
+    stats = per_cpu_ptr(bf->stats, get_cpu());
+    stats->queries++;
+    stats->lookup_ns += timespec_to_ns(&now) - timespec_to_ns(&c_bvec->bloom_start);
+    if (!found)
+    {
+        stats->negatives++;
+        stats->ios_saved += c_bvec->tree->tree_depth;
+    }
+#ifdef CASTLE_BLOOM_FP_STATS
+    if (stats->queries % 10000 == 0)
+    {
+        put_cpu();
+        castle_bloom_stats_get(bf, &sum);
+        castle_printk(LOG_INFO, "******** bf %p, false positive rate is %llu%% for %llu queries.\n",
+                bf, 100 * sum.false_positives / sum.queries, sum.queries);
+        return;
+    }
+#endif
+    put_cpu();
+}
+
+/**
+ * Move the search on to the next tree.  If none left, report not found.
+ *
+ * @return  0           if the bvec has been completed
+ * @return  non-zero    if c_bvec->tree is the next tree
+ */
+static int castle_bloom_ct_next(c_bvec_t *c_bvec)
 {
     struct castle_component_tree *ct, *next_ct;
 
@@ -660,12 +1133,21 @@ static void castle_bloom_lookup_next_ct(c_bvec_t *c_bvec)
     {
         /* We've finished looking through all the trees. */
         c_bvec->submit_complete(c_bvec, 0, INVAL_VAL_TUP);
-        return;
+        return 0;
     }
     castle_ct_put(ct, 0);
     c_bvec->tree = next_ct;
 
-    castle_bloom_submit(c_bvec);
+    return 1;
+}
+
+/**
+ * Used to advance the search to the next tree.  If none left, report not found.
+ */
+static void castle_bloom_lookup_next_ct(c_bvec_t *c_bvec)
+{
+    if (castle_bloom_ct_next(c_bvec))
+        castle_bloom_submit(c_bvec);
 }
 
 /**
@@ -688,6 +1170,7 @@ static void castle_bloom_block_process(c_bvec_t *c_bvec)
 
     put_c2b(chunk_c2b);
 
+    castle_bloom_lookup_done(c_bvec, found);
     if (!found)
     {
         castle_bloom_lookup_next_ct(c_bvec);
@@ -695,9 +1178,7 @@ static void castle_bloom_block_process(c_bvec_t *c_bvec)
     }
 
     /* Bloom says yes, let's do the btree walk */
-#ifdef CASTLE_BLOOM_FP_STATS
     c_bvec->bloom_positive = 1;
-#endif
     castle_btree_submit(c_bvec);
 }
 
@@ -783,7 +1264,10 @@ static void castle_bloom_index_process(c_bvec_t *c_bvec, c2_block_t **btree_node
     found = castle_bloom_get_chunk_id(bf, key, btree_nodes_c2bs, NULL, &chunk_id);
 
     if (!found)
+    {
+        castle_bloom_lookup_done(c_bvec, 0);
         castle_bloom_lookup_next_ct(c_bvec);
+    }
     else
         castle_bloom_chunk_read(c_bvec, chunk_id);
 }
@@ -854,6 +1338,474 @@ static void castle_bloom_index_read(c_bvec_t *c_bvec)
     castle_free(btree_nodes_c2bs);
 }
 
+/**** Residency ****/
+
+/*
+ * Whole filters can be kept in memory outside of the cache, within a budget.  A lookup in a
+ * resident filter finds the chunk from an in-memory copy of the index keys and tests the
+ * block in place: no IO, no index btree walk and no workqueue hop.
+ *
+ * Filters get registered on their first lookup.  Every BLOOM_RESIDENT_PERIOD seconds (and
+ * whenever a filter is registered) the rebalance work ranks them and loads or evicts
+ * filters to fit the budget.  Resident copies are RCU protected, lookups never block.
+ */
+#define BLOOM_RESIDENT_PERIOD   (10)    /* Seconds between rebalances. */
+
+struct castle_bloom_resident {
+    void                     *chunks;   /* All chunks, as laid out on disk.                 */
+    void                    **keys;     /* Last key of each chunk, from the index.          */
+    uint32_t                  nr_keys;
+    uint64_t                  size;     /* Bytes charged to the budget.                     */
+};
+
+static int castle_bloom_resident_mb = 64;
+module_param(castle_bloom_resident_mb, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_bloom_resident_mb, "Memory for bloom filters held outside the cache, in MB");
+
+static               DEFINE_SPINLOCK(castle_bloom_resident_lock);   /* Protects the list, flags
+                                                                       and bytes below.        */
+static                     LIST_HEAD(castle_bloom_resident_filters);
+static uint64_t                      castle_bloom_resident_bytes;
+static       DECLARE_WAIT_QUEUE_HEAD(castle_bloom_resident_wq);     /* Waiters for loads.      */
+static struct workqueue_struct      *castle_bloom_resident_wqueue;
+static struct work_struct            castle_bloom_resident_work;
+static struct timer_list             castle_bloom_resident_timer;
+
+/**
+ * Bytes of the chunks of a filter.
+ */
+static uint64_t castle_bloom_chunks_size(castle_bloom_t *bf)
+{
+    return (uint64_t)(bf->num_chunks - 1) * BLOOM_CHUNK_SIZE
+                + bf->num_blocks_last_chunk * BLOOM_BLOCK_SIZE(bf);
+}
+
+/**
+ * Read a c2b of a complete filter, unless it is in the cache already.
+ */
+static int castle_bloom_c2b_read(c2_block_t *c2b)
+{
+    int ret = 0;
+
+    if (c2b_uptodate(c2b))
+        return 0;
+
+    write_lock_c2b(c2b);
+    if (!c2b_uptodate(c2b))
+        ret = submit_c2b_sync(READ, c2b);
+    write_unlock_c2b(c2b);
+
+    return ret;
+}
+
+static void castle_bloom_resident_free(castle_bloom_t *bf, struct castle_bloom_resident *res)
+{
+    uint32_t i;
+
+    for (i = 0; i < res->nr_keys; i++)
+        bf->btree->key_dealloc(res->keys[i]);
+    if (res->keys)
+        castle_free(res->keys);
+    if (res->chunks)
+        castle_vfree(res->chunks);
+    castle_free(res);
+}
+
+/**
+ * Copy a complete filter into memory.
+ *
+ * @return  Resident copy, NULL on failure
+ */
+static struct castle_bloom_resident* castle_bloom_resident_load(castle_bloom_t *bf)
+{
+    struct castle_bloom_resident *res;
+    struct castle_btree_node *node;
+    c_ext_pos_t cep;
+    c2_block_t *c2b;
+    uint32_t i, chunk_id, pages;
+    void *key;
+
+    res = castle_zalloc(sizeof(struct castle_bloom_resident), GFP_KERNEL);
+    if (!res)
+        return NULL;
+    res->keys = castle_zalloc(bf->num_chunks * sizeof(void *), GFP_KERNEL);
+    res->chunks = castle_vmalloc(castle_bloom_chunks_size(bf));
+    if (!res->keys || !res->chunks)
+        goto err;
+    res->size = castle_bloom_chunks_size(bf) + bf->num_chunks * sizeof(void *);
+
+    /* Chunk keys, in the order castle_bloom_get_chunk_id() counts them. */
+    cep.ext_id = bf->ext_id;
+    cep.offset = 0;
+    for (i = 0; i < bf->num_btree_nodes && res->nr_keys < bf->num_chunks; i++)
+    {
+        c2b = castle_cache_block_get(cep, BLOOM_INDEX_NODE_SIZE_PAGES);
+        if (castle_bloom_c2b_read(c2b))
+        {
+            put_c2b(c2b);
+            goto err;
+        }
+        node = (struct castle_btree_node *)c2b_buffer(c2b);
+        for (chunk_id = 0; chunk_id < node->used && res->nr_keys < bf->num_chunks; chunk_id++)
+        {
+            bf->btree->entry_get(node, chunk_id, &key, NULL, NULL);
+            res->keys[res->nr_keys] = bf->btree->key_duplicate(key);
+            if (!res->keys[res->nr_keys])
+            {
+                put_c2b(c2b);
+                goto err;
+            }
+            res->size += sizeof(vlba_key_t) + ((vlba_key_t *)key)->length;
+            res->nr_keys++;
+        }
+        put_c2b(c2b);
+        cep.offset += BLOOM_INDEX_NODE_SIZE;
+    }
+
+    /* Chunks, read with the same c2b sizes they were built with. */
+    for (chunk_id = 0; chunk_id < bf->num_chunks; chunk_id++)
+    {
+        pages = BLOCKS_IN_CHUNK(bf, chunk_id) * bf->block_size_pages;
+        cep.offset = bf->chunks_offset + chunk_id * BLOOM_CHUNK_SIZE;
+        c2b = castle_cache_block_get(cep, pages);
+        if (castle_bloom_c2b_read(c2b))
+        {
+            put_c2b(c2b);
+            goto err;
+        }
+        memcpy(res->chunks + chunk_id * BLOOM_CHUNK_SIZE, c2b_buffer(c2b), pages * PAGE_SIZE);
+        put_c2b(c2b);
+    }
+
+    return res;
+
+err:
+    castle_printk(LOG_WARN, "Failed to load bloom filter %p into memory.\n", bf);
+    castle_bloom_resident_free(bf, res);
+    return NULL;
+}
+
+/**
+ * Initialise residency state of a new or just read filter.
+ */
+static void castle_bloom_resident_reset(castle_bloom_t *bf)
+{
+    INIT_LIST_HEAD(&bf->resident_list);
+    bf->resident            = NULL;
+    bf->resident_registered = 0;
+    bf->resident_busy       = 0;
+    bf->resident_score      = 0;
+    bf->resident_negatives  = 0;
+}
+
+/**
+ * Make a filter a candidate for residency.
+ */
+static void castle_bloom_resident_register(castle_bloom_t *bf)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+    if (!bf->resident_registered)
+    {
+        list_add_tail(&bf->resident_list, &castle_bloom_resident_filters);
+        bf->resident_registered = 1;
+    }
+    spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+
+    queue_work(castle_bloom_resident_wqueue, &castle_bloom_resident_work);
+}
+
+/**
+ * Is the filter still registered, i.e. not dropped yet.  Called with the lock held.
+ */
+static int castle_bloom_resident_listed(castle_bloom_t *bf)
+{
+    castle_bloom_t *listed;
+
+    list_for_each_entry(listed, &castle_bloom_resident_filters, resident_list)
+        if (listed == bf)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * Unregister a filter and free its resident copy.  Must be called before the filter,
+ * or its extent, goes away.
+ */
+static void castle_bloom_resident_drop(castle_bloom_t *bf)
+{
+    struct castle_bloom_resident *res;
+    unsigned long flags;
+
+    spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+    list_del_init(&bf->resident_list);
+    /* Never to be registered again. */
+    bf->resident_registered = 1;
+    while (bf->resident_busy)
+    {
+        spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+        wait_event(castle_bloom_resident_wq, !bf->resident_busy);
+        spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+    }
+    res = bf->resident;
+    rcu_assign_pointer(bf->resident, NULL);
+    if (res)
+        castle_bloom_resident_bytes -= res->size;
+    spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+
+    if (res)
+    {
+        synchronize_rcu();
+        castle_bloom_resident_free(bf, res);
+    }
+}
+
+/**
+ * Lookup a key in a resident filter.
+ *
+ * @return  -1          if the filter is not resident
+ * @return  0           if not found
+ * @return  1           if found
+ */
+static int castle_bloom_resident_lookup(castle_bloom_t *bf, struct castle_btree_type *btree,
+                                        void *key)
+{
+    struct castle_bloom_resident *res;
+    uint32_t lo, hi, mid;
+    void *block;
+    int found;
+
+    if (unlikely(!bf->resident_registered))
+        castle_bloom_resident_register(bf);
+
+    rcu_read_lock();
+    res = rcu_dereference(bf->resident);
+    if (!res)
+    {
+        rcu_read_unlock();
+        return -1;
+    }
+
+    /* The key is in the first chunk whose last key isn't smaller. */
+    lo = 0;
+    hi = res->nr_keys;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (bf->btree->key_compare(key, res->keys[mid]) <= 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (lo == res->nr_keys)
+    {
+        /* Off the end of the partition index. */
+        rcu_read_unlock();
+        return 0;
+    }
+
+    block = res->chunks + lo * BLOOM_CHUNK_SIZE
+                + castle_bloom_get_block_id(bf, key, BLOCKS_IN_CHUNK(bf, lo)) * BLOOM_BLOCK_SIZE(bf);
+    found = castle_bloom_block_lookup(bf, block, btree, key);
+    rcu_read_unlock();
+
+    return found;
+}
+
+struct castle_bloom_resident_cand {
+    castle_bloom_t           *bf;
+    uint64_t                  size;
+    uint64_t                  priority;
+    int                       resident;
+    int                       wanted;
+};
+
+/**
+ * Rank registered filters and load or evict them to fit the budget.
+ *
+ * Filters are ranked by measured usefulness per byte.  Usefulness is the number of
+ * negatives (lookups saved), decayed by half every rebalance, weighted by level: upper
+ * levels hold the newest trees which every get consults first.  Filters which haven't
+ * answered any lookups yet are ranked on level and size alone.
+ */
+static void castle_bloom_resident_rebalance(struct work_struct *work)
+{
+    struct castle_bloom_resident_cand *cands, cand;
+    struct castle_bloom_resident *res;
+    castle_bloom_t *bf;
+    struct castle_bloom_stats stats;
+    uint64_t budget, used;
+    unsigned long flags;
+    int nr, i, j, level;
+
+    budget = (uint64_t)max(castle_bloom_resident_mb, 0) << 20;
+
+    spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+    nr = 0;
+    list_for_each_entry(bf, &castle_bloom_resident_filters, resident_list)
+        nr++;
+    spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+    if (nr == 0)
+        return;
+
+    cands = castle_malloc(nr * sizeof(struct castle_bloom_resident_cand), GFP_KERNEL);
+    if (!cands)
+        return;
+
+    spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+    i = 0;
+    list_for_each_entry(bf, &castle_bloom_resident_filters, resident_list)
+    {
+        if (i == nr)
+            break;
+
+        castle_bloom_stats_get(bf, &stats);
+        bf->resident_score = bf->resident_score / 2 + (stats.negatives - bf->resident_negatives);
+        bf->resident_negatives = stats.negatives;
+
+        level = container_of(bf, struct castle_component_tree, bloom)->level;
+        level = min(level, MAX_DA_LEVEL - 1);
+
+        cands[i].bf       = bf;
+        cands[i].resident = (bf->resident != NULL);
+        cands[i].size     = bf->resident ? bf->resident->size
+                                         : castle_bloom_chunks_size(bf)
+                                            + bf->num_chunks * sizeof(void *);
+        cands[i].priority = (bf->resident_score + 1) * (MAX_DA_LEVEL - level) * 1024
+                                / (cands[i].size / PAGE_SIZE + 1);
+        i++;
+    }
+    spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+    nr = i;
+
+    /* Most useful per byte first. */
+    for (i = 1; i < nr; i++)
+    {
+        cand = cands[i];
+        for (j = i; j > 0 && cands[j-1].priority < cand.priority; j--)
+            cands[j] = cands[j-1];
+        cands[j] = cand;
+    }
+    used = 0;
+    for (i = 0; i < nr; i++)
+    {
+        cands[i].wanted = (used + cands[i].size <= budget);
+        if (cands[i].wanted)
+            used += cands[i].size;
+    }
+
+    /* Evict first, to make room. */
+    for (i = 0; i < nr; i++)
+    {
+        if (cands[i].wanted || !cands[i].resident)
+            continue;
+        bf = cands[i].bf;
+
+        spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+        if (!castle_bloom_resident_listed(bf) || bf->resident_busy || !bf->resident)
+        {
+            spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+            continue;
+        }
+        res = bf->resident;
+        rcu_assign_pointer(bf->resident, NULL);
+        castle_bloom_resident_bytes -= res->size;
+        /* Keep the filter around while we sleep. */
+        bf->resident_busy = 1;
+        spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+
+        synchronize_rcu();
+        castle_bloom_resident_free(bf, res);
+
+        /* Back to the cache, softpinned if small, as after castle_bloom_unmarshall(). */
+        if (bf->num_chunks <= BLOOM_MAX_SOFTPIN_CHUNKS)
+            castle_cache_advise((c_ext_pos_t){bf->ext_id, 0}, C2_ADV_EXTENT|C2_ADV_SOFTPIN,
+                    CHUNK(bf->chunks_offset + bf->num_chunks * BLOOM_CHUNK_SIZE) + 1, -1, 0);
+
+        spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+        bf->resident_busy = 0;
+        spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+        wake_up(&castle_bloom_resident_wq);
+    }
+
+    /* Then load. */
+    for (i = 0; i < nr; i++)
+    {
+        if (!cands[i].wanted || cands[i].resident)
+            continue;
+        bf = cands[i].bf;
+
+        spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+        if (!castle_bloom_resident_listed(bf) || bf->resident_busy || bf->resident
+                || castle_bloom_resident_bytes + cands[i].size > budget)
+        {
+            spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+            continue;
+        }
+        bf->resident_busy = 1;
+        spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+
+        res = castle_bloom_resident_load(bf);
+        if (res)
+            /* No need to hold the filter in the cache as well. */
+            castle_cache_advise_clear((c_ext_pos_t){bf->ext_id, 0},
+                    C2_ADV_EXTENT|C2_ADV_SOFTPIN, -1, -1, 0);
+
+        spin_lock_irqsave(&castle_bloom_resident_lock, flags);
+        if (res)
+        {
+            rcu_assign_pointer(bf->resident, res);
+            castle_bloom_resident_bytes += res->size;
+        }
+        bf->resident_busy = 0;
+        spin_unlock_irqrestore(&castle_bloom_resident_lock, flags);
+        wake_up(&castle_bloom_resident_wq);
+    }
+
+    castle_free(cands);
+}
+
+static void castle_bloom_resident_timer_tick(unsigned long unused)
+{
+    queue_work(castle_bloom_resident_wqueue, &castle_bloom_resident_work);
+    mod_timer(&castle_bloom_resident_timer, jiffies + HZ * BLOOM_RESIDENT_PERIOD);
+}
+
+int castle_bloom_init(void)
+{
+    castle_bloom_build_wqueue = create_workqueue("castle_bloom_build");
+    if (!castle_bloom_build_wqueue)
+    {
+        castle_printk(LOG_ERROR, "Could not create bloom build workqueue.\n");
+        return -ENOMEM;
+    }
+    castle_bloom_resident_wqueue = create_singlethread_workqueue("castle_bloom");
+    if (!castle_bloom_resident_wqueue)
+    {
+        castle_printk(LOG_ERROR, "Could not create bloom residency workqueue.\n");
+        destroy_workqueue(castle_bloom_build_wqueue);
+        return -ENOMEM;
+    }
+    CASTLE_INIT_WORK(&castle_bloom_resident_work, castle_bloom_resident_rebalance);
+    setup_timer(&castle_bloom_resident_timer, castle_bloom_resident_timer_tick, 0);
+    mod_timer(&castle_bloom_resident_timer, jiffies + HZ * BLOOM_RESIDENT_PERIOD);
+
+    return 0;
+}
+
+/**
+ * Stop the residency manager and build helpers.  Resident filters are freed as their trees
+ * go away.
+ */
+void castle_bloom_fini(void)
+{
+    del_timer_sync(&castle_bloom_resident_timer);
+    destroy_workqueue(castle_bloom_resident_wqueue);
+    destroy_workqueue(castle_bloom_build_wqueue);
+}
+
 /**
  * Start the chain of calls to do a Bloom filter lookup
  */
@@ -869,11 +1821,34 @@ static void _castle_bloom_submit(void *data)
  */
 void castle_bloom_submit(c_bvec_t *c_bvec)
 {
+    int found;
+
+    /* Resident filters are answered inline, without IO, skipping all trees they rule out. */
+    while (castle_bloom_use && c_bvec->tree->bloom_exists)
+    {
+        getnstimeofday(&c_bvec->bloom_start);
+        found = castle_bloom_resident_lookup(&c_bvec->tree->bloom,
+                                             castle_btree_type_get(c_bvec->tree->btree_type),
+                                             c_bvec->key);
+        if (found < 0)
+            break;
+        castle_bloom_lookup_done(c_bvec, found);
+        if (found)
+        {
+            c_bvec->bloom_positive = 1;
+            castle_btree_submit(c_bvec);
+            return;
+        }
+        if (!castle_bloom_ct_next(c_bvec))
+            return;
+    }
+
     /* bloom filters won't exist for unmerged trees i.e. T0s */
     if (!castle_bloom_use || !c_bvec->tree->bloom_exists)
         castle_btree_submit(c_bvec);
     else
     {
+        getnstimeofday(&c_bvec->bloom_start);
         INIT_WORK(&c_bvec->work, _castle_bloom_submit, c_bvec);
         queue_work_on(c_bvec->cpu, castle_wqs[19], &c_bvec->work);
     }
@@ -884,6 +1859,8 @@ void castle_bloom_submit(c_bvec_t *c_bvec)
 void castle_bloom_marshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
 {
     ctm->bloom_num_hashes = bf->num_hashes;
+    ctm->bloom_bits_per_element = bf->bits_per_element;
+    ctm->bloom_format = bf->format;
     ctm->bloom_block_size_pages = bf->block_size_pages;
     ctm->bloom_num_chunks = bf->num_chunks;
     ctm->bloom_num_blocks_last_chunk = bf->num_blocks_last_chunk;
@@ -897,10 +1874,22 @@ void castle_bloom_marshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
  *
  * - Prefetch bloom filter extent where the total number of chunks satisfies our
  *   cache requirements
+ *
+ * @return -EINVAL if the filter can't be used, its extent is left to be reclaimed
  */
-void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
+int castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
 {
     bf->num_hashes = ctm->bloom_num_hashes;
+    /* Filters from before per-tree sizing don't record it. */
+    bf->bits_per_element = (ctm->magic == CLIST_ENTRY_MAGIC) ? ctm->bloom_bits_per_element
+                                                             : BLOOM_BITS_PER_ELEMENT;
+    /* Probing with the wrong size would miss keys, go without the filter instead. */
+    if (bf->bits_per_element == 0 || bf->bits_per_element > BLOOM_MAX_BITS_PER_ELEMENT)
+        return -EINVAL;
+    /* Filters from before cache line blocking are all in the block format. */
+    bf->format = (ctm->magic == CLIST_ENTRY_MAGIC) ? ctm->bloom_format : BLOOM_FORMAT_BLOCKS;
+    if (bf->format != BLOOM_FORMAT_BLOCKS && bf->format != BLOOM_FORMAT_LINES)
+        return -EINVAL;
     bf->block_size_pages = ctm->bloom_block_size_pages;
     bf->num_chunks = ctm->bloom_num_chunks;
     bf->num_blocks_last_chunk = ctm->bloom_num_blocks_last_chunk;
@@ -927,10 +1916,10 @@ void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
                 C2_ADV_EXTENT|C2_ADV_PREFETCH|C2_ADV_SOFTPIN, chunks, -1, 0);
     }
 
-#ifdef CASTLE_BLOOM_FP_STATS
-    atomic64_set(&bf->queries, 0);
-    atomic64_set(&bf->false_positives, 0);
-#endif
+    if (castle_bloom_stats_init(bf))
+        castle_printk(LOG_WARN, "Failed to alloc stats for bloom filter %p, not counting.\n", bf);
+
+    return 0;
 }
 
 /* Marshalling/unmarshalling of bloom_build_params handled seperately because they are only needed
@@ -939,6 +1928,10 @@ void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
 void castle_bloom_build_param_marshall(struct castle_bbp_entry *bbpm,
                                        struct castle_bloom_build_params *bf_bp)
 {
+    /* Serialised state covers elements_inserted keys, their bits must be in the chunk. */
+    if (bf_bp->batches[0])
+        castle_bloom_build_sync(bf_bp->batches[0]->bf);
+
     bbpm->expected_num_elements = bf_bp->expected_num_elements;
     bbpm->elements_inserted     = bf_bp->elements_inserted;
     bbpm->chunks_complete       = bf_bp->chunks_complete;
@@ -19,21 +19,57 @@ struct castle_bloom_build_params
     c_ext_pos_t chunk_cep;
     uint32_t cur_chunk_num_blocks;
     uint32_t nodes_complete;
+    struct castle_cache_stream *stream; /* Writes out completed chunks and nodes, if set. */
+    struct castle_bloom_build_batch *batches[2]; /* Hashed keys, filled and set in turn. */
+    int cur_batch;                      /* Batch being filled. */
+    atomic_t batches_in_flight;         /* Batches handed to the helper, at most one. */
+    int cpu;                            /* CPU setting the bits. */
 #ifdef DEBUG
     uint32_t *elements_inserted_per_block;
 #endif
 };
 
-int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements);
+/* Filters sharing a bits per key budget, @see castle_bloom_budget_bits(). */
+struct castle_bloom_budget
+{
+    uint64_t elements;
+    uint64_t log2_sum;  /* Sum of elements * log2(elements), in 1/16ths. */
+};
+
+void     castle_bloom_budget_add(struct castle_bloom_budget *budget, uint64_t num_elements);
+uint32_t castle_bloom_budget_bits(struct castle_bloom_budget *budget, uint64_t num_elements);
+/**
+ * Bump a per-CPU counter of a bloom filter, @see struct castle_bloom_stats.
+ */
+#define castle_bloom_stats_add(_bf, _field, _n)                                     \
+do {                                                                                \
+    if ((_bf)->stats)                                                               \
+    {                                                                               \
+        per_cpu_ptr((_bf)->stats, get_cpu())->_field += (_n);                       \
+        put_cpu();                                                                  \
+    }                                                                               \
+} while (0)
+
+void     castle_bloom_stats_get(castle_bloom_t *bf, struct castle_bloom_stats *sum);
+uint32_t castle_bloom_fp_expected(castle_bloom_t *bf);
+uint32_t castle_bloom_fp_measured(castle_bloom_t *bf);
+
+int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements,
+                        uint32_t bits_per_element);
 void castle_bloom_complete(castle_bloom_t *bf);
 void castle_bloom_abort(castle_bloom_t *bf);
+void castle_bloom_stream_set(castle_bloom_t *bf, struct castle_cache_stream *stream);
 void castle_bloom_destroy(castle_bloom_t *bf);
 void castle_bloom_add(castle_bloom_t *bf, struct castle_btree_type *btree, void *key);
+void castle_bloom_build_sync(castle_bloom_t *bf);
 void castle_bloom_submit(c_bvec_t *c_bvec);
 void castle_bloom_marshall(castle_bloom_t *bf, struct castle_clist_entry *ctm);
-void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm);
+int castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm);
 void castle_bloom_build_param_marshall(struct castle_bbp_entry *bbpm,
                                        struct castle_bloom_build_params *bbp);
 void castle_bloom_build_param_unmarshall(castle_bloom_t *bf,
                                          struct castle_bbp_entry *bbpm);
+void castle_bloom_release(castle_bloom_t *bf);
+int  castle_bloom_init(void);
+void castle_bloom_fini(void);
 #endif /* __CASTLE_BLOOM_H__ */
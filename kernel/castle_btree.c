@@ -9,6 +9,7 @@
 #include "castle_utils.h"
 #include "castle_versions.h"
 #include "castle_da.h"
+#include "castle_memtable.h"
 #include "castle_debug.h"
 
 //#define DEBUG
@@ -2465,6 +2466,7 @@ static void castle_btree_read_process(c_bvec_t *c_bvec)
                 memcpy(loc_buf, lub_cvt.val, lub_cvt.length);
                 lub_cvt.val = loc_buf;
             }
+            c_bvec->found_version = lub_version;
             castle_btree_io_end(c_bvec, lub_cvt, 0);
         }
         else
@@ -2708,6 +2710,13 @@ static void _castle_btree_submit(struct work_struct *work)
     ct = c_bvec->tree;
     btree = castle_btree_type_get(ct->btree_type);
 
+    /* Memtable T0s have no btree to walk. */
+    if (ct->memtable)
+    {
+        castle_memtable_submit(c_bvec);
+        return;
+    }
+
     /* Prepare the state flags, etc. */
     clear_bit(CBV_ROOT_LOCKED_BIT, &c_bvec->flags);
     clear_bit(CBV_PARENT_WRITE_LOCKED, &c_bvec->flags);
@@ -3979,6 +3988,31 @@ static void castle_rq_enum_iter_each(c_iter_t *c_iter,
     }
 }
 
+/**
+ * Advise the cache to read ahead of the leaf the range query is about to go through.
+ *
+ * Leaves of merged trees are laid out in key order, so prefetching forward from the current
+ * leaf brings in the next leaves of the range before the consumer gets to them.  Leaves of
+ * dynamic trees are allocated in no particular order, and are left alone.
+ */
+static void castle_rq_enum_iter_node_start(c_iter_t *c_iter)
+{
+    c_rq_enum_t *rq_enum = c_iter->private;
+    c2_block_t *leaf = c_iter->path[c_iter->depth];
+    c_ext_pos_t cep;
+
+    if (rq_enum->tree->dynamic)
+        return;
+
+    /* The leaf is locked, start from the next chunk so the prefetcher keeps clear of it. */
+    cep.ext_id = leaf->cep.ext_id;
+    cep.offset = (CHUNK(leaf->cep.offset) + 1) << C_CHK_SHIFT;
+    if (CHUNK(cep.offset) >= castle_extent_size_get(cep.ext_id))
+        return;
+
+    castle_cache_advise(cep, C2_ADV_PREFETCH|C2_ADV_FRWD, -1, -1, 0);
+}
+
 static int castle_btree_rq_enum_prep_next(c_rq_enum_t *rq_enum);
 
 static void castle_rq_enum_iter_node_end(c_iter_t *c_iter)
@@ -4089,7 +4123,7 @@ void castle_btree_rq_enum_init(c_rq_enum_t *rq_enum, c_ver_t version,
     iter = &rq_enum->iterator;
     iter->tree       = rq_enum->tree;
     iter->need_visit = NULL;
-    iter->node_start = NULL;
+    iter->node_start = castle_rq_enum_iter_node_start;
     iter->each       = castle_rq_enum_iter_each;
     iter->node_end   = castle_rq_enum_iter_node_end;
     iter->end        = castle_rq_enum_iter_end;
@@ -4512,6 +4512,116 @@ next_c2b:
         *flushed_p = flushed;
 }
 
+/**
+ * Initialise a write stream.
+ *
+ * @param stream    Stream to initialise
+ * @param window    Maximum number of c2bs in flight, 0 disables the stream
+ */
+void castle_cache_stream_init(c2_stream_t *stream, int window)
+{
+    memset(stream, 0, sizeof(c2_stream_t));
+    if (window > 0 && window < C2B_STREAM_BATCH_SIZE)
+        window = C2B_STREAM_BATCH_SIZE;
+    stream->window = window;
+    atomic_set(&stream->in_flight, 0);
+}
+
+/**
+ * Submit batched c2bs of a write stream.
+ *
+ * c2bs are submitted in the order they were added.  The slaves are unplugged
+ * only once the whole batch has been queued, so that writes to adjacent blocks
+ * get merged into large requests.
+ *
+ * c2bs already being flushed, or cleaned in the meantime, are skipped.
+ *
+ * @also castle_cache_extent_flush_endio()
+ */
+static void castle_cache_stream_submit(c2_stream_t *stream)
+{
+    c2_block_t *c2b;
+    int i, submitted = 0;
+
+    for (i = 0; i < stream->nr_batched; i++)
+    {
+        c2b = stream->batch[i];
+        stream->batch[i] = NULL;
+
+        if (test_set_c2b_flushing(c2b))
+        {
+            put_c2b(c2b);
+            continue;
+        }
+        read_lock_c2b(c2b);
+        if (!c2b_uptodate(c2b) || !c2b_dirty(c2b))
+        {
+            read_unlock_c2b(c2b);
+            clear_c2b_flushing(c2b);
+            put_c2b(c2b);
+            continue;
+        }
+
+        /* Completion releases the lock, flushing bit and our reference. */
+        atomic_inc(&stream->in_flight);
+        c2b->end_io  = castle_cache_extent_flush_endio;
+        c2b->private = (void *)&stream->in_flight;
+        BUG_ON(submit_c2b(WRITE, c2b));
+        submitted++;
+    }
+    stream->nr_batched = 0;
+
+    if (submitted)
+        castle_slaves_unplug();
+}
+
+/**
+ * Hand a released dirty c2b over to a write stream.
+ *
+ * Takes over the caller's reference.  The c2b must not be locked.  Blocks if
+ * the stream already has its window of c2bs in flight.
+ *
+ * If the stream is disabled or paused the c2b is left for the flush thread.
+ */
+void castle_cache_stream_add(c2_stream_t *stream, c2_block_t *c2b)
+{
+    if (!stream->window || stream->paused)
+    {
+        put_c2b(c2b);
+        return;
+    }
+
+    stream->batch[stream->nr_batched++] = c2b;
+    if (stream->nr_batched < C2B_STREAM_BATCH_SIZE)
+        return;
+
+    castle_cache_stream_submit(stream);
+    wait_event(castle_cache_flush_wq, atomic_read(&stream->in_flight) <= stream->window);
+}
+
+/**
+ * Submit any batched c2bs and wait for all writes of the stream to complete.
+ */
+void castle_cache_stream_drain(c2_stream_t *stream)
+{
+    castle_cache_stream_submit(stream);
+    wait_event(castle_cache_flush_wq, atomic_read(&stream->in_flight) == 0);
+}
+
+/**
+ * Pause or resume a write stream.
+ *
+ * Pausing drains the stream, so once it returns every c2b added earlier is
+ * either on disk or dirty in the cache.  Later c2bs are left dirty for the
+ * flush thread (and checkpoints) until the stream is resumed.
+ */
+void castle_cache_stream_pause(c2_stream_t *stream, int pause)
+{
+    if (pause && !stream->paused)
+        castle_cache_stream_drain(stream);
+    stream->paused = pause;
+}
+
 /**
  * Synchronously flush dirty pages from beginning of extent to start+size.
  * Extent must exist, checked with a BUG_ON(!dirtytree).
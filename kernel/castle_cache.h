@@ -162,6 +162,24 @@ c2_block_t* castle_cache_block_get    (c_ext_pos_t  cep, int nr_pages);
 void        castle_cache_page_block_unreserve(c2_block_t *c2b);
 int         castle_cache_extent_flush_schedule (c_ext_id_t ext_id, uint64_t start, uint64_t size);
 
+/**********************************************************************************************
+ * Write streams: dirty c2bs produced in extent order (e.g. merge output) written straight to
+ * disk, rather than left for the flush thread.
+ */
+#define C2B_STREAM_BATCH_SIZE       (16)                /**< c2bs submitted together.         */
+typedef struct castle_cache_stream {
+    c2_block_t                *batch[C2B_STREAM_BATCH_SIZE]; /**< Released c2bs not yet submitted. */
+    int                        nr_batched;
+    int                        window;          /**< Max c2bs in flight, 0 disables the stream.   */
+    int                        paused;          /**< c2bs are left dirty for the flush thread.    */
+    atomic_t                   in_flight;       /**< Number of c2bs being written.                */
+} c2_stream_t;
+
+void        castle_cache_stream_init  (c2_stream_t *stream, int window);
+void        castle_cache_stream_add   (c2_stream_t *stream, c2_block_t *c2b);
+void        castle_cache_stream_drain (c2_stream_t *stream);
+void        castle_cache_stream_pause (c2_stream_t *stream, int pause);
+
 
 /**********************************************************************************************
  * MStore related functions (including stats store handler).
@@ -905,6 +905,13 @@ int castle_control_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                             castle_double_array_compact(ioctl.destroy_vertree.vertree_id);
             break;
 
+        case CASTLE_CTRL_VERTREE_COMPACTION_POLICY:
+            ioctl.vertree_compaction_policy.ret =
+                castle_double_array_compaction_policy_set(
+                                            ioctl.vertree_compaction_policy.vertree_id,
+                                            ioctl.vertree_compaction_policy.policy);
+            break;
+
         case CASTLE_CTRL_CLONE:
             castle_control_clone( ioctl.clone.version,
                                  &ioctl.clone.ret,
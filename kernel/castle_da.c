@@ -16,6 +16,7 @@
 #include "castle_sysfs.h"
 #include "castle_objects.h"
 #include "castle_bloom.h"
+#include "castle_memtable.h"
 
 #ifndef CASTLE_PERF_DEBUG
 #define ts_delta_ns(a, b)                       ((void)0)
@@ -58,6 +59,7 @@ static struct castle_mstore    *castle_da_store      = NULL;
 static struct castle_mstore    *castle_tree_store    = NULL;
 static struct castle_mstore    *castle_lo_store      = NULL;
 static struct castle_mstore    *castle_dmser_store   = NULL;
+static struct castle_mstore    *castle_rt_store      = NULL;
        c_da_t                   castle_next_da_id    = 1;
 static atomic_t                 castle_next_tree_seq = ATOMIC(0);
 static int                      castle_da_exiting    = 0;
@@ -89,6 +91,73 @@ static int                      castle_use_ssd_leaf_nodes = 0;
 module_param(castle_use_ssd_leaf_nodes, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(castle_use_ssd_leaf_nodes, "Use SSDs for btree leaf nodes");
 
+#define CASTLE_MERGE_WORKERS_MAX        (32)
+static int                      castle_merge_workers = 4;
+
+module_param(castle_merge_workers, int, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(castle_merge_workers, "Number of merge threads shared by all doubling arrays");
+
+/* 0 means merges are not bandwidth limited. */
+static int                      castle_merge_bandwidth_cap = 0;
+
+module_param(castle_merge_bandwidth_cap, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_bandwidth_cap, "Total merge output bandwidth cap, in MB/s (0=unlimited)");
+
+static int                      castle_write_latency_target = 10;
+
+module_param(castle_write_latency_target, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_write_latency_target, "Write admission delay (ms) above which merges get paced");
+
+static int                      castle_write_delay_max = 2000;
+
+module_param(castle_write_delay_max, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_write_delay_max, "Per-insert delay (us) once merge backlog reaches the insert stop limit");
+
+static int                      castle_compaction_policy = CASTLE_COMPACTION_DOUBLING;
+
+module_param(castle_compaction_policy, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_compaction_policy, "Compaction policy of new version trees (0=doubling, 1=leveled)");
+
+static int                      castle_leveled_size_ratio = 10;
+
+module_param(castle_leveled_size_ratio, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_leveled_size_ratio, "Size ratio between consecutive levels of leveled version trees");
+
+static int                      castle_trivial_moves = 1;
+
+module_param(castle_trivial_moves, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_trivial_moves, "Move trees with disjoint key ranges up a level instead of merging them");
+
+static int                      castle_value_log = 0;
+
+module_param(castle_value_log, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_value_log, "Leave medium objects in place during merges above level 1");
+
+static int                      castle_value_gc_ratio = 50;
+
+module_param(castle_value_gc_ratio, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_value_gc_ratio, "Live percentage below which merges copy medium objects out of a value extent");
+
+static int                      castle_tombstone_density = 50;
+
+module_param(castle_tombstone_density, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_tombstone_density, "Percentage of tombstones in the merged trees of a DA that triggers a total merge (0=never)");
+
+static int                      castle_memtables = 0;
+
+module_param(castle_memtables, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_memtables, "Keep new T0s in memory, with a write-ahead log in their tree extent");
+
+static int                      castle_modlist_sort_bench = 0;
+
+module_param(castle_modlist_sort_bench, int, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(castle_modlist_sort_bench, "Benchmark T0 sort on start-up, up to this many entries (0=off)");
+
+static int                      castle_merge_write_window = 64;
+
+module_param(castle_merge_write_window, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_merge_write_window, "Merge output nodes written straight to disk in flight per merge (0=leave to flush thread)");
+
 /**********************************************************************************************/
 /* Notes about the locking on doubling arrays & component trees.
    Each doubling array has a spinlock which protects the lists of component trees rooted in
@@ -140,13 +209,14 @@ static USED void castle_da_merges_print(struct castle_double_array *da);
 static int castle_da_merge_restart(struct castle_double_array *da, void *unused);
 static int castle_da_merge_start(struct castle_double_array *da, void *unused);
 void castle_double_array_merges_fini(void);
-static void castle_da_merge_budget_consume(struct castle_da_merge *merge);
+static int castle_da_merge_budget_consume(struct castle_da_merge *merge);
 static struct castle_component_tree* castle_da_rwct_get(struct castle_double_array *da,
                                                         int cpu_index);
 static void castle_da_queue_kick(struct work_struct *work);
 static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *c_bvec);
 static void castle_da_write_bvec_start(struct castle_double_array *da, c_bvec_t *c_bvec);
 static void castle_da_reserve(struct castle_double_array *da, c_bvec_t *c_bvec);
+static void castle_da_write_timer_fire(unsigned long data);
 static void castle_da_get(struct castle_double_array *da);
 static void castle_da_put(struct castle_double_array *da);
 static void castle_da_merge_serialise(struct castle_da_merge *merge);
@@ -179,9 +249,13 @@ static int castle_da_rwct_create(struct castle_double_array *da,
                                  int in_tran,
                                  c_lfs_vct_type_t lfs_type);
 static int castle_da_no_disk_space(struct castle_double_array *da);
+static int castle_ct_key_bounds_get(struct castle_component_tree *ct);
+static int castle_ct_key_bounds_overlap(struct castle_component_tree *ct1,
+                                        struct castle_component_tree *ct2);
 
 struct workqueue_struct *castle_da_wqs[NR_CASTLE_DA_WQS];
 char *castle_da_wqs_names[NR_CASTLE_DA_WQS] = {"castle_da0"};
+static struct workqueue_struct *castle_ct_modlist_sort_wq;  /**< Modlist sort workers.      */
 
 tree_seq_t castle_da_next_ct_seq(void);
 
@@ -265,6 +339,11 @@ int castle_da_merge_running(struct castle_double_array *da, int level)
     return test_bit(DA_MERGE_RUNNING_BIT, &da->levels[level].merge.flags);
 }
 
+static inline int castle_da_leveled(struct castle_double_array *da)
+{
+    return da->compaction_policy == CASTLE_COMPACTION_LEVELED;
+}
+
 static inline void castle_da_merge_running_set(struct castle_double_array *da, int level)
 {
     set_bit(DA_MERGE_RUNNING_BIT, &da->levels[level].merge.flags);
@@ -561,6 +640,13 @@ static void castle_ct_immut_iter_init(c_immut_iter_t *iter,
     iter->node_start= node_start;
     iter->private   = private;
 
+    /* Trees holding nothing but range tombstones have an empty root leaf. */
+    if (atomic64_read(&iter->tree->item_count) == 0)
+    {
+        iter->completed = 1;
+        return;
+    }
+
     first_node_cep.ext_id = iter->tree->tree_ext_free.ext_id;
     first_node_cep.offset = 0;
     first_node_size = iter->btree->node_size(iter->tree, 0);
@@ -649,15 +735,10 @@ typedef struct castle_modlist_iterator {
     uint32_t nr_items;              /**< Number of items in the buffer                            */
     uint32_t next_item;             /**< Next item to return in iterator                          */
     struct item_idx {
+        uint64_t prefix;            /**< Order preserving key prefix (used for sort)              */
         uint32_t node;              /**< Which btree node                                         */
         uint32_t node_offset;       /**< Offset within btree node                                 */
-    } *src_entry_idx;               /**< 1 of 2 arrays of entry pointers (used for sort)          */
-    struct item_idx *dst_entry_idx; /**< 2nd array of entry pointers                              */
-    struct entry_range {            /**< Entry range describes start,end within *_entry_idx       */
-        uint32_t start;
-        uint32_t end;
-    } *ranges;
-    uint32_t nr_ranges;             /**< Number of elements in node_ranges                        */
+    } *entry_idx;                   /**< Entry pointers, sorted in k,<-v order after init         */
 } c_modlist_iter_t;
 
 struct mutex    castle_da_level1_merge_init;            /**< For level 1 merges serialise entry to
@@ -679,12 +760,8 @@ static void castle_ct_modlist_iter_free(c_modlist_iter_t *iter)
     }
     if(iter->node_buffer)
         castle_vfree(iter->node_buffer);
-    if (iter->src_entry_idx)
-        castle_vfree(iter->src_entry_idx);
-    if (iter->dst_entry_idx)
-        castle_vfree(iter->dst_entry_idx);
-    if (iter->ranges)
-        castle_vfree(iter->ranges);
+    if (iter->entry_idx)
+        castle_vfree(iter->entry_idx);
 
     /* Replenish the budget - no need to serialise. */
     buffer_size = iter->nr_nodes * iter->leaf_node_size * C_BLK_SIZE;
@@ -703,23 +780,21 @@ static struct castle_btree_node* castle_ct_modlist_iter_buffer_get(c_modlist_ite
 }
 
 /**
- * Return key, version, cvt for entry sort_idx within iter->src_entry_idx[].
+ * Return key, version, cvt for the entry pointed to by idx.
  */
-static void castle_ct_modlist_iter_item_get(c_modlist_iter_t *iter,
-                                            uint32_t sort_idx,
-                                            void **key_p,
-                                            c_ver_t *version_p,
-                                            c_val_tup_t *cvt_p)
+static void castle_ct_modlist_iter_entry_get(c_modlist_iter_t *iter,
+                                             struct item_idx *idx,
+                                             void **key_p,
+                                             c_ver_t *version_p,
+                                             c_val_tup_t *cvt_p)
 {
     struct castle_btree_type *btree = iter->btree;
     struct castle_btree_node *node;
 
-    debug_verbose("Node_idx=%d, offset=%d\n",
-                  iter->sort_idx[sort_idx].node,
-                  iter->sort_idx[sort_idx].node_offset);
-    node = castle_ct_modlist_iter_buffer_get(iter, iter->src_entry_idx[sort_idx].node);
+    debug_verbose("Node_idx=%d, offset=%d\n", idx->node, idx->node_offset);
+    node = castle_ct_modlist_iter_buffer_get(iter, idx->node);
     btree->entry_get(node,
-                     iter->src_entry_idx[sort_idx].node_offset,
+                     idx->node_offset,
                      key_p,
                      version_p,
                      cvt_p);
@@ -728,17 +803,18 @@ static void castle_ct_modlist_iter_item_get(c_modlist_iter_t *iter,
 /**
  * Return the next entry from the iterator.
  *
- * - Uses the final sorted src_entry_idx[].
+ * - Uses the final sorted entry_idx[].
  *
  * @also castle_ct_modlist_iter_fill()
- * @also castle_ct_modlist_iter_mergesort()
+ * @also castle_ct_modlist_iter_sort()
  */
 static void castle_ct_modlist_iter_next(c_modlist_iter_t *iter,
                                         void **key_p,
                                         c_ver_t *version_p,
                                         c_val_tup_t *cvt_p)
 {
-    castle_ct_modlist_iter_item_get(iter, iter->next_item, key_p, version_p, cvt_p);
+    castle_ct_modlist_iter_entry_get(iter, &iter->entry_idx[iter->next_item],
+                                     key_p, version_p, cvt_p);
     iter->next_item++;
 }
 
@@ -753,105 +829,6 @@ static int castle_ct_modlist_iter_has_next(c_modlist_iter_t *iter)
     return (!iter->err && (iter->next_item < iter->nr_items));
 }
 
-/**
- * Fill count entry pointers in dst_entry_idx from src_entry_idx.
- *
- * @param iter  Modlist iterator (provides src_entry_idx, dst_entry_idx)
- * @param src   Starting src_entry_idx entry to source entry pointers from
- * @param dst   Starting dst_entry_idx entry to populate from
- * @param count Number of entries to populate
- */
-static inline void castle_ct_modlist_iter_merge_index_fill(c_modlist_iter_t *iter,
-                                                           uint32_t src,
-                                                           uint32_t dst,
-                                                           uint32_t count)
-{
-    uint32_t i;
-
-    for (i = 0; i < count; i++, src++, dst++)
-    {
-        iter->dst_entry_idx[dst].node        = iter->src_entry_idx[src].node;
-        iter->dst_entry_idx[dst].node_offset = iter->src_entry_idx[src].node_offset;
-    }
-}
-
-/**
- * Mergesort two contiguous entry ptr ranges (r1, r2) from src_entry_idx into dst_entry_idx.
- *
- * @param iter  Modlist iterator (provides src_entry_idx, dst_entry_idx)
- * @param r1    First range of node entry pointers
- * @param r2    Second range of node entry pointers
- *
- * - Iterate over entries pointed to by r1->start,r1->end and r2->start,r2->end
- *   from src_entry_idx[]
- * - Write out entry pointers in smallest to largest order into dst_entry_idx[]
- *   starting at index r1->start
- * - Result is that dst_entry_idx[r1->start] to dst_entry_idx[r2->end] will be
- *   sorted in smallest to largest order
- *
- * @also castle_ct_modlist_iter_mergesort()
- */
-static void castle_ct_modlist_iter_merge_ranges(c_modlist_iter_t *iter,
-                                                struct entry_range *r1,
-                                                struct entry_range *r2)
-{
-    uint32_t r1_idx = r1->start;    /* current index for r1 */
-    uint32_t r2_idx = r2->start;    /* current index for r2 */
-    uint32_t dst_idx = r1->start;   /* output index */
-    uint32_t src_idx = 0;           /* index of next smallest entry (from r1 or r2) */
-    void *r1_key, *r2_key;
-    c_ver_t r1_ver, r2_ver;
-
-    BUG_ON(r1->end+1 != r2->start); /* ranges *MUST* be contiguous */
-
-    for (dst_idx = r1->start; dst_idx <= r2->end; dst_idx++)
-    {
-        might_resched();
-
-        /* Both ranges have more entries if their indexes lie within the range. */
-        if (r1_idx <= r1->end && r2_idx <= r2->end)
-        {
-            /* Both ranges have more entries, we need to do a comparison to
-             * determine which range has the next smallest value. */
-            castle_ct_modlist_iter_item_get(iter, r1_idx, &r1_key, &r1_ver, NULL);
-            castle_ct_modlist_iter_item_get(iter, r2_idx, &r2_key, &r2_ver, NULL);
-
-            if (castle_kv_compare(iter->btree, r1_key, r1_ver, r2_key, r2_ver) < 0)
-            {
-                /* r1 smaller than r2. */
-                src_idx = r1_idx;
-                r1_idx++;
-            }
-            else
-            {
-                /* r1 larger than or equal to r2. */
-                src_idx = r2_idx;
-                r2_idx++;
-            }
-
-            /* Update dst_entry_idx with the smallest available entry pointer. */
-            castle_ct_modlist_iter_merge_index_fill(iter, src_idx, dst_idx, 1);
-
-            continue;
-        }
-
-        /* If we reached here then one of the two entry ranges has been
-         * exhausted.  We need do no more comparisons and can just populate
-         * the remainder of the output index with the entries from the range
-         * that has not yet been exhausted. */
-
-        if (r1_idx <= r1->end)
-            castle_ct_modlist_iter_merge_index_fill(iter, r1_idx, dst_idx, r1->end-r1_idx+1);
-        else if (r2_idx <= r2->end)
-            castle_ct_modlist_iter_merge_index_fill(iter, r2_idx, dst_idx, r2->end-r2_idx+1);
-        else
-            BUG();
-
-        /* We're done. */
-        break;
-    }
-}
-
 /**
  * Handler called when immutable iterator advances to a new source btree node.
  *
@@ -869,7 +846,7 @@ static void castle_ct_modlist_iter_next_node(c_immut_iter_t *immut_iter)
 }
 
 /**
- * Populate node_buffer with leaf btree nodes, set up entry indexes and node ranges.
+ * Populate node_buffer with leaf btree nodes, set up entry indexes.
  *
  * - Using immutable iterator (iter->enumerator) iterate over entries in the
  *   unsorted btree
@@ -878,13 +855,10 @@ static void castle_ct_modlist_iter_next_node(c_immut_iter_t *immut_iter)
  *   and sets iter->enum_advanced whenever a new source node is used
  * - Get a new buffer btree node whenever the source iterator node advances
  * - Keep getting (unsorted) entries from the immutable iterator and store them
- *   in the node_buffer.  Put an entry in dst_entry_idx[] pointing to the node
- *   and node_offset
- * - As we move to a new node when the immutable iterator moves, we are
- *   guaranteed that individual btree nodes are sorted.  Fill ranges[] with
- *   start and end index within dst_entry_idx[]
+ *   in the node_buffer.  Put an entry in entry_idx[] pointing to the node
+ *   and node_offset, together with the order preserving prefix of its key
  *
- * @also castle_ct_modlist_iter_mergesort()
+ * @also castle_ct_modlist_iter_sort()
  */
 static void castle_ct_modlist_iter_fill(c_modlist_iter_t *iter)
 {
@@ -914,12 +888,6 @@ static void castle_ct_modlist_iter_fill(c_modlist_iter_t *iter)
          * nodes being identically sized to our destination nodes. */
         if (iter->enum_advanced)
         {
-            /* Set end entry for node range we just completed. */
-            if (likely(node_idx))
-                iter->ranges[node_idx-1].end = item_idx-1;
-            /* Set start entry for node range we're moving to. */
-            iter->ranges[node_idx].start = item_idx;
-
             /* Get a new node. */
             node = castle_ct_modlist_iter_buffer_get(iter, node_idx);
             castle_da_node_buffer_init(btree, node, btree->node_size(iter->tree, 0));
@@ -932,15 +900,13 @@ static void castle_ct_modlist_iter_fill(c_modlist_iter_t *iter)
 
         /* Insert entry into node. */
         btree->entry_add(node, node_offset, key, version, cvt);
-        iter->dst_entry_idx[item_idx].node        = node_idx-1;
-        iter->dst_entry_idx[item_idx].node_offset = node_offset;
+        iter->entry_idx[item_idx].prefix      = castle_object_btree_key_prefix(key);
+        iter->entry_idx[item_idx].node        = node_idx-1;
+        iter->entry_idx[item_idx].node_offset = node_offset;
         node_offset++;
         item_idx++;
     }
 
-    if (likely(node_idx))
-        iter->ranges[node_idx-1].end = item_idx-1;    /* @TODO this should be tidier */
-
     if (item_idx != atomic64_read(&iter->tree->item_count))
     {
         castle_printk(LOG_WARN, "Error. Different number of items than expected in CT=%d "
@@ -950,153 +916,313 @@ static void castle_ct_modlist_iter_fill(c_modlist_iter_t *iter)
         WARN_ON(1);
     }
     iter->nr_items = item_idx;
-    iter->nr_ranges = node_idx;
     //iter->err = iter->enumerator->err;
 }
 
-/**
- * Mergesort the underlying component tree into smallest->largest k,<-v order.
- *
- * L1 btrees are in insertion order but individual nodes have entries sorted in
- * k,<-v order.  To iterate over the btree we must first sort the whole tree.
- * This is done by merging leaf-nodes together repeatedly until we have a single
- * large k,<-v sorted set of entries.
- *
- * Internally the iterator uses:
- *
- * - node_buffer: contiguous buffer of btree leaf-nodes with entries
- * - src_entry_idx[], dst_entry_idx[]: two indirect indexes of entries within
- *   node_buffer.  We sort the data indirectly and hence for simplicity
- *   alternate src_entry_idx[] and dst_entry_idx[] for each round of merges
- * - ranges: ranges of entries within src_entry_idx[] that are guaranteed to
- *   be k,<-v sorted
- * - nr_ranges: number of ranges in src_entry_idx[]
- *
- * Mergesort implementation as follows:
+/*
+ * Modlist sort.
  *
- * castle_ct_modlist_iter_fill() fills iter->entry_buffer with leaf-nodes from
- * the source btree.  For each entry that gets inserted into the buffer a
- * pointer to that entry goes into dst_entry_idx[].  Individual source btree
- * nodes are k,<-v sorted so we define ranges of entries on top of
- * dst_entry_idx[].  Each range encompasses the entries from a single source
- * btree node.  iter->nr_ranges contains the number of active ranges in
- * src_entry_idx[] (except after a fill when it is valid for dst_entry_idx[]).
+ * Entries are sorted with an in-place MSD radix sort (American flag sort) on the 64-bit
+ * order preserving key prefixes stored in entry_idx[], a byte at a time, most significant
+ * byte first.  Keys only get compared (castle_kv_compare()) to order entries with equal
+ * prefixes, which happens in small buckets and once all prefix bytes have been used up.
  *
- * We go through the main mergesort loop until nr_ranges has reached 1 (single
- * sorted range of entries).  Each time we go through the loop we swap the src
- * and dst entry_idx[] such that src_entry_idx[] contains the most up-to-date
- * sorted data we have available.
- *
- * Take two ranges of entries and merge them together in _merge_ranges().  This
- * takes the entries from src_entry_idx[] and writes out sorted entries into
- * dst_entry_idx[].
- *
- * Update ranges[] with the new range start and end (new range start will be
- * range1.start and end will be range2.end - ranges must be contiguous).
- *
- * If we have an uneven number of ranges move the entry pointers from src_
- * to dst_entry_idx[] and ensure the range points to the correct entries.  No
- * merge is performed in this instance.  @TODO this is inefficient
- *
- * Update the total number of ranges and go again if necessary.
- *
- * @also castle_ct_modlist_iter_fill()
- * @also castle_ct_modlist_iter_merge_ranges()
- * @also castle_ct_modlist_iter_init()
+ * Big trees are sorted on multiple CPUs: the entries get partitioned until they split into
+ * more than one bucket, the buckets are then sorted independently by workers queued on
+ * castle_ct_modlist_sort_wq on every online CPU (and by the caller).  The sort workers get
+ * a workqueue of their own, long sorts must not hold up castle_da_wqs[] users (bloom
+ * filter IO completions, etc.).
  */
-static void castle_ct_modlist_iter_mergesort(c_modlist_iter_t *iter)
+#define MODLIST_SORT_BYTES          (8)         /**< Bytes of prefix radix sorted on.         */
+#define MODLIST_SORT_SMALL          (32)        /**< Insertion sort buckets up to this size.  */
+#define MODLIST_SORT_PARALLEL_MIN   (1 << 16)   /**< Sort on multiple CPUs from this many
+                                                     entries up.                              */
+
+struct castle_ct_modlist_sort {
+    c_modlist_iter_t       *iter;
+    uint32_t                start;              /**< Start of the partitioned range.          */
+    int                     depth;              /**< Prefix byte buckets are sorted from.     */
+    uint32_t                buckets[257];       /**< Bucket bounds, relative to start.        */
+    atomic_t                next_bucket;        /**< Next bucket for a worker to sort.        */
+    atomic_t                workers;            /**< Workers still running.                   */
+    struct completion       done;               /**< Completed by the last worker.            */
+};
+
+struct castle_ct_modlist_sort_worker {
+    struct castle_ct_modlist_sort  *sort;
+    struct work_struct              work;
+    uint32_t                        bounds[MODLIST_SORT_BYTES][257];
+    uint32_t                        next[256];
+};
+
+static inline uint8_t castle_ct_modlist_sort_byte(struct item_idx *idx, int depth)
+{
+    return (idx->prefix >> (8 * (MODLIST_SORT_BYTES - 1 - depth))) & 0xff;
+}
+
+static int castle_ct_modlist_sort_compare(c_modlist_iter_t *iter,
+                                          struct item_idx *idx1,
+                                          struct item_idx *idx2)
 {
-    uint32_t src_range, dst_range;
-    void *tmp_entry_idx;
+    void *k1, *k2;
+    c_ver_t v1, v2;
 
-    /* Populate internal entry buffer and initialise dst_entry_idx[] and the
-     * initial node ranges for sorting. */
-    castle_ct_modlist_iter_fill(iter);
+    if (idx1->prefix != idx2->prefix)
+        return (idx1->prefix < idx2->prefix) ? -1 : 1;
+
+    castle_ct_modlist_iter_entry_get(iter, idx1, &k1, &v1, NULL);
+    castle_ct_modlist_iter_entry_get(iter, idx2, &k2, &v2, NULL);
 
-    /* Repeatedly merge ranges of entry pointers until we have a single
-     * all-encompassing smallest->largest sorted range we can use to return
-     * entries when the iterator .has_next(), .next() functions are called. */
-    while (iter->nr_ranges > 1)
+    return castle_kv_compare(iter->btree, k1, v1, k2, v2);
+}
+
+/**
+ * Insertion sort entry_idx[start, end).
+ */
+static void castle_ct_modlist_sort_small(c_modlist_iter_t *iter, uint32_t start, uint32_t end)
+{
+    struct item_idx *idx = iter->entry_idx, tmp;
+    uint32_t i, j;
+
+    for (i = start + 1; i < end; i++)
     {
-        /* Another merge.  Swap the src and dst entry indexes around.
-         * We will now be sourcing from the previous iteration's dst_entry_idx
-         * (also used by castle_ct_modlist_iter_fill()) and writing our values
-         * out to our previous source. */
-        tmp_entry_idx = iter->src_entry_idx;
-        iter->src_entry_idx = iter->dst_entry_idx;  /* src = dst */
-        iter->dst_entry_idx = tmp_entry_idx;        /* dst = src */
+        tmp = idx[i];
+        for (j = i; (j > start) && (castle_ct_modlist_sort_compare(iter, &idx[j-1], &tmp) > 0); j--)
+            idx[j] = idx[j-1];
+        idx[j] = tmp;
+    }
+}
 
-        src_range = dst_range = 0;
+static void castle_ct_modlist_sort_sift(c_modlist_iter_t *iter,
+                                       struct item_idx *idx,
+                                       uint32_t root,
+                                       uint32_t n)
+{
+    struct item_idx tmp;
+    uint32_t child;
 
-        /* So long as we have two remaining entry ranges, mergesort the entries
-         * together to create a single range spanning the capacity of both. */
-        while (src_range+1 < iter->nr_ranges)
-        {
-            /* Mergesort. */
-            castle_ct_modlist_iter_merge_ranges(iter,
-                                                &iter->ranges[src_range],
-                                                &iter->ranges[src_range+1]);
+    while ((child = 2 * root + 1) < n)
+    {
+        if ((child + 1 < n) &&
+            (castle_ct_modlist_sort_compare(iter, &idx[child], &idx[child+1]) < 0))
+            child++;
+        if (castle_ct_modlist_sort_compare(iter, &idx[root], &idx[child]) >= 0)
+            return;
+        tmp = idx[root]; idx[root] = idx[child]; idx[child] = tmp;
+        root = child;
+    }
+}
+
+/**
+ * Heap sort entry_idx[start, end), for big buckets of entries with equal prefixes.
+ */
+static void castle_ct_modlist_sort_heap(c_modlist_iter_t *iter, uint32_t start, uint32_t end)
+{
+    struct item_idx *idx = iter->entry_idx + start, tmp;
+    uint32_t n = end - start, i;
 
-            /* Update the destination range. */
-            iter->ranges[dst_range].start = iter->ranges[src_range].start;
-            iter->ranges[dst_range].end   = iter->ranges[src_range+1].end;
+    for (i = n / 2; i > 0; i--)
+        castle_ct_modlist_sort_sift(iter, idx, i - 1, n);
+    for (i = n - 1; i > 0; i--)
+    {
+        might_resched();
+        tmp = idx[0]; idx[0] = idx[i]; idx[i] = tmp;
+        castle_ct_modlist_sort_sift(iter, idx, 0, i);
+    }
+}
 
-            src_range += 2;
-            dst_range++;
-        }
+/**
+ * Partition entry_idx[start, end) into 256 buckets on the depth-th prefix byte, in place.
+ *
+ * @param bounds    [out] Bucket bounds, relative to start (bucket b is [bounds[b], bounds[b+1]))
+ * @param next      Scratch space
+ */
+static void castle_ct_modlist_sort_partition(c_modlist_iter_t *iter,
+                                             uint32_t start,
+                                             uint32_t end,
+                                             int depth,
+                                             uint32_t *bounds,
+                                             uint32_t *next)
+{
+    struct item_idx *idx = iter->entry_idx, tmp, swap;
+    uint32_t i, b, tb;
+
+    memset(bounds, 0, 257 * sizeof(uint32_t));
+    for (i = start; i < end; i++)
+        bounds[castle_ct_modlist_sort_byte(&idx[i], depth) + 1]++;
+    for (b = 0; b < 256; b++)
+    {
+        bounds[b+1] += bounds[b];
+        next[b] = start + bounds[b];
+    }
 
-        /* Above we merged pairs of ranges.  Part of the merge process (handled
-         * within castle_ct_modlist_iter_merge_ranges() is to populate the
-         * dst_entry_idx.  If we started with an odd number of ranges we must
-         * deal with the straggling range as a special case. */
-        if (src_range < iter->nr_ranges)
+    /* Move every entry to its bucket, following cycles of displaced entries. */
+    for (b = 0; b < 256; b++)
+    {
+        while (next[b] < start + bounds[b+1])
         {
-            /* We only have one range to merge so we fake up a range that
-             * castle_ct_modlist_iter_merge_ranges() will determine to be
-             * exhausted and therefore will populate dst_entry_idx with only
-             * those entries from our one remaining src_range. */
-            struct entry_range null_range;
-
-            /* Mergesort. */
-            null_range.start = iter->ranges[src_range].end+1;
-            null_range.end   = iter->ranges[src_range].end;
-            castle_ct_modlist_iter_merge_ranges(iter,
-                                                &iter->ranges[src_range],
-                                                &null_range);
-
-            /* Update the destination range. */
-            iter->ranges[dst_range].start = iter->ranges[src_range].start;
-            iter->ranges[dst_range].end   = iter->ranges[src_range].end;
-
-            src_range++;
-            dst_range++;
+            tmp = idx[next[b]];
+            while ((tb = castle_ct_modlist_sort_byte(&tmp, depth)) != b)
+            {
+                swap = idx[next[tb]];
+                idx[next[tb]++] = tmp;
+                tmp = swap;
+            }
+            idx[next[b]++] = tmp;
         }
-        /* else even number of source ranges */
+        might_resched();
+    }
+}
+
+/**
+ * Sort entry_idx[start, end), whose entries share prefix bytes before depth.
+ */
+static void castle_ct_modlist_sort_range(struct castle_ct_modlist_sort_worker *worker,
+                                         uint32_t start,
+                                         uint32_t end,
+                                         int depth)
+{
+    c_modlist_iter_t *iter = worker->sort->iter;
+    uint32_t *bounds;
+    int b;
+
+    if (end - start <= MODLIST_SORT_SMALL)
+    {
+        castle_ct_modlist_sort_small(iter, start, end);
+        return;
+    }
+    if (depth == MODLIST_SORT_BYTES)
+    {
+        castle_ct_modlist_sort_heap(iter, start, end);
+        return;
+    }
+
+    bounds = worker->bounds[depth];
+    castle_ct_modlist_sort_partition(iter, start, end, depth, bounds, worker->next);
+    for (b = 0; b < 256; b++)
+        if (bounds[b+1] - bounds[b] > 1)
+            castle_ct_modlist_sort_range(worker, start + bounds[b], start + bounds[b+1], depth + 1);
+}
+
+/**
+ * Sort buckets of the top level partition until there are none left.
+ */
+static void castle_ct_modlist_sort_buckets(struct castle_ct_modlist_sort_worker *worker)
+{
+    struct castle_ct_modlist_sort *sort = worker->sort;
+    int b;
+
+    while ((b = atomic_inc_return(&sort->next_bucket) - 1) < 256)
+    {
+        if (sort->buckets[b+1] - sort->buckets[b] > 1)
+            castle_ct_modlist_sort_range(worker,
+                                         sort->start + sort->buckets[b],
+                                         sort->start + sort->buckets[b+1],
+                                         sort->depth + 1);
+    }
+}
+
+static void castle_ct_modlist_sort_work(struct work_struct *work)
+{
+    struct castle_ct_modlist_sort_worker *worker =
+                container_of(work, struct castle_ct_modlist_sort_worker, work);
+    struct castle_ct_modlist_sort *sort = worker->sort;
+
+    castle_ct_modlist_sort_buckets(worker);
+    if (atomic_dec_and_test(&sort->workers))
+        complete(&sort->done);
+}
+
+/**
+ * Sort entry_idx[] in k,<-v order, on multiple CPUs for big trees.
+ *
+ * @return -ENOMEM  Could not allocate sort state
+ */
+static int castle_ct_modlist_iter_sort(c_modlist_iter_t *iter)
+{
+    struct castle_ct_modlist_sort *sort;
+    struct castle_ct_modlist_sort_worker *workers;
+    int nr_workers, i, cpu, b;
+
+    sort = castle_malloc(sizeof(struct castle_ct_modlist_sort), GFP_KERNEL);
+    nr_workers = (iter->nr_items >= MODLIST_SORT_PARALLEL_MIN) ? num_online_cpus() : 1;
+    workers = castle_vmalloc(nr_workers * sizeof(struct castle_ct_modlist_sort_worker));
+    if (!sort || !workers)
+    {
+        if (sort)
+            castle_free(sort);
+        if (workers)
+            castle_vfree(workers);
+        return -ENOMEM;
+    }
+    sort->iter = iter;
+    for (i = 0; i < nr_workers; i++)
+        workers[i].sort = sort;
+
+    if (nr_workers == 1)
+    {
+        castle_ct_modlist_sort_range(&workers[0], 0, iter->nr_items, 0);
+        goto out;
+    }
+
+    /* Partition until the entries split into more than one bucket. */
+    sort->start = 0;
+    for (sort->depth = 0; sort->depth < MODLIST_SORT_BYTES; sort->depth++)
+    {
+        castle_ct_modlist_sort_partition(iter, sort->start, iter->nr_items, sort->depth,
+                                         sort->buckets, workers[0].next);
+        for (b = 0; b < 256; b++)
+            if (sort->buckets[b+1] - sort->buckets[b] == iter->nr_items)
+                break;
+        if (b == 256)
+            break;
+    }
+    if (sort->depth == MODLIST_SORT_BYTES)
+    {
+        /* All prefixes identical. */
+        castle_ct_modlist_sort_heap(iter, 0, iter->nr_items);
+        goto out;
+    }
 
-        iter->nr_ranges = dst_range;
+    /* Sort the buckets, on all the CPUs. */
+    atomic_set(&sort->next_bucket, 0);
+    atomic_set(&sort->workers, 1);
+    init_completion(&sort->done);
+    i = 1;
+    for_each_online_cpu(cpu)
+    {
+        if (i == nr_workers)
+            break;
+        atomic_inc(&sort->workers);
+        CASTLE_INIT_WORK(&workers[i].work, castle_ct_modlist_sort_work);
+        queue_work_on(cpu, castle_ct_modlist_sort_wq, &workers[i].work);
+        i++;
     }
+    /* The caller sorts buckets too. */
+    castle_ct_modlist_sort_work(&workers[0].work);
+    wait_for_completion(&sort->done);
+
+out:
+    castle_vfree(workers);
+    castle_free(sort);
 
-    /* Finally ensure dst_entry_idx points to the final sorted index and free
-     * the other temporary index right now. */
-    castle_vfree(iter->src_entry_idx);
-    iter->src_entry_idx = iter->dst_entry_idx;
-    iter->dst_entry_idx = NULL;
+    return 0;
 }
 
 /**
  * Initialise modlist btree iterator.
  *
- * See castle_ct_modlist_iter_mergesort() for full implementation details.
+ * See castle_ct_modlist_iter_sort() for sort implementation details.
  *
  * - Initialise members
  * - Consume bytes from the global modlist iter byte budget
- * - Allocate memory for node_buffer, src_ and dst_entry_idx[] and ranges
+ * - Allocate memory for node_buffer and entry_idx[]
  * - Initialise immutable iterator (for sort)
- * - Kick of mergesort
+ * - Fill the buffer and kick off sort
  *
  * NOTE: Caller must hold castle_da_level1_merge_init mutex.
  *
- * @also castle_ct_modlist_iter_mergesort()
+ * @also castle_ct_modlist_iter_sort()
  */
 static void castle_ct_modlist_iter_init(c_modlist_iter_t *iter)
 {
@@ -1104,12 +1230,21 @@ static void castle_ct_modlist_iter_init(c_modlist_iter_t *iter)
     int buffer_size;
 
     BUG_ON(!mutex_is_locked(&castle_da_level1_merge_init));
-    BUG_ON(atomic64_read(&ct->item_count) == 0);
     BUG_ON(!ct); /* component tree must be provided */
 
     iter->err = 0;
     iter->btree = castle_btree_type_get(ct->btree_type);
     iter->leaf_node_size = iter->btree->node_size(ct, 0);
+    iter->enumerator = NULL;
+    iter->node_buffer = NULL;
+    iter->entry_idx = NULL;
+    iter->nr_nodes = 0;
+    iter->nr_items = 0;
+    iter->next_item = 0;
+
+    /* Empty trees only get merged for their range tombstones, nothing to sort. */
+    if (atomic64_read(&ct->item_count) == 0)
+        return;
 
     /* To prevent sudden kernel memory ballooning we impose a modlist byte
      * budget for all DAs.  Size the node buffer based on leaf nodes only. */
@@ -1128,15 +1263,12 @@ static void castle_ct_modlist_iter_init(c_modlist_iter_t *iter)
      * For iterating over source entries during sort. */
     iter->enumerator = castle_malloc(sizeof(c_immut_iter_t), GFP_KERNEL);
 
-    /* Allocate btree-entry buffer, two indexes for the buffer (for sorting)
-     * and space to define ranges of sorted nodes within the index. */
+    /* Allocate btree-entry buffer and the index for the buffer (for sorting). */
     iter->node_buffer = castle_vmalloc(buffer_size);
-    iter->src_entry_idx = castle_vmalloc(atomic64_read(&ct->item_count) * sizeof(struct item_idx));
-    iter->dst_entry_idx = castle_vmalloc(atomic64_read(&ct->item_count) * sizeof(struct item_idx));
-    iter->ranges = castle_vmalloc(iter->nr_nodes * sizeof(struct entry_range));
+    iter->entry_idx = castle_vmalloc(atomic64_read(&ct->item_count) * sizeof(struct item_idx));
 
     /* Return ENOMEM if we failed any of our allocations. */
-    if(!iter->enumerator || !iter->node_buffer || !iter->src_entry_idx || !iter->dst_entry_idx)
+    if(!iter->enumerator || !iter->node_buffer || !iter->entry_idx)
     {
         castle_ct_modlist_iter_free(iter);
         iter->err = -ENOMEM;
@@ -1147,14 +1279,115 @@ static void castle_ct_modlist_iter_init(c_modlist_iter_t *iter)
     iter->enumerator->tree = ct;
     castle_ct_immut_iter_init(iter->enumerator, castle_ct_modlist_iter_next_node, iter);
 
+    /* Populate the entry buffer and entry_idx[]. */
+    castle_ct_modlist_iter_fill(iter);
+
     /* Finally, sort the data so we can return sorted entries to the caller. */
-    castle_ct_modlist_iter_mergesort(iter);
+    if (castle_ct_modlist_iter_sort(iter))
+    {
+        castle_ct_modlist_iter_free(iter);
+        iter->err = -ENOMEM;
+        return;
+    }
+    debug("Sorted %u entries of ct=%d.\n", iter->nr_items, ct->seq);
 
     /* Good state before we accept requests. */
     iter->err = 0;
     iter->next_item = 0;
 }
 
+/**
+ * Time castle_ct_modlist_iter_sort() on synthetic T0s of growing sizes.
+ *
+ * Fills node buffers with random single dimension, 16 byte keys (in root version), sharing
+ * their first 4 bytes, so that both radix passes and key comparisons get exercised.
+ * Checks the result is sorted, and logs the sort time against the number of entries.
+ *
+ * @param max_entries   Largest number of entries to sort
+ */
+static void castle_ct_modlist_sort_bench(uint32_t max_entries)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(RW_VLBA_TREE_TYPE);
+    struct castle_btree_node *node;
+    struct timespec ts_start, ts_end;
+    c_modlist_iter_t iter;
+    c_vl_okey_t *okey;
+    c_vl_bkey_t *bkey;
+    c_val_tup_t cvt;
+    uint32_t nr_entries, node_idx, i;
+    int unsorted;
+
+    okey = castle_zalloc(sizeof(c_vl_okey_t) + sizeof(c_vl_key_t *), GFP_KERNEL);
+    if (!okey)
+        return;
+    okey->nr_dims = 1;
+    okey->dims[0] = castle_malloc(sizeof(c_vl_key_t) + 16, GFP_KERNEL);
+    if (!okey->dims[0])
+        goto out;
+    okey->dims[0]->length = 16;
+    memcpy(okey->dims[0]->key, "key:", 4);
+    CVT_TOMB_STONE_SET(cvt);
+
+    for (nr_entries = 1024; nr_entries <= max_entries; nr_entries *= 4)
+    {
+        memset(&iter, 0, sizeof(c_modlist_iter_t));
+        iter.btree          = btree;
+        iter.leaf_node_size = btree->node_size(NULL, 0);
+        /* Plenty of nodes, each holds way more than 8 of these entries. */
+        iter.nr_nodes       = nr_entries / 8 + 1;
+        iter.node_buffer    = castle_vmalloc(iter.nr_nodes * iter.leaf_node_size * C_BLK_SIZE);
+        iter.entry_idx      = castle_vmalloc(nr_entries * sizeof(struct item_idx));
+        if (!iter.node_buffer || !iter.entry_idx)
+            goto next;
+
+        node = NULL;
+        node_idx = 0;
+        for (i = 0; i < nr_entries; i++)
+        {
+            get_random_bytes(okey->dims[0]->key + 4, 12);
+            bkey = castle_object_key_convert(okey);
+            if (!bkey)
+                goto next;
+            if (!node || btree->need_split(node, 0))
+            {
+                BUG_ON(node_idx >= iter.nr_nodes);
+                node = castle_ct_modlist_iter_buffer_get(&iter, node_idx++);
+                castle_da_node_buffer_init(btree, node, iter.leaf_node_size);
+            }
+            btree->entry_add(node, node->used, bkey, 0, cvt);
+            iter.entry_idx[i].prefix      = castle_object_btree_key_prefix(bkey);
+            iter.entry_idx[i].node        = node_idx - 1;
+            iter.entry_idx[i].node_offset = node->used - 1;
+            castle_object_bkey_free(bkey);
+            might_resched();
+        }
+        iter.nr_items = nr_entries;
+
+        getnstimeofday(&ts_start);
+        if (castle_ct_modlist_iter_sort(&iter))
+            goto next;
+        getnstimeofday(&ts_end);
+
+        for (unsorted = 0, i = 1; i < nr_entries; i++)
+            if (castle_ct_modlist_sort_compare(&iter, &iter.entry_idx[i-1], &iter.entry_idx[i]) > 0)
+                unsorted++;
+
+        castle_printk(LOG_INIT, "Modlist sort: %8u entries in %8lluus%s\n",
+                nr_entries,
+                (timespec_to_ns(&ts_end) - timespec_to_ns(&ts_start)) / 1000,
+                unsorted ? ", NOT SORTED" : "");
+next:
+        if (iter.node_buffer)
+            castle_vfree(iter.node_buffer);
+        if (iter.entry_idx)
+            castle_vfree(iter.entry_idx);
+    }
+
+    castle_free(okey->dims[0]);
+out:
+    castle_free(okey);
+}
+
 struct castle_iterator_type castle_ct_modlist_iter = {
     .register_cb = NULL,
     .prep_next   = NULL,
@@ -1311,6 +1544,13 @@ static int _castle_ct_merged_iter_prep_next(c_merged_iter_t *iter,
                 comp_iter->cached = 1;
                 iter->src_items_completed++;
                 debug_iter("%s:%p:%d - cached\n", __FUNCTION__, iter, i);
+                /* Drop entries hidden by range tombstones, and get the next one. */
+                if (iter->hidden && iter->hidden(iter, comp_iter))
+                {
+                    comp_iter->cached = 0;
+                    i--;
+                    continue;
+                }
                 /* Insert the kv pair into RB tree. */
                 /* It is possible that. this call could delete kv pairs of the component
                  * iterators (which is fine, as we go through that component iterator anyway)
@@ -1388,6 +1628,7 @@ static void castle_ct_merged_iter_next(c_merged_iter_t *iter,
     comp_iter = castle_ct_merge_iter_rbtree_min_del(iter);
     debug("Smallest entry is from iterator: %p.\n", comp_iter);
     comp_iter->cached = 0;
+    iter->last_idx = comp_iter - iter->iterators;
 
     /* Return the smallest entry */
     if(key_p) *key_p = comp_iter->cached_entry.k;
@@ -1455,7 +1696,8 @@ static void castle_ct_merged_iter_cancel(c_merged_iter_t *iter)
 static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
                                        void **iterators,
                                        struct castle_iterator_type **iterator_types,
-                                       castle_merged_iterator_each_skip each_skip)
+                                       castle_merged_iterator_each_skip each_skip,
+                                       castle_merged_iterator_hidden hidden)
 {
     int i;
 
@@ -1465,6 +1707,7 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
     iter->err = 0;
     iter->src_items_completed = 0;
     iter->end_io = NULL;
+    iter->last_idx = -1;
     iter->rb_root = RB_ROOT;
     iter->iterators = castle_malloc(iter->nr_iters * sizeof(struct component_iterator), GFP_KERNEL);
     if(!iter->iterators)
@@ -1474,6 +1717,7 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
         return;
     }
     iter->each_skip = each_skip;
+    iter->hidden = hidden;
     /* Memory allocated for the iterators array, init the state.
        Assume that all iterators have something in them, and let the has_next_check()
        handle the opposite. */
@@ -1547,6 +1791,7 @@ static USED void castle_ct_sort(struct castle_component_tree *ct1,
     castle_ct_merged_iter_init(&test_miter,
                                iters,
                                iter_types,
+                               NULL,
                                NULL);
     debug("=============== SORTED ================\n");
     while(castle_ct_merged_iter_has_next(&test_miter))
@@ -1561,39 +1806,156 @@ static USED void castle_ct_sort(struct castle_component_tree *ct1,
 }
 #endif
 
-/* Has next, next and skip only need to call the corresponding functions on
-   the underlying merged iterator */
+/**
+ * Allocate a range tombstone, with copies of the start and end keys.
+ *
+ * @return  NULL if out of memory
+ */
+static struct castle_range_tombstone* castle_range_tombstone_alloc(c_ver_t version,
+                                                                   uint16_t cpu_index,
+                                                                   uint16_t nr_cpus,
+                                                                   c_vl_bkey_t *start_key,
+                                                                   c_vl_bkey_t *end_key)
+{
+    struct castle_range_tombstone *rt;
+    uint32_t start_len = start_key->length + 4;
+    uint32_t end_len = end_key->length + 4;
+
+    /* Keys are stored just after the structure, in the same allocation. */
+    rt = castle_malloc(sizeof(struct castle_range_tombstone) + ALIGN(start_len, 8) + end_len,
+                       GFP_KERNEL);
+    if (!rt)
+        return NULL;
 
-static void castle_da_rq_iter_register_cb(c_da_rq_iter_t *iter,
-                                          castle_iterator_end_io_t cb,
-                                          void *data)
-{
-    iter->end_io  = cb;
-    iter->private = data;
-}
+    rt->version    = version;
+    rt->origin_seq = INVAL_TREE;
+    rt->cpu_index  = cpu_index;
+    rt->nr_cpus    = nr_cpus;
+    rt->start_key  = (c_vl_bkey_t *)(rt + 1);
+    rt->end_key    = (c_vl_bkey_t *)((char *)rt->start_key + ALIGN(start_len, 8));
+    memcpy(rt->start_key, start_key, start_len);
+    memcpy(rt->end_key, end_key, end_len);
+    INIT_LIST_HEAD(&rt->list);
 
-static int castle_da_rq_iter_prep_next(c_da_rq_iter_t *iter)
-{
-    return castle_ct_merged_iter_prep_next(&iter->merged_iter);
+    return rt;
 }
 
-
-static int castle_da_rq_iter_has_next(c_da_rq_iter_t *iter)
+/**
+ * Free all range tombstones on a list.
+ */
+static void castle_range_tombstones_free(struct list_head *rts)
 {
-    return castle_ct_merged_iter_has_next(&iter->merged_iter);
+    struct castle_range_tombstone *rt, *tmp;
+
+    list_for_each_entry_safe(rt, tmp, rts, list)
+    {
+        list_del(&rt->list);
+        castle_free(rt);
+    }
 }
 
-static void castle_da_rq_iter_end_io(void *merged_iter, int err)
+/**
+ * Append copies of all range tombstones on src list to dst list.
+ *
+ * @return -ENOMEM  Out of memory, some tombstones may have been copied already
+ */
+static int castle_range_tombstones_copy(struct list_head *dst, struct list_head *src)
 {
-    c_da_rq_iter_t *iter = ((c_merged_iter_t *)merged_iter)->private;
+    struct castle_range_tombstone *rt, *copy;
 
-    if (castle_da_rq_iter_prep_next(iter))
+    list_for_each_entry(rt, src, list)
     {
-        iter->end_io(iter, 0);
-        return;
+        copy = castle_range_tombstone_alloc(rt->version, rt->cpu_index, rt->nr_cpus,
+                                            rt->start_key, rt->end_key);
+        if (!copy)
+            return -ENOMEM;
+        copy->origin_seq = rt->origin_seq;
+        list_add_tail(&copy->list, dst);
     }
-    else
-        BUG();
+
+    return 0;
+}
+
+/**
+ * Number of range tombstones held by ct.
+ */
+static int castle_ct_range_tombstones_count(struct castle_component_tree *ct)
+{
+    struct list_head *lh;
+    int count = 0;
+
+    list_for_each(lh, &ct->range_tombstones)
+        count++;
+
+    return count;
+}
+
+/**
+ * Does the range tombstone cover the key (ignoring versions)?
+ */
+static int castle_range_tombstone_covers(struct castle_range_tombstone *rt, c_vl_bkey_t *key)
+{
+    return (castle_object_btree_key_dims_hash(key) % rt->nr_cpus == rt->cpu_index) &&
+            castle_object_btree_key_in_hypercube(key, rt->start_key, rt->end_key);
+}
+
+/**
+ * Is an entry in version hidden by a range tombstone?
+ *
+ * Range tombstones delete entries from their version, and from its ancestors. Entries of
+ * the range tombstone's version in the CT holding it were written after the range was
+ * removed, unless the CT is still its origin T0 (@see castle_da_rwct_range_removed()).
+ * Merges turn the others into tombstones.
+ *
+ * @param rt        Range tombstone covering the entry's key
+ * @param version   Version of the entry
+ * @param rt_ct     CT holding the range tombstone
+ * @param ct        CT holding the entry
+ */
+static int castle_range_tombstone_hides(struct castle_range_tombstone *rt,
+                                        c_ver_t version,
+                                        struct castle_component_tree *rt_ct,
+                                        struct castle_component_tree *ct)
+{
+    if ((ct == rt_ct) && (version == rt->version) && (rt_ct->seq != rt->origin_seq))
+        return 0;
+
+    return castle_version_is_ancestor(version, rt->version);
+}
+
+/* Has next, next and skip only need to call the corresponding functions on
+   the underlying merged iterator */
+
+static void castle_da_rq_iter_register_cb(c_da_rq_iter_t *iter,
+                                          castle_iterator_end_io_t cb,
+                                          void *data)
+{
+    iter->end_io  = cb;
+    iter->private = data;
+}
+
+static int castle_da_rq_iter_prep_next(c_da_rq_iter_t *iter)
+{
+    return castle_ct_merged_iter_prep_next(&iter->merged_iter);
+}
+
+
+static int castle_da_rq_iter_has_next(c_da_rq_iter_t *iter)
+{
+    return castle_ct_merged_iter_has_next(&iter->merged_iter);
+}
+
+static void castle_da_rq_iter_end_io(void *merged_iter, int err)
+{
+    c_da_rq_iter_t *iter = ((c_merged_iter_t *)merged_iter)->private;
+
+    if (castle_da_rq_iter_prep_next(iter))
+    {
+        iter->end_io(iter, 0);
+        return;
+    }
+    else
+        BUG();
 }
 
 static void castle_da_rq_iter_next(c_da_rq_iter_t *iter,
@@ -1609,15 +1971,104 @@ static void castle_da_rq_iter_skip(c_da_rq_iter_t *iter, void *key)
     castle_ct_merged_iter_skip(&iter->merged_iter, key);
 }
 
+/**
+ * Drop range query entries hidden by range tombstones of the same or newer CTs.
+ *
+ * @also castle_range_tombstone_hides()
+ */
+static int castle_da_rq_iter_hidden(c_merged_iter_t *merged_iter,
+                                    struct component_iterator *comp_iter)
+{
+    c_da_rq_iter_t *iter = container_of(merged_iter, c_da_rq_iter_t, merged_iter);
+    int ct_idx = comp_iter - merged_iter->iterators;
+    int i;
+
+    /* rts[] is sorted by CT index, newest CT first. */
+    for (i = 0; i < iter->nr_rts && iter->rts[i].ct_idx <= ct_idx; i++)
+    {
+        struct castle_range_tombstone *rt = iter->rts[i].rt;
+
+        if (castle_range_tombstone_covers(rt, comp_iter->cached_entry.k) &&
+            castle_range_tombstone_hides(rt,
+                                         comp_iter->cached_entry.v,
+                                         iter->ct_rqs[iter->rts[i].ct_idx].ct,
+                                         iter->ct_rqs[ct_idx].ct))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Find range tombstones of the CTs taken by the range query, that are visible in version.
+ *
+ * Range tombstones only change under the DA lock, but CTs may be merged away by now. Range
+ * tombstones are freed with their CT, so the CT refs keep them around.
+ */
+static int castle_da_rq_iter_rts_get(c_da_rq_iter_t *iter,
+                                     struct castle_double_array *da,
+                                     c_ver_t version)
+{
+    struct castle_range_tombstone *rt;
+    int i, nr_rts;
+
+    iter->rts = NULL;
+    iter->nr_rts = 0;
+again:
+    nr_rts = 0;
+    read_lock(&da->lock);
+    for (i = 0; i < iter->nr_cts; i++)
+        list_for_each_entry(rt, &iter->ct_rqs[i].ct->range_tombstones, list)
+            if (castle_version_is_ancestor(rt->version, version))
+                nr_rts++;
+    read_unlock(&da->lock);
+
+    if (nr_rts == 0)
+        return 0;
+
+    /* Can't allocate under the DA lock. */
+    iter->rts = castle_malloc(nr_rts * sizeof(struct rq_range_tombstone), GFP_KERNEL);
+    if (!iter->rts)
+        return -ENOMEM;
+
+    read_lock(&da->lock);
+    for (i = 0; i < iter->nr_cts; i++)
+        list_for_each_entry(rt, &iter->ct_rqs[i].ct->range_tombstones, list)
+        {
+            if (!castle_version_is_ancestor(rt->version, version))
+                continue;
+            /* More range tombstones got added, retry. */
+            if (iter->nr_rts == nr_rts)
+            {
+                read_unlock(&da->lock);
+                castle_free(iter->rts);
+                iter->rts = NULL;
+                iter->nr_rts = 0;
+                goto again;
+            }
+            iter->rts[iter->nr_rts].ct_idx = i;
+            iter->rts[iter->nr_rts].rt = rt;
+            iter->nr_rts++;
+        }
+    read_unlock(&da->lock);
+
+    return 0;
+}
+
 void castle_da_rq_iter_cancel(c_da_rq_iter_t *iter)
 {
     int i;
 
     castle_ct_merged_iter_cancel(&iter->merged_iter);
+    if (iter->rts)
+        castle_free(iter->rts);
     for(i=0; i<iter->nr_cts; i++)
     {
         struct ct_rq *ct_rq = iter->ct_rqs + i;
-        castle_btree_rq_enum_cancel(&ct_rq->ct_rq_iter);
+        if (ct_rq->ct->memtable)
+            castle_memtable_iter_cancel(&ct_rq->mt_iter);
+        else
+            castle_btree_rq_enum_cancel(&ct_rq->ct_rq_iter);
         castle_ct_put(ct_rq->ct, 0);
     }
     castle_free(iter->ct_rqs);
@@ -1650,6 +2101,8 @@ again:
     iter->nr_cts = da->nr_trees;
     iter->err    = 0;
     iter->end_io = NULL;
+    iter->rts    = NULL;
+    iter->nr_rts = 0;
     iter->ct_rqs = castle_zalloc(iter->nr_cts * sizeof(struct ct_rq), GFP_KERNEL);
     iters        = castle_malloc(iter->nr_cts * sizeof(void *), GFP_KERNEL);
     iter_types   = castle_malloc(iter->nr_cts * sizeof(struct castle_iterator_type *), GFP_KERNEL);
@@ -1697,6 +2150,10 @@ again:
     read_unlock(&da->lock);
     BUG_ON(j != iter->nr_cts);
 
+    i = 0;
+    if ((iter->err = castle_da_rq_iter_rts_get(iter, da, version)))
+        goto err;
+
     /* Initialise range queries for individual cts */
     /* @TODO: Better to re-organize the code, such that these iterators belong to
      * merged iterator. Easy to manage resources - Talk to Gregor */
@@ -1704,6 +2161,23 @@ again:
     {
         struct ct_rq *ct_rq = iter->ct_rqs + i;
 
+        if (ct_rq->ct->memtable)
+        {
+            castle_memtable_iter_init(&ct_rq->mt_iter,
+                                      ct_rq->ct,
+                                      version,
+                                      start_key,
+                                      end_key);
+            if (ct_rq->mt_iter.err)
+            {
+                iter->err = ct_rq->mt_iter.err;
+                goto err;
+            }
+            iters[i]        = &ct_rq->mt_iter;
+            iter_types[i]   = &castle_memtable_iter;
+            continue;
+        }
+
         castle_btree_rq_enum_init(&ct_rq->ct_rq_iter,
                                    version,
                                    ct_rq->ct,
@@ -1721,12 +2195,38 @@ again:
     castle_ct_merged_iter_init(&iter->merged_iter,
                                 iters,
                                 iter_types,
-                                NULL);
+                                NULL,
+                                castle_da_rq_iter_hidden);
     castle_ct_merged_iter_register_cb(&iter->merged_iter,
                                       castle_da_rq_iter_end_io,
                                       iter);
     castle_free(iters);
     castle_free(iter_types);
+
+    return;
+
+err:
+    /* Unwind iterators initialised before the i-th one failed and drop all CT refs. */
+    for(j=0; j<iter->nr_cts; j++)
+    {
+        struct ct_rq *ct_rq = iter->ct_rqs + j;
+
+        if (j < i)
+        {
+            if (ct_rq->ct->memtable)
+                castle_memtable_iter_cancel(&ct_rq->mt_iter);
+            else
+                castle_btree_rq_enum_cancel(&ct_rq->ct_rq_iter);
+        }
+        castle_ct_put(ct_rq->ct, 0);
+    }
+    if (iter->rts)
+        castle_free(iter->rts);
+    iter->rts = NULL;
+    castle_free(iter->ct_rqs);
+    iter->ct_rqs = NULL;
+    castle_free(iters);
+    castle_free(iter_types);
 }
 
 struct castle_iterator_type castle_da_rq_iter = {
@@ -1740,6 +2240,33 @@ struct castle_iterator_type castle_da_rq_iter = {
 
 /**********************************************************************************************/
 /* Merges */
+
+/* Merge scheduler state.  Merges from all DAs are run by a shared pool of worker threads.
+   Each (DA, level) pair is a merge slot; in-flight merges are parked in their slot between
+   units, so that any worker can pick the most urgent runnable slot next. */
+static              DEFINE_SPINLOCK(castle_merge_sched_lock); /**< Protects DA list and claims. */
+static              LIST_HEAD(castle_merge_sched_das);        /**< DAs registered for merges.   */
+static              DECLARE_WAIT_QUEUE_HEAD(castle_merge_sched_wq);
+static atomic_t     castle_merge_sched_gen = ATOMIC(0);       /**< Bumped on merge state change.*/
+static uint32_t     castle_merge_sched_round = 0;
+static struct task_struct *castle_merge_sched_workers[CASTLE_MERGE_WORKERS_MAX];
+static int          castle_merge_sched_nr_workers = 0;
+static atomic64_t   castle_merge_bw_budget;                   /**< Merge output bytes allowed
+                                                                   before throttling.           */
+
+#define CASTLE_MERGE_RETRY_DELAY        (10 * HZ)   /* Back-off after a failed merge.         */
+#define CASTLE_TOMBSTONES_MERGE_DELAY   (600 * HZ)  /* Min gap between tombstone compactions. */
+#define CASTLE_MERGE_URGENCY_STALL      (1000)      /* Weight of level 1 write stall risk.    */
+
+/**
+ * Notify merge scheduler workers that merge state has changed.
+ */
+static inline void castle_merge_sched_wake(void)
+{
+    atomic_inc(&castle_merge_sched_gen);
+    wake_up(&castle_merge_sched_wq);
+}
+
 struct castle_da_merge {
     struct castle_double_array   *da;
     struct castle_btree_type     *out_btree;
@@ -1780,6 +2307,27 @@ struct castle_da_merge {
     int                           internals_on_ssds;    /**< Are internal nodes stored on SSD.  */
     struct list_head              new_large_objs;       /**< Large objects added since last
                                                              checkpoint (for merge serdes).     */
+    struct castle_da_merge_value_ext {
+        c_ext_id_t                ext_id;
+        uint64_t                  size;                 /**< Bytes of medium objects in ext.    */
+        uint64_t                  live;                 /**< Of which live in the in_trees.     */
+        uint64_t                  merged;               /**< Of which referenced by out_tree.   */
+        uint8_t                   copy;                 /**< Copy objects to out_tree (GC).     */
+        struct castle_value_ext_entry *entry;           /**< Preallocated out_tree list entry.  */
+    }                            *value_exts;           /**< Extents medium objects come from.  */
+    int                           nr_value_exts;
+    int                           value_exts_resumed;   /**< Merge was deserialised, merged
+                                                             counts are incomplete.             */
+    uint8_t                       bottom;               /**< No tree older than the in_trees,
+                                                             tombstones can be dropped.         */
+    void                         *tomb_key;             /**< Tombstone held back until the next */
+    c_ver_t                       tomb_version;         /**< entry shows whether it shadows     */
+    c_val_tup_t                   tomb_cvt;             /**< anything (bottom merges only).     */
+    uint64_t                      tombstones_dropped;
+    struct list_head              range_tombstones;     /**< Copies of the in_trees' range
+                                                             tombstones, for the out_tree.      */
+    uint8_t                       range_tombstones_kept;/**< Some entries still hidden by range
+                                                             tombstones had to be output.       */
     struct castle_version_states  version_states;       /**< Merged version states.             */
     struct castle_version_delete_state snapshot_delete; /**< Snapshot delete state.             */
 
@@ -1798,12 +2346,24 @@ struct castle_da_merge {
 #endif
     uint32_t                      skipped_count;        /**< Count of entries from deleted
                                                              versions.                          */
+    uint64_t                      bw_written;           /**< Output bytes already charged to
+                                                             the merge bandwidth cap.           */
+    uint8_t                       unit_yielded;         /**< Unit ran out of budget, resume it
+                                                             rather than start the next one.    */
+    uint8_t                       relock_bloom_node_c2b;  /**< Bloom c2bs unlocked while the  */
+    uint8_t                       relock_bloom_chunk_c2b; /**< merge is parked between units. */
+    c2_stream_t                   out_stream;           /**< Writes out completed output nodes
+                                                             and bloom chunks.                  */
 };
 
-#define MAX_IOS             (1000) /* Arbitrary constants */
-/* @TODO: Merges are now effectively always full throughput, because MIN is set high. */
-#define MIN_BUDGET_DELTA    (1000000)
-#define MAX_BUDGET          (1000000)
+/* Rate controller (@see castle_da_rate_ctrl_update()). */
+#define CASTLE_RATE_CTRL_KP         (1000)      /* Proportional gain, per-mille.              */
+#define CASTLE_RATE_CTRL_KI         (200)       /* Integral gain, per-mille.                  */
+#define CASTLE_RATE_CTRL_MAX_STEP   (500)       /* Max admission change per epoch, per-mille. */
+#define CASTLE_IOS_RATE_MIN         (100)       /* Min admitted writes per epoch.             */
+#define CASTLE_MERGE_PACE_MIN       (1000)      /* Min merged entries per epoch.              */
+#define CASTLE_MERGE_PACE_LIMITED   (100000)    /* Max merged entries per epoch, when paced.  */
+#define CASTLE_MERGE_PACE_MAX       (1000000)   /* Merged entries per epoch, at full speed.   */
 #define BIG_MERGE           (0)
 #if ( (MIN_DA_SERDES_LEVEL) <= (BIG_MERGE) )
 #error "MIN_DA_SERDES_LEVEL must be > BIG_MERGE or things will break"
@@ -1811,58 +2371,220 @@ struct castle_da_merge {
 
 /************************************/
 /* Marge rate control functionality */
-static void castle_da_merge_budget_consume(struct castle_da_merge *merge)
+
+/**
+ * Returns number of bytes allocated in the extents of a CT.
+ */
+static inline uint64_t castle_ct_bytes_used(struct castle_component_tree *ct)
+{
+    return atomic64_read(&ct->internal_ext_free.used) +
+           atomic64_read(&ct->tree_ext_free.used) +
+           atomic64_read(&ct->data_ext_free.used);
+}
+
+/**
+ * Returns number of bytes allocated so far for the merge output tree.
+ */
+static inline uint64_t castle_da_merge_bytes_written(struct castle_da_merge *merge)
+{
+    return castle_ct_bytes_used(merge->out_tree);
+}
+
+/**
+ * Charges merge output written since the last call against the global merge bandwidth
+ * budget.
+ *
+ * The budget is shared by all merges on all DAs, and is refilled by the throttle timer
+ * (@see castle_merge_bandwidth_replenish()).
+ *
+ * @return EAGAIN if the budget is exhausted, 0 otherwise
+ */
+static int castle_da_merge_bandwidth_consume(struct castle_da_merge *merge)
+{
+    uint64_t written;
+    long delta;
+
+    written = castle_da_merge_bytes_written(merge);
+    delta = (long)(written - merge->bw_written);
+    merge->bw_written = written;
+
+    if (!castle_merge_bandwidth_cap || (delta <= 0))
+        return 0;
+
+    return (atomic64_add_return(-delta, &castle_merge_bw_budget) < 0) ? EAGAIN : 0;
+}
+
+/**
+ * Charges a merged entry against the DA merge budget and the merge bandwidth budget.
+ *
+ * Merges don't wait for the budgets to be replenished, that would hold on to a shared merge
+ * worker. The worker yields the merge instead, and the scheduler doesn't pick it up again
+ * until budget is available (@see castle_merge_sched_slot_priority()).
+ *
+ * @return EAGAIN if the merge should yield its worker, 0 otherwise
+ */
+static int castle_da_merge_budget_consume(struct castle_da_merge *merge)
 {
     struct castle_double_array *da;
+    int ret;
 
     BUG_ON(in_atomic());
     if(castle_da_exiting)
-        return;
+        return 0;
+
+    ret = castle_da_merge_bandwidth_consume(merge);
 
     /* Check if we need to consume some merge budget */
     merge->budget_cons_units++;
     if(merge->budget_cons_units < merge->budget_cons_rate)
-        return;
+        return ret;
 
     da = merge->da;
+    /* Deleted DAs don't get budget replenished, let the merge abort. */
+    if (castle_da_deleted(da))
+        return 0;
+
     /* Consume a single unit of budget. */
-    while(atomic_dec_return(&da->merge_budget) < 0)
+    if(atomic_dec_return(&da->merge_budget) < 0)
     {
-        /* We failed to get merge budget, readd the unit, and wait for some to appear. */
+        /* We failed to get merge budget, readd the unit. */
         atomic_inc(&da->merge_budget);
-        /* Extra warning message, which we shouldn't see. Increase the MIN, if we do. */
-        castle_printk(LOG_WARN,
-                "WARNING, possible error: Merges running fast, but not throttling.\n");
-        atomic_add(MIN_BUDGET_DELTA, &da->merge_budget);
-        return;
-        //wait_event(da->merge_budget_waitq, atomic_read(&da->merge_budget) > 0);
+        ret = EAGAIN;
     }
+
+    return ret;
+}
+
+/**
+ * Returns number of trees waiting to be merged above level 1.
+ *
+ * Level state is read without the DA lock, the result is only used as a controller input.
+ */
+static int castle_da_merge_debt(struct castle_double_array *da)
+{
+    int level, debt;
+
+    for (debt=0, level=2; level<MAX_DA_LEVEL-1; level++)
+        if (da->levels[level].nr_trees > 1)
+            debt += da->levels[level].nr_trees - 1;
+
+    return debt;
 }
 
 #define REPLENISH_FREQUENCY (10)        /* Replenish budgets every 100ms. */
-static int castle_da_merge_budget_replenish(struct castle_double_array *da, void *unused)
+/**
+ * Closed-loop merge and insert rate controller, run once every throttle timer epoch.
+ *
+ * Backlog is measured as the number of T1s plus half of the merge debt above level 1.
+ * Error is the backlog above the setpoint (half of the T1 count at which inserts get
+ * stopped by castle_da_merge_restart()), in per-mille of that limit.
+ *
+ * Insert admission (ios_rate) is adjusted by a velocity-form PI controller, which scales
+ * the rate multiplicatively: admission shrinks while backlog is growing or above the
+ * setpoint, and grows back once it is below. Throttling is removed once admission grows
+ * past twice the measured write rate.
+ *
+ * Merges run at full speed whenever backlog is at or above the setpoint, or if foreground
+ * writes are not being delayed. Otherwise merges are paced in proportion to the spare
+ * backlog, leaving IO bandwidth to foreground writes.
+ *
+ * Admitted writes are spaced out by a per-insert delay (@see castle_da_write_admit()), so
+ * that backpressure builds up gradually rather than writes queueing until the next epoch.
+ * The delay covers the admission rate, and above the setpoint it grows quadratically up to
+ * castle_write_delay_max at the insert stop limit.
+ */
+static int castle_da_rate_ctrl_update(struct castle_double_array *da, void *unused)
 {
-    int ios = atomic_read(&da->epoch_ios);
-    int budget_delta = 0, merge_budget;
+    int ios, wait, limit, setpoint, error, step, rate, pace, delay;
 
+    ios  = atomic_read(&da->epoch_ios);
+    wait = atomic_read(&da->epoch_ios_wait);
     atomic_set(&da->epoch_ios, 0);
-    debug("Merge replenish, number of ios in last second=%d.\n", ios);
-    if(ios < MAX_IOS)
-        budget_delta = MAX_IOS - ios;
-    if(budget_delta < MIN_BUDGET_DELTA)
-        budget_delta = MIN_BUDGET_DELTA;
-    BUG_ON(budget_delta <= 0);
-    merge_budget = atomic_add_return(budget_delta, &da->merge_budget);
-    if(merge_budget > MAX_BUDGET)
-        atomic_sub(merge_budget - MAX_BUDGET, &da->merge_budget);
-    wake_up(&da->merge_budget_waitq);
+    atomic_set(&da->epoch_ios_wait, 0);
+    da->rate_ctrl.write_wait_us = ios ? jiffies_to_usecs(wait) / ios : 0;
+
+    limit    = 4 * castle_double_array_request_cpus();
+    setpoint = limit / 2;
+    error    = 1000 * (da->levels[1].nr_trees + castle_da_merge_debt(da) / 2 - setpoint) / limit;
+
+    /* Insert admission. */
+    step = -(CASTLE_RATE_CTRL_KP * (error - da->rate_ctrl.error) +
+             CASTLE_RATE_CTRL_KI * error) / 1000;
+    step = max(step, -CASTLE_RATE_CTRL_MAX_STEP);
+    step = min(step,  CASTLE_RATE_CTRL_MAX_STEP);
+    da->rate_ctrl.error = error;
+
+    rate = da->rate_ctrl.ios_rate;
+    if (rate == INT_MAX)
+    {
+        /* Not throttling. Start from the measured write rate, if we need to. */
+        if (step >= 0)
+            goto rate_done;
+        rate = max(ios, CASTLE_IOS_RATE_MIN);
+    }
+    rate += (int)((long)rate * step / 1000);
+    if (rate < CASTLE_IOS_RATE_MIN)
+        rate = CASTLE_IOS_RATE_MIN;
+    if ((step > 0) && (rate > 2 * ios + CASTLE_IOS_RATE_MIN))
+        rate = INT_MAX;
+
+rate_done:
+    debug("DA=%d rate control: ios=%d, error=%d, step=%d, rate=%d\n",
+            da->id, ios, error, step, rate);
+    da->rate_ctrl.ios_rate = rate;
+
+    /* Merge pace. */
+    if ((error >= 0) || (da->rate_ctrl.write_wait_us <= castle_write_latency_target * 1000))
+        pace = CASTLE_MERGE_PACE_MAX;
+    else
+        pace = CASTLE_MERGE_PACE_MIN +
+               (CASTLE_MERGE_PACE_LIMITED - CASTLE_MERGE_PACE_MIN) / 500 * max(500 + error, 0);
+    da->rate_ctrl.merge_pace = pace;
+    atomic_set(&da->merge_budget, pace);
+
+    /* Per-insert delay, per write queue. */
+    delay = 0;
+    if (error > 0)
+    {
+        error = min(error, 500);
+        delay = castle_write_delay_max * error / 500 * error / 500;
+    }
+    if (rate != INT_MAX)
+        delay = max(delay, (int)(USEC_PER_SEC / REPLENISH_FREQUENCY)
+                                * castle_double_array_request_cpus() / rate);
+    da->rate_ctrl.write_delay_us = delay;
+
+    /* Apply the admission, unless inserts are stopped (@see castle_da_merge_restart()). */
+    write_lock(&da->lock);
+    if (da->ios_rate != 0)
+        da->ios_rate = da->rate_ctrl.ios_rate;
+    write_unlock(&da->lock);
 
     return 0;
 }
 
+/**
+ * Refill the global merge bandwidth budget with one timer period worth of bytes.
+ *
+ * Unused budget doesn't accumulate beyond a single period, so that idle time can't
+ * be turned into a burst above the configured cap.
+ */
+static void castle_merge_bandwidth_replenish(void)
+{
+    long quantum, budget;
+
+    quantum = (long)castle_merge_bandwidth_cap * 1024 * 1024 / REPLENISH_FREQUENCY;
+    budget  = atomic64_add_return(quantum, &castle_merge_bw_budget);
+    if (budget > quantum)
+        atomic64_sub(budget - quantum, &castle_merge_bw_budget);
+}
+
 static void castle_merge_budgets_replenish(void *unused)
 {
-   castle_da_hash_iterate(castle_da_merge_budget_replenish, NULL);
+   castle_da_hash_iterate(castle_da_rate_ctrl_update, NULL);
+   castle_merge_bandwidth_replenish();
+   /* Merges yielded for lack of budget can go on now. */
+   castle_merge_sched_wake();
 }
 
 /**
@@ -1919,11 +2641,6 @@ static void castle_ios_budgets_replenish(void *unused)
    castle_da_hash_iterate(castle_da_ios_budget_replenish, NULL);
 }
 
-static inline void castle_da_merge_budget_io_end(struct castle_double_array *da)
-{
-    atomic_inc(&da->epoch_ios);
-}
-
 static DECLARE_WORK(merge_budgets_replenish_work, castle_merge_budgets_replenish, NULL);
 static DECLARE_WORK(ios_budgets_replenish_work, castle_ios_budgets_replenish, NULL);
 
@@ -1947,7 +2664,12 @@ static void castle_da_iterator_destroy(struct castle_component_tree *tree,
     if(!iter)
         return;
 
-    if(tree->dynamic)
+    if(tree->memtable)
+    {
+        castle_memtable_iter_cancel(iter);
+        castle_free(iter);
+    }
+    else if(tree->dynamic)
     {
         /* For dynamic trees we are using modlist iterator. */
         castle_ct_modlist_iter_free(iter);
@@ -1964,14 +2686,31 @@ static void castle_da_iterator_destroy(struct castle_component_tree *tree,
 /**
  * Allocate/initialise correct iterator type for level of merge.
  *
- * - Allocate a castle_ct_modlist_iter for T1 merges
+ * - Allocate a castle_memtable_iter for T1 merges of memtables
+ * - Allocate a castle_ct_modlist_iter for other T1 merges
  * - Allocate a castle_ct_immut_iter for all higher level merges
  */
 static void castle_da_iterator_create(struct castle_da_merge *merge,
                                       struct castle_component_tree *tree,
                                       void **iter_p)
 {
-    if (tree->dynamic)
+    if (tree->memtable)
+    {
+        /* Memtables are sorted already, iterate over all versions. */
+        struct castle_btree_type *btree = castle_btree_type_get(tree->btree_type);
+        c_mt_iter_t *iter = castle_malloc(sizeof(c_mt_iter_t), GFP_KERNEL);
+        BUG_ON(merge->deserialising);
+        if (!iter)
+            return;
+        castle_memtable_iter_init(iter, tree, INVAL_VERSION, btree->min_key, btree->max_key);
+        if (iter->err)
+        {
+            castle_free(iter);
+            return;
+        }
+        *iter_p = iter;
+    }
+    else if (tree->dynamic)
     {
         c_modlist_iter_t *iter = castle_malloc(sizeof(c_modlist_iter_t), GFP_KERNEL);
         BUG_ON(merge->deserialising); /* we only serialise merges with immut in_trees */
@@ -2008,7 +2747,9 @@ static void castle_da_iterator_create(struct castle_da_merge *merge,
 
 static struct castle_iterator_type* castle_da_iter_type_get(struct castle_component_tree *ct)
 {
-    if(ct->dynamic)
+    if(ct->memtable)
+        return &castle_memtable_iter;
+    else if(ct->dynamic)
         return &castle_ct_modlist_iter;
     else
         return &castle_ct_immut_iter;
@@ -2112,8 +2853,9 @@ static int castle_da_merge_cts_get(struct castle_double_array *da,
             msleep_interruptible(10);
         }
 
-        /* Check that the tree has non-zero elements. */
-        if(atomic64_read(&ct->item_count) == 0)
+        /* Check that the tree has non-zero elements. Empty trees holding range tombstones
+           still have to be merged, to carry them down. */
+        if((atomic64_read(&ct->item_count) == 0) && list_empty(&ct->range_tombstones))
         {
             printk("Found empty CT=%d, freeing it up.\n", ct->seq);
             /* No items in this CT, deallocate it by removing it from the DA,
@@ -2198,7 +2940,8 @@ static int castle_da_iterators_create(struct castle_da_merge *merge)
     castle_ct_merged_iter_init(merge->merged_iter,
                                merge->iters,
                                iter_types,
-                               castle_da_each_skip);
+                               castle_da_each_skip,
+                               NULL);
     ret = merge->merged_iter->err;
     debug("Merged iterator inited with ret=%d.\n", ret);
     if(ret)
@@ -2667,6 +3410,45 @@ static int castle_da_lfs_merge_ct_callback(void *data)
                                         1);   /* Not a T0. Use SSD. */
 }
 
+/**
+ * Size the Bloom filter of a merge output tree, sharing the DA's bloom budget with the
+ * filters of the trees which will remain once the merge completes.
+ *
+ * @param merge         Merge state structure.
+ * @param nr_elements   Expected number of elements in the output tree.
+ *
+ * @return Bits per element for the output tree filter.
+ */
+static uint32_t castle_da_merge_bloom_bits(struct castle_da_merge *merge, uint64_t nr_elements)
+{
+    struct castle_double_array *da = merge->da;
+    struct castle_bloom_budget budget = {0, 0};
+    struct castle_component_tree *ct;
+    struct list_head *l;
+    int level, i;
+
+    castle_bloom_budget_add(&budget, nr_elements);
+    read_lock(&da->lock);
+    for (level = 1; level < MAX_DA_LEVEL; level++)
+    {
+        list_for_each(l, &da->levels[level].trees)
+        {
+            ct = list_entry(l, struct castle_component_tree, da_list);
+            if (!ct->bloom_exists)
+                continue;
+            FOR_EACH_MERGE_TREE(i, merge)
+                if (merge->in_trees[i] == ct)
+                    break;
+            if (i < merge->nr_trees)
+                continue;
+            castle_bloom_budget_add(&budget, atomic64_read(&ct->item_count));
+        }
+    }
+    read_unlock(&da->lock);
+
+    return castle_bloom_budget_bits(&budget, nr_elements);
+}
+
 /**
  * Allocates extents for the output tree, medium objects and Bloom filetrs. Tree may be split
  * between two extents (internal nodes in an SSD-backed extent, leaf nodes on HDDs).
@@ -2689,11 +3471,22 @@ static int castle_da_merge_extents_alloc(struct castle_da_merge *merge)
         tree_size += atomic64_read(&merge->in_trees[i]->tree_ext_free.used);
 
         BUG_ON(!castle_ext_freespace_consistent(&merge->in_trees[i]->data_ext_free));
-        data_size += atomic64_read(&merge->in_trees[i]->data_ext_free.used);
-        data_size = MASK_CHK_OFFSET(data_size + C_CHK_SIZE);
 
         bloom_size += atomic64_read(&merge->in_trees[i]->item_count);
     }
+    /* Empty trees get merged for their range tombstones, the Bloom filter is dropped later. */
+    if (!bloom_size)
+        bloom_size = 1;
+    /* Only medium objects which get copied need space in the output data extent. */
+    for (i = 0; i < merge->nr_value_exts; i++)
+    {
+        if (!merge->value_exts[i].copy)
+            continue;
+        data_size += merge->value_exts[i].live;
+        data_size = MASK_CHK_OFFSET(data_size + C_CHK_SIZE);
+    }
+    if (!data_size)
+        data_size = C_CHK_SIZE;
     /* In case of multiple version test-case, in worst case tree could grow upto
      * double the size. Ex: For every alternative k_n in o/p stream of merged
      * iterator, k_n has only one version and k_(n+1) has (p-1) versions, where p
@@ -2759,42 +3552,172 @@ __again:
     castle_da_lfs_ct_reset(lfs);
 
     /* Allocate Bloom filters. */
-    if ((ret = castle_bloom_create(&merge->out_tree->bloom, merge->da->id, bloom_size)))
+    if ((ret = castle_bloom_create(&merge->out_tree->bloom, merge->da->id, bloom_size,
+                                   castle_da_merge_bloom_bits(merge, bloom_size))))
         merge->out_tree->bloom_exists = 0;
     else
+    {
         merge->out_tree->bloom_exists = 1;
+        castle_printk(LOG_DEBUG, "%s::da %d level %d bloom filter with %u bits per element "
+                "for %llu elements.\n", __FUNCTION__, merge->da->id, merge->level,
+                merge->out_tree->bloom.bits_per_element, bloom_size);
+    }
 
     return 0;
 }
 
-
-static c_val_tup_t castle_da_medium_obj_copy(struct castle_da_merge *merge,
-                                             c_val_tup_t old_cvt)
+/**
+ * Find the merge bookkeeping for a data extent medium objects of the in_trees live in.
+ */
+static struct castle_da_merge_value_ext* castle_da_merge_value_ext_get(struct castle_da_merge *merge,
+                                                                      c_ext_id_t ext_id)
 {
-    c_ext_pos_t old_cep, new_cep;
-    c_val_tup_t new_cvt;
-    int total_blocks, blocks, i;
-    c2_block_t *s_c2b, *c_c2b;
-#ifdef CASTLE_PERF_DEBUG
-    struct castle_component_tree *tree = NULL;
-    struct timespec ts_start, ts_end;
-#endif
+    int i;
 
-    old_cep = old_cvt.cep;
-    /* Old cvt needs to be a medium object. */
-    BUG_ON(!CVT_MEDIUM_OBJECT(old_cvt));
-    /* It needs to be of the right size. */
-    BUG_ON(!is_medium(old_cvt.length));
-    /* It must belong to one of the in_trees data extent. */
-    FOR_EACH_MERGE_TREE(i, merge)
-        if (old_cvt.cep.ext_id == merge->in_trees[i]->data_ext_free.ext_id)
-            break;
-    BUG_ON(i == merge->nr_trees);
-    /* We assume objects are page aligned. */
-    BUG_ON(BLOCK_OFFSET(old_cep.offset) != 0);
+    for (i = 0; i < merge->nr_value_exts; i++)
+        if (merge->value_exts[i].ext_id == ext_id)
+            return &merge->value_exts[i];
 
-    /* Allocate space for the new copy. */
-    total_blocks = (old_cvt.length - 1) / C_BLK_SIZE + 1;
+    return NULL;
+}
+
+/**
+ * Work out which data extents medium objects of the in_trees live in, and which of them
+ * the merge is going to copy objects out of.
+ *
+ * Normally, all medium objects get copied into the output tree's data extent. In value-log
+ * mode, merges of RO trees leave them in place, and the output tree takes over references
+ * to the extents. Objects are still copied out of extents where less than
+ * castle_value_gc_ratio percent of the bytes are live, which garbage collects them.
+ */
+static int castle_da_merge_value_exts_init(struct castle_da_merge *merge)
+{
+    struct castle_da_merge_value_ext *vext;
+    struct castle_component_tree *ct;
+    struct list_head *l;
+    int i, nr, value_log;
+
+    nr = 0;
+    value_log = castle_value_log && (merge->level >= 2);
+    FOR_EACH_MERGE_TREE(i, merge)
+    {
+        nr++;
+        list_for_each(l, &merge->in_trees[i]->value_exts)
+            nr++;
+        if (merge->in_trees[i]->dynamic)
+            value_log = 0;
+    }
+
+    merge->value_exts = castle_zalloc(nr * sizeof(struct castle_da_merge_value_ext), GFP_KERNEL);
+    if (!merge->value_exts)
+        return -ENOMEM;
+
+    nr = 0;
+    FOR_EACH_MERGE_TREE(i, merge)
+    {
+        ct = merge->in_trees[i];
+
+        /* The CT's own data extent. */
+        vext = &merge->value_exts[nr++];
+        vext->ext_id = ct->data_ext_free.ext_id;
+        vext->size   = atomic64_read(&ct->data_ext_free.used);
+        vext->live   = vext->size;
+        vext->copy   = !value_log;
+
+        /* And extents inherited from earlier merges. */
+        list_for_each(l, &ct->value_exts)
+        {
+            struct castle_value_ext_entry *entry =
+                            list_entry(l, struct castle_value_ext_entry, list);
+
+            vext = &merge->value_exts[nr++];
+            vext->ext_id = entry->ext_id;
+            vext->size   = entry->size;
+            vext->live   = entry->live;
+            vext->copy   = !value_log ||
+                           (vext->live * 100 < vext->size * castle_value_gc_ratio);
+        }
+    }
+    merge->nr_value_exts = nr;
+
+    /* Preallocate list entries, merge completion can't fail. Not needed if all objects
+       get copied (unless the merge was interrupted, value-log might have been on then). */
+    for (i = 0; i < merge->nr_value_exts; i++)
+        if (!merge->value_exts[i].copy)
+            break;
+    if ((i == merge->nr_value_exts) && !merge->value_exts_resumed)
+        return 0;
+
+    for (i = 0; i < merge->nr_value_exts; i++)
+    {
+        vext = &merge->value_exts[i];
+        if (!vext->size)
+            continue;
+        vext->entry = castle_malloc(sizeof(struct castle_value_ext_entry), GFP_KERNEL);
+        if (!vext->entry)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * Hand the extents medium objects were left in over to the output tree.
+ *
+ * If the merge was deserialised, the output tree may reference any of the extents, so it
+ * takes all of them. The ones which turn out not to be live get collected by the next merge.
+ */
+static void castle_da_merge_value_exts_package(struct castle_da_merge *merge)
+{
+    struct castle_da_merge_value_ext *vext;
+    int i;
+
+    for (i = 0; i < merge->nr_value_exts; i++)
+    {
+        vext = &merge->value_exts[i];
+        if (!vext->entry)
+            continue;
+        if (!merge->value_exts_resumed && (vext->copy || !vext->merged))
+            continue;
+
+        vext->entry->ext_id = vext->ext_id;
+        vext->entry->size   = vext->size;
+        vext->entry->live   = vext->merged;
+        /* Input trees hold references too, extent must still be there. */
+        BUG_ON(!castle_extent_get(vext->ext_id));
+        list_add(&vext->entry->list, &merge->out_tree->value_exts);
+        vext->entry = NULL;
+
+        debug("%s::out_tree=%d takes value extent %lld, %lld/%lld bytes live.\n",
+                __FUNCTION__, merge->out_tree->seq, vext->ext_id, vext->merged, vext->size);
+    }
+}
+
+static c_val_tup_t castle_da_medium_obj_copy(struct castle_da_merge *merge,
+                                             c_val_tup_t old_cvt)
+{
+    c_ext_pos_t old_cep, new_cep;
+    c_val_tup_t new_cvt;
+    int total_blocks, blocks;
+    c2_block_t *s_c2b, *c_c2b;
+#ifdef CASTLE_PERF_DEBUG
+    struct castle_component_tree *tree = merge->in_trees[0];
+    struct timespec ts_start, ts_end;
+    int i;
+#endif
+
+    old_cep = old_cvt.cep;
+    /* Old cvt needs to be a medium object. */
+    BUG_ON(!CVT_MEDIUM_OBJECT(old_cvt));
+    /* It needs to be of the right size. */
+    BUG_ON(!is_medium(old_cvt.length));
+    /* It must belong to one of the in_trees data (or value) extents. */
+    BUG_ON(!castle_da_merge_value_ext_get(merge, old_cvt.cep.ext_id));
+    /* We assume objects are page aligned. */
+    BUG_ON(BLOCK_OFFSET(old_cep.offset) != 0);
+
+    /* Allocate space for the new copy. */
+    total_blocks = (old_cvt.length - 1) / C_BLK_SIZE + 1;
     BUG_ON(castle_ext_freespace_get(&merge->out_tree->data_ext_free,
                                      total_blocks * C_BLK_SIZE,
                                      0,
@@ -2874,7 +3797,7 @@ static c_val_tup_t castle_da_medium_obj_copy(struct castle_da_merge *merge,
         old_cep.offset += blocks * PAGE_SIZE;
         new_cep.offset += blocks * PAGE_SIZE;
     }
-    debug("Finished copy, i=%d\n", i);
+    debug("Finished copy.\n");
 
     return new_cvt;
 }
@@ -2975,10 +3898,20 @@ static inline void castle_da_entry_add(struct castle_da_merge *merge,
     {
         if(CVT_MEDIUM_OBJECT(cvt))
         {
-            castle_perf_debug_getnstimeofday(&ts_start);
-            cvt = castle_da_medium_obj_copy(merge, cvt);
-            castle_perf_debug_getnstimeofday(&ts_end);
-            castle_perf_debug_bump_ctr(merge->da_medium_obj_copy_ns, ts_end, ts_start);
+            struct castle_da_merge_value_ext *vext;
+
+            vext = castle_da_merge_value_ext_get(merge, cvt.cep.ext_id);
+            BUG_ON(!vext);
+            if (vext->copy)
+            {
+                castle_perf_debug_getnstimeofday(&ts_start);
+                cvt = castle_da_medium_obj_copy(merge, cvt);
+                castle_perf_debug_getnstimeofday(&ts_end);
+                castle_perf_debug_bump_ctr(merge->da_medium_obj_copy_ns, ts_end, ts_start);
+            }
+            else
+                /* Value-log mode, the object stays where it is. */
+                vext->merged += ((cvt.length - 1) / C_BLK_SIZE + 1) * C_BLK_SIZE;
         }
         if(CVT_LARGE_OBJECT(cvt))
         {
@@ -2998,7 +3931,8 @@ static inline void castle_da_entry_add(struct castle_da_merge *merge,
 
     BUG_ON(is_re_add &&
            CVT_MEDIUM_OBJECT(cvt) &&
-           (cvt.cep.ext_id != merge->out_tree->data_ext_free.ext_id));
+           (cvt.cep.ext_id != merge->out_tree->data_ext_free.ext_id) &&
+           !castle_da_merge_value_ext_get(merge, cvt.cep.ext_id));
 
     debug("Adding an entry at depth: %d for merge on da %d level %d\n",
         depth, merge->da->id, merge->level);
@@ -3243,12 +4177,17 @@ release_node:
 
         merge->last_leaf_node_c2b = node_c2b;
         get_c2b(merge->last_leaf_node_c2b);
+
+        /* Leaves are written in key order, remember the outermost ones as key bounds. */
+        if (EXT_POS_INVAL(merge->out_tree->first_leaf))
+            merge->out_tree->first_leaf = node_c2b->cep;
+        merge->out_tree->last_leaf = node_c2b->cep;
     }
 
-    /* Release the c2b. */
+    /* Release the c2b, it goes straight to disk unless the stream is paused. */
     dirty_c2b(node_c2b);
     write_unlock_c2b(node_c2b);
-    put_c2b(node_c2b);
+    castle_cache_stream_add(&merge->out_stream, node_c2b);
 
 #ifdef CASTLE_DEBUG
     merge->is_recursion = 0;
@@ -3283,6 +4222,17 @@ out:
     return 0;
 }
 
+/**
+ * Should the range tombstones of the in_trees be carried to the out_tree?
+ *
+ * The bottom merge drops them, unless they still hide some output entries.
+ */
+static int castle_da_merge_range_tombstones_keep(struct castle_da_merge *merge)
+{
+    return !list_empty(&merge->range_tombstones) &&
+           (!merge->bottom || merge->range_tombstones_kept);
+}
+
 static struct castle_component_tree* castle_da_merge_package(struct castle_da_merge *merge,
                                                              c_ext_pos_t root_cep)
 {
@@ -3313,6 +4263,11 @@ static struct castle_component_tree* castle_da_merge_package(struct castle_da_me
     if(serdes_state > NULL_DAM_SERDES)
         mutex_unlock(&merge->da->levels[merge->level].merge.serdes.mutex);
 
+    /* Take over the extents of medium objects which weren't copied. */
+    castle_da_merge_value_exts_package(merge);
+    if (castle_da_merge_range_tombstones_keep(merge))
+        list_splice_init(&merge->range_tombstones, &out_tree->range_tombstones);
+
     debug("Number of entries=%ld, number of nodes=%ld\n",
             atomic64_read(&out_tree->item_count));
 
@@ -3392,6 +4347,36 @@ static void castle_da_max_path_complete(struct castle_da_merge *merge, c_ext_pos
     put_c2b(node_c2b);
 }
 
+/**
+ * Allocate an empty root leaf, for an out_tree which holds nothing but range tombstones.
+ *
+ * @return cep of the root node
+ */
+static c_ext_pos_t castle_da_merge_empty_root_create(struct castle_da_merge *merge)
+{
+    c_ext_free_t *ext_free;
+    uint16_t node_size;
+    c2_block_t *c2b;
+    c_ext_pos_t cep;
+
+    BUG_ON(merge->nr_entries || (merge->root_depth != -1));
+    castle_da_merge_node_info_get(merge, 0, &node_size, &ext_free);
+    BUG_ON(castle_ext_freespace_get(ext_free, node_size * C_BLK_SIZE, 0, &cep) < 0);
+
+    c2b = castle_cache_block_get(cep, node_size);
+    write_lock_c2b(c2b);
+    update_c2b(c2b);
+    castle_da_node_buffer_init(merge->out_btree, c2b_bnode(c2b), node_size);
+    dirty_c2b(c2b);
+    write_unlock_c2b(c2b);
+    castle_cache_stream_add(&merge->out_stream, c2b);
+
+    merge->root_depth = 0;
+    merge->out_tree->node_sizes[0] = node_size;
+
+    return cep;
+}
+
 /**
  * Complete merge process.
  *
@@ -3458,10 +4443,30 @@ static struct castle_component_tree* castle_da_merge_complete(struct castle_da_m
     /* Write out the max keys along the max path. */
     if (merge->nr_entries)
         castle_da_max_path_complete(merge, root_cep);
+    else
+    {
+        merge->out_tree->first_leaf = merge->out_tree->last_leaf = INVAL_EXT_POS;
+        /* Range tombstones get kept in an empty tree. */
+        if (castle_da_merge_range_tombstones_keep(merge))
+            root_cep = castle_da_merge_empty_root_create(merge);
+    }
 
-    /* Complete Bloom filters. */
+    /* Complete Bloom filters. Empty trees don't need one. */
     if (merge->out_tree->bloom_exists)
+    {
         castle_bloom_complete(&merge->out_tree->bloom);
+        if (!merge->nr_entries)
+        {
+            castle_bloom_destroy(&merge->out_tree->bloom);
+            merge->out_tree->bloom_exists = 0;
+        }
+    }
+
+    /* Wait for the tail of the output tree to hit the disk. */
+    castle_cache_stream_drain(&merge->out_stream);
+
+    /* Cache the key bounds while the outermost leaves are still in the cache. */
+    castle_ct_key_bounds_get(merge->out_tree);
 
     /* Package the merge result. */
     return castle_da_merge_package(merge, root_cep);
@@ -3534,6 +4539,9 @@ static void castle_da_merge_dealloc(struct castle_da_merge *merge, int err)
 
     BUG_ON(!merge->da);
 
+    /* Streamed writes hold references to output c2bs. */
+    castle_cache_stream_drain(&merge->out_stream);
+
     serdes_state = atomic_read(&merge->da->levels[merge->level].merge.serdes.valid);
     if (serdes_state > NULL_DAM_SERDES)
         mutex_lock(&merge->da->levels[merge->level].merge.serdes.mutex);
@@ -3547,6 +4555,16 @@ static void castle_da_merge_dealloc(struct castle_da_merge *merge, int err)
         castle_free(merge->snapshot_delete.occupied);
     if (merge->snapshot_delete.need_parent)
         castle_free(merge->snapshot_delete.need_parent);
+    if (merge->value_exts)
+    {
+        for (i = 0; i < merge->nr_value_exts; i++)
+            if (merge->value_exts[i].entry)
+                castle_free(merge->value_exts[i].entry);
+        castle_free(merge->value_exts);
+    }
+    if (merge->tomb_key)
+        merge->out_btree->key_dealloc(merge->tomb_key);
+    castle_range_tombstones_free(&merge->range_tombstones);
 
     for(i=0; i<MAX_BTREE_DEPTH; i++)
     {
@@ -3585,7 +4603,7 @@ static void castle_da_merge_dealloc(struct castle_da_merge *merge, int err)
            from the DA by castle_da_merge_package(). */
         FOR_EACH_MERGE_TREE(i, merge)
             castle_ct_put(merge->in_trees[i], 0);
-        if (merge->nr_entries == 0)
+        if ((merge->nr_entries == 0) && list_empty(&merge->out_tree->range_tombstones))
         {
             castle_printk(LOG_WARN, "Empty merge at level: %u\n", merge->level);
             castle_ct_put(merge->out_tree, 0);
@@ -3697,6 +4715,14 @@ static void castle_da_merge_dealloc(struct castle_da_merge *merge, int err)
     castle_free(merge);
 }
 
+/**
+ * Number of units a merge at given level is done in.
+ */
+static inline uint32_t castle_da_merge_units_total(struct castle_double_array *da, int level)
+{
+    return da->levels[level].merge.deamortize ? (1U << level) : 1;
+}
+
 static int castle_da_merge_progress_update(struct castle_da_merge *merge, uint32_t unit_nr)
 {
     uint64_t items_completed, total_items, unit_items;
@@ -3707,7 +4733,7 @@ static int castle_da_merge_progress_update(struct castle_da_merge *merge, uint32
     if (!merge->da->levels[merge->level].merge.deamortize)
         return 0;
 
-    total_units = 1 << merge->level;
+    total_units = castle_da_merge_units_total(merge->da, merge->level);
     /* Don't stop the last merge unit, let it run out of iterator. */
     if(unit_nr >= total_units)
         return 0;
@@ -3756,12 +4782,244 @@ static int castle_da_entry_skip(struct castle_da_merge *merge,
     return castle_version_is_deletable(state, version);
 }
 
+/**
+ * Apply per-version stat changes for an entry written to the output tree.
+ *
+ * @param stats [in]    merged iterator stats (@see castle_da_each_skip())
+ */
+static void castle_da_merge_entry_stats_adjust(struct castle_da_merge *merge,
+                                               c_ver_t version,
+                                               c_val_tup_t cvt,
+                                               cv_nonatomic_stats_t stats)
+{
+    if (merge->level == 1)
+    {
+        /* Live stats to reflect adjustments by castle_da_each_skip(). */
+        castle_version_live_stats_adjust(version, stats);
+
+        /* Key & tombstone inserts have not been accounted for in private
+         * level 1 merge version stats.  Zero any stat adjustments made in
+         * castle_da_each_skip() and perform accounting now. */
+        stats.keys = 0;
+        stats.tombstones = 0;
+
+        if (CVT_TOMB_STONE(cvt))
+            stats.tombstones++;
+        else
+            stats.keys++;
+
+        castle_version_private_stats_adjust(version, stats, &merge->version_states);
+    }
+    else
+    {
+        castle_version_live_stats_adjust(version, stats);
+        castle_version_private_stats_adjust(version, stats, &merge->version_states);
+    }
+}
+
+/**
+ * Write an entry to the output tree.
+ *
+ * - Add to level 0 node (and recurse up the tree)
+ * - Update the bloom filter
+ * - Complete any full nodes
+ */
+static int castle_da_merge_entry_output(struct castle_da_merge *merge,
+                                        void *key,
+                                        c_ver_t version,
+                                        c_val_tup_t cvt)
+{
+    int ret;
+#ifdef CASTLE_PERF_DEBUG
+    struct timespec ts_start, ts_end;
+#endif
+
+    castle_da_entry_add(merge, 0, key, version, cvt, 0);
+    if (merge->out_tree->bloom_exists)
+        castle_bloom_add(&merge->out_tree->bloom, merge->out_btree, key);
+    merge->nr_entries++;
+    if (CVT_TOMB_STONE(cvt))
+        merge->out_tree->nr_tombstones++;
+
+    /* Try to complete node. */
+    castle_perf_debug_getnstimeofday(&ts_start);
+    ret = castle_da_nodes_complete(merge);
+    castle_perf_debug_getnstimeofday(&ts_end);
+    castle_perf_debug_bump_ctr(merge->nodes_complete_ns, ts_end, ts_start);
+
+    return ret;
+}
+
+/**
+ * Decide the fate of the tombstone held back by a bottom-most merge.
+ *
+ * Entries for a key come newest version first, so older versions of the key the tombstone
+ * could shadow can only follow it. If the next entry is for a different key (or there
+ * isn't one), nothing is shadowed and the tombstone is dropped. Otherwise it is written out,
+ * ahead of the entry.
+ *
+ * @param key [in]  key of the next entry, NULL at the end of the merge
+ */
+static int castle_da_merge_tomb_resolve(struct castle_da_merge *merge, void *key)
+{
+    cv_nonatomic_stats_t stats;
+    int ret = 0;
+
+    BUG_ON(!merge->tomb_key);
+    if (key && (merge->out_btree->key_compare(key, merge->tomb_key) == 0))
+        ret = castle_da_merge_entry_output(merge, merge->tomb_key,
+                                           merge->tomb_version, merge->tomb_cvt);
+    else
+    {
+        /* Stats were adjusted as if the tombstone had been written out, undo that. */
+        memset(&stats, 0, sizeof(cv_nonatomic_stats_t));
+        stats.tombstones = -1;
+        castle_version_live_stats_adjust(merge->tomb_version, stats);
+        castle_version_private_stats_adjust(merge->tomb_version, stats, &merge->version_states);
+        merge->tombstones_dropped++;
+    }
+
+    merge->out_btree->key_dealloc(merge->tomb_key);
+    merge->tomb_key = NULL;
+
+    return ret;
+}
+
+/**
+ * Checks whether the merge output is the oldest tree for all the keys it holds, i.e. the
+ * DA doesn't have trees older than the in_trees.
+ *
+ * Trees older than the in_trees are ones at higher levels, and trees marked for a total
+ * merge at the same level. Merges can't add any older trees while this merge runs.
+ */
+static int castle_da_merge_bottom_check(struct castle_da_merge *merge)
+{
+    struct castle_double_array *da = merge->da;
+    struct castle_component_tree *ct;
+    struct list_head *l;
+    int level, i, bottom = 1;
+
+    read_lock(&da->lock);
+    for (level = (merge->level == BIG_MERGE) ? 2 : merge->level; level < MAX_DA_LEVEL; level++)
+    {
+        list_for_each(l, &da->levels[level].trees)
+        {
+            ct = list_entry(l, struct castle_component_tree, da_list);
+            FOR_EACH_MERGE_TREE(i, merge)
+                if (merge->in_trees[i] == ct)
+                    break;
+            if (i < merge->nr_trees)
+                continue;
+            if ((level > merge->level) || ct->compacting)
+                bottom = 0;
+        }
+    }
+    read_unlock(&da->lock);
+
+    return bottom;
+}
+
+/**
+ * Mark the DA for a total merge if tombstones make up too much of its merged trees. Only a
+ * merge into the bottom of the DA can drop them.
+ *
+ * The total merge rewrites the whole DA, so the density is taken over all trees above
+ * level 1 rather than just the new one, and tombstones trigger it at most once every
+ * CASTLE_TOMBSTONES_MERGE_DELAY.
+ *
+ * WARNING: Caller must hold da->lock for writing.
+ */
+static void castle_da_merge_tombstones_check(struct castle_da_merge *merge,
+                                             struct castle_component_tree *out_tree)
+{
+    struct castle_double_array *da = merge->da;
+    struct castle_component_tree *ct;
+    uint64_t items, tombstones;
+    struct list_head *l;
+    int level;
+
+    if (!castle_tombstone_density || merge->bottom || (out_tree->level < 2))
+        return;
+
+    if (da->tombstones_merge &&
+        time_before(jiffies, da->tombstones_merge + CASTLE_TOMBSTONES_MERGE_DELAY))
+        return;
+
+    items = tombstones = 0;
+    for (level = 2; level < MAX_DA_LEVEL; level++)
+    {
+        list_for_each(l, &da->levels[level].trees)
+        {
+            ct = list_entry(l, struct castle_component_tree, da_list);
+            items      += atomic64_read(&ct->item_count);
+            tombstones += ct->nr_tombstones;
+        }
+    }
+
+    if (!items || (tombstones * 100 < items * castle_tombstone_density))
+        return;
+
+    castle_printk(LOG_INFO, "DA=%d holds %llu tombstones in %llu merged entries, "
+            "scheduling a total merge.\n", da->id, tombstones, items);
+    da->tombstones_merge = jiffies;
+    castle_da_need_compaction_set(da);
+}
+
+/**
+ * Apply range tombstones of the in_trees to an entry of in_trees[ct_idx].
+ *
+ * Entries from the range tombstone's version get turned into tombstones. Entries from its
+ * ancestors can't be, other descendants may still need them. These get output unchanged and
+ * the range tombstone has to be kept for the out_tree, even by the bottom merge.
+ *
+ * The in_trees are no longer T0s, their range tombstones don't change.
+ *
+ * @also castle_range_tombstone_hides()
+ */
+static void castle_da_merge_range_tombstones_apply(struct castle_da_merge *merge,
+                                                   int ct_idx,
+                                                   void *key,
+                                                   c_ver_t version,
+                                                   c_val_tup_t *cvt,
+                                                   cv_nonatomic_stats_t *stats)
+{
+    struct castle_range_tombstone *rt;
+    int i;
+
+    /* Already deleted. */
+    if (CVT_TOMB_STONE(*cvt))
+        return;
+
+    for (i = 0; i <= ct_idx; i++)
+    {
+        list_for_each_entry(rt, &merge->in_trees[i]->range_tombstones, list)
+        {
+            if (!castle_range_tombstone_covers(rt, key) ||
+                !castle_range_tombstone_hides(rt, version, merge->in_trees[i],
+                                              merge->in_trees[ct_idx]))
+                continue;
+
+            if (version != rt->version)
+            {
+                merge->range_tombstones_kept = 1;
+                continue;
+            }
+
+            stats->keys--;
+            stats->tombstones++;
+            stats->tombstone_deletes++;
+            CVT_TOMB_STONE_SET(*cvt);
+            return;
+        }
+    }
+}
+
 static int castle_da_merge_unit_do(struct castle_da_merge *merge, uint32_t unit_nr)
 {
     void *key;
     c_ver_t version;
     c_val_tup_t cvt;
-    int ret;
+    int ret, no_budget;
 #ifdef CASTLE_PERF_DEBUG
     struct timespec ts_start, ts_end;
 #endif
@@ -3785,6 +5043,14 @@ static int castle_da_merge_unit_do(struct castle_da_merge *merge, uint32_t unit_
         /* Start with merged iterator stats (see castle_da_each_skip()). */
         stats = merge->merged_iter->stats;
 
+        /* Entries removed by range tombstones become tombstones. */
+        castle_da_merge_range_tombstones_apply(merge, merge->merged_iter->last_idx,
+                                               key, version, &cvt, &stats);
+
+        /* Entry following a held back tombstone decides whether it gets dropped. */
+        if (merge->tomb_key && (ret = castle_da_merge_tomb_resolve(merge, key)))
+            goto err_out;
+
         /* Skip entry if version marked for deletion and no descendant keys. */
         if (castle_da_entry_skip(merge, key, version))
         {
@@ -3815,56 +5081,36 @@ static int castle_da_merge_unit_do(struct castle_da_merge *merge, uint32_t unit_
             goto entry_done;
         }
 
-        /* Update merge serialisation state. */
-        if ((castle_merges_checkpoint) && (merge->level >= MIN_DA_SERDES_LEVEL))
-            castle_da_merge_serialise(merge);
-
-        /* Add entry to the output btree.
-         *
-         * - Add to level 0 node (and recurse up the tree)
-         * - Update the bloom filter */
-        castle_da_entry_add(merge, 0, key, version, cvt, 0);
-        if (merge->out_tree->bloom_exists)
-            castle_bloom_add(&merge->out_tree->bloom, merge->out_btree, key);
-
         /* Update per-version and merge statistics.
          * We are starting with merged iterator stats (from above). */
-        merge->nr_entries++;
-        if (merge->level == 1)
-        {
-            /* Live stats to reflect adjustments by castle_da_each_skip(). */
-            castle_version_live_stats_adjust(version, stats);
-
-            /* Key & tombstone inserts have not been accounted for in private
-             * level 1 merge version stats.  Zero any stat adjustments made in
-             * castle_da_each_skip() and perform accounting now. */
-            stats.keys = 0;
-            stats.tombstones = 0;
-
-            if (CVT_TOMB_STONE(cvt))
-                stats.tombstones++;
-            else
-                stats.keys++;
+        castle_da_merge_entry_stats_adjust(merge, version, cvt, stats);
 
-            castle_version_private_stats_adjust(version, stats, &merge->version_states);
-        }
-        else
+        /* Nothing older than the output, hold tombstones back until we know whether they
+           shadow anything. The merge doesn't get serialised in the meantime, so the
+           tombstone can't be lost. */
+        if (merge->bottom && CVT_TOMB_STONE(cvt))
         {
-            castle_version_live_stats_adjust(version, stats);
-            castle_version_private_stats_adjust(version, stats, &merge->version_states);
+            merge->tomb_key = merge->out_btree->key_duplicate(key);
+            merge->tomb_version = version;
+            merge->tomb_cvt = cvt;
+            if (merge->tomb_key)
+                goto entry_done;
         }
 
-        /* Try to complete node. */
-        castle_perf_debug_getnstimeofday(&ts_start);
-        ret = castle_da_nodes_complete(merge);
-        castle_perf_debug_getnstimeofday(&ts_end);
-        castle_perf_debug_bump_ctr(merge->nodes_complete_ns, ts_end, ts_start);
+        /* Update merge serialisation state. Only two-tree (deamortised) merges get
+         * serialised, leveled merges restart from scratch. */
+        if ((castle_merges_checkpoint) && (merge->level >= MIN_DA_SERDES_LEVEL)
+                && merge->da->levels[merge->level].merge.deamortize)
+            castle_da_merge_serialise(merge);
+
+        /* Add entry to the output btree. */
+        ret = castle_da_merge_entry_output(merge, key, version, cvt);
         if (ret != EXIT_SUCCESS)
             goto err_out;
 
 entry_done:
         castle_perf_debug_getnstimeofday(&ts_start);
-        castle_da_merge_budget_consume(merge);
+        no_budget = castle_da_merge_budget_consume(merge);
         castle_perf_debug_getnstimeofday(&ts_end);
         castle_perf_debug_bump_ctr(merge->budget_consume_ns, ts_end, ts_start);
         /* Update the progress, returns non-zero if we've completed the current unit. */
@@ -3875,13 +5121,20 @@ entry_done:
             castle_perf_debug_bump_ctr(merge->progress_update_ns, ts_end, ts_start);
             return EAGAIN;
         }
+        /* Out of budget, stop short of the end of the unit. */
+        if (no_budget)
+            return EBUSY;
 
         FAULT(MERGE_FAULT);
     }
 
+    /* Nothing follows the last tombstone. */
+    if (merge->tomb_key && (ret = castle_da_merge_tomb_resolve(merge, NULL)))
+        goto err_out;
+
     /* If we got few number of entries than the number of units. We might need to do few empty units
      * at the end to be in sync with other merges. */
-    if (unit_nr != (1U << merge->level))
+    if (unit_nr != castle_da_merge_units_total(merge->da, merge->level))
     {
         debug_merges("Going through an empty unit\n");
         return EAGAIN;
@@ -3999,10 +5252,10 @@ static inline int castle_da_merge_wait_event(struct castle_double_array *da, int
     not_ready_wake = 0;
     /* Protect the reads/updates to merge variables with DA lock. */
     write_lock(&da->lock);
-    /* If the merge isn't deamortised (total merges only), start immediately. */
+    /* If the merge isn't deamortised (total and leveled merges), start immediately. */
     if (!da->levels[level].merge.deamortize)
     {
-        BUG_ON(level != BIG_MERGE);
+        BUG_ON((level != BIG_MERGE) && !castle_da_leveled(da));
         da->levels[level].merge.units_commited++;
         write_unlock(&da->lock);
         return 1;
@@ -4094,27 +5347,16 @@ static inline int castle_da_merge_wait_event(struct castle_double_array *da, int
 not_ready_out:
     write_unlock(&da->lock);
     if(not_ready_wake)
-        wake_up(&da->merge_waitq);
+        castle_merge_sched_wake();
     return 0;
 
 ready_out:
     da->levels[level].merge.units_commited = this_level_units+1;
     write_unlock(&da->lock);
-    wake_up(&da->merge_waitq);
+    castle_merge_sched_wake();
     return 1;
 }
 
-static inline uint32_t castle_da_merge_units_inc_return(struct castle_double_array *da, int level)
-{
-    int ignore;
-
-    /* Wait until we are allowed to proceed with the merge. */
-    __wait_event_interruptible(da->merge_waitq, castle_da_merge_wait_event(da, level), ignore);
-    debug_merges("Merging unit %d.\n", da->levels[level].merge.units_commited);
-
-    return da->levels[level].merge.units_commited;
-}
-
 static inline void castle_da_merge_unit_complete(struct castle_double_array *da, int level)
 {
     struct castle_merge_token *token;
@@ -4132,7 +5374,7 @@ static inline void castle_da_merge_unit_complete(struct castle_double_array *da,
         da->levels[level].merge.active_token = NULL;
     }
     /* Wakeup everyone waiting on merge state update. */
-    wake_up(&da->merge_waitq);
+    castle_merge_sched_wake();
 }
 
 static inline void castle_da_merge_intermediate_unit_complete(struct castle_double_array *da,
@@ -4173,7 +5415,7 @@ static inline void castle_da_driver_merge_reset(struct castle_double_array *da)
         }
     }
 
-    wake_up(&da->merge_waitq);
+    castle_merge_sched_wake();
 }
 
 static int __castle_da_driver_merge_reset(struct castle_double_array *da, void *unused)
@@ -4296,11 +5538,15 @@ static tree_seq_t castle_da_merge_last_unit_complete(struct castle_double_array
     else
         BUG_ON(out_tree->level != level + 1);
 
-    if (merge->nr_entries)
+    if (merge->nr_entries || !list_empty(&out_tree->range_tombstones))
+    {
         castle_component_tree_add(merge->da, out_tree, head, 0 /*not in init*/);
+        castle_da_merge_tombstones_check(merge, out_tree);
+    }
+    atomic64_add(merge->nr_entries, &da->merged_entries);
 
     /* Reset the number of completed units. */
-    BUG_ON(da->levels[level].merge.units_commited != (1U << level));
+    BUG_ON(da->levels[level].merge.units_commited != castle_da_merge_units_total(da, level));
     da->levels[level].merge.units_commited = 0;
     /* Return any merge tokens we may still hold if we are not going to be doing more merges. */
     if(da->levels[level].nr_trees < 2)
@@ -4321,8 +5567,9 @@ static tree_seq_t castle_da_merge_last_unit_complete(struct castle_double_array
 
     castle_da_merge_restart(da, NULL);
 
-    castle_printk(LOG_INFO, "Completed merge at level: %d and deleted %u entries\n",
-            merge->level, merge->skipped_count);
+    castle_printk(LOG_INFO, "Completed merge at level: %d and deleted %u entries, "
+            "dropped %llu tombstones\n",
+            merge->level, merge->skipped_count, merge->tombstones_dropped);
 
     return out_tree_id;
 }
@@ -4353,14 +5600,16 @@ static struct castle_da_merge* castle_da_merge_init(struct castle_double_array *
     /* Sanity checks. */
     BUG_ON(nr_trees < 2);
     BUG_ON(da->levels[level].merge.units_commited != 0);
-    BUG_ON((level != BIG_MERGE) && (nr_trees != 2));
+    BUG_ON(da->levels[level].merge.deamortize && (nr_trees != 2));
     /* Work out what type of trees are we going to be merging. Bug if in_trees don't match. */
     btree = castle_btree_type_get(in_trees[0]->btree_type);
     for (i=0; i<nr_trees; i++)
     {
         /* Btree types may, and often will be different during big merges. */
         BUG_ON((level != BIG_MERGE) && (btree != castle_btree_type_get(in_trees[i]->btree_type)));
-        BUG_ON((level != BIG_MERGE) && (in_trees[i]->level != level));
+        /* Leveled merges take the run from the next level too. */
+        BUG_ON((level != BIG_MERGE) && (in_trees[i]->level != level) &&
+               (!castle_da_leveled(da) || (in_trees[i]->level != level + 1)));
     }
 
     /* Malloc everything ... */
@@ -4368,6 +5617,7 @@ static struct castle_da_merge* castle_da_merge_init(struct castle_double_array *
     merge = castle_zalloc(sizeof(struct castle_da_merge), GFP_KERNEL);
     if (!merge)
         goto error_out;
+    INIT_LIST_HEAD(&merge->range_tombstones);
     if (castle_version_states_alloc(&merge->version_states,
                 castle_versions_count_get(da->id, CVH_TOTAL)) != EXIT_SUCCESS)
         goto error_out;
@@ -4389,6 +5639,7 @@ static struct castle_da_merge* castle_da_merge_init(struct castle_double_array *
     merge->budget_cons_units    = 0;
     merge->is_new_key           = 1;
     merge->skipped_count        = 0;
+    castle_cache_stream_init(&merge->out_stream, castle_merge_write_window);
     for (i = 0; i < MAX_BTREE_DEPTH; i++)
     {
         merge->levels[i].last_key      = NULL;
@@ -4432,6 +5683,8 @@ static struct castle_da_merge* castle_da_merge_init(struct castle_double_array *
         merge->out_tree->tree_ext_free.ext_id = INVAL_EXT_ID;
         merge->out_tree->data_ext_free.ext_id = INVAL_EXT_ID;
         INIT_LIST_HEAD(&merge->out_tree->large_objs);
+        INIT_LIST_HEAD(&merge->out_tree->value_exts);
+        INIT_LIST_HEAD(&merge->out_tree->range_tombstones);
     }
     INIT_LIST_HEAD(&merge->new_large_objs);
 
@@ -4468,6 +5721,22 @@ static struct castle_da_merge* castle_da_merge_init(struct castle_double_array *
     if(ret)
         goto error_out;
 
+    /* Medium object extents. Objects written before a deserialised merge was interrupted
+       aren't accounted for. */
+    merge->value_exts_resumed = da->levels[level].merge.serdes.des;
+    ret = castle_da_merge_value_exts_init(merge);
+    if(ret)
+        goto error_out;
+
+    /* Range tombstones, for the out_tree. */
+    for (i = 0; i < nr_trees; i++)
+        if ((ret = castle_range_tombstones_copy(&merge->range_tombstones,
+                                                &in_trees[i]->range_tombstones)))
+            goto error_out;
+
+    /* Tombstones can be dropped if nothing older than the output tree exists. */
+    merge->bottom = castle_da_merge_bottom_check(merge);
+
     if(!da->levels[level].merge.serdes.des)
     {
         ret = castle_da_merge_extents_alloc(merge);
@@ -4475,6 +5744,13 @@ static struct castle_da_merge* castle_da_merge_init(struct castle_double_array *
             goto error_out;
     }
 
+    /* Stream output to disk. A resumed merge waits for its checkpoint first, see
+       castle_da_merge_serialise(). */
+    if (merge->out_tree->bloom_exists)
+        castle_bloom_stream_set(&merge->out_tree->bloom, &merge->out_stream);
+    if (atomic_read(&da->levels[level].merge.serdes.valid) == VALID_AND_FRESH_DAM_SERDES)
+        castle_cache_stream_pause(&merge->out_stream, 1);
+
     if(da->levels[level].merge.serdes.des)
     {
 #ifdef DEBUG_MERGE_SERDES
@@ -4618,6 +5894,10 @@ static void castle_da_merge_serialise(struct castle_da_merge *merge)
         BUG_ON(!da->levels[level].merge.serdes.mstore_entry);
         if( unlikely(merge->is_new_key) )
         {
+            /* Nodes streamed so far must be on disk before the checkpoint flushes the rest
+               of the output extents, and nothing may be in flight until it has done so. */
+            castle_cache_stream_pause(&merge->out_stream, 1);
+
             /* update output tree state */
             castle_da_merge_marshall(da->levels[level].merge.serdes.mstore_entry, merge,
                     DAM_MARSHALL_OUTTREE);
@@ -4657,6 +5937,9 @@ static void castle_da_merge_serialise(struct castle_da_merge *merge)
         castle_da_merge_marshall(da->levels[level].merge.serdes.mstore_entry, merge,
                 DAM_MARSHALL_ITERS);
 
+        /* Serialised output is durable, stream again. */
+        castle_cache_stream_pause(&merge->out_stream, 0);
+
         new_state = INVALID_DAM_SERDES;
         atomic_set(&da->levels[level].merge.serdes.valid, (int)new_state);
         mutex_unlock(&da->levels[level].merge.serdes.mutex);
@@ -4806,6 +6089,7 @@ update_output_tree_state:
     merge_mstore->completing         = merge->completing;
     merge_mstore->is_new_key         = merge->is_new_key;
     merge_mstore->skipped_count      = merge->skipped_count;
+    merge_mstore->range_tombstones_kept = merge->range_tombstones_kept;
     merge_mstore->nr_entries         = merge->nr_entries;
     merge_mstore->last_leaf_node_cep = INVAL_EXT_POS;
     if(merge->last_leaf_node_c2b)
@@ -4955,6 +6239,7 @@ static void castle_da_merge_deserialise(struct castle_da_merge *merge,
     merge->completing        = merge_mstore->completing;
     merge->is_new_key        = merge_mstore->is_new_key;
     merge->skipped_count     = merge_mstore->skipped_count;
+    merge->range_tombstones_kept = merge_mstore->range_tombstones_kept;
     merge->nr_entries        = merge_mstore->nr_entries;
     merge->leafs_on_ssds     = merge_mstore->leafs_on_ssds;
     merge->internals_on_ssds = merge_mstore->internals_on_ssds;
@@ -5127,26 +6412,118 @@ static void castle_da_merge_des_check(struct castle_da_merge *merge, struct cast
 }
 
 /**
- * Merge multiple trees into one. The same function gets used by both compaction
+ * Unlock output tree c2bs before parking the merge between units.
+ *
+ * Only the active leaf node and the in-progress bloom filter c2bs are held locked across
+ * merge entries. Unlocking them lets checkpoint flush partial merges, while the merge is
+ * waiting for its next unit to be scheduled. It is assumed that no other thread would ever
+ * have a wlock on these c2bs.
+ */
+static void castle_da_merge_park(struct castle_da_merge *merge)
+{
+    struct castle_double_array *da = merge->da;
+    int level = merge->level;
+    c2_block_t *node_c2b;
+    int i;
+
+    /* unlock output ct active leaf c2b, so checkpoint can quickly flush partial merges */
+    for(i=0; i<MAX_BTREE_DEPTH; i++)
+    {
+        node_c2b = merge->levels[i].node_c2b;
+        if(node_c2b)
+        {
+            if(i==0)
+                write_unlock_c2b(node_c2b);
+            else
+                BUG_ON(c2b_write_locked(node_c2b)); /* arriving here, only leaf node may be locked */
+        }
+    }
+    /* ditto the in-progress bloom filter */
+    merge->relock_bloom_node_c2b  = 0;
+    merge->relock_bloom_chunk_c2b = 0;
+    if (merge->out_tree->bloom_exists)
+    {
+        struct castle_bloom_build_params *bf_bp =  merge->out_tree->bloom.private;
+        if(bf_bp)
+        {
+            /* Nothing may write the chunk while the merge is parked. */
+            castle_bloom_build_sync(&merge->out_tree->bloom);
+            if(bf_bp->chunk_c2b)
+            {
+                if(c2b_write_locked(bf_bp->chunk_c2b))
+                {
+                    castle_printk(LOG_DEBUG, "%s::unlocking bloom filter chunk_c2b for merge on da %d level %d.\n",
+                            __FUNCTION__, da->id, level);
+                    write_unlock_c2b(bf_bp->chunk_c2b);
+                    merge->relock_bloom_chunk_c2b = 1;
+                }
+            }
+            if(bf_bp->node_c2b)
+            {
+                if(c2b_write_locked(bf_bp->node_c2b))
+                {
+                    castle_printk(LOG_DEBUG, "%s::unlocking bloom filter node_c2b for merge on da %d level %d.\n",
+                            __FUNCTION__, da->id, level);
+                    write_unlock_c2b(bf_bp->node_c2b);
+                    merge->relock_bloom_node_c2b = 1;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Relock c2bs unlocked by castle_da_merge_park(), as unit_do expects to find them locked.
+ */
+static void castle_da_merge_unpark(struct castle_da_merge *merge)
+{
+    struct castle_double_array *da = merge->da;
+    int level = merge->level;
+    c2_block_t *node_c2b;
+
+    /* relock output ct active leaf c2b, as unit_do expects to find it */
+    node_c2b = merge->levels[0].node_c2b;
+    if(node_c2b)
+        write_lock_c2b(node_c2b);
+    /* ditto the in-progress bloom filter */
+    if(merge->relock_bloom_node_c2b)
+    {
+        struct castle_bloom_build_params *bf_bp = merge->out_tree->bloom.private;
+        castle_printk(LOG_DEBUG, "%s::relocking bloom filter node_c2b for merge on da %d level %d.\n",
+                __FUNCTION__, da->id, level);
+        write_lock_c2b(bf_bp->node_c2b);
+    }
+    if(merge->relock_bloom_chunk_c2b)
+    {
+        struct castle_bloom_build_params *bf_bp = merge->out_tree->bloom.private;
+        castle_printk(LOG_DEBUG, "%s::relocking bloom filter chunk_c2b for merge on da %d level %d.\n",
+                __FUNCTION__, da->id, level);
+        write_lock_c2b(bf_bp->chunk_c2b);
+    }
+    merge->relock_bloom_node_c2b  = 0;
+    merge->relock_bloom_chunk_c2b = 0;
+}
+
+/**
+ * Start merging multiple trees into one. The same function gets used by both compaction
  * (total merges) and standard 2 tree merges.
  *
+ * Merge is returned parked (@see castle_da_merge_park()). Units are then performed by
+ * castle_da_merge_unit_run(), and the merge is finished with castle_da_merge_end().
+ *
  * @param da [in] doubling array to be merged
  * @param nr_trees [in] number of trees to be merged
- * @param in_trees [in] list of trees
+ * @param in_trees [in] list of trees, must remain valid until castle_da_merge_end()
  * @param level [in] level of the double array - 0 for total merge
  *
- * @return non-zero if failure
+ * @return merge structure, NULL on failure
  */
-static int castle_da_merge_do(struct castle_double_array *da,
-                              int nr_trees,
-                              struct castle_component_tree *in_trees[],
-                              int level)
+static struct castle_da_merge* castle_da_merge_begin(struct castle_double_array *da,
+                                                     int nr_trees,
+                                                     struct castle_component_tree *in_trees[],
+                                                     int level)
 {
     struct castle_da_merge *merge;
-    uint32_t units_cnt;
-    tree_seq_t out_tree_id=0;
-    int ret;
-    c_merge_serdes_state_t serdes_state;
 
     castle_trace_da_merge(TRACE_START,
                           TRACE_DA_MERGE_ID,
@@ -5165,15 +6542,20 @@ static int castle_da_merge_do(struct castle_double_array *da,
     if(!merge)
     {
         castle_printk(LOG_WARN, "Could not start a merge for DA=%d, level=%d.\n", da->id, level);
-        return -EAGAIN;
+        castle_trace_da_merge(TRACE_END, TRACE_DA_MERGE_ID, da->id, level, INVAL_TREE, 0);
+        return NULL;
     }
     castle_printk(LOG_DEBUG, "%s::MERGE START - DA %d L %d, with input cts %d and %d \n",
             __FUNCTION__, da->id, level, in_trees[0]->seq, in_trees[1]->seq);
 #ifdef DEBUG
-    debug_merges("MERGE START - L%d -> ", level);
-    FOR_EACH_MERGE_TREE(i, merge)
-        debug_merges("[%d]", merge->in_trees[i]->seq);
-    debug_merges("\n");
+    {
+        int i;
+
+        debug_merges("MERGE START - L%d -> ", level);
+        FOR_EACH_MERGE_TREE(i, merge)
+            debug_merges("[%d]", merge->in_trees[i]->seq);
+        debug_merges("\n");
+    }
 #endif
 
     /* Merge no fail zone starts here. Can't fail from here. Expected to complete, unless
@@ -5193,143 +6575,132 @@ static int castle_da_merge_do(struct castle_double_array *da,
                 C2_ADV_EXTENT|C2_ADV_HARDPIN, -1, -1, 0);
     }
 
-    /* Do the merge. */
-    do {
-        int i;
-        c2_block_t *node_c2b;
-        /* We unlock some c2bs before the unit merge boundary to allow checkpoint thread to flush
-           c2bs. It is assumed that no other thread would ever have a wlock on these c2bs. */
-        uint8_t relock_bloom_node_c2b = 0;
-        uint8_t relock_bloom_chunk_c2b = 0;
-        /* unlock output ct active leaf c2b, so checkpoint can quickly flush partial merges */
-        for(i=0; i<MAX_BTREE_DEPTH; i++)
-        {
-            node_c2b = merge->levels[i].node_c2b;
-            if(node_c2b)
-            {
-                if(i==0)
-                    write_unlock_c2b(node_c2b);
-                else
-                    BUG_ON(c2b_write_locked(node_c2b)); /* arriving here, only leaf node may be locked */
-            }
-        }
-        /* ditto the in-progress bloom filter */
-        if (merge->out_tree->bloom_exists)
-        {
-            struct castle_bloom_build_params *bf_bp =  merge->out_tree->bloom.private;
-            if(bf_bp)
-            {
-                if(bf_bp->chunk_c2b)
-                {
-                    if(c2b_write_locked(bf_bp->chunk_c2b))
-                    {
-                        castle_printk(LOG_DEBUG, "%s::unlocking bloom filter chunk_c2b for merge on da %d level %d.\n",
-                                __FUNCTION__, da->id, level);
-                        write_unlock_c2b(bf_bp->chunk_c2b);
-                        relock_bloom_chunk_c2b = 1;
-                    }
-                }
-                if(bf_bp->node_c2b)
-                {
-                    if(c2b_write_locked(bf_bp->node_c2b))
-                    {
-                        castle_printk(LOG_DEBUG, "%s::unlocking bloom filter node_c2b for merge on da %d level %d.\n",
-                                __FUNCTION__, da->id, level);
-                        write_unlock_c2b(bf_bp->node_c2b);
-                        relock_bloom_node_c2b = 1;
-                    }
-                }
-            }
-        }
+    /* Deserialised merges have already written some output, don't charge for it again. */
+    merge->bw_written = castle_da_merge_bytes_written(merge);
 
-        /* Wait until we are allowed to do next unit of merge. */
-        units_cnt = castle_da_merge_units_inc_return(da, level);
+    castle_da_merge_park(merge);
 
-        /* relock output ct active leaf c2b, as unit_do expects to find it */
-        node_c2b = merge->levels[0].node_c2b;
-        if(node_c2b)
-            write_lock_c2b(node_c2b);
-        /* ditto the in-progress bloom filter */
-        if(relock_bloom_node_c2b)
-        {
-            struct castle_bloom_build_params *bf_bp = merge->out_tree->bloom.private;
-            castle_printk(LOG_DEBUG, "%s::relocking bloom filter node_c2b for merge on da %d level %d.\n",
-                    __FUNCTION__, da->id, level);
-            write_lock_c2b(bf_bp->node_c2b);
-        }
-        if(relock_bloom_chunk_c2b)
-        {
-            struct castle_bloom_build_params *bf_bp = merge->out_tree->bloom.private;
-            castle_printk(LOG_DEBUG, "%s::relocking bloom filter chunk_c2b for merge on da %d level %d.\n",
-                    __FUNCTION__, da->id, level);
-            write_lock_c2b(bf_bp->chunk_c2b);
-        }
+    return merge;
+}
 
-        castle_printk(LOG_DEBUG, "%s::doing unit %d on merge %p (da %d level %d)\n", __FUNCTION__,
-            units_cnt, merge, da->id, level);
-        /* Trace event. */
-        castle_trace_da_merge_unit(TRACE_START,
-                                   TRACE_DA_MERGE_UNIT_ID,
-                                   da->id,
-                                   level,
-                                   units_cnt,
-                                   0);
-        /* Check for castle stop and merge abort */
-        if (castle_merges_abortable && exit_cond)
-        {
-            castle_printk(LOG_INIT, "Merge for DA=%d, level=%d, aborted.\n", da->id, level);
-            ret = -ESHUTDOWN;
-            CASTLE_TRANSACTION_BEGIN;
-            goto merge_aborted;
-        }
+/**
+ * Do a single unit of a parked merge.
+ *
+ * Caller must have been allowed to proceed with the next unit by castle_da_merge_wait_event().
+ *
+ * @param merge [in] merge to progress
+ *
+ * @return EAGAIN       Unit completed, merge parked again
+ * @return EBUSY        Out of budget, merge parked again with the unit to be resumed
+ * @return 0            Last unit completed, merge needs to be finished
+ * @return -ESHUTDOWN   Merge aborted, merge needs to be finished
+ * @return <0           Merge failed, merge needs to be finished
+ */
+static int castle_da_merge_unit_run(struct castle_da_merge *merge)
+{
+    struct castle_double_array *da = merge->da;
+    int level = merge->level;
+    c_merge_serdes_state_t serdes_state;
+    uint32_t units_cnt;
+    int ret;
 
-        /* Perform the merge work. */
-        ret = castle_da_merge_unit_do(merge, units_cnt);
+    units_cnt = da->levels[level].merge.units_commited;
+    debug_merges("Merging unit %d.\n", units_cnt);
 
-        serdes_state = atomic_read(&da->levels[level].merge.serdes.valid);
-        if((serdes_state > NULL_DAM_SERDES) && (!castle_merges_checkpoint))
-        {
-            /* user changed castle_merges_checkpoint param from 1 to 0 */
-            castle_printk(LOG_USERINFO,
-                    "Discarding checkpoint state for in-flight merge on DA=%d, level=%d.\n",
-                    da->id, level);
-            mutex_lock(&merge->da->levels[merge->level].merge.serdes.mutex);
-            castle_da_merge_serdes_dealloc(merge);
-            mutex_unlock(&merge->da->levels[merge->level].merge.serdes.mutex);
-        }
-        /* Trace event. */
-        castle_trace_da_merge_unit(TRACE_END,
-                                   TRACE_DA_MERGE_UNIT_ID,
-                                   da->id,
-                                   level,
-                                   units_cnt,
-                                   0);
-        debug_merges("Completing %d unit for merge at level: %d\n", units_cnt, level);
+    castle_da_merge_unpark(merge);
+
+    castle_printk(LOG_DEBUG, "%s::doing unit %d on merge %p (da %d level %d)\n", __FUNCTION__,
+        units_cnt, merge, da->id, level);
+    /* Trace event. */
+    castle_trace_da_merge_unit(TRACE_START,
+                               TRACE_DA_MERGE_UNIT_ID,
+                               da->id,
+                               level,
+                               units_cnt,
+                               0);
+    /* Check for castle stop and merge abort */
+    if (castle_merges_abortable && exit_cond)
+    {
+        castle_printk(LOG_INIT, "Merge for DA=%d, level=%d, aborted.\n", da->id, level);
+        return -ESHUTDOWN;
+    }
+
+    /* Perform the merge work. */
+    ret = castle_da_merge_unit_do(merge, units_cnt);
+
+    serdes_state = atomic_read(&da->levels[level].merge.serdes.valid);
+    if((serdes_state > NULL_DAM_SERDES) && (!castle_merges_checkpoint))
+    {
+        /* user changed castle_merges_checkpoint param from 1 to 0 */
+        castle_printk(LOG_USERINFO,
+                "Discarding checkpoint state for in-flight merge on DA=%d, level=%d.\n",
+                da->id, level);
+        mutex_lock(&merge->da->levels[merge->level].merge.serdes.mutex);
+        castle_da_merge_serdes_dealloc(merge);
+        mutex_unlock(&merge->da->levels[merge->level].merge.serdes.mutex);
+    }
+    /* Trace event. */
+    castle_trace_da_merge_unit(TRACE_END,
+                               TRACE_DA_MERGE_UNIT_ID,
+                               da->id,
+                               level,
+                               units_cnt,
+                               0);
+    debug_merges("Completing %d unit for merge at level: %d\n", units_cnt, level);
 
 #ifdef CASTLE_PERF_DEBUG
-        /* Output & reset performance stats. */
-        castle_da_merge_perf_stats_flush_reset(da, merge, units_cnt);
+    /* Output & reset performance stats. */
+    castle_da_merge_perf_stats_flush_reset(da, merge, units_cnt);
 #endif
-        /* Exit on errors. */
-        if (ret < 0)
-        {
-            /* Merges should never fail.
-             *
-             * Per-version statistics will now be out of sync. */
-            out_tree_id = INVAL_TREE;
-            castle_printk(LOG_WARN, "%s::MERGE FAILED - DA %d L %d, with input cts %d and %d \n",
-                    __FUNCTION__, da->id, level, in_trees[0]->seq, in_trees[1]->seq);
-            CASTLE_TRANSACTION_BEGIN;
-            goto merge_failed;
-        }
-        /* Only ret>0 we are expecting to continue, i.e. ret==EAGAIN. */
-        BUG_ON(ret && (ret != EAGAIN));
+    /* Exit on errors. */
+    if (ret < 0)
+    {
+        /* Merges should never fail.
+         *
+         * Per-version statistics will now be out of sync. */
+        castle_printk(LOG_WARN, "%s::MERGE FAILED - DA %d L %d, with input cts %d and %d \n",
+                __FUNCTION__, da->id, level, merge->in_trees[0]->seq, merge->in_trees[1]->seq);
+        return ret;
+    }
+    /* Only ret>0 we are expecting to continue, i.e. ret==EAGAIN or ret==EBUSY. */
+    BUG_ON(ret && (ret != EAGAIN) && (ret != EBUSY));
+    merge->unit_yielded = (ret == EBUSY);
+    if (ret == EAGAIN)
         /* Notify interested parties that we've completed current merge unit. */
-        if (ret == EAGAIN)
-            castle_da_merge_intermediate_unit_complete(da, level);
-    } while(ret);
+        castle_da_merge_intermediate_unit_complete(da, level);
+    if (ret > 0)
+        castle_da_merge_park(merge);
+
+    return ret;
+}
+
+/**
+ * Finish a merge, packaging the output tree if all units completed successfully.
+ *
+ * Deallocates the merge structure. The in_trees array passed to castle_da_merge_begin()
+ * remains owned by the caller.
+ *
+ * @param merge [in] merge to finish, unparked
+ * @param ret   [in] return value of the last castle_da_merge_unit_run()
+ *
+ * @return 0            Merge completed
+ * @return -ESHUTDOWN   Merge aborted
+ * @return -EAGAIN      Merge failed
+ */
+static int castle_da_merge_end(struct castle_da_merge *merge, int ret)
+{
+    struct castle_double_array *da = merge->da;
+    struct castle_component_tree **in_trees = merge->in_trees;
+    int level = merge->level;
+    tree_seq_t out_tree_id = INVAL_TREE;
+#ifdef DEBUG_MERGE_SERDES
+    c_merge_serdes_state_t serdes_state;
+#endif
 
     CASTLE_TRANSACTION_BEGIN;
+    if (ret)
+        goto merge_failed;
+
     castle_printk(LOG_DEBUG, "%s::MERGE COMPLETING - DA %d L %d, with input cts %d and %d, "
         "and output ct %d.\n", __FUNCTION__, da->id, level, in_trees[0]->seq, in_trees[1]->seq,
         merge->out_tree->seq);
@@ -5354,7 +6725,6 @@ static int castle_da_merge_do(struct castle_double_array *da,
     /* Commit and zero private stats to global crash-consistent tree. */
     castle_version_states_commit(&merge->version_states);
 
-merge_aborted:
 merge_failed:
     /* Unhard-pin T1s in the cache. Do this before we deallocate the merge and extents. */
     if (level == 1)
@@ -5406,7 +6776,7 @@ void castle_da_version_delete(c_da_t da_id)
     castle_da_need_compaction_set(da);
 
     /* Wakeup compaction thread. */
-    wake_up(&da->merge_waitq);
+    castle_merge_sched_wake();
 }
 
 /**
@@ -5433,6 +6803,51 @@ static int castle_da_merge_units_ongoing(struct castle_double_array *da, int lev
     return 0;
 }
 
+/**
+ * Works out whether a level of a leveled DA holds more than its share of data.
+ *
+ * Level 2 may hold castle_leveled_size_ratio T0s worth of data, and each level above it
+ * castle_leveled_size_ratio times more than the level below.
+ *
+ * Level size is read without the DA lock, the result is only used to trigger merges.
+ */
+static int castle_da_leveled_level_full(struct castle_double_array *da, int level)
+{
+    uint64_t capacity;
+    int ratio, i;
+
+    if (level < 2)
+        return 0;
+
+    ratio = max(castle_leveled_size_ratio, 2);
+    capacity = (uint64_t)MAX_DYNAMIC_TREE_SIZE * C_CHK_SIZE;
+    for (i=1; i<level; i++)
+    {
+        /* Level can't realistically fill up. */
+        if (capacity > (uint64_t)-1 / ratio)
+            return 0;
+        capacity *= ratio;
+    }
+
+    return atomic64_read(&da->levels[level].size) > capacity;
+}
+
+/**
+ * Works out whether there is anything to merge at a level.
+ *
+ * Doubling policy merges two trees at a time. Leveled policy additionally pushes the run
+ * at levels 2+ into the next level up, once the level is full.
+ */
+static int castle_da_merge_level_ready(struct castle_double_array *da, int level)
+{
+    int nr_trees = da->levels[level].nr_trees;
+
+    if (nr_trees >= 2)
+        return 1;
+
+    return castle_da_leveled(da) && (nr_trees == 1) && castle_da_leveled_level_full(da, level);
+}
+
 /**
  * Determines whether to do a total merge.
  *
@@ -5479,217 +6894,304 @@ out:
 }
 
 /**
- * Do a total merge on all trees in a DA. Triggered, after completing the last level
- * merge, if any versions marked for deletion.
+ * Unmark trees collected by castle_da_big_merge_trees_get(), after a total merge failed.
  *
- * @param da_p [in] doubling array to run total merge on.
+ * @param da [in] doubling array
+ * @param nr_trees [in] number of trees marked for compaction
  */
-static int castle_da_big_merge_run(void *da_p)
+static void castle_da_big_merge_trees_put(struct castle_double_array *da, int nr_trees)
 {
-    struct castle_double_array *da = (struct castle_double_array *)da_p;
-    struct castle_component_tree **in_trees;
     struct list_head *l;
-    int level=0, ignore;
-    int nr_trees=0;
-    int i, ret = 0;
-
-    /* Disable deamortization of total merges. */
-    da->levels[BIG_MERGE].merge.deamortize = 0;
-
-    debug_merges("Starting big-merge thread.\n");
-    do {
-        /* Start big-merge only when the DA has versions marked for deletion
-         * and only after completing the top-level merge(to make sure no merge
-         * is going on). */
-        __wait_event_interruptible(da->merge_waitq,
-                                   exit_cond || castle_da_big_merge_trigger(da),
-                                   ignore);
-
-        /* Exit without doing a merge, if we are stopping execution, or da has been deleted. */
-        if(exit_cond)
-            break;
-
-        /* Otherwise do a merge. */
-        castle_printk(LOG_INFO, "Triggered a total merge.\n");
-
-        /* Allocate array for in_tree pointers, but do that without holding the lock. */
-        in_trees = NULL;
+    int level, i;
 
-        /* Lock the DA, because we may reset the compacting flag. */
-        write_lock(&da->lock);
+    write_lock(&da->lock);
 
-        /* Count number of trees to compact. Don't compact level-1 trees.
-         *
-         * Note: Merging T1s need memory as we need to sort them before merge. If we try to
-         * include T1s in compaction, we might run out of memory.
-         */
-        for (nr_trees=0, level=2; level<MAX_DA_LEVEL; level++)
-            nr_trees += da->levels[level].nr_trees;
+    /* If the merge was actually scheduled (i.e. some trees were collected),
+       but failed afterward (e.g. due to NOSPC), readjust the counters again. */
 
-        /* Merge cannot be scheduled with < 2 trees. */
-        if(nr_trees < 2)
+    /* Merge failed, unmark compacting bit for all trees. */
+    for (level=2, i=0; level<MAX_DA_LEVEL; level++)
+    {
+        list_for_each(l, &da->levels[level].trees)
         {
-            /* Don't compact any more (not enough trees). */
-            castle_printk(LOG_USERINFO, "Aborting compaction: Need minimum 2 trees above"
-                                        " level 1.\n");
-            castle_da_need_compaction_clear(da);
-            write_unlock(&da->lock);
-            goto wait_and_try;
-        }
+            struct castle_component_tree *ct =
+                        list_entry(l, struct castle_component_tree, da_list);
 
-        /* Mark all the trees for compaction. So, we start compaction on them after allocating
-         * resources. */
-        for (level=2, i=0; level<MAX_DA_LEVEL; level++)
-        {
-            list_for_each(l, &da->levels[level].trees)
+            if (ct->compacting)
             {
-                struct castle_component_tree *ct = list_entry(l, struct castle_component_tree, da_list);
-
-                BUG_ON(ct->compacting);
-                ct->compacting = 1;
-                da->levels[level].nr_trees--;
-                da->levels[level].nr_compac_trees++;
+                ct->compacting = 0;
                 i++;
-                BUG_ON(i > nr_trees);
             }
+            BUG_ON(i > nr_trees);
         }
-        BUG_ON(i != nr_trees);
-
-        write_unlock(&da->lock);
+    }
+    BUG_ON(i != nr_trees);
 
-        /* Allocate in_trees array for appropriate number of trees. */
-        in_trees = castle_zalloc(sizeof(struct castle_component_tree *) * nr_trees,
-                                 GFP_KERNEL);
-        if (!in_trees)
-        {
-            castle_printk(LOG_USERINFO, "Aborting compaction: Failed to allocate memory.\n");
-            goto wait_and_try;
-        }
+    /* Change count for compaction trees on each level. */
+    for (i=0; i<MAX_DA_LEVEL; i++)
+    {
+        BUG_ON((i <=1 ) && da->levels[i].nr_compac_trees);
 
-        /* Now, lock the DA, take the in trees and start the merge. */
-        write_lock(&da->lock);
+        da->levels[i].nr_trees += da->levels[i].nr_compac_trees;
+        da->levels[i].nr_compac_trees = 0;
+    }
 
-        /* Allocated memory for in_trees; store all trees on in_trees array. */
-        for (level=2, i=0; level<MAX_DA_LEVEL; level++)
-        {
-            list_for_each(l, &da->levels[level].trees)
-            {
-                struct castle_component_tree *ct =
-                            list_entry(l, struct castle_component_tree, da_list);
+    write_unlock(&da->lock);
 
-                /* Store trees marked for compaction. */
-                if (ct->compacting)
-                {
-                    in_trees[i] = ct;
-                    i++;
-                }
+    /* Wakeup everyone waiting on merge state update. */
+    castle_merge_sched_wake();
+}
 
-                BUG_ON(i > nr_trees);
-            }
-        }
+/**
+ * Collect all trees in a DA for a total merge, and mark them as being compacted.
+ *
+ * @param da [in] doubling array to run total merge on
+ * @param nr_trees_p [out] number of trees to be merged
+ *
+ * @return array of trees to be merged, NULL if total merge couldn't be started
+ */
+static struct castle_component_tree** castle_da_big_merge_trees_get(struct castle_double_array *da,
+                                                                    int *nr_trees_p)
+{
+    struct castle_component_tree **in_trees;
+    struct list_head *l;
+    int level, nr_trees, i;
 
-        /* We should have seen all marked in trees. */
-        BUG_ON(i != nr_trees);
+    /* Lock the DA, because we may reset the compacting flag. */
+    write_lock(&da->lock);
 
-        /* Marked trees for compaction, register a component tree sequence number, before
-         * letting other merges start.
-         *
-         * Note: This is important as, merges can race with compaction and it is possible to have
-         * compaction out_tree with latest sequence number than the racing merge.
-         */
-        if (TREE_INVAL(da->compaction_ct_seq))
-            da->compaction_ct_seq = castle_da_next_ct_seq();
+    /* Count number of trees to compact. Don't compact level-1 trees.
+     *
+     * Note: Merging T1s need memory as we need to sort them before merge. If we try to
+     * include T1s in compaction, we might run out of memory.
+     */
+    for (nr_trees=0, level=2; level<MAX_DA_LEVEL; level++)
+        nr_trees += da->levels[level].nr_trees;
+    *nr_trees_p = nr_trees;
 
+    /* Merge cannot be scheduled with < 2 trees. */
+    if(nr_trees < 2)
+    {
+        /* Don't compact any more (not enough trees). */
+        castle_printk(LOG_USERINFO, "Aborting compaction: Need minimum 2 trees above"
+                                    " level 1.\n");
+        castle_da_need_compaction_clear(da);
         write_unlock(&da->lock);
+        return NULL;
+    }
 
-        castle_da_need_compaction_clear(da);
-        atomic_set(&da->nr_del_versions, 0);
+    /* Mark all the trees for compaction. So, we start compaction on them after allocating
+     * resources. */
+    for (level=2, i=0; level<MAX_DA_LEVEL; level++)
+    {
+        list_for_each(l, &da->levels[level].trees)
+        {
+            struct castle_component_tree *ct = list_entry(l, struct castle_component_tree, da_list);
+
+            BUG_ON(ct->compacting);
+            ct->compacting = 1;
+            da->levels[level].nr_trees--;
+            da->levels[level].nr_compac_trees++;
+            i++;
+            BUG_ON(i > nr_trees);
+        }
+    }
+    BUG_ON(i != nr_trees);
 
-        /* Wakeup everyone waiting on merge state update. */
-        wake_up(&da->merge_waitq);
+    write_unlock(&da->lock);
 
-        castle_printk(LOG_USERINFO, "Starting total merge on %d trees\n", nr_trees);
+    /* Allocate in_trees array for appropriate number of trees. */
+    in_trees = castle_zalloc(sizeof(struct castle_component_tree *) * nr_trees,
+                             GFP_KERNEL);
+    if (!in_trees)
+    {
+        castle_printk(LOG_USERINFO, "Aborting compaction: Failed to allocate memory.\n");
+        castle_da_big_merge_trees_put(da, nr_trees);
+        return NULL;
+    }
 
-        /* Mark DA as compaction is ongoing. */
-        castle_da_compacting_set(da);
+    /* Now, lock the DA, take the in trees and start the merge. */
+    write_lock(&da->lock);
 
-        /* Do the merge. If fails, retry after 10s. */
-        if ((ret = castle_da_merge_do(da, nr_trees, in_trees, BIG_MERGE)))
+    /* Allocated memory for in_trees; store all trees on in_trees array. */
+    for (level=2, i=0; level<MAX_DA_LEVEL; level++)
+    {
+        list_for_each(l, &da->levels[level].trees)
         {
-            castle_printk(LOG_WARN, "Total merge failed with error: %d\n", ret);
-wait_and_try:
-            if (nr_trees >= 2)
+            struct castle_component_tree *ct =
+                        list_entry(l, struct castle_component_tree, da_list);
+
+            /* Store trees marked for compaction. */
+            if (ct->compacting)
             {
-                write_lock(&da->lock);
+                in_trees[i] = ct;
+                i++;
+            }
 
-                /* If the merge was actually scheduled (i.e. some trees were collected),
-                   but failed afterward (e.g. due to NOSPC), readjust the counters again. */
+            BUG_ON(i > nr_trees);
+        }
+    }
 
-                /* Merge failed, unmark compacting bit for all trees. */
-                for (level=2, i=0; level<MAX_DA_LEVEL; level++)
-                {
-                    list_for_each(l, &da->levels[level].trees)
-                    {
-                        struct castle_component_tree *ct =
-                                    list_entry(l, struct castle_component_tree, da_list);
-
-                        if (ct->compacting)
-                        {
-                            ct->compacting = 0;
-                            i++;
-                        }
-                        BUG_ON(i > nr_trees);
-                    }
-                }
-                BUG_ON(i != nr_trees);
+    /* We should have seen all marked in trees. */
+    BUG_ON(i != nr_trees);
 
-                /* Change count for compaction trees on each level. */
-                for (i=0; i<MAX_DA_LEVEL; i++)
-                {
-                    BUG_ON((i <=1 ) && da->levels[i].nr_compac_trees);
+    /* Marked trees for compaction, register a component tree sequence number, before
+     * letting other merges start.
+     *
+     * Note: This is important as, merges can race with compaction and it is possible to have
+     * compaction out_tree with latest sequence number than the racing merge.
+     */
+    if (TREE_INVAL(da->compaction_ct_seq))
+        da->compaction_ct_seq = castle_da_next_ct_seq();
 
-                    da->levels[i].nr_trees += da->levels[i].nr_compac_trees;
-                    da->levels[i].nr_compac_trees = 0;
-                }
+    write_unlock(&da->lock);
 
-                write_unlock(&da->lock);
-            }
+    castle_da_need_compaction_clear(da);
+    atomic_set(&da->nr_del_versions, 0);
 
-            /* Free in_trees structure. */
-            if (in_trees)
-            {
-                castle_free(in_trees);
-                in_trees = NULL;
-            }
+    /* Wakeup everyone waiting on merge state update. */
+    castle_merge_sched_wake();
 
-            /* Wakeup everyone waiting on merge state update. */
-            wake_up(&da->merge_waitq);
+    return in_trees;
+}
 
-            /* Mark DA as compaction is completed. */
-            castle_da_compacting_clear(da);
+/**
+ * Collect trees for a leveled merge at levels 2+: all trees at the level, followed by the
+ * run at the next level up. Trees are stored newest first, same as for total merges.
+ *
+ * Merges at the neighbouring levels don't run at the same time
+ * (@see castle_merge_sched_slot_blocked()), but level 1 merges may still add trees to the
+ * front of level 2. Only the trees counted up front get merged.
+ *
+ * @param da [in] doubling array
+ * @param level [in] merge level
+ * @param nr_trees_p [out] number of trees to be merged
+ *
+ * @return array of trees to be merged, NULL if it couldn't be allocated
+ */
+static struct castle_component_tree** castle_da_leveled_merge_trees_get(struct castle_double_array *da,
+                                                                        int level,
+                                                                        int *nr_trees_p)
+{
+    struct castle_component_tree **in_trees;
+    struct castle_component_tree *ct;
+    struct list_head *l;
+    int nr_level, nr_trees, i;
 
-            /* In case we failed the merge because of no memory for in_trees, wait and retry. */
-            msleep_interruptible(10000);
-        }
-        else
-        {
-            /* Mark DA as compaction is completed. */
-            castle_da_compacting_clear(da);
+    BUG_ON((level < 2) || (level+1 >= MAX_DA_LEVEL));
 
-            castle_printk(LOG_USERINFO, "Successfully completed compaction\n");
-        }
-    } while(1);
+    read_lock(&da->lock);
+    nr_level = da->levels[level].nr_trees;
+    nr_trees = nr_level + da->levels[level+1].nr_trees;
+    read_unlock(&da->lock);
+
+    in_trees = castle_zalloc(sizeof(struct castle_component_tree *) * nr_trees, GFP_KERNEL);
+    if (!in_trees)
+        return NULL;
+
+    read_lock(&da->lock);
+
+    /* Oldest trees at the level. Skip trees being compacted. */
+    i = nr_level;
+    list_for_each_prev(l, &da->levels[level].trees)
+    {
+        ct = list_entry(l, struct castle_component_tree, da_list);
+        if (ct->compacting)
+            continue;
+        if (i == 0)
+            break;
+        in_trees[--i] = ct;
+    }
+    BUG_ON(i != 0);
+
+    /* Followed by the run at the next level. */
+    i = nr_level;
+    list_for_each(l, &da->levels[level+1].trees)
+    {
+        ct = list_entry(l, struct castle_component_tree, da_list);
+        if (ct->compacting)
+            continue;
+        BUG_ON(i >= nr_trees);
+        in_trees[i++] = ct;
+    }
+    BUG_ON(i != nr_trees);
+
+    read_unlock(&da->lock);
+
+    *nr_trees_p = nr_trees;
 
-    debug_merges("Merge thread exiting.\n");
+    return in_trees;
+}
+
+/**
+ * Move the run of a full level of a leveled DA to the next level up, if there is no
+ * run to merge it with.
+ */
+static void castle_da_leveled_tree_push(struct castle_double_array *da,
+                                        struct castle_component_tree *ct)
+{
+    int level = ct->level;
 
+    CASTLE_TRANSACTION_BEGIN;
     write_lock(&da->lock);
-    /* Remove ourselves from the da merge threads array to indicate that we are finished. */
-    da->levels[BIG_MERGE].merge.thread = NULL;
+    if (!ct->compacting && list_empty(&da->levels[level+1].trees))
+        castle_component_tree_promote(da, ct, 0 /*in_init*/);
     write_unlock(&da->lock);
-    /* castle_da_alloc() took a reference for us, we have to drop it now. */
-    castle_da_put(da);
+    CASTLE_TRANSACTION_END;
 
-    return 0;
+    castle_printk(LOG_INFO, "Moved ct=%d from level %d to level %d of DA=%d.\n",
+            ct->seq, level, ct->level, da->id);
+}
+
+/**
+ * Move the two trees picked for a merge up a level, if their key ranges are disjoint.
+ *
+ * A merge of disjoint trees would just copy both trees. Instead, both trees are moved to
+ * the next level, oldest first, where lookups keep searching them (and their Bloom
+ * filters) one after another, skipping the one which can't hold the key.
+ *
+ * @param in_trees  Trees returned by castle_da_merge_cts_get(), in_trees[1] is the oldest
+ *
+ * @return 0 if the trees were moved, -EINVAL if they have to be merged
+ */
+static int castle_da_trivial_move(struct castle_double_array *da,
+                                  int level,
+                                  struct castle_component_tree **in_trees)
+{
+    struct castle_component_tree *ct;
+    int ret = -EINVAL;
+
+    /* T1s are dynamic and have no key bounds. */
+    if (!castle_trivial_moves || (level < 2) || (level + 1 >= MAX_DA_LEVEL))
+        return -EINVAL;
+
+    if (castle_ct_key_bounds_overlap(in_trees[0], in_trees[1]))
+        return -EINVAL;
+
+    CASTLE_TRANSACTION_BEGIN;
+    write_lock(&da->lock);
+    if (in_trees[0]->compacting || in_trees[1]->compacting)
+        goto out;
+    /* Moved trees have to be newer than all trees at the next level. */
+    if (!list_empty(&da->levels[level+1].trees))
+    {
+        ct = list_entry(da->levels[level+1].trees.next, struct castle_component_tree, da_list);
+        if (in_trees[1]->seq <= ct->seq)
+            goto out;
+    }
+    castle_component_tree_promote(da, in_trees[1], 0 /*in_init*/);
+    castle_component_tree_promote(da, in_trees[0], 0 /*in_init*/);
+    atomic64_add(2, &da->moved_trees);
+    ret = 0;
+out:
+    write_unlock(&da->lock);
+    CASTLE_TRANSACTION_END;
+
+    if (!ret)
+        castle_printk(LOG_INFO, "Moved disjoint cts=%d,%d from level %d to level %d of DA=%d.\n",
+                in_trees[1]->seq, in_trees[0]->seq, level, level+1, da->id);
+
+    return ret;
 }
 
 /**
@@ -5718,7 +7220,7 @@ static int castle_da_merge_trigger(struct castle_double_array *da, int level)
     if (exit_cond)
         goto start_merge;
 
-    if (da->levels[level].nr_trees < 2)
+    if (!castle_da_merge_level_ready(da, level))
         goto out;
 
     /* Make sure there are no ongoing merge units on top levels. */
@@ -5747,109 +7249,575 @@ out:
     return ret;
 }
 
+/**********************************************************************************************/
+/* Merge scheduler */
+
 /**
- * Merge doubling array trees at a level.
+ * Works out how urgently the merge at a given level needs a worker. Higher values win.
+ *
+ * The score combines:
+ *  - write stall risk: level 1 backlog, relative to the number of trees at which
+ *    castle_da_merge_restart() disables inserts,
+ *  - level backlog: trees waiting at the level, weighted towards lower levels (their output
+ *    feeds all the levels above),
+ *  - space reclaim: versions deleted since the last total merge.
  *
- * @param da_p [in] Doubling array to do merge on.
+ * Level state is read without the DA lock, the result is only a scheduling hint.
+ *
+ * @return 0 if there is nothing to merge at the level
  */
-static int castle_da_merge_run(void *da_p)
+static int castle_da_merge_urgency(struct castle_double_array *da, int level)
 {
-    struct castle_double_array *da = (struct castle_double_array *)da_p;
-    struct castle_component_tree *in_trees[2];
-    int level, ignore, ret;
+    int nr_trees, urgency;
 
-    /* Work out the level at which we are supposed to be doing merges.
-       Do that by working out where is this thread in threads array. */
-    for(level=1; level<MAX_DA_LEVEL; level++)
-        if(da->levels[level].merge.thread == current)
-            break;
-    BUG_ON(level >= MAX_DA_LEVEL);
+    if (level == BIG_MERGE)
+    {
+        if (!castle_da_need_compaction(da))
+            return 0;
 
-    /* Enable deamortization of normal merges. */
-    da->levels[level].merge.deamortize = 1;
-    castle_printk(LOG_DEBUG, "Starting merge thread.\n");
-    do {
+        return 1 + atomic_read(&da->nr_del_versions);
+    }
+
+    if (!castle_da_merge_level_ready(da, level))
+        return 0;
+
+    nr_trees = da->levels[level].nr_trees;
+    urgency = max(nr_trees - 1, 1) * (MAX_DA_LEVEL - level);
+    if (level == 1)
+        urgency += CASTLE_MERGE_URGENCY_STALL * nr_trees /
+                   (4 * castle_double_array_request_cpus());
+
+    return urgency;
+}
+
+/**
+ * Leveled merges at levels 2+ take the run at the next level as an input, so they mustn't
+ * overlap with merges at the neighbouring levels 2+.
+ *
+ * WARNING: Caller must hold castle_merge_sched_lock.
+ */
+static int castle_merge_sched_slot_blocked(struct castle_double_array *da, int level)
+{
+    int i;
+
+    if (!castle_da_leveled(da) || (level < 2))
+        return 0;
+
+    for (i=max(level-1, 2); i<=min(level+1, MAX_DA_LEVEL-2); i++)
+        if ((i != level) &&
+            (da->levels[i].merge.sched_claimed || da->levels[i].merge.sched_merge))
+            return 1;
+
+    return 0;
+}
+
+/**
+ * Works out whether a merge slot could be run by a worker, and with what priority.
+ *
+ * In-flight merges are always eligible, they need to be drained when exiting.
+ *
+ * WARNING: Caller must hold castle_merge_sched_lock.
+ *
+ * @return 0 if the slot shouldn't be tried, priority otherwise
+ */
+static int castle_merge_sched_slot_priority(struct castle_double_array *da, int level)
+{
+    unsigned long retry = da->levels[level].merge.sched_retry;
+    int urgency;
+
+    if (da->levels[level].merge.sched_claimed)
+        return 0;
+
+    /* Merges paced by the rate controller, or by the bandwidth cap, wait for their budget
+       to be replenished. */
+    if (!exit_cond && ((atomic_read(&da->merge_budget) <= 0) ||
+                       (castle_merge_bandwidth_cap &&
+                        (atomic64_read(&castle_merge_bw_budget) <= 0))))
+        return 0;
+
+    urgency = castle_da_merge_urgency(da, level);
+    if (da->levels[level].merge.sched_merge)
+        return max(urgency, 1);
+
+    if (exit_cond)
+        return 0;
+
+    if (retry && time_before(jiffies, retry))
+        return 0;
+
+    if (castle_merge_sched_slot_blocked(da, level))
+        return 0;
+
+    return urgency;
+}
+
+/**
+ * Free merge input trees array, and handle merge completion or failure.
+ *
+ * @param da        [in] doubling array
+ * @param level     [in] merge level
+ * @param nr_trees  [in] number of trees in in_trees
+ * @param in_trees  [in] merge input trees array
+ * @param ret       [in] merge result (@see castle_da_merge_end())
+ */
+static void castle_merge_sched_merge_done(struct castle_double_array *da,
+                                          int level,
+                                          int nr_trees,
+                                          struct castle_component_tree **in_trees,
+                                          int ret)
+{
+    if (level == BIG_MERGE)
+    {
+        if (ret)
+        {
+            castle_printk(LOG_WARN, "Total merge failed with error: %d\n", ret);
+            castle_da_big_merge_trees_put(da, nr_trees);
+        }
+        else
+            castle_printk(LOG_USERINFO, "Successfully completed compaction\n");
+
+        /* Mark DA as compaction is completed. */
+        castle_da_compacting_clear(da);
+    }
+    else if (ret)
+        /* Completed merges drop ongoing count in castle_da_merge_last_unit_complete(). */
+        atomic_dec(&da->ongoing_merges);
+
+    castle_free(in_trees);
+
+    /* If merge failed (not aborted), back off before retrying. */
+    if (ret && (ret != -ESHUTDOWN))
+        da->levels[level].merge.sched_retry = jiffies + CASTLE_MERGE_RETRY_DELAY;
+
+    /* Wakeup everyone waiting on merge state update. */
+    castle_merge_sched_wake();
+}
+
+/**
+ * Start a new merge in an idle merge slot, and park it in the slot.
+ *
+ * @return  0       Merge started
+ * @return -EAGAIN  Nothing to merge at the moment
+ * @return  <0      Merge couldn't be started, slot backs off
+ */
+static int castle_merge_sched_slot_start(struct castle_double_array *da, int level)
+{
+    struct castle_component_tree **in_trees;
+    struct castle_da_merge *merge;
+    int nr_trees, ret;
+
+    if (level == BIG_MERGE)
+    {
+        /* Start big-merge only when the DA has versions marked for deletion
+         * and only after completing the top-level merge(to make sure no merge
+         * is going on). */
+        if (exit_cond || !castle_da_big_merge_trigger(da))
+            return -EAGAIN;
+
+        castle_printk(LOG_INFO, "Triggered a total merge.\n");
+        in_trees = castle_da_big_merge_trees_get(da, &nr_trees);
+        if (!in_trees)
+        {
+            /* In case we failed the merge because of no memory for in_trees, wait and retry. */
+            da->levels[level].merge.sched_retry = jiffies + CASTLE_MERGE_RETRY_DELAY;
+            return -ENOMEM;
+        }
+
+        castle_printk(LOG_USERINFO, "Starting total merge on %d trees\n", nr_trees);
+
+        /* Mark DA as compaction is ongoing. */
+        castle_da_compacting_set(da);
+    }
+    else
+    {
         /* Wait for 2+ trees to appear at this level. */
-        __wait_event_interruptible(da->merge_waitq,
-                    castle_da_merge_trigger(da, level),
-                    ignore);
+        if (!castle_da_merge_trigger(da, level))
+            return -EAGAIN;
 
-        /* Exit without doing a merge, if we are stopping execution, or da has been deleted. */
-        if(exit_cond)
+        /* Don't start a merge, if we are stopping execution, or da has been deleted. */
+        if (exit_cond)
         {
             atomic_dec(&da->ongoing_merges);
-            break;
+            return -EAGAIN;
+        }
+
+        if (castle_da_leveled(da) && (level >= 2))
+            goto leveled;
+
+        nr_trees = 2;
+        in_trees = castle_zalloc(sizeof(struct castle_component_tree *) * nr_trees,
+                                 GFP_KERNEL);
+        if (!in_trees)
+        {
+            atomic_dec(&da->ongoing_merges);
+            da->levels[level].merge.sched_retry = jiffies + CASTLE_MERGE_RETRY_DELAY;
+            return -ENOMEM;
         }
 
         /* Extract the two oldest component trees. */
         ret = castle_da_merge_cts_get(da, level, in_trees);
         BUG_ON(ret && (ret != -EAGAIN));
-        if(ret == -EAGAIN)
-            goto __again;
+        if (ret == -EAGAIN)
+        {
+            /* An empty tree was freed, try again straight away. */
+            atomic_dec(&da->ongoing_merges);
+            castle_free(in_trees);
+            castle_merge_sched_wake();
+            return -EAGAIN;
+        }
 
         /* We expect to have 2 trees. */
         BUG_ON(!in_trees[0] || !in_trees[1]);
+
+        /* Trees with disjoint key ranges don't need merging. */
+        if (!castle_da_trivial_move(da, level, in_trees))
+        {
+            atomic_dec(&da->ongoing_merges);
+            castle_free(in_trees);
+            castle_merge_sched_wake();
+            return -EAGAIN;
+        }
         debug_merges("Doing merge, trees=[%u]+[%u]\n", in_trees[0]->seq, in_trees[1]->seq);
+    }
+    goto begin;
+
+leveled:
+    /* Merge the level into the run at the next level up. */
+    in_trees = castle_da_leveled_merge_trees_get(da, level, &nr_trees);
+    if (!in_trees)
+    {
+        atomic_dec(&da->ongoing_merges);
+        da->levels[level].merge.sched_retry = jiffies + CASTLE_MERGE_RETRY_DELAY;
+        return -ENOMEM;
+    }
+    if (nr_trees == 1)
+    {
+        /* Nothing to merge with, the run just moves up. */
+        castle_da_leveled_tree_push(da, in_trees[0]);
+        atomic_dec(&da->ongoing_merges);
+        castle_free(in_trees);
+        castle_merge_sched_wake();
+        return -EAGAIN;
+    }
+    debug_merges("Doing leveled merge of %d trees at level %d\n", nr_trees, level);
+
+begin:
+    merge = castle_da_merge_begin(da, nr_trees, in_trees, level);
+    if (!merge)
+    {
+        castle_merge_sched_merge_done(da, level, nr_trees, in_trees, -EAGAIN);
+        return -EAGAIN;
+    }
+    da->levels[level].merge.sched_merge = merge;
+
+    return 0;
+}
+
+/**
+ * Make progress on a merge slot claimed by the calling worker.
+ *
+ * Starts a new merge if the slot is idle, and then does a single merge unit, if the merge
+ * is allowed to proceed (@see castle_da_merge_wait_event()). Units which ran out of budget
+ * are resumed.
+ *
+ * @return 1 if a merge unit was done, 0 otherwise
+ */
+static int castle_merge_sched_slot_run(struct castle_double_array *da, int level)
+{
+    struct castle_component_tree **in_trees;
+    struct castle_da_merge *merge;
+    int nr_trees, ret;
+
+    merge = da->levels[level].merge.sched_merge;
+    if (!merge)
+    {
+        if (castle_merge_sched_slot_start(da, level))
+            return 0;
+        merge = da->levels[level].merge.sched_merge;
+    }
+
+    /* Check whether we are allowed to do next unit of merge. */
+    if (!merge->unit_yielded && !castle_da_merge_wait_event(da, level))
+        return 0;
+
+    ret = castle_da_merge_unit_run(merge);
+    if (ret == EAGAIN)
+        return 1;
+    /* Out of budget, let the worker try other slots. */
+    if (ret == EBUSY)
+        return 0;
+
+    /* Merge finished, aborted or failed. */
+    in_trees = merge->in_trees;
+    nr_trees = merge->nr_trees;
+    da->levels[level].merge.sched_merge = NULL;
+    ret = castle_da_merge_end(merge, ret);
+    castle_merge_sched_merge_done(da, level, nr_trees, in_trees, ret);
 
-        /* Do the merge.  If it fails, retry after 10s (unless it's a merge abort). */
-        ret = castle_da_merge_do(da, 2, in_trees, level);
-        if (ret == -ESHUTDOWN)
-            /* Merge has been aborted. */
-            goto __again;
-        else if (ret)
+    return 1;
+}
+
+/**
+ * Pick the most urgent merge slot not yet tried in this scheduling round, and claim it.
+ *
+ * @param round     [in]  scheduling round of the calling worker
+ * @param da_p      [out] doubling array of the claimed slot
+ * @param level_p   [out] level of the claimed slot
+ *
+ * @return 1 if a slot was claimed, 0 otherwise
+ */
+static int castle_merge_sched_pick(uint32_t round,
+                                   struct castle_double_array **da_p,
+                                   int *level_p)
+{
+    struct castle_double_array *da;
+    struct list_head *l;
+    int level, priority, best;
+
+    best = 0;
+    spin_lock(&castle_merge_sched_lock);
+    list_for_each(l, &castle_merge_sched_das)
+    {
+        da = list_entry(l, struct castle_double_array, merge_sched_list);
+        for (level=0; level<MAX_DA_LEVEL-1; level++)
         {
-            /* Merge failed, wait 10s to retry. */
-            msleep_interruptible(10000);
-            goto __again;
+            if (da->levels[level].merge.sched_round == round)
+                continue;
+
+            priority = castle_merge_sched_slot_priority(da, level);
+            if (priority > best)
+            {
+                best     = priority;
+                *da_p    = da;
+                *level_p = level;
+            }
+        }
+    }
+    if (best)
+    {
+        (*da_p)->levels[*level_p].merge.sched_claimed = 1;
+        (*da_p)->levels[*level_p].merge.sched_round   = round;
+    }
+    spin_unlock(&castle_merge_sched_lock);
+
+    return (best > 0);
+}
+
+static void castle_merge_sched_release(struct castle_double_array *da, int level)
+{
+    spin_lock(&castle_merge_sched_lock);
+    BUG_ON(!da->levels[level].merge.sched_claimed);
+    da->levels[level].merge.sched_claimed = 0;
+    spin_unlock(&castle_merge_sched_lock);
+}
+
+/**
+ * Unregister DAs which are exiting and have no merges in flight.
+ *
+ * Drops the references taken by castle_da_merge_start(), which may free deleted DAs.
+ */
+static void castle_merge_sched_reap(void)
+{
+    struct castle_double_array *da;
+    struct list_head *l, *t;
+    LIST_HEAD(reaped);
+    int level, busy;
+
+    spin_lock(&castle_merge_sched_lock);
+    list_for_each_safe(l, t, &castle_merge_sched_das)
+    {
+        da = list_entry(l, struct castle_double_array, merge_sched_list);
+        if (!exit_cond)
+            continue;
+
+        for (busy=0, level=0; level<MAX_DA_LEVEL-1; level++)
+            busy |= da->levels[level].merge.sched_claimed ||
+                    (da->levels[level].merge.sched_merge != NULL);
+        if (!busy)
+            list_move(&da->merge_sched_list, &reaped);
+    }
+    spin_unlock(&castle_merge_sched_lock);
+
+    list_for_each_safe(l, t, &reaped)
+    {
+        da = list_entry(l, struct castle_double_array, merge_sched_list);
+        list_del_init(&da->merge_sched_list);
+        debug("Merges stopped for DA=%d.\n", da->id);
+        /* castle_da_merge_start() took a reference for us, we have to drop it now. */
+        castle_da_put(da);
+    }
+}
+
+/**
+ * Merge worker thread. Workers are shared by all DAs.
+ *
+ * Each scheduling round tries merge slots in order of urgency, until one of them makes
+ * progress. If none does, the worker sleeps until merge state changes.
+ */
+static int castle_merge_sched_worker(void *unused)
+{
+    struct castle_double_array *da;
+    int level, gen, worked;
+    uint32_t round;
+
+    debug("Starting merge thread.\n");
+    while (!kthread_should_stop())
+    {
+        gen = atomic_read(&castle_merge_sched_gen);
+
+        spin_lock(&castle_merge_sched_lock);
+        round = ++castle_merge_sched_round;
+        spin_unlock(&castle_merge_sched_lock);
+
+        castle_merge_sched_reap();
+
+        worked = 0;
+        while (!worked && castle_merge_sched_pick(round, &da, &level))
+        {
+            worked = castle_merge_sched_slot_run(da, level);
+            castle_merge_sched_release(da, level);
+        }
+        if (worked)
+            continue;
+
+        /* Timeout makes sure failed merges get retried. */
+        wait_event_interruptible_timeout(castle_merge_sched_wq,
+                                         kthread_should_stop() ||
+                                         (atomic_read(&castle_merge_sched_gen) != gen),
+                                         HZ);
+    }
+    debug("Merge thread exiting.\n");
+
+    return 0;
+}
+
+static void castle_merge_sched_workers_stop(void)
+{
+    while (castle_merge_sched_nr_workers > 0)
+        kthread_stop(castle_merge_sched_workers[--castle_merge_sched_nr_workers]);
+}
+
+static int castle_merge_sched_workers_start(void)
+{
+    struct task_struct *worker;
+    int i, nr_workers;
+
+    nr_workers = castle_merge_workers;
+    if (nr_workers < 1)
+        nr_workers = 1;
+    if (nr_workers > CASTLE_MERGE_WORKERS_MAX)
+        nr_workers = CASTLE_MERGE_WORKERS_MAX;
+
+    for (i=0; i<nr_workers; i++)
+    {
+        worker = kthread_run(castle_merge_sched_worker, NULL, "castle-m-%.2d", i);
+        if (IS_ERR(worker))
+        {
+            castle_merge_sched_workers_stop();
+            return PTR_ERR(worker);
+        }
+        set_user_nice(worker, castle_nice_value + 15);
+        castle_merge_sched_workers[castle_merge_sched_nr_workers++] = worker;
+    }
+    castle_printk(LOG_INIT, "Started %d merge threads.\n", nr_workers);
+
+    return 0;
+}
+
+/**
+ * Show merge scheduler queue.
+ *
+ * Format:
+ * ------
+ *
+ * " One row for scheduler stats
+ * <nr of workers> <bandwidth cap (MB/s)> <remaining bandwidth budget (bytes)>
+ *
+ * " One row for each merge slot with merge work
+ * <DA id> <level> <running|parked|backoff|waiting> <urgency> <units done> <units> <nr of trees>
+ */
+ssize_t castle_da_merge_sched_print(char *buf)
+{
+    struct castle_double_array *da;
+    struct list_head *l;
+    unsigned long retry;
+    const char *state;
+    int level, urgency;
+    ssize_t len;
+
+    spin_lock(&castle_merge_sched_lock);
+    len = snprintf(buf, PAGE_SIZE, "%d %d %ld\n",
+                   castle_merge_sched_nr_workers,
+                   castle_merge_bandwidth_cap,
+                   (long)atomic64_read(&castle_merge_bw_budget));
+    list_for_each(l, &castle_merge_sched_das)
+    {
+        da = list_entry(l, struct castle_double_array, merge_sched_list);
+        for (level=0; level<MAX_DA_LEVEL-1; level++)
+        {
+            urgency = castle_da_merge_urgency(da, level);
+            retry   = da->levels[level].merge.sched_retry;
+
+            if (da->levels[level].merge.sched_claimed)
+                state = "running";
+            else if (da->levels[level].merge.sched_merge)
+                state = "parked";
+            else if (urgency && retry && time_before(jiffies, retry))
+                state = "backoff";
+            else if (urgency)
+                state = "waiting";
+            else
+                continue;
+
+            len += snprintf(buf + len, PAGE_SIZE - len, "%u %d %s %d %u %u %d\n",
+                            da->id,
+                            level,
+                            state,
+                            urgency,
+                            da->levels[level].merge.units_commited,
+                            castle_da_merge_units_total(da, level),
+                            da->levels[level].nr_trees);
+            if (len >= PAGE_SIZE)
+            {
+                len = PAGE_SIZE - 1;
+                goto out;
+            }
         }
+    }
+out:
+    spin_unlock(&castle_merge_sched_lock);
 
-        continue;
-__again:
-        atomic_dec(&da->ongoing_merges);
-        if (ret == -ESHUTDOWN)
-            goto exit_thread;
-    } while(1);
-exit_thread:
-    debug_merges("Merge thread exiting.\n");
-
-    write_lock(&da->lock);
-    /* Remove ourselves from the da merge threads array to indicate that we are finished. */
-    da->levels[level].merge.thread = NULL;
-    write_unlock(&da->lock);
-    /* castle_da_alloc() took a reference for us, we have to drop it now. */
-    castle_da_put(da);
-
-    return 0;
+    return len;
 }
 
-static int __castle_da_threads_priority_set(struct castle_double_array *da, void *_value);
-
+/**
+ * Register DA with the merge scheduler.
+ *
+ * Takes a DA reference, dropped once the DA exits (@see castle_merge_sched_reap()).
+ */
 static int castle_da_merge_start(struct castle_double_array *da, void *unused)
 {
-    int i;
-
-    /* Wake up all of the merge threads. */
-    for(i=0; i<MAX_DA_LEVEL-1; i++)
-        wake_up_process(da->levels[i].merge.thread);
+    spin_lock(&castle_merge_sched_lock);
+    if (list_empty(&da->merge_sched_list))
+    {
+        castle_da_get(da);
+        list_add_tail(&da->merge_sched_list, &castle_merge_sched_das);
+    }
+    spin_unlock(&castle_merge_sched_lock);
 
-    __castle_da_threads_priority_set(da, &castle_nice_value);
+    castle_merge_sched_wake();
 
     return 0;
 }
 
 static int castle_da_merge_stop(struct castle_double_array *da, void *unused)
 {
-    int i;
-
     /* castle_da_exiting should have been set by now. */
     BUG_ON(!exit_cond);
-    wake_up(&da->merge_waitq);
-    for(i=0; i<MAX_DA_LEVEL-1; i++)
-    {
-        while(da->levels[i].merge.thread)
-            msleep(10);
-        castle_printk(LOG_INIT, "Stopped merge thread for DA=%d, level=%d\n", da->id, i);
-    }
+    castle_merge_sched_wake();
+    while(!list_empty(&da->merge_sched_list))
+        msleep(10);
+    castle_printk(LOG_INIT, "Stopped merges for DA=%d\n", da->id);
 
     return 0;
 }
@@ -5880,10 +7848,11 @@ static int castle_da_merge_restart(struct castle_double_array *da, void *unused)
             castle_printk(LOG_PERF, "Enabling inserts on da=%d.\n", da->id);
             castle_trace_da(TRACE_END, TRACE_DA_INSERTS_DISABLED_ID, da->id, 0);
         }
-        da->ios_rate = INT_MAX;
+        /* Admit inserts at the rate set by the rate controller. */
+        da->ios_rate = da->rate_ctrl.ios_rate;
     }
     write_unlock(&da->lock);
-    wake_up(&da->merge_waitq);
+    castle_merge_sched_wake();
 
     return 0;
 }
@@ -5952,6 +7921,15 @@ int castle_double_array_okey_cpu_index(c_vl_okey_t *okey, uint32_t key_len)
     return seed % castle_double_array_request_cpus();
 }
 
+/**
+ * Get cpu_index for a btree key, the same as castle_double_array_okey_cpu_index() returns
+ * for the corresponding object key.
+ */
+int castle_double_array_bkey_cpu_index(c_vl_bkey_t *bkey)
+{
+    return castle_object_btree_key_dims_hash(bkey) % castle_double_array_request_cpus();
+}
+
 /**
  * Get cpu id for specified cpu_index.
  *
@@ -5994,7 +7972,10 @@ static int castle_da_wait_queue_create(struct castle_double_array *da, void *unu
         spin_lock_init(&da->ios_waiting[i].lock);
         INIT_LIST_HEAD(&da->ios_waiting[i].list);
         CASTLE_INIT_WORK(&da->ios_waiting[i].work, castle_da_queue_kick);
+        setup_timer(&da->ios_waiting[i].timer, castle_da_write_timer_fire,
+                    (unsigned long)&da->ios_waiting[i]);
         da->ios_waiting[i].cnt = 0;
+        da->ios_waiting[i].next_admit = 0;
         da->ios_waiting[i].da = da;
     }
 
@@ -6066,17 +8047,18 @@ static void castle_da_merge_serdes_out_tree_check(struct castle_dmserlist_entry
  *
  * @param da    Doubling array for deallocate
  *
- * - Merge threads
+ * - Merge serdes state
  * - IO wait queues
  */
 static void castle_da_dealloc(struct castle_double_array *da)
 {
     int i; /* DA level */
     BUG_ON(!da);
+    /* Merge scheduler holds a reference, it must have let go of the DA by now. */
+    BUG_ON(!list_empty(&da->merge_sched_list));
     for (i=0; i<MAX_DA_LEVEL-1; i++)
     {
-        if(da->levels[i].merge.thread != NULL)
-            kthread_stop(da->levels[i].merge.thread);
+        BUG_ON(da->levels[i].merge.sched_merge);
 
         /* if we have merge state, must have an associated output tree... */
         if(da->levels[i].merge.serdes.mstore_entry)
@@ -6112,7 +8094,11 @@ static void castle_da_dealloc(struct castle_double_array *da)
 
     }
     if (da->ios_waiting)
+    {
+        for (i = 0; i < castle_double_array_request_cpus(); i++)
+            del_timer_sync(&da->ios_waiting[i].timer);
         castle_free(da->ios_waiting);
+    }
     if (da->t0_lfs)
         castle_free(da->t0_lfs);
     /* Poison and free (may be repoisoned on debug kernel builds). */
@@ -6134,22 +8120,38 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id)
     da->id              = da_id;
     da->root_version    = INVAL_VERSION;
     rwlock_init(&da->lock);
+    INIT_LIST_HEAD(&da->merge_sched_list);
     da->flags           = 0;
     da->nr_trees        = 0;
     atomic_set(&da->ref_cnt, 1);
     da->attachment_cnt  = 0;
     atomic_set(&da->ios_waiting_cnt, 0);
+    atomic_set(&da->batches, 0);
+    atomic_set(&da->batch_seq, 0);
+    spin_lock_init(&da->batch_waiting_lock);
+    INIT_LIST_HEAD(&da->batch_waiting);
     if (castle_da_wait_queue_create(da, NULL) != EXIT_SUCCESS)
         goto err_out;
     atomic_set(&da->ios_budget, 0);
     da->ios_rate        = 0;
     da->top_level       = 0;
     atomic_set(&da->nr_del_versions, 0);
+    atomic_set(&da->nr_range_tombstones, 0);
     /* For existing double arrays driver merge has to be reset after loading it. */
     da->driver_merge    = -1;
     da->compaction_ct_seq = INVAL_TREE;
+    da->compaction_policy = CASTLE_COMPACTION_DOUBLING;
+    atomic64_set(&da->inserted_entries, 0);
+    atomic64_set(&da->merged_entries, 0);
+    atomic64_set(&da->moved_trees, 0);
     atomic_set(&da->epoch_ios, 0);
-    atomic_set(&da->merge_budget, 0);
+    atomic_set(&da->epoch_ios_wait, 0);
+    atomic_set(&da->merge_budget, CASTLE_MERGE_PACE_MAX);
+    da->rate_ctrl.error         = 0;
+    da->rate_ctrl.ios_rate      = INT_MAX;
+    da->rate_ctrl.merge_pace    = CASTLE_MERGE_PACE_MAX;
+    da->rate_ctrl.write_wait_us = 0;
+    da->rate_ctrl.write_delay_us = 0;
     atomic_set(&da->ongoing_merges, 0);
 
     atomic_set(&da->lfs_victim_count, 0);
@@ -6162,8 +8164,6 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id)
         castle_da_lfs_ct_reset(&da->t0_lfs[i]);
     }
 
-    init_waitqueue_head(&da->merge_waitq);
-    init_waitqueue_head(&da->merge_budget_waitq);
     /* Initialise the merge tokens list. */
     INIT_LIST_HEAD(&da->merge_tokens);
     for(i=0; i<MAX_DA_LEVEL-1; i++)
@@ -6188,24 +8188,22 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id)
         da->levels[i].merge.active_token   = NULL;
         da->levels[i].merge.driver_token   = NULL;
         da->levels[i].merge.units_commited = 0;
-        da->levels[i].merge.thread         = NULL;
+        da->levels[i].merge.sched_merge    = NULL;
+        da->levels[i].merge.sched_claimed  = 0;
+        da->levels[i].merge.sched_round    = 0;
+        da->levels[i].merge.sched_retry    = 0;
+        /* Total merges are not deamortised. */
+        da->levels[i].merge.deamortize     = (i != BIG_MERGE);
+        atomic64_set(&da->levels[i].size, 0);
 
         /* Low free space structure. */
         da->levels[i].lfs.da = da;
         castle_da_lfs_ct_reset(&da->levels[i].lfs);
-
-        /* Create merge threads, and take da ref for all levels >= 1. */
-        castle_da_get(da);
-        da->levels[i].merge.thread =
-            kthread_create((i == BIG_MERGE)? castle_da_big_merge_run: castle_da_merge_run,
-                           da, "castle-m-%d-%.2d", da_id, i);
-
-        if(!da->levels[i].merge.thread)
-            goto err_out;
     }
     /* allocate top-level */
     INIT_LIST_HEAD(&da->levels[MAX_DA_LEVEL-1].trees);
     da->levels[MAX_DA_LEVEL-1].nr_trees = 0;
+    atomic64_set(&da->levels[MAX_DA_LEVEL-1].size, 0);
     da->levels[MAX_DA_LEVEL-1].lfs.da   = da;
     castle_da_lfs_ct_reset(&da->levels[MAX_DA_LEVEL-1].lfs);
 
@@ -6214,26 +8212,35 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id)
     return da;
 
 err_out:
-#ifdef CASTLE_DEBUG
-    {
-        int j;
-        for(j=0; j<MAX_DA_LEVEL-1; j++)
-        {
-            BUG_ON((j<i)  && (da->levels[j].merge.thread == NULL));
-            BUG_ON((j>=i) && (da->levels[j].merge.thread != NULL));
-        }
-    }
-#endif
     castle_da_dealloc(da);
 
     return NULL;
 }
 
+/**
+ * Set up level merges for the DA compaction policy.
+ *
+ * Leveled merges take a variable number of trees, they are not deamortised. Level 1 merges
+ * two trees under both policies.
+ *
+ * WARNING: Merges must not be in flight (@see castle_double_array_compaction_policy_set()).
+ */
+static void castle_da_compaction_policy_apply(struct castle_double_array *da)
+{
+    int i;
+
+    for (i=2; i<MAX_DA_LEVEL; i++)
+        da->levels[i].merge.deamortize = !castle_da_leveled(da);
+}
+
 void castle_da_marshall(struct castle_dlist_entry *dam,
                         struct castle_double_array *da)
 {
-    dam->id           = da->id;
-    dam->root_version = da->root_version;
+    memset(dam, 0, sizeof(struct castle_dlist_entry));
+    dam->magic             = DLIST_ENTRY_MAGIC;
+    dam->id                = da->id;
+    dam->root_version      = da->root_version;
+    dam->compaction_policy = da->compaction_policy;
 }
 
 static void castle_da_unmarshall(struct castle_double_array *da,
@@ -6241,6 +8248,10 @@ static void castle_da_unmarshall(struct castle_double_array *da,
 {
     da->id           = dam->id;
     da->root_version = dam->root_version;
+    /* DAs from older filesystems keep the default policy. */
+    if ((dam->magic == DLIST_ENTRY_MAGIC) && (dam->compaction_policy < CASTLE_COMPACTION_POLICIES))
+        da->compaction_policy = dam->compaction_policy;
+    castle_da_compaction_policy_apply(da);
     castle_sysfs_da_add(da);
 }
 
@@ -6317,6 +8328,9 @@ static void castle_component_tree_add(struct castle_double_array *da,
     list_add(&ct->da_list, head);
     da->levels[ct->level].nr_trees++;
     da->nr_trees++;
+    atomic_add(castle_ct_range_tombstones_count(ct), &da->nr_range_tombstones);
+    if (!ct->dynamic)
+        atomic64_add(castle_ct_bytes_used(ct), &da->levels[ct->level].size);
 
     if (ct->level > da->top_level)
     {
@@ -6345,6 +8359,9 @@ static void castle_component_tree_del(struct castle_double_array *da,
     else
         da->levels[ct->level].nr_trees--;
     da->nr_trees--;
+    atomic_sub(castle_ct_range_tombstones_count(ct), &da->nr_range_tombstones);
+    if (!ct->dynamic)
+        atomic64_sub(castle_ct_bytes_used(ct), &da->levels[ct->level].size);
 }
 
 /**
@@ -6368,13 +8385,113 @@ static void castle_ct_large_obj_writeback(struct castle_large_obj_entry *lo,
 {
     struct castle_lolist_entry mstore_entry;
 
-    mstore_entry.ext_id = lo->ext_id;
-    mstore_entry.length = lo->length;
-    mstore_entry.ct_seq = ct->seq;
+    memset(&mstore_entry, 0, sizeof(struct castle_lolist_entry));
+    mstore_entry.ext_id    = lo->ext_id;
+    mstore_entry.length    = lo->length;
+    mstore_entry.ct_seq    = ct->seq;
+
+    castle_mstore_entry_insert(castle_lo_store, &mstore_entry);
+}
+
+/**
+ * Value extents are stored in the large objects mstore, marked with value_ext.
+ */
+static void castle_ct_value_ext_writeback(struct castle_value_ext_entry *entry,
+                                          struct castle_component_tree *ct)
+{
+    struct castle_lolist_entry mstore_entry;
+
+    memset(&mstore_entry, 0, sizeof(struct castle_lolist_entry));
+    mstore_entry.ext_id    = entry->ext_id;
+    mstore_entry.length    = entry->size;
+    mstore_entry.ct_seq    = ct->seq;
+    mstore_entry.value_ext = LOLIST_VALUE_EXT_MAGIC;
+    mstore_entry.live      = entry->live;
 
     castle_mstore_entry_insert(castle_lo_store, &mstore_entry);
 }
 
+/**
+ * Range tombstones are stored in their own mstore, with the seq of the CT holding them.
+ */
+static void castle_ct_range_tombstone_writeback(struct castle_range_tombstone *rt,
+                                                struct castle_component_tree *ct)
+{
+    /* Too big for the stack, checkpoints are serialised by CASTLE_TRANSACTION. */
+    static struct castle_rtlist_entry rt_mstore_entry;
+    struct castle_rtlist_entry *mstore_entry = &rt_mstore_entry;
+
+    BUG_ON(!CASTLE_IN_TRANSACTION);
+    memset(mstore_entry, 0, sizeof(struct castle_rtlist_entry));
+    mstore_entry->ct_seq     = ct->seq;
+    mstore_entry->version    = rt->version;
+    mstore_entry->cpu_index  = rt->cpu_index;
+    mstore_entry->nr_cpus    = rt->nr_cpus;
+    mstore_entry->origin_seq = rt->origin_seq;
+    memcpy(mstore_entry->start_key, rt->start_key, rt->start_key->length + 4);
+    memcpy(mstore_entry->end_key, rt->end_key, rt->end_key->length + 4);
+
+    castle_mstore_entry_insert(castle_rt_store, mstore_entry);
+}
+
+static int castle_ct_value_ext_add(struct castle_component_tree *ct,
+                                   c_ext_id_t ext_id,
+                                   uint64_t size,
+                                   uint64_t live)
+{
+    struct castle_value_ext_entry *entry;
+
+    if (EXT_ID_INVAL(ext_id))
+        return -EINVAL;
+
+    entry = castle_malloc(sizeof(struct castle_value_ext_entry), GFP_KERNEL);
+    if (!entry)
+        return -ENOMEM;
+
+    entry->ext_id = ext_id;
+    entry->size   = size;
+    entry->live   = live;
+    list_add(&entry->list, &ct->value_exts);
+
+    return 0;
+}
+
+/**
+ * Drop references to all value extents of a CT. Extents get freed once no other CT
+ * references them.
+ */
+static void castle_ct_value_exts_remove(struct list_head *value_exts)
+{
+    struct list_head *lh, *tmp;
+
+    list_for_each_safe(lh, tmp, value_exts)
+    {
+        struct castle_value_ext_entry *entry =
+                            list_entry(lh, struct castle_value_ext_entry, list);
+
+        list_del(&entry->list);
+        castle_extent_free(entry->ext_id);
+        castle_free(entry);
+    }
+}
+
+/**
+ * Checks whether medium objects of ct may live in extent ext_id.
+ */
+int castle_ct_value_ext_contains(struct castle_component_tree *ct, c_ext_id_t ext_id)
+{
+    struct list_head *lh;
+
+    if (ct->data_ext_free.ext_id == ext_id)
+        return 1;
+
+    list_for_each(lh, &ct->value_exts)
+        if (list_entry(lh, struct castle_value_ext_entry, list)->ext_id == ext_id)
+            return 1;
+
+    return 0;
+}
+
 static void __castle_ct_large_obj_remove(struct list_head *lh)
 {
     struct castle_large_obj_entry *lo = list_entry(lh, struct castle_large_obj_entry, list);
@@ -6455,6 +8572,130 @@ int castle_ct_large_obj_add(c_ext_id_t              ext_id,
     return 0;
 }
 
+/**
+ * Read the key at idx (or the last key, if idx is negative) of the leaf node at cep, and
+ * return a duplicate of it.
+ */
+static void* castle_ct_leaf_key_get(struct castle_component_tree *ct, c_ext_pos_t cep, int idx)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    struct castle_btree_node *node;
+    c2_block_t *c2b;
+    c_val_tup_t cvt;
+    c_ver_t version;
+    void *key = NULL;
+
+    c2b = castle_cache_block_get(cep, btree->node_size(ct, 0));
+    write_lock_c2b(c2b);
+    if(!c2b_uptodate(c2b))
+        BUG_ON(submit_c2b_sync(READ, c2b));
+    node = c2b_bnode(c2b);
+    BUG_ON(!node->is_leaf);
+    if (node->used > 0)
+    {
+        btree->entry_get(node, idx < 0 ? node->used - 1 : idx, &key, &version, &cvt);
+        key = btree->key_duplicate(key);
+    }
+    write_unlock_c2b(c2b);
+    put_c2b(c2b);
+
+    return key;
+}
+
+/**
+ * Make the key bounds of a merged CT available in memory.
+ *
+ * Only the positions of the first and last leaf nodes are stored on disk, the keys
+ * themselves are read in (and cached) when the CT is loaded, or the first time the bounds
+ * are asked for if that failed.
+ *
+ * @return 0 if ct->min_key and ct->max_key are set, -ENOENT/-ENOMEM otherwise
+ */
+static int castle_ct_key_bounds_get(struct castle_component_tree *ct)
+{
+    struct castle_btree_type *btree;
+    void *min_key, *max_key;
+
+    BUG_ON(in_atomic());
+    if (ct->min_key && ct->max_key)
+        return 0;
+    if (ct->dynamic || EXT_POS_INVAL(ct->first_leaf) || EXT_POS_INVAL(ct->last_leaf))
+        return -ENOENT;
+
+    btree = castle_btree_type_get(ct->btree_type);
+    max_key = castle_ct_leaf_key_get(ct, ct->last_leaf, -1);
+    min_key = castle_ct_leaf_key_get(ct, ct->first_leaf, 0);
+    if (!min_key || !max_key)
+        goto err_out;
+
+    /* Lookups check min_key first, make sure max_key is visible by then. Bounds may be
+       loaded by two threads at once, drop our copy if we lost the race. */
+    if (cmpxchg(&ct->max_key, NULL, max_key) != NULL)
+        btree->key_dealloc(max_key);
+    smp_wmb();
+    if (cmpxchg(&ct->min_key, NULL, min_key) != NULL)
+        btree->key_dealloc(min_key);
+
+    return 0;
+
+err_out:
+    if (min_key) btree->key_dealloc(min_key);
+    if (max_key) btree->key_dealloc(max_key);
+
+    return -ENOMEM;
+}
+
+/**
+ * Free the cached key bounds of ct, if there are any.
+ */
+static void castle_ct_key_bounds_free(struct castle_component_tree *ct)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+
+    if (ct->min_key)
+        btree->key_dealloc(ct->min_key);
+    if (ct->max_key)
+        btree->key_dealloc(ct->max_key);
+    ct->min_key = ct->max_key = NULL;
+}
+
+/**
+ * Checks whether key may be present in ct, judging by the cached key bounds.
+ *
+ * Never blocks, CTs which do not have their bounds in memory are always searched.
+ */
+static int castle_ct_key_in_bounds(struct castle_component_tree *ct, void *key)
+{
+    struct castle_btree_type *btree;
+    void *min_key = ct->min_key;
+
+    if (!min_key)
+        return 1;
+    smp_rmb();
+    btree = castle_btree_type_get(ct->btree_type);
+
+    return (btree->key_compare(key, min_key) >= 0) &&
+           (btree->key_compare(key, ct->max_key) <= 0);
+}
+
+/**
+ * Checks whether the key ranges of two CTs overlap.
+ *
+ * @return 0 if the CTs are known to be disjoint, 1 otherwise
+ */
+static int castle_ct_key_bounds_overlap(struct castle_component_tree *ct1,
+                                        struct castle_component_tree *ct2)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct1->btree_type);
+
+    if (castle_ct_key_bounds_get(ct1) || castle_ct_key_bounds_get(ct2))
+        return 1;
+    BUG_ON(ct1->btree_type != ct2->btree_type);
+
+    return (btree->key_compare(ct1->max_key, ct2->min_key) >= 0) &&
+           (btree->key_compare(ct2->max_key, ct1->min_key) >= 0);
+}
+
 /**
  * Get a reference to the CT.
  *
@@ -6496,6 +8737,8 @@ void castle_ct_put(struct castle_component_tree *ct, int write)
     debug("Releasing freespace occupied by ct=%d\n", ct->seq);
     /* Freeing all large objects. */
     castle_ct_large_objs_remove(&ct->large_objs);
+    castle_ct_value_exts_remove(&ct->value_exts);
+    castle_range_tombstones_free(&ct->range_tombstones);
 
     /* Free the extents. */
     castle_ext_freespace_fini(&ct->internal_ext_free);
@@ -6504,6 +8747,8 @@ void castle_ct_put(struct castle_component_tree *ct, int write)
 
     if (ct->bloom_exists)
         castle_bloom_destroy(&ct->bloom);
+    castle_ct_key_bounds_free(ct);
+    castle_memtable_destroy(ct);
 
     /* Poison ct (note this will be repoisoned by kfree on kernel debug build. */
     memset(ct, 0xde, sizeof(struct castle_component_tree));
@@ -6560,9 +8805,9 @@ static void __castle_da_level0_modified_promote(struct work_struct *work)
     {
         ct = castle_da_rwct_get(da, cpu_index);
 
-        /* Promote level 0 CTs if they contain items.
+        /* Promote level 0 CTs if they contain items or range tombstones.
          * CTs at level 1 will be written to disk by the checkpoint thread. */
-        if (atomic64_read(&ct->item_count) != 0)
+        if (atomic64_read(&ct->item_count) != 0 || !list_empty(&ct->range_tombstones))
         {
             castle_printk(LOG_INFO, "Promote for DA 0x%x level 0 RWCT seq %u (has %ld items)\n",
                     da->id, ct->seq, atomic64_read(&ct->item_count));
@@ -6627,10 +8872,15 @@ void castle_da_ct_marshall(struct castle_clist_entry *ctm,
 {
     int i;
 
+    /* Unused fields must read back as zero, whatever later formats make of them. */
+    memset(ctm, 0, sizeof(struct castle_clist_entry));
+    ctm->magic             = CLIST_ENTRY_MAGIC;
     ctm->da_id             = ct->da;
     ctm->item_count        = atomic64_read(&ct->item_count);
+    ctm->nr_tombstones     = ct->nr_tombstones;
     ctm->btree_type        = ct->btree_type;
     ctm->dynamic           = ct->dynamic;
+    ctm->memtable          = ct->memtable != NULL;
     ctm->seq               = ct->seq;
     ctm->level             = ct->level;
     ctm->tree_depth        = ct->tree_depth;
@@ -6646,6 +8896,10 @@ void castle_da_ct_marshall(struct castle_clist_entry *ctm,
     ctm->bloom_exists = ct->bloom_exists;
     if (ct->bloom_exists)
         castle_bloom_marshall(&ct->bloom, ctm);
+
+    ctm->leaf_bounds_exist = !EXT_POS_INVAL(ct->first_leaf) && !EXT_POS_INVAL(ct->last_leaf);
+    ctm->first_leaf        = ct->first_leaf;
+    ctm->last_leaf         = ct->last_leaf;
 }
 
 /**
@@ -6662,6 +8916,8 @@ static c_da_t castle_da_ct_unmarshall(struct castle_component_tree *ct,
     atomic_set(&ct->ref_count, 1);
     atomic_set(&ct->write_ref_count, 0);
     atomic64_set(&ct->item_count, ctm->item_count);
+    /* Not counted by older filesystems, merging the tree counts them again. */
+    ct->nr_tombstones       = (ctm->magic == CLIST_ENTRY_MAGIC) ? ctm->nr_tombstones : 0;
     ct->btree_type          = ctm->btree_type;
     ct->dynamic             = ctm->dynamic;
     ct->da                  = ctm->da_id;
@@ -6684,9 +8940,26 @@ static c_da_t castle_da_ct_unmarshall(struct castle_component_tree *ct,
     ct->da_list.next = NULL;
     ct->da_list.prev = NULL;
     INIT_LIST_HEAD(&ct->large_objs);
+    INIT_LIST_HEAD(&ct->value_exts);
+    INIT_LIST_HEAD(&ct->range_tombstones);
     ct->bloom_exists = ctm->bloom_exists;
-    if (ctm->bloom_exists)
-        castle_bloom_unmarshall(&ct->bloom, ctm);
+    if (ctm->bloom_exists && castle_bloom_unmarshall(&ct->bloom, ctm))
+    {
+        castle_printk(LOG_WARN, "Invalid bloom filter for CT %u, dropping it.\n", ct->seq);
+        ct->bloom_exists = 0;
+    }
+    /* Key bounds are read in by the caller, @see castle_ct_key_bounds_get(). */
+    ct->first_leaf = INVAL_EXT_POS;
+    ct->last_leaf  = INVAL_EXT_POS;
+    if ((ctm->magic == CLIST_ENTRY_MAGIC) && ctm->leaf_bounds_exist)
+    {
+        ct->first_leaf = ctm->first_leaf;
+        ct->last_leaf  = ctm->last_leaf;
+    }
+    ct->min_key    = NULL;
+    ct->max_key    = NULL;
+    /* Memtables get rebuilt from their WAL by the caller. */
+    ct->memtable   = NULL;
     /* Pre-warm cache for T0 btree extents. */
     if (ct->level == 0)
     {
@@ -6791,6 +9064,14 @@ static int castle_ct_hash_destroy_check(struct castle_component_tree *ct, void *
        list_del(lh);
        castle_free(lo);
    }
+   list_for_each_safe(lh, t, &ct->value_exts)
+   {
+       struct castle_value_ext_entry *entry =
+                list_entry(lh, struct castle_value_ext_entry, list);
+       list_del(lh);
+       castle_free(entry);
+   }
+   castle_range_tombstones_free(&ct->range_tombstones);
 
     return 0;
 }
@@ -6803,6 +9084,10 @@ static int castle_da_ct_dealloc(struct castle_double_array *da,
     castle_ct_hash_destroy_check(ct, (void*)0UL);
     list_del(&ct->da_list);
     list_del(&ct->hash_list);
+    if (ct->bloom_exists)
+        castle_bloom_release(&ct->bloom);
+    castle_ct_key_bounds_free(ct);
+    castle_memtable_destroy(ct);
     castle_free(ct);
 
     return 0;
@@ -6895,6 +9180,15 @@ mstore_writeback:
     }
     mutex_unlock(&ct->lo_mutex);
 
+    /* No need for lo_mutex, value extents don't change once CT is in the DA. */
+    list_for_each(lh, &ct->value_exts)
+        castle_ct_value_ext_writeback(list_entry(lh, struct castle_value_ext_entry, list), ct);
+
+    /* Range tombstones are only added to T0s, within CASTLE_TRANSACTION. */
+    list_for_each(lh, &ct->range_tombstones)
+        castle_ct_range_tombstone_writeback(list_entry(lh, struct castle_range_tombstone, list),
+                                            ct);
+
     castle_da_ct_marshall(&mstore_entry, ct);
     castle_mstore_entry_insert(castle_tree_store, &mstore_entry);
 
@@ -7128,7 +9422,8 @@ static int castle_da_writeback(struct castle_double_array *da, void *unused)
  */
 void castle_double_arrays_writeback(void)
 {
-    BUG_ON(castle_da_store || castle_tree_store || castle_lo_store || castle_dmser_store);
+    BUG_ON(castle_da_store || castle_tree_store || castle_lo_store || castle_dmser_store ||
+           castle_rt_store);
 
     castle_da_store   = castle_mstore_init(MSTORE_DOUBLE_ARRAYS,
                                          sizeof(struct castle_dlist_entry));
@@ -7138,20 +9433,25 @@ void castle_double_arrays_writeback(void)
                                          sizeof(struct castle_lolist_entry));
     castle_dmser_store= castle_mstore_init(MSTORE_DA_MERGE,
                                          sizeof(struct castle_dmserlist_entry));
+    castle_rt_store   = castle_mstore_init(MSTORE_RANGE_TOMBSTONES,
+                                         sizeof(struct castle_rtlist_entry));
 
-    if(!castle_da_store || !castle_tree_store || !castle_lo_store || !castle_dmser_store)
+    if(!castle_da_store || !castle_tree_store || !castle_lo_store || !castle_dmser_store ||
+       !castle_rt_store)
         goto out;
 
     castle_da_hash_iterate(castle_da_writeback, NULL);
     castle_da_tree_writeback(NULL, &castle_global_tree, -1, NULL);
 
 out:
+    if (castle_rt_store)    castle_mstore_fini(castle_rt_store);
     if (castle_dmser_store) castle_mstore_fini(castle_dmser_store);
     if (castle_lo_store)    castle_mstore_fini(castle_lo_store);
     if (castle_tree_store)  castle_mstore_fini(castle_tree_store);
     if (castle_da_store)    castle_mstore_fini(castle_da_store);
 
     castle_da_store = castle_tree_store = castle_lo_store = castle_dmser_store = NULL;
+    castle_rt_store = NULL;
 }
 
 #define RWCT_CHECKPOINT_FREQUENCY   (10)    /**< Checkpoint level 0 RWCTs every N checkpoints. */
@@ -7287,6 +9587,9 @@ static int castle_da_rwct_init(struct castle_double_array *da, void *unused)
  */
 int castle_double_array_start(void)
 {
+    if (castle_modlist_sort_bench > 0)
+        castle_ct_modlist_sort_bench(castle_modlist_sort_bench);
+
     /* Check all DAs to see whether any merges need to be done. */
     castle_da_hash_iterate(castle_da_merge_restart, NULL);
 
@@ -7323,6 +9626,76 @@ static int castle_da_ct_bloom_build_param_deserialise(struct castle_component_tr
     return 0;
 }
 
+/**
+ * Read range tombstones in from disk, onto the lists of their CTs.
+ *
+ * Filesystems written before range tombstones existed don't have the mstore.
+ *
+ * @also castle_ct_range_tombstone_writeback()
+ */
+static int castle_da_range_tombstones_read(void)
+{
+    struct castle_rtlist_entry *mstore_entry = NULL;
+    struct castle_mstore_iter *iterator = NULL;
+    struct castle_double_array *da;
+    struct castle_component_tree *ct;
+    struct castle_range_tombstone *rt;
+    c_mstore_key_t key;
+    int ret = -ENOMEM;
+
+    castle_rt_store = castle_mstore_open(MSTORE_RANGE_TOMBSTONES,
+                                         sizeof(struct castle_rtlist_entry));
+    if (!castle_rt_store)
+        return 0;
+
+    mstore_entry = castle_malloc(sizeof(struct castle_rtlist_entry), GFP_KERNEL);
+    if (!mstore_entry)
+        goto out;
+
+    iterator = castle_mstore_iterate(castle_rt_store);
+    if (!iterator)
+        goto out;
+
+    while (castle_mstore_iterator_has_next(iterator))
+    {
+        castle_mstore_iterator_next(iterator, mstore_entry, &key);
+        ct = castle_component_tree_get(mstore_entry->ct_seq);
+        if (!ct)
+        {
+            castle_printk(LOG_ERROR, "Found zombi range tombstone (version %u, CT %u)\n",
+                    mstore_entry->version, mstore_entry->ct_seq);
+            ret = -EINVAL;
+            goto out;
+        }
+        rt = castle_range_tombstone_alloc(mstore_entry->version,
+                                          mstore_entry->cpu_index,
+                                          mstore_entry->nr_cpus,
+                                          (c_vl_bkey_t *)mstore_entry->start_key,
+                                          (c_vl_bkey_t *)mstore_entry->end_key);
+        if (!rt)
+            goto out;
+        rt->origin_seq = mstore_entry->origin_seq;
+        /* CTs have been added to their DAs already. */
+        da = castle_da_hash_get(ct->da);
+        BUG_ON(!da);
+        write_lock(&da->lock);
+        list_add_tail(&rt->list, &ct->range_tombstones);
+        atomic_inc(&da->nr_range_tombstones);
+        write_unlock(&da->lock);
+    }
+    ret = 0;
+
+out:
+    if (iterator)
+        castle_mstore_iterator_destroy(iterator);
+    if (mstore_entry)
+        castle_free(mstore_entry);
+    castle_mstore_fini(castle_rt_store);
+    castle_rt_store = NULL;
+
+    return ret;
+}
+
 /**
  * Read doubling arrays and serialised component trees in from disk.
  *
@@ -7472,6 +9845,12 @@ int castle_double_array_read(void)
             goto error_out;
         da_id = castle_da_ct_unmarshall(ct, &mstore_centry);
         castle_ct_hash_add(ct);
+        /* Point lookups only use bounds already in memory. Not fatal, retried lazily. */
+        castle_ct_key_bounds_get(ct);
+        /* Older filesystems may have garbage in place of the memtable flag. */
+        if ((mstore_centry.magic == CLIST_ENTRY_MAGIC) && mstore_centry.memtable &&
+           (castle_memtable_create(ct) || castle_memtable_replay(ct)))
+            goto error_out;
         da = castle_da_hash_get(da_id);
         if(!da)
             goto error_out;
@@ -7508,9 +9887,22 @@ int castle_double_array_read(void)
                     mstore_loentry.ext_id, mstore_loentry.ct_seq);
             BUG();
         }
-        if (castle_ct_large_obj_add(mstore_loentry.ext_id,
-                                    mstore_loentry.length,
-                                    &ct->large_objs, NULL))
+        if (mstore_loentry.value_ext == LOLIST_VALUE_EXT_MAGIC)
+        {
+            if (castle_ct_value_ext_add(ct,
+                                        mstore_loentry.ext_id,
+                                        mstore_loentry.length,
+                                        mstore_loentry.live))
+            {
+                castle_printk(LOG_WARN, "Failed to add value extent %llu to CT: %u\n",
+                        mstore_loentry.ext_id,
+                        mstore_loentry.ct_seq);
+                goto error_out;
+            }
+        }
+        else if (castle_ct_large_obj_add(mstore_loentry.ext_id,
+                                         mstore_loentry.length,
+                                         &ct->large_objs, NULL))
         {
             castle_printk(LOG_WARN, "Failed to add Large Object %llu to CT: %u\n",
                     mstore_loentry.ext_id,
@@ -7524,6 +9916,10 @@ int castle_double_array_read(void)
     castle_mstore_iterator_destroy(iterator);
     iterator = NULL;
 
+    /* Read range tombstones. */
+    if (castle_da_range_tombstones_read())
+        goto error_out;
+
     /* Promote level 0 RWCTs if necessary. */
     castle_da_hash_iterate(castle_da_level0_check_promote, NULL);
     /* Sort all the tree lists by the sequence number */
@@ -7590,6 +9986,7 @@ static struct castle_component_tree* castle_ct_alloc(struct castle_double_array
     atomic_set(&ct->ref_count, 1);
     atomic_set(&ct->write_ref_count, 0);
     atomic64_set(&ct->item_count, 0);
+    ct->nr_tombstones   = 0;
     atomic64_set(&ct->large_ext_chk_cnt, 0);
     ct->btree_type      = type;
     ct->dynamic         = type == RW_VLBA_TREE_TYPE ? 1 : 0;
@@ -7605,11 +10002,16 @@ static struct castle_component_tree* castle_ct_alloc(struct castle_double_array
     ct->da_list.prev = NULL;
     INIT_LIST_HEAD(&ct->hash_list);
     INIT_LIST_HEAD(&ct->large_objs);
+    INIT_LIST_HEAD(&ct->value_exts);
+    INIT_LIST_HEAD(&ct->range_tombstones);
     castle_ct_hash_add(ct);
     ct->internal_ext_free.ext_id = INVAL_EXT_ID;
     ct->tree_ext_free.ext_id     = INVAL_EXT_ID;
     ct->data_ext_free.ext_id     = INVAL_EXT_ID;
     ct->bloom_exists    = 0;
+    ct->first_leaf      = INVAL_EXT_POS;
+    ct->last_leaf       = INVAL_EXT_POS;
+    ct->memtable        = NULL;
 #ifdef CASTLE_PERF_DEBUG
     ct->bt_c2bsync_ns   = 0;
     ct->data_c2bsync_ns = 0;
@@ -7720,16 +10122,26 @@ static int __castle_da_rwct_create(struct castle_double_array *da, int cpu_index
     /* Done with lfs structure; reset it. */
     castle_da_lfs_ct_reset(lfs);
 
-    /* Create a root node for this tree, and update the root version */
-    ct->tree_depth = 0;
-    c2b = castle_btree_node_create(ct,
-                                   0 /* version */,
-                                   0 /* level */,
-                                   0 /* wasn't preallocated */);
-    ct->root_node = c2b->cep;
-    ct->tree_depth = 1;
-    write_unlock_c2b(c2b);
-    put_c2b(c2b);
+    if (castle_memtables)
+    {
+        /* Memtable T0s use the tree extent for their WAL, no root node needed. */
+        ct->tree_depth = 0;
+        err = castle_memtable_create(ct);
+        if (err)    goto no_space;
+    }
+    else
+    {
+        /* Create a root node for this tree, and update the root version */
+        ct->tree_depth = 0;
+        c2b = castle_btree_node_create(ct,
+                                       0 /* version */,
+                                       0 /* level */,
+                                       0 /* wasn't preallocated */);
+        ct->root_node = c2b->cep;
+        ct->tree_depth = 1;
+        write_unlock_c2b(c2b);
+        put_c2b(c2b);
+    }
 
     if (!in_tran) CASTLE_TRANSACTION_BEGIN;
     write_lock(&da->lock);
@@ -7757,7 +10169,7 @@ static int __castle_da_rwct_create(struct castle_double_array *da, int cpu_index
 
     debug("Added component tree seq=%d, root_node="cep_fmt_str
           ", it's threaded onto da=%p, level=%d\n",
-            ct->seq, cep2str(c2b->cep), da, ct->level);
+            ct->seq, cep2str(ct->root_node), da, ct->level);
 
     FAULT(MERGE_FAULT);
 
@@ -7836,6 +10248,9 @@ int castle_double_array_make(c_da_t da_id, c_ver_t root_version)
     /* Write out the id, and the root version. */
     da->id = da_id;
     da->root_version = root_version;
+    if ((castle_compaction_policy >= 0) && (castle_compaction_policy < CASTLE_COMPACTION_POLICIES))
+        da->compaction_policy = castle_compaction_policy;
+    castle_da_compaction_policy_apply(da);
     /* Allocate all T0 RWCTs. */
     ret = castle_da_all_rwcts_create(da, LFS_VCT_T_INVALID);
     if (ret != EXIT_SUCCESS)
@@ -8076,14 +10491,71 @@ static void castle_da_bvec_queue(struct castle_double_array *da, c_bvec_t *c_bve
 {
     struct castle_da_io_wait_queue *wq = &da->ios_waiting[c_bvec->cpu_index];
 
-    BUG_ON(!spin_is_locked(&wq->lock));
+    BUG_ON(!spin_is_locked(&wq->lock));
+
+    /* Queue the bvec. */
+    list_add_tail(&c_bvec->io_list, &wq->list);
+
+    /* Increment IO waiting counters. */
+    wq->cnt++;
+    atomic_inc(&da->ios_waiting_cnt);
+}
+
+/**
+ * Decide whether the next write on a write queue may be admitted now.
+ *
+ * Writes are admitted within the DA ios_budget, and are spaced at least
+ * rate_ctrl.write_delay_us apart on each queue. Up to a jiffy worth of unused
+ * spacing is carried over, so that sub-jiffy delays still average out right.
+ * If the spacing holds the write back, the queue timer is armed to kick the
+ * queue once the write is due.
+ *
+ * WARNING: Caller must hold wq->lock.
+ *
+ * @return 1 if the write may be submitted, 0 if it has to wait
+ *
+ * @also castle_da_rate_ctrl_update()
+ */
+static int castle_da_write_admit(struct castle_double_array *da,
+                                 struct castle_da_io_wait_queue *wq)
+{
+    uint64_t now, jiffy_us;
+    int delay;
+
+    BUG_ON(!spin_is_locked(&wq->lock));
+
+    delay = da->rate_ctrl.write_delay_us;
+    if (delay > 0)
+    {
+        jiffy_us = jiffies_to_usecs(1);
+        now = get_jiffies_64() * jiffy_us;
+        if (wq->next_admit + jiffy_us < now)
+            wq->next_admit = now - jiffy_us;
+        if (wq->next_admit > now)
+        {
+            mod_timer(&wq->timer,
+                      jiffies + usecs_to_jiffies((unsigned int)(wq->next_admit - now)));
+            return 0;
+        }
+    }
+
+    if (atomic_dec_return(&da->ios_budget) < 0)
+        return 0;
 
-    /* Queue the bvec. */
-    list_add_tail(&c_bvec->io_list, &wq->list);
+    wq->next_admit += delay;
 
-    /* Increment IO waiting counters. */
-    wq->cnt++;
-    atomic_inc(&da->ios_waiting_cnt);
+    return 1;
+}
+
+/**
+ * Kick write queue once the paced write at its head is due.
+ */
+static void castle_da_write_timer_fire(unsigned long data)
+{
+    struct castle_da_io_wait_queue *wq = (struct castle_da_io_wait_queue *)data;
+
+    /* wq->work is initialised as castle_da_queue_kick(). */
+    queue_work_on(request_cpus.cpus[wq - wq->da->ios_waiting], castle_wqs[0], &wq->work);
 }
 
 /**
@@ -8099,6 +10571,7 @@ static void castle_da_bvec_queue(struct castle_double_array *da, c_bvec_t *c_bve
  *
  * @also struct castle_da_io_wait_queue
  * @also castle_da_ios_budget_replenish()
+ * @also castle_da_write_admit()
  * @also castle_da_write_bvec_start()
  */
 static void castle_da_queue_kick(struct work_struct *work)
@@ -8111,10 +10584,10 @@ static void castle_da_queue_kick(struct work_struct *work)
     /* Get as many c_bvecs as we can and place them on the submit list.
        Take them all on module exit. */
     spin_lock(&wq->lock);
-    while (((atomic_dec_return(&wq->da->ios_budget) >= 0)
-                || castle_fs_exiting
-                || castle_da_no_disk_space(wq->da))
-            && !list_empty(&wq->list))
+    while (!list_empty(&wq->list)
+            && (castle_fs_exiting
+                || castle_da_no_disk_space(wq->da)
+                || castle_da_write_admit(wq->da, wq)))
     {
         /* New IOs are queued at the end of the list.  Always pull from the
          * front of the list to preserve ordering. */
@@ -8137,6 +10610,61 @@ static void castle_da_queue_kick(struct work_struct *work)
     }
 }
 
+/**
+ * Is the entry a read found in c_bvec->tree hidden by a range tombstone?
+ *
+ * Range tombstones of c_bvec->tree and of all newer CTs get checked. Only the ones in
+ * ancestors of the read version apply.
+ *
+ * @also castle_range_tombstone_hides()
+ */
+static int castle_da_ct_read_hidden(struct castle_double_array *da, c_bvec_t *c_bvec)
+{
+    struct castle_component_tree *ct;
+    struct castle_range_tombstone *rt;
+    int i, hidden = 0;
+
+    /* Range removes racing with the read may go either side of it. */
+    if (atomic_read(&da->nr_range_tombstones) == 0)
+        return 0;
+
+    read_lock(&da->lock);
+    for (i = 0; i < MAX_DA_LEVEL; i++)
+    {
+        list_for_each_entry(ct, &da->levels[i].trees, da_list)
+        {
+            list_for_each_entry(rt, &ct->range_tombstones, list)
+            {
+                if (castle_version_is_ancestor(rt->version, c_bvec->version) &&
+                    castle_range_tombstone_covers(rt, c_bvec->key) &&
+                    castle_range_tombstone_hides(rt, c_bvec->found_version, ct, c_bvec->tree))
+                {
+                    hidden = 1;
+                    goto out;
+                }
+            }
+            /* Older CTs can't hide the entry. */
+            if (ct == c_bvec->tree)
+                goto out;
+        }
+    }
+out:
+    read_unlock(&da->lock);
+
+    return hidden;
+}
+
+/**
+ * Release what a read got on a value it won't return.
+ */
+static void castle_da_read_cvt_release(c_val_tup_t cvt)
+{
+    if (CVT_INLINE(cvt))
+        castle_free(cvt.val);
+    else if (CVT_LARGE_OBJECT(cvt))
+        castle_extent_put(cvt.cep.ext_id);
+}
+
 /**
  * This is the callback used to complete a btree read. It either:
  * - calls back to the client if the key sought for has been found
@@ -8159,18 +10687,39 @@ static void castle_da_ct_read_complete(c_bvec_t *c_bvec, int err, c_val_tup_t cv
     BUG_ON(c_bvec_data_dir(c_bvec) != READ);
     BUG_ON(atomic_read(&c_bvec->reserv_nodes));
 
+    /* Done with the first CT. Start again if a write batch began inserting meanwhile, the
+       lookup mustn't see part of it. */
+    if (test_and_clear_bit(CBV_DA_BATCH_CHECK, &c_bvec->flags))
+    {
+        smp_rmb();
+        if (unlikely(atomic_read(&da->batch_seq) != c_bvec->batch_seq))
+        {
+            if (!err)
+                castle_da_read_cvt_release(cvt);
+            castle_ct_put(ct, 0);
+            c_bvec->submit_complete = callback;
+            castle_da_read_bvec_start(da, c_bvec);
+            return;
+        }
+    }
+
     /* If the key hasn't been found, check in the next tree. */
     if(CVT_INVALID(cvt) && (!err))
     {
-#ifdef CASTLE_BLOOM_FP_STATS
         if (ct->bloom_exists && c_bvec->bloom_positive)
         {
-            atomic64_inc(&ct->bloom.false_positives);
+            castle_bloom_stats_add(&ct->bloom, false_positives, 1);
             c_bvec->bloom_positive = 0;
         }
-#endif
         debug_verbose("Checking next ct.\n");
         next_ct = castle_da_ct_next(ct);
+        /* Skip trees which can't hold the key, before their Bloom filters get consulted. */
+        while(next_ct && !castle_ct_key_in_bounds(next_ct, c_bvec->key))
+        {
+            castle_ct_put(ct, 0);
+            c_bvec->tree = ct = next_ct;
+            next_ct = castle_da_ct_next(ct);
+        }
         /* We've finished looking through all the trees. */
         if(!next_ct)
         {
@@ -8187,6 +10736,13 @@ static void castle_da_ct_read_complete(c_bvec_t *c_bvec, int err, c_val_tup_t cv
     }
     debug_verbose("Finished with DA read, calling back.\n");
 
+    /* Drop the value if a range tombstone removed it, the key doesn't exist. */
+    if (!err && !CVT_TOMB_STONE(cvt) && castle_da_ct_read_hidden(da, c_bvec))
+    {
+        castle_da_read_cvt_release(cvt);
+        cvt = INVAL_VAL_TUP;
+    }
+
     /* Don't release the ct reference in order to hold on to medium objects array, etc. */
     callback(c_bvec, err, cvt);
 }
@@ -8228,7 +10784,6 @@ static void castle_da_ct_write_complete(c_bvec_t *c_bvec, int err, c_val_tup_t c
     }
     BUG_ON(c_bvec_data_dir(c_bvec) != WRITE);
     debug_verbose("Finished with DA, calling back.\n");
-    castle_da_merge_budget_io_end(castle_da_hash_get(ct->da));
     /* Release the preallocated space in the btree extent. */
     castle_double_array_unreserve(c_bvec);
     BUG_ON(CVT_MEDIUM_OBJECT(cvt) && (cvt.cep.ext_id != c_bvec->tree->data_ext_free.ext_id));
@@ -8288,6 +10843,26 @@ insert:
     castle_btree_submit(c_bvec);
 }
 
+/**
+ * Park a point lookup until the write batches inserting into the DA are done.
+ *
+ * @return 1 if parked, castle_double_array_batch_unlock() restarts the lookup
+ */
+static int castle_da_read_batch_wait(struct castle_double_array *da, c_bvec_t *c_bvec)
+{
+    int parked = 0;
+
+    spin_lock(&da->batch_waiting_lock);
+    if (atomic_read(&da->batches))
+    {
+        list_add_tail(&c_bvec->io_list, &da->batch_waiting);
+        parked = 1;
+    }
+    spin_unlock(&da->batch_waiting_lock);
+
+    return parked;
+}
+
 /**
  * Hand-off read request (bvec) to DA via bloom filter.
  *
@@ -8303,6 +10878,14 @@ static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *
     debug_verbose("Doing DA read for da_id=%d\n", da_id);
     BUG_ON(c_bvec_data_dir(c_bvec) != READ);
 
+    /* Don't look in the first CT (normally the T0) while a write batch is inserting keys,
+       lookups see all of the batch or none of it. Batches starting later are caught by
+       castle_da_ct_read_complete(). */
+    c_bvec->batch_seq = atomic_read(&da->batch_seq);
+    smp_rmb();
+    if (unlikely(atomic_read(&da->batches)) && castle_da_read_batch_wait(da, c_bvec))
+        return;
+
     /* Get a reference to the first appropriate CT for this bvec. */
     c_bvec->tree = castle_da_first_ct_get(da, c_bvec);
     if (!c_bvec->tree)
@@ -8310,6 +10893,7 @@ static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *
         c_bvec->submit_complete(c_bvec, -EINVAL, INVAL_VAL_TUP);
         return;
     }
+    set_bit(CBV_DA_BATCH_CHECK, &c_bvec->flags);
 
     c_bvec->orig_complete   = c_bvec->submit_complete;
     c_bvec->submit_complete = castle_da_ct_read_complete;
@@ -8317,12 +10901,72 @@ static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *
     debug_verbose("Looking up in ct=%d\n", c_bvec->tree->seq);
 
     /* Submit via bloom filter. */
-#ifdef CASTLE_BLOOM_FP_STATS
     c_bvec->bloom_positive = 0;
-#endif
     castle_bloom_submit(c_bvec);
 }
 
+/**
+ * Remove all keys of the start_key - end_key hypercube visible in version, in one go.
+ *
+ * Adds a range tombstone to every T0, each covering the keys hashing to its CPU. All of
+ * them get added at once, or none. The T0s aren't replaced, the range tombstones hide
+ * everything they already hold in version, @see castle_da_rwct_range_removed().
+ *
+ * @also castle_range_tombstone_hides()
+ */
+int castle_double_array_range_remove(c_ver_t version, c_vl_bkey_t *start_key, c_vl_bkey_t *end_key)
+{
+    struct castle_range_tombstone **rts;
+    struct castle_component_tree *ct;
+    struct castle_double_array *da;
+    int cpu_index, nr_cpus, err = 0;
+
+    da = castle_da_hash_get(castle_version_da_id_get(version));
+    BUG_ON(!da);
+
+    /* Allocate everything upfront, can't allocate under the DA lock. */
+    nr_cpus = castle_double_array_request_cpus();
+    rts = castle_zalloc(nr_cpus * sizeof(struct castle_range_tombstone *), GFP_KERNEL);
+    if (!rts)
+        return -ENOMEM;
+    for (cpu_index = 0; cpu_index < nr_cpus; cpu_index++)
+    {
+        rts[cpu_index] = castle_range_tombstone_alloc(version, cpu_index, nr_cpus,
+                                                      start_key, end_key);
+        if (!rts[cpu_index])
+        {
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+
+    /* T0s only get replaced under the DA lock, all of them get the range tombstone.
+       Checkpoint writes range tombstones of T0s back on exit. */
+    CASTLE_TRANSACTION_BEGIN;
+    write_lock(&da->lock);
+    /* T0s may not exist yet, if the DA was low on space (@see castle_da_all_rwcts_create()). */
+    if (da->levels[0].nr_trees != nr_cpus)
+        err = -EAGAIN;
+    for (cpu_index = 0; !err && (cpu_index < nr_cpus); cpu_index++)
+    {
+        ct = __castle_da_rwct_get(da, cpu_index);
+        rts[cpu_index]->origin_seq = ct->seq;
+        list_add_tail(&rts[cpu_index]->list, &ct->range_tombstones);
+        atomic_inc(&da->nr_range_tombstones);
+        rts[cpu_index] = NULL;
+    }
+    write_unlock(&da->lock);
+    CASTLE_TRANSACTION_END;
+
+out:
+    for (cpu_index = 0; cpu_index < nr_cpus; cpu_index++)
+        if (rts[cpu_index])
+            castle_free(rts[cpu_index]);
+    castle_free(rts);
+
+    return err;
+}
+
 /**
  * Submit request to DA, queueing write IOs that are not within the DA ios_budget.
  *
@@ -8334,6 +10978,7 @@ static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *
  * - If we're within ios_budget and there write queue is empty, queue the write
  *   IO immediately
  * - Otherwise queue write IO and wait for the ios_budget to be replenished
+ *   or for the per-insert delay to expire
  *
  * @also castle_da_bvec_queue()
  * @also castle_da_read_bvec_start()
@@ -8348,6 +10993,8 @@ void castle_double_array_submit(c_bvec_t *c_bvec)
     down_read(&att->lock);
     /* Since the version is attached, it must be found */
     BUG_ON(castle_version_read(att->version, &da_id, NULL, NULL, NULL, NULL));
+    /* Range tombstones are checked against it once the read completes. */
+    c_bvec->version = att->version;
     up_read(&att->lock);
 
     da = castle_da_hash_get(da_id);
@@ -8365,17 +11012,99 @@ void castle_double_array_submit(c_bvec_t *c_bvec)
     castle_da_write_bvec_start(da, c_bvec);
 }
 
+/**
+ * Size of a unit of btree extent space reserved for writes (see c_bvec->reserv_nodes).
+ *
+ * Btree T0s reserve whole leaf nodes, memtable T0s reserve pages of their WAL.
+ */
+static uint64_t castle_da_reserv_unit(struct castle_component_tree *ct)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+
+    if (ct->memtable)
+        return MEMTABLE_WAL_PAGE_SIZE;
+
+    return btree->node_size(ct, 0) * C_BLK_SIZE;
+}
+
+/**
+ * Would the chain of replaces starting at c_bvec write keys removed by a range tombstone
+ * of T0 ct, in the range tombstone's version?
+ *
+ * Without an ordering between entries of the same T0, range tombstones hide all the
+ * entries of their version in their origin T0. Such writes have to go to a new T0.
+ *
+ * @also castle_range_tombstone_hides()
+ */
+static int castle_da_rwct_range_removed(struct castle_double_array *da,
+                                        struct castle_component_tree *ct,
+                                        c_bvec_t *c_bvec)
+{
+    struct castle_object_replace *replace;
+    struct castle_attachment *att;
+    struct castle_range_tombstone *rt;
+    c_ver_t version;
+    int removed = 0;
+
+    /* Range tombstones get added under the DA lock. Writes racing with one may go either
+       side of it. */
+    if (list_empty(&ct->range_tombstones))
+        return 0;
+
+    for (replace = c_bvec->c_bio->replace; replace && !removed; replace = replace->next)
+    {
+        att = replace->c_bvec->c_bio->attachment;
+        down_read(&att->lock);
+        version = att->version;
+        up_read(&att->lock);
+
+        read_lock(&da->lock);
+        list_for_each_entry(rt, &ct->range_tombstones, list)
+        {
+            if ((rt->origin_seq == ct->seq) && (rt->version == version) &&
+                castle_range_tombstone_covers(rt, replace->c_bvec->key))
+            {
+                removed = 1;
+                break;
+            }
+        }
+        read_unlock(&da->lock);
+    }
+
+    return removed;
+}
+
 /**
  * Gets write reference to the appropriate T0 (for the cpu_index stored in c_bvec) and
  * reserves space in btree and medium object extents (for medium object writes).
  * It calls back to the client through queue_complete() callback, on success or failure.
+ *
+ * Space for a chain of batched replaces (@see castle_object_replace_batch_queue()) is
+ * reserved at once, for all of them or none. The CT and its share of the reservation
+ * are handed to every c_bvec of the chain, queue_complete() is only called for the first.
  */
 static void castle_da_reserve(struct castle_double_array *da, c_bvec_t *c_bvec)
 {
     struct castle_component_tree *ct;
-    struct castle_btree_type *btree;
+    struct castle_object_replace *replace;
     uint64_t value_len, req_btree_space, req_medium_space;
-    int ret;
+    int nr_units, nr_replaces, ret;
+
+    /* Count replaces (and their medium object space) in the chain. */
+    nr_replaces = 0;
+    req_medium_space = 0;
+    for (replace = c_bvec->c_bio->replace; replace; replace = replace->next)
+    {
+        nr_replaces++;
+        value_len = replace->value_len;
+        /* Preallocate (ceil to C_BLK_SIZE) space for the medium object. */
+        if (is_medium(value_len))
+            req_medium_space += ((value_len - 1) / C_BLK_SIZE + 1) * C_BLK_SIZE;
+    }
+
+    /* Account the write admission for the rate controller. */
+    atomic_add(nr_replaces, &da->epoch_ios);
+    atomic_add(jiffies - c_bvec->queue_time, &da->epoch_ios_wait);
 
     if(castle_da_no_disk_space(da))
     {
@@ -8383,34 +11112,59 @@ static void castle_da_reserve(struct castle_double_array *da, c_bvec_t *c_bvec)
         return;
     }
 
-    value_len = c_bvec->c_bio->replace->value_len;
+    /* A chain that wouldn't fit in an empty T0 would keep creating new ones. */
+    if (req_medium_space > MAX_DYNAMIC_DATA_SIZE * C_CHK_SIZE)
+    {
+        c_bvec->queue_complete(c_bvec, -E2BIG);
+        return;
+    }
+
 again:
     ct = castle_da_rwct_get(da, c_bvec->cpu_index);
     BUG_ON(!ct);
 
     /* Attempt to preallocate space in the btree and m-obj extents for writes. */
-    btree = castle_btree_type_get(ct->btree_type);
 
-    /* We may have to create up to 2 new leaf nodes in this write. Preallocate
-       the space for this. */
-    req_btree_space = 2 * btree->node_size(ct, 0) * C_BLK_SIZE;
+    /* We may have to create up to 2 new leaf nodes in this write (or start a new WAL
+       page, for memtables). Preallocate the space for this. */
+    nr_units = ct->memtable ? 1 : 2;
+    /* Flush memtables once memtables use more memory than they are allowed to. */
+    if (ct->memtable && castle_memtable_over_budget(ct))
+        goto new_ct;
+    /* Keys written again after a range remove mustn't share the T0 with the removed ones. */
+    if (castle_da_rwct_range_removed(da, ct, c_bvec))
+        goto new_ct;
+    req_btree_space = nr_replaces * nr_units * castle_da_reserv_unit(ct);
+    /* (A new btree T0 holds its root node.) */
+    if (req_btree_space > MAX_DYNAMIC_TREE_SIZE * C_CHK_SIZE - castle_da_reserv_unit(ct))
+    {
+        castle_ct_put(ct, 1 /*write*/);
+        c_bvec->queue_complete(c_bvec, -E2BIG);
+        return;
+    }
     if (castle_ext_freespace_prealloc(&ct->tree_ext_free, req_btree_space) < 0)
         goto new_ct;
-    /* Save how many nodes we've pre-allocated. */
-    atomic_set(&c_bvec->reserv_nodes, 2);
 
-    /* Preallocate (ceil to C_BLK_SIZE) space for the medium object. */
-    req_medium_space = ((value_len - 1) / C_BLK_SIZE + 1) * C_BLK_SIZE;
-    if ( is_medium(value_len) &&
+    if ((req_medium_space > 0) &&
         (castle_ext_freespace_prealloc(&ct->data_ext_free, req_medium_space) < 0))
     {
         /* We failed to preallocate space for the medium object. Free the space in btree extent. */
         castle_ext_freespace_free(&ct->tree_ext_free, req_btree_space);
-        atomic_set(&c_bvec->reserv_nodes, 0);
         goto new_ct;
     }
-    /* Save the CT in bvec. */
-    c_bvec->tree = ct;
+
+    /* Save the CT, and how many nodes we've pre-allocated, in every bvec of the chain.
+       Each holds its own CT reference. */
+    for (replace = c_bvec->c_bio->replace; replace; replace = replace->next)
+    {
+        BUG_ON(atomic_read(&replace->c_bvec->reserv_nodes) != 0);
+        BUG_ON(replace->c_bvec->cpu_index != c_bvec->cpu_index);
+        if (replace->c_bvec != c_bvec)
+            castle_ct_get(ct, 1 /*write*/);
+        atomic_set(&replace->c_bvec->reserv_nodes, nr_units);
+        replace->c_bvec->tree = ct;
+    }
+    atomic64_add(nr_replaces, &da->inserted_entries);
 
     c_bvec->queue_complete(c_bvec, 0);
     return;
@@ -8436,7 +11190,6 @@ new_ct:
 void castle_double_array_unreserve(c_bvec_t *c_bvec)
 {
     struct castle_component_tree *ct;
-    struct castle_btree_type *btree;
     uint32_t reserv_nodes;
 
     /* Only works for write requests. */
@@ -8449,14 +11202,76 @@ void castle_double_array_unreserve(c_bvec_t *c_bvec)
 
     /* Free the nodes. */
     ct = c_bvec->tree;
-    btree = castle_btree_type_get(ct->btree_type);
-    castle_ext_freespace_free(&ct->tree_ext_free,
-                               reserv_nodes * btree->node_size(ct, 0) * C_BLK_SIZE);
+    castle_ext_freespace_free(&ct->tree_ext_free, reserv_nodes * castle_da_reserv_unit(ct));
     /* Set the reservation back to 0. Don't use atomic_set() because this doesn't use
        locked prefix. */
     atomic_sub(reserv_nodes, &c_bvec->reserv_nodes);
 }
 
+/**
+ * Get the DA an attachment belongs to.
+ */
+static struct castle_double_array *castle_da_attachment_da_get(struct castle_attachment *att)
+{
+    struct castle_double_array *da;
+    c_da_t da_id;
+
+    down_read(&att->lock);
+    BUG_ON(castle_version_read(att->version, &da_id, NULL, NULL, NULL, NULL));
+    up_read(&att->lock);
+
+    da = castle_da_hash_get(da_id);
+    BUG_ON(!da);
+
+    return da;
+}
+
+/**
+ * Stops point lookups in the attachment's DA from starting, for a write batch to insert
+ * its keys.
+ *
+ * Lookups already in their first CT (the T0) start again once they're done with it, the
+ * batch is then either all visible to a lookup or not at all.
+ *
+ * @also castle_da_read_bvec_start()
+ */
+void castle_double_array_batch_lock(struct castle_attachment *att)
+{
+    struct castle_double_array *da = castle_da_attachment_da_get(att);
+
+    /* Lookups read batch_seq before batches. */
+    atomic_inc(&da->batches);
+    smp_mb__after_atomic_inc();
+    atomic_inc(&da->batch_seq);
+    smp_mb__after_atomic_inc();
+}
+
+/**
+ * Lets lookups back in, once all the keys of a write batch have been inserted. May be
+ * called from a different context than castle_double_array_batch_lock().
+ *
+ * The last batch to finish restarts the lookups parked meanwhile.
+ */
+void castle_double_array_batch_unlock(struct castle_attachment *att)
+{
+    struct castle_double_array *da = castle_da_attachment_da_get(att);
+    struct list_head *l, *t;
+    LIST_HEAD(waiting);
+    c_bvec_t *c_bvec;
+
+    spin_lock(&da->batch_waiting_lock);
+    if (atomic_dec_and_test(&da->batches))
+        list_splice_init(&da->batch_waiting, &waiting);
+    spin_unlock(&da->batch_waiting_lock);
+
+    list_for_each_safe(l, t, &waiting)
+    {
+        c_bvec = list_entry(l, c_bvec_t, io_list);
+        list_del(l);
+        castle_da_read_bvec_start(da, c_bvec);
+    }
+}
+
 /**
  * Submits write requests to this DA write queue which throttles inserts according to the
  * merge progress. Once the write is scheduled for processing (which could happen immediately
@@ -8485,23 +11300,25 @@ void castle_double_array_queue(c_bvec_t *c_bvec)
 
     /* Write requests must operate within the ios_budget but reads can be
      * scheduled immediately. */
+    c_bvec->queue_time = jiffies;
     wq = &da->ios_waiting[c_bvec->cpu_index];
     spin_lock(&wq->lock);
-    if ((atomic_dec_return(&da->ios_budget) >= 0) && list_empty(&wq->list))
+    if (list_empty(&wq->list) && castle_da_write_admit(da, wq))
     {
-        /* We're within the budget and there are no other IOs on the queue,
+        /* There are no other IOs on the queue and the write is admitted,
          * schedule this write IO immediately. */
         spin_unlock(&wq->lock);
         castle_da_reserve(da, c_bvec);
     }
     else
     {
-        /* Either the budget is exhausted or there are other IOs pending on
-         * the write queue.  Queue this write IO.
+        /* Either the write isn't admitted yet or there are other IOs pending
+         * on the write queue.  Queue this write IO.
          *
          * Don't do a manual queue kick as if/when ios_budget is replenished
-         * kicks for all of the DA's write queues will be scheduled.  The
-         * kick for 'our' write queue will block on the spinlock we hold.
+         * kicks for all of the DA's write queues will be scheduled.  Delayed
+         * writes get kicked by the queue timer.  The kick for 'our' write
+         * queue will block on the spinlock we hold.
          *
          * ios_budget will be replenished; save an atomic op and leave it
          * in a negative state. */
@@ -8510,6 +11327,36 @@ void castle_double_array_queue(c_bvec_t *c_bvec)
     }
 }
 
+/**
+ * Print write admission state of a DA.
+ *
+ * Format:
+ * ------
+ *
+ * <admission rate (writes/s, -1 if unthrottled)> <per-insert delay (us)>
+ *     <average admission delay (us)> <merge pace> <total queued writes>
+ * <queued writes on request-cpu 0> <... request-cpu 1> ...
+ */
+ssize_t castle_da_admission_print(struct castle_double_array *da, char *buf)
+{
+    ssize_t len;
+    int i, rate;
+
+    rate = da->ios_rate;
+    rate = (rate == INT_MAX) ? -1 : rate * REPLENISH_FREQUENCY;
+    len = snprintf(buf, PAGE_SIZE, "%d %d %d %d %d\n",
+                   rate,
+                   da->rate_ctrl.write_delay_us,
+                   da->rate_ctrl.write_wait_us,
+                   da->rate_ctrl.merge_pace,
+                   atomic_read(&da->ios_waiting_cnt));
+    for (i = 0; i < castle_double_array_request_cpus(); i++)
+        len += snprintf(buf + len, PAGE_SIZE - len, "%d ", da->ios_waiting[i].cnt);
+    len += snprintf(buf + len, PAGE_SIZE - len, "\n");
+
+    return min_t(ssize_t, len, PAGE_SIZE - 1);
+}
+
 /**************************************/
 /* Double Array Management functions. */
 
@@ -8541,8 +11388,14 @@ int castle_double_array_init(void)
             goto err0;
         }
     }
+    castle_ct_modlist_sort_wq = create_workqueue("castle_da_sort");
+    if (!castle_ct_modlist_sort_wq)
+    {
+        castle_printk(LOG_ERROR, KERN_ALERT "Error: Could not alloc wq\n");
+        goto err0;
+    }
 
-    /* Initialise modlist iter mergesort buffer based on cache size.
+    /* Initialise modlist iter sort buffer based on cache size.
      * As a minimum we need to be able to merge two full T0s. */
     min_budget = 2 * MAX_DYNAMIC_TREE_SIZE * C_CHK_SIZE;            /* Two full T0s. */
     budget     = (castle_cache_size_get() * PAGE_SIZE) / 10;        /* 10% of cache. */
@@ -8573,16 +11426,31 @@ int castle_double_array_init(void)
 
     castle_da_hash_init();
     castle_ct_hash_init();
+
+    if ((ret = castle_bloom_init()))
+        goto err3;
+
+    /* Start the merge threads, shared by all DAs. */
+    atomic64_set(&castle_merge_bw_budget, 0);
+    if ((ret = castle_merge_sched_workers_start()))
+        goto err4;
+
     /* Start up the timer which replenishes merge and write IOs budget */
     castle_throttle_timer_fire(1);
 
     return 0;
 
+err4:
+    castle_bloom_fini();
+err3:
+    castle_free(castle_ct_hash);
 err2:
     castle_free(castle_da_hash);
 err1:
     castle_free(request_cpus.cpus);
 err0:
+    if (castle_ct_modlist_sort_wq)
+        destroy_workqueue(castle_ct_modlist_sort_wq);
     for (j = 0; j < i; j++)
         destroy_workqueue(castle_da_wqs[j]);
     BUG_ON(!ret);
@@ -8605,17 +11473,21 @@ void castle_double_array_merges_fini(void)
         if(deleted_das)
             msleep(10);
     } while(deleted_das);
+    /* No merges left in flight, stop the merge threads. */
+    castle_merge_sched_workers_stop();
 }
 
 void castle_double_array_fini(void)
 {
     int i;
     castle_printk(LOG_DEBUG, "%s::start.\n", __FUNCTION__);
+    castle_bloom_fini();
     castle_da_hash_destroy();
     castle_ct_hash_destroy();
 
     castle_free(request_cpus.cpus);
 
+    destroy_workqueue(castle_ct_modlist_sort_wq);
     for (i = 0; i < NR_CASTLE_DA_WQS; i++)
         destroy_workqueue(castle_da_wqs[i]);
     castle_printk(LOG_DEBUG, "%s::end.\n", __FUNCTION__);
@@ -8745,11 +11617,97 @@ int castle_double_array_compact(c_da_t da_id)
     castle_printk(LOG_USERINFO, "Marking version tree %u for compaction.\n", da_id);
     castle_da_need_compaction_set(da);
 
-    wake_up(&da->merge_waitq);
+    castle_merge_sched_wake();
+
+    return 0;
+}
+
+/**
+ * Change compaction policy of a DA.
+ *
+ * Policy can only be changed while no merges are in flight, because it changes how
+ * level merges are deamortised.
+ *
+ * @return -EINVAL  No such DA, or invalid policy
+ * @return -EBUSY   Merges are in flight, retry later
+ */
+int castle_double_array_compaction_policy_set(c_da_t da_id, uint32_t policy)
+{
+    struct castle_double_array *da;
+    int level, ret;
+
+    da = castle_da_hash_get(da_id);
+    if (!da || (policy >= CASTLE_COMPACTION_POLICIES))
+        return -EINVAL;
+
+    ret = 0;
+    spin_lock(&castle_merge_sched_lock);
+    write_lock(&da->lock);
+    if (atomic_read(&da->ongoing_merges))
+        ret = -EBUSY;
+    for (level=1; level<MAX_DA_LEVEL-1; level++)
+        if (da->levels[level].merge.sched_claimed ||
+            da->levels[level].merge.sched_merge ||
+            da->levels[level].merge.serdes.des)
+            ret = -EBUSY;
+    if (!ret)
+    {
+        da->compaction_policy = policy;
+        castle_da_compaction_policy_apply(da);
+    }
+    write_unlock(&da->lock);
+    spin_unlock(&castle_merge_sched_lock);
+
+    if (ret)
+        return ret;
+
+    castle_printk(LOG_USERINFO, "Version tree %u compaction policy set to %s.\n",
+            da_id, castle_da_leveled(da) ? "leveled" : "doubling");
+    castle_merge_sched_wake();
 
     return 0;
 }
 
+/**
+ * Print compaction policy of a DA, and its read, write and space amplification.
+ *
+ * Format:
+ * ------
+ *
+ * <policy> <read amp> <write amp> <space amp> <moved trees>
+ *
+ * - read amp: number of trees a point lookup may need to search
+ * - write amp: entries written to T0s and by merges, per entry written to T0s
+ * - space amp: bytes in RO trees, per byte in the biggest level
+ * - moved trees: trees moved up a level without being rewritten
+ */
+ssize_t castle_da_compaction_print(struct castle_double_array *da, char *buf)
+{
+    uint64_t inserted, written, total, biggest, level_size;
+    uint32_t write_amp, space_amp;
+    int level;
+
+    inserted = atomic64_read(&da->inserted_entries);
+    written  = inserted + atomic64_read(&da->merged_entries);
+    write_amp = inserted ? (uint32_t)(written * 1000 / inserted) : 1000;
+
+    total = biggest = 0;
+    for (level=1; level<MAX_DA_LEVEL; level++)
+    {
+        level_size = atomic64_read(&da->levels[level].size);
+        total     += level_size;
+        biggest    = max(biggest, level_size);
+    }
+    space_amp = biggest ? (uint32_t)(total * 1000 / biggest) : 1000;
+
+    return snprintf(buf, PAGE_SIZE, "%s %d %u.%03u %u.%03u %lld\n",
+                    castle_da_leveled(da) ? "leveled" : "doubling",
+                    da->nr_trees,
+                    write_amp / 1000, write_amp % 1000,
+                    space_amp / 1000, space_amp % 1000,
+                    (long long)atomic64_read(&da->moved_trees));
+}
+
 int castle_double_array_destroy(c_da_t da_id)
 {
     struct castle_double_array *da;
@@ -8801,31 +11759,16 @@ err_out:
 }
 
 /**
- * Set nice value for all merge threads within a DA.
- */
-static int __castle_da_threads_priority_set(struct castle_double_array *da, void *_value)
-{
-    int i;
-    int nice_value = *((int *)_value);
-
-    for (i=0; i<MAX_DA_LEVEL; i++)
-    {
-        if (da->levels[i].merge.thread)
-            set_user_nice(da->levels[i].merge.thread, nice_value + 15);
-    }
-
-    return 0;
-}
-
-/**
- * Change the priority of merge threads for all doubling arrays.
+ * Change the priority of merge threads.
  */
 void castle_da_threads_priority_set(int nice_value)
 {
     int i;
 
-    castle_da_hash_iterate(__castle_da_threads_priority_set, &nice_value);
+    for(i=0; i<castle_merge_sched_nr_workers; i++)
+        set_user_nice(castle_merge_sched_workers[i], nice_value + 15);
 
     for(i=0; i<NR_CASTLE_DA_WQS; i++)
         castle_wq_priority_set(castle_da_wqs[i]);
+    castle_wq_priority_set(castle_ct_modlist_sort_wq);
 }
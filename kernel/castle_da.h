@@ -20,12 +20,18 @@ extern struct castle_iterator_type castle_da_rq_iter;
 
 int  castle_da_compacting      (struct castle_double_array *da);
 int  castle_double_array_okey_cpu_index(c_vl_okey_t *okey, uint32_t key_len);
+int  castle_double_array_bkey_cpu_index(c_vl_bkey_t *bkey);
 int  castle_double_array_request_cpu   (int cpu_index);
 int  castle_double_array_request_cpus  (void);
 
 void castle_double_array_queue    (c_bvec_t *c_bvec);
 void castle_double_array_unreserve(c_bvec_t *c_bvec);
+void castle_double_array_batch_lock  (struct castle_attachment *att);
+void castle_double_array_batch_unlock(struct castle_attachment *att);
 void castle_double_array_submit   (c_bvec_t *c_bvec);
+int  castle_double_array_range_remove(c_ver_t version,
+                                      c_vl_bkey_t *start_key,
+                                      c_vl_bkey_t *end_key);
 
 int  castle_double_array_make     (c_da_t da_id, c_ver_t root_version);
 
@@ -41,6 +47,7 @@ int  castle_double_array_get            (c_da_t da_id);
 void castle_double_array_put            (c_da_t da_id);
 int  castle_double_array_destroy        (c_da_t da_id);
 int  castle_double_array_compact        (c_da_t da_id);
+int  castle_double_array_compaction_policy_set(c_da_t da_id, uint32_t policy);
 void castle_double_arrays_writeback     (void);
 void castle_double_arrays_pre_writeback (void);
 void castle_double_array_merges_fini    (void);
@@ -52,8 +59,13 @@ int  castle_ct_large_obj_add    (c_ext_id_t              ext_id,
 int  castle_ct_large_obj_remove (c_ext_id_t              ext_id,
                                  struct list_head       *head,
                                  struct mutex           *mutex);
+int  castle_ct_value_ext_contains(struct castle_component_tree *ct,
+                                 c_ext_id_t              ext_id);
 void castle_da_version_delete   (c_da_t da_id);
 
 uint32_t castle_da_count(void);
+ssize_t  castle_da_merge_sched_print(char *buf);
+ssize_t  castle_da_admission_print   (struct castle_double_array *da, char *buf);
+ssize_t  castle_da_compaction_print  (struct castle_double_array *da, char *buf);
 void castle_da_threads_priority_set(int nice_value);
 #endif /* __CASTLE_DA_H__ */
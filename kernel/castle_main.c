@@ -45,6 +45,8 @@ struct castle_component_tree castle_global_tree = {.seq             = GLOBAL_TRE
                                                    .da_list         = {NULL, NULL},
                                                    .hash_list       = {NULL, NULL},
                                                    .large_objs      = {NULL, NULL},
+                                                   .value_exts      = {NULL, NULL},
+                                                   .range_tombstones= {NULL, NULL},
                                                    .tree_ext_free   = {INVAL_EXT_ID,
                                                                        (100 * C_CHK_SIZE),
                                                                        {0ULL},
@@ -793,6 +795,8 @@ int castle_fs_init(void)
         init_rwsem(&castle_global_tree.lock);
         mutex_init(&castle_global_tree.lo_mutex);
         INIT_LIST_HEAD(&castle_global_tree.large_objs);
+        INIT_LIST_HEAD(&castle_global_tree.value_exts);
+        INIT_LIST_HEAD(&castle_global_tree.range_tombstones);
 
         castle_extent_transaction_start();
 
@@ -0,0 +1,866 @@
+#include <linux/rbtree.h>
+
+#include "castle.h"
+#include "castle_da.h"
+#include "castle_btree.h"
+#include "castle_cache.h"
+#include "castle_utils.h"
+#include "castle_versions.h"
+#include "castle_memtable.h"
+#include "castle_debug.h"
+
+static unsigned int castle_memtable_budget = 512;
+module_param(castle_memtable_budget, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_memtable_budget, "Memory (in MB) memtable entries of all T0s may use before T0s get flushed");
+
+/** Memtables using less than this are never flushed to get back under the budget. */
+#define MEMTABLE_FLUSH_MIN_BYTES    (1024 * 1024)
+
+static atomic64_t castle_memtable_bytes = ATOMIC64_INIT(0); /**< Bytes in entries of all memtables. */
+
+//#define DEBUG
+#ifndef DEBUG
+#define debug(_f, ...)            ((void)0)
+#else
+#define debug(_f, _a...)          (castle_printk(LOG_DEBUG, "%s:%.4d: " _f, __FILE__, __LINE__ , ##_a))
+#endif
+
+/**
+ * In-memory index of a T0 (memtable).
+ *
+ * Inserts go into a red-black tree ordered the same way as btree leaves (keys ascending,
+ * versions of a key newest first). Every insert is also logged to the tree extent of the
+ * CT, which holds a sequential write-ahead log (WAL) instead of btree nodes. The memtable
+ * is rebuilt from the WAL when the CT gets read back from disk.
+ *
+ * When a memtable T0 fills up, it is promoted to level 1 like any other T0. The level 1
+ * merge reads it in order through castle_memtable_iter, no sorting needed.
+ */
+struct castle_memtable {
+    struct rw_semaphore     lock;       /**< Protects the index and the WAL tail. Inserts
+                                             may sleep in cvt_get(), hence a semaphore.  */
+    struct rb_root          root;
+    uint64_t                nr_entries;
+    atomic64_t              nr_bytes;   /**< Bytes allocated for entries.                */
+    c2_block_t             *wal_c2b;    /**< WAL page currently appended to (ref held).  */
+    uint32_t                wal_off;    /**< Offset of the next record in wal_c2b.       */
+};
+
+struct castle_memtable_entry {
+    struct rb_node          rb_node;
+    c_ver_t                 version;
+    uint32_t                size;       /**< Bytes allocated for the entry.              */
+    c_val_tup_t             cvt;        /**< Inline values point into data[].            */
+    void                   *key;        /**< Points into data[].                         */
+    uint8_t                 data[0];
+};
+
+#define MEMTABLE_WAL_MAGIC          (0x4c57544d)
+
+/**
+ * WAL record.
+ *
+ * Records never cross page boundaries, unused space at the end of a page is zeroed.
+ * Records are tagged with the CT seq, so that stale extent contents are never mistaken
+ * for records of this CT.
+ */
+struct castle_memtable_wal_record {
+    /* align:   4 */
+    /* offset:  0 */ uint32_t    magic;
+    /*          4 */ tree_seq_t  seq;
+    /*          8 */ c_ver_t     version;
+    /*         12 */ uint32_t    key_len;
+    /*         16 */ uint32_t    val_len;     /**< Inline value bytes, following the key. */
+    /*         20 */ uint8_t     type;        /**< CVT type.                              */
+    /*         21 */ uint8_t     _pad[3];
+    /*         24 */ uint64_t    length;      /**< CVT length.                            */
+    /*         32 */ c_ext_pos_t cep;         /**< CVT cep, on-disk values only.          */
+    /*         48 */ uint8_t     payload[0];
+    /*         48 */
+} PACKED;
+
+#define MEMTABLE_WAL_MAX_KEY_LEN    (VLBA_TREE_MAX_KEY_SIZE + sizeof(vlba_key_t))
+#define MEMTABLE_WAL_MAX_REC_LEN    (sizeof(struct castle_memtable_wal_record)              \
+                                     + MEMTABLE_WAL_MAX_KEY_LEN + MAX_INLINE_VAL_SIZE)
+
+static inline uint32_t castle_memtable_key_len(void *key)
+{
+    return ((vlba_key_t *)key)->length + sizeof(vlba_key_t);
+}
+
+static inline uint32_t castle_memtable_wal_rec_len(void *key, uint32_t val_len)
+{
+    return sizeof(struct castle_memtable_wal_record) + castle_memtable_key_len(key) + val_len;
+}
+
+/**
+ * Compares (key, version) pairs, in the order entries are stored in btree leaves.
+ */
+static int castle_memtable_kv_compare(struct castle_btree_type *btree,
+                                      void *k1, c_ver_t v1,
+                                      void *k2, c_ver_t v2)
+{
+    int ret = btree->key_compare(k1, k2);
+    if (ret != 0)
+        return ret;
+
+    /* Reverse v1,v2 in castle_version_compare() to get descending version order. */
+    return castle_version_compare(v2, v1);
+}
+
+/**
+ * Allocates an entry for (key, version), with space for val_len bytes of inline value.
+ *
+ * Entry memory is accounted against the memtable and the global memtable budget.
+ */
+static struct castle_memtable_entry* castle_memtable_entry_alloc(struct castle_memtable *mt,
+                                                                 void *key,
+                                                                 c_ver_t version,
+                                                                 uint32_t val_len)
+{
+    struct castle_memtable_entry *entry;
+    uint32_t key_len = castle_memtable_key_len(key);
+    uint32_t size = sizeof(struct castle_memtable_entry) + key_len + val_len;
+
+    BUG_ON(key_len > MEMTABLE_WAL_MAX_KEY_LEN);
+    BUG_ON(val_len > MAX_INLINE_VAL_SIZE);
+    entry = castle_malloc(size, GFP_KERNEL);
+    if (!entry)
+        return NULL;
+    atomic64_add(size, &mt->nr_bytes);
+    atomic64_add(size, &castle_memtable_bytes);
+
+    entry->version = version;
+    entry->size    = size;
+    entry->cvt     = INVAL_VAL_TUP;
+    entry->key     = entry->data;
+    memcpy(entry->key, key, key_len);
+
+    return entry;
+}
+
+static void castle_memtable_entry_free(struct castle_memtable *mt,
+                                      struct castle_memtable_entry *entry)
+{
+    atomic64_sub(entry->size, &mt->nr_bytes);
+    atomic64_sub(entry->size, &castle_memtable_bytes);
+    castle_free(entry);
+}
+
+/**
+ * Should the memtable T0 be flushed, to bring memory used by memtables back under the budget.
+ *
+ * Only memtables holding a worthwhile amount of memory get flushed, so that inserts
+ * don't keep creating new T0s while memtables already flushed wait to be merged.
+ *
+ * @also castle_da_reserve()
+ */
+int castle_memtable_over_budget(struct castle_component_tree *ct)
+{
+    struct castle_memtable *mt = ct->memtable;
+
+    BUG_ON(!mt);
+    if (atomic64_read(&castle_memtable_bytes) <= (uint64_t)castle_memtable_budget << 20)
+        return 0;
+
+    return atomic64_read(&mt->nr_bytes) >= MEMTABLE_FLUSH_MIN_BYTES;
+}
+
+/**
+ * Sets the value of an entry, copying inline values into the entry.
+ */
+static void castle_memtable_entry_cvt_set(struct castle_memtable_entry *entry, c_val_tup_t cvt)
+{
+    if (CVT_INLINE(cvt))
+    {
+        void *val = entry->data + castle_memtable_key_len(entry->key);
+
+        memcpy(val, cvt.val, cvt.length);
+        cvt.val = val;
+    }
+    entry->cvt = cvt;
+}
+
+/**
+ * Finds the entry for exactly (key, version).
+ */
+static struct castle_memtable_entry* castle_memtable_entry_find(struct castle_memtable *mt,
+                                                                struct castle_btree_type *btree,
+                                                                void *key,
+                                                                c_ver_t version)
+{
+    struct rb_node *n = mt->root.rb_node;
+    struct castle_memtable_entry *entry;
+    int cmp;
+
+    while (n)
+    {
+        entry = rb_entry(n, struct castle_memtable_entry, rb_node);
+        cmp = castle_memtable_kv_compare(btree, key, version, entry->key, entry->version);
+        if (cmp < 0)
+            n = n->rb_left;
+        else if (cmp > 0)
+            n = n->rb_right;
+        else
+            return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * Inserts an entry, replacing the entry for the same (key, version) if there is one.
+ *
+ * @return Entry that got replaced, NULL if none
+ */
+static struct castle_memtable_entry* castle_memtable_entry_insert(struct castle_memtable *mt,
+                                                                  struct castle_btree_type *btree,
+                                                                  struct castle_memtable_entry *new)
+{
+    struct rb_node **p = &mt->root.rb_node, *parent = NULL;
+    struct castle_memtable_entry *entry;
+    int cmp;
+
+    while (*p)
+    {
+        parent = *p;
+        entry = rb_entry(parent, struct castle_memtable_entry, rb_node);
+        cmp = castle_memtable_kv_compare(btree, new->key, new->version, entry->key, entry->version);
+        if (cmp < 0)
+            p = &(*p)->rb_left;
+        else if (cmp > 0)
+            p = &(*p)->rb_right;
+        else
+        {
+            rb_replace_node(&entry->rb_node, &new->rb_node, &mt->root);
+            return entry;
+        }
+    }
+    rb_link_node(&new->rb_node, parent, p);
+    rb_insert_color(&new->rb_node, &mt->root);
+    mt->nr_entries++;
+
+    return NULL;
+}
+
+/**
+ * Finds the first entry with key >= key (if strict == 0), or key > key (strict == 1).
+ */
+static struct rb_node* castle_memtable_key_bound(struct castle_memtable *mt,
+                                                 struct castle_btree_type *btree,
+                                                 void *key,
+                                                 int strict)
+{
+    struct rb_node *n = mt->root.rb_node, *found = NULL;
+    struct castle_memtable_entry *entry;
+
+    while (n)
+    {
+        entry = rb_entry(n, struct castle_memtable_entry, rb_node);
+        if (btree->key_compare(entry->key, key) >= strict)
+        {
+            found = n;
+            n = n->rb_left;
+        }
+        else
+            n = n->rb_right;
+    }
+
+    return found;
+}
+
+/**
+ * Finds the first entry after (key, version).
+ */
+static struct rb_node* castle_memtable_kv_next(struct castle_memtable *mt,
+                                               struct castle_btree_type *btree,
+                                               void *key,
+                                               c_ver_t version)
+{
+    struct rb_node *n = mt->root.rb_node, *found = NULL;
+    struct castle_memtable_entry *entry;
+
+    while (n)
+    {
+        entry = rb_entry(n, struct castle_memtable_entry, rb_node);
+        if (castle_memtable_kv_compare(btree, entry->key, entry->version, key, version) > 0)
+        {
+            found = n;
+            n = n->rb_left;
+        }
+        else
+            n = n->rb_right;
+    }
+
+    return found;
+}
+
+/**
+ * Makes sure the current WAL page has room for a record of rec_len bytes.
+ *
+ * Moves on to a new WAL page otherwise. The page is taken out of the space set aside for
+ * the write by castle_da_reserve(), if there is any left.
+ *
+ * NOTE: Caller must hold the memtable lock for writing.
+ *
+ * @return -ENOSPC  Tree extent is full
+ */
+static int castle_memtable_wal_room(c_bvec_t *c_bvec, uint32_t rec_len)
+{
+    struct castle_component_tree *ct = c_bvec->tree;
+    struct castle_memtable *mt = ct->memtable;
+    c_ext_pos_t cep;
+    int reserved;
+
+    BUG_ON(rec_len > MEMTABLE_WAL_PAGE_SIZE);
+    if (mt->wal_c2b && (mt->wal_off + rec_len <= MEMTABLE_WAL_PAGE_SIZE))
+        return 0;
+
+    reserved = (atomic_read(&c_bvec->reserv_nodes) > 0);
+    if (castle_ext_freespace_get(&ct->tree_ext_free, MEMTABLE_WAL_PAGE_SIZE, reserved, &cep) < 0)
+        return -ENOSPC;
+    if (reserved)
+        atomic_dec(&c_bvec->reserv_nodes);
+
+    if (mt->wal_c2b)
+        put_c2b(mt->wal_c2b);
+    mt->wal_c2b = castle_cache_block_get(cep, 1);
+    write_lock_c2b(mt->wal_c2b);
+    memset(c2b_buffer(mt->wal_c2b), 0, MEMTABLE_WAL_PAGE_SIZE);
+    update_c2b(mt->wal_c2b);
+    dirty_c2b(mt->wal_c2b);
+    write_unlock_c2b(mt->wal_c2b);
+    mt->wal_off = 0;
+    debug("Memtable for ct=%d moved to WAL page "cep_fmt_str_nl, ct->seq, cep2str(cep));
+
+    return 0;
+}
+
+/**
+ * Appends a record for entry to the WAL. Room must have been made with
+ * castle_memtable_wal_room().
+ *
+ * NOTE: Caller must hold the memtable lock for writing.
+ */
+static void castle_memtable_wal_write(struct castle_component_tree *ct,
+                                      struct castle_memtable_entry *entry)
+{
+    struct castle_memtable *mt = ct->memtable;
+    struct castle_memtable_wal_record *rec;
+    uint32_t key_len, val_len;
+
+    key_len = castle_memtable_key_len(entry->key);
+    val_len = CVT_INLINE(entry->cvt) ? entry->cvt.length : 0;
+    BUG_ON(!mt->wal_c2b);
+    BUG_ON(mt->wal_off + castle_memtable_wal_rec_len(entry->key, val_len) > MEMTABLE_WAL_PAGE_SIZE);
+
+    write_lock_c2b(mt->wal_c2b);
+    rec = (struct castle_memtable_wal_record *)((uint8_t *)c2b_buffer(mt->wal_c2b) + mt->wal_off);
+    rec->magic   = MEMTABLE_WAL_MAGIC;
+    rec->seq     = ct->seq;
+    rec->version = entry->version;
+    rec->key_len = key_len;
+    rec->val_len = val_len;
+    rec->type    = entry->cvt.type;
+    rec->length  = entry->cvt.length;
+    rec->cep     = CVT_ONDISK(entry->cvt) ? entry->cvt.cep : INVAL_EXT_POS;
+    memcpy(rec->payload, entry->key, key_len);
+    if (val_len)
+        memcpy(rec->payload + key_len, entry->cvt.val, val_len);
+    dirty_c2b(mt->wal_c2b);
+    write_unlock_c2b(mt->wal_c2b);
+
+    mt->wal_off += castle_memtable_wal_rec_len(entry->key, val_len);
+}
+
+/**
+ * Inserts (c_bvec->key, c_bvec->version) into the memtable.
+ *
+ * Mirrors castle_btree_write_process(): cvt_get() is called with the value being replaced
+ * (if any), live per-version stats are updated the same way.
+ */
+static void castle_memtable_write(c_bvec_t *c_bvec)
+{
+    struct castle_component_tree *ct = c_bvec->tree;
+    struct castle_memtable *mt = ct->memtable;
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    struct castle_memtable_entry *entry, *old;
+    cv_nonatomic_stats_t stats = { 0, 0, 0, 0, 0 };
+    c_val_tup_t old_cvt = INVAL_VAL_TUP, new_cvt = INVAL_VAL_TUP;
+    uint32_t val_len = 0;
+    int ret;
+
+    /* Allocate everything up front, nothing may fail once cvt_get() succeeded. */
+    if (!c_bvec_data_del(c_bvec) && (c_bvec->c_bio->replace->value_len <= MAX_INLINE_VAL_SIZE))
+        val_len = c_bvec->c_bio->replace->value_len;
+    entry = castle_memtable_entry_alloc(mt, c_bvec->key, c_bvec->version, val_len);
+    if (!entry)
+    {
+        ret = -ENOMEM;
+        goto err_out;
+    }
+
+    down_write(&mt->lock);
+    ret = castle_memtable_wal_room(c_bvec, castle_memtable_wal_rec_len(c_bvec->key, val_len));
+    if (ret)
+        goto err_unlock;
+
+    old = castle_memtable_entry_find(mt, btree, c_bvec->key, c_bvec->version);
+    if (old)
+        old_cvt = old->cvt;
+    if ((ret = c_bvec->cvt_get(c_bvec, old_cvt, &new_cvt)))
+        goto err_unlock;
+    BUG_ON(CVT_LEAF_PTR(new_cvt));
+    BUG_ON(CVT_INLINE(new_cvt) && (new_cvt.length != val_len));
+
+    castle_memtable_entry_cvt_set(entry, new_cvt);
+    castle_memtable_wal_write(ct, entry);
+    BUG_ON(castle_memtable_entry_insert(mt, btree, entry) != old);
+
+    /* Update live per-version statistics. */
+    if (!old)
+    {
+        atomic64_inc(&ct->item_count);
+        if (CVT_TOMB_STONE(new_cvt))
+            stats.tombstones++;
+        else
+            stats.keys++;
+    }
+    else if (CVT_TOMB_STONE(old_cvt))
+    {
+        /* Tombstone replacing a tombstone doesn't delete anything. */
+        if (!CVT_TOMB_STONE(new_cvt))
+        {
+            stats.keys++;
+            stats.tombstones--;
+        }
+    }
+    else
+    {
+        if (CVT_TOMB_STONE(new_cvt))
+        {
+            stats.keys--;
+            stats.tombstones++;
+            stats.tombstone_deletes++;
+        }
+        else
+            stats.key_replaces++;
+    }
+    castle_version_live_stats_adjust(c_bvec->version, stats);
+    up_write(&mt->lock);
+
+    /* Nobody can be looking at the replaced entry any more. */
+    if (old)
+        castle_memtable_entry_free(mt, old);
+    debug("Inserted into memtable of ct=%d, %llu entries.\n", ct->seq, mt->nr_entries);
+    c_bvec->submit_complete(c_bvec, 0, new_cvt);
+
+    return;
+
+err_unlock:
+    up_write(&mt->lock);
+    castle_memtable_entry_free(mt, entry);
+err_out:
+    c_bvec->submit_complete(c_bvec, ret, INVAL_VAL_TUP);
+}
+
+/**
+ * Looks (c_bvec->key, c_bvec->version) up in the memtable.
+ *
+ * Returns the entry for the closest ancestral version of the key, as
+ * castle_btree_read_process() does.
+ */
+static void castle_memtable_read(c_bvec_t *c_bvec)
+{
+    struct castle_component_tree *ct = c_bvec->tree;
+    struct castle_memtable *mt = ct->memtable;
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    struct castle_memtable_entry *entry;
+    c_val_tup_t cvt = INVAL_VAL_TUP;
+    struct rb_node *n;
+
+    down_read(&mt->lock);
+    /* Versions of a key are ordered newest first, the first ancestor is the closest. */
+    for (n = castle_memtable_key_bound(mt, btree, c_bvec->key, 0); n; n = rb_next(n))
+    {
+        entry = rb_entry(n, struct castle_memtable_entry, rb_node);
+        if (btree->key_compare(entry->key, c_bvec->key) != 0)
+            break;
+        if (castle_version_is_ancestor(entry->version, c_bvec->version))
+        {
+            cvt = entry->cvt;
+            c_bvec->found_version = entry->version;
+            break;
+        }
+    }
+
+    if (CVT_INLINE(cvt))
+    {
+        char *loc_buf = castle_malloc(cvt.length, GFP_NOIO);
+
+        if (!loc_buf)
+        {
+            up_read(&mt->lock);
+            c_bvec->submit_complete(c_bvec, -ENOMEM, INVAL_VAL_TUP);
+            return;
+        }
+        memcpy(loc_buf, cvt.val, cvt.length);
+        cvt.val = loc_buf;
+    }
+
+    /* Get reference on objects before the entry can be replaced. */
+    BUG_ON(!c_bvec->ref_get);
+    c_bvec->ref_get(c_bvec, cvt);
+    up_read(&mt->lock);
+
+    c_bvec->submit_complete(c_bvec, 0, cvt);
+}
+
+/**
+ * Handles a btree request against a memtable CT.
+ *
+ * Called from the btree workqueue in place of the btree walk.
+ *
+ * @also _castle_btree_submit()
+ */
+void castle_memtable_submit(c_bvec_t *c_bvec)
+{
+    BUG_ON(!c_bvec->tree->memtable);
+
+    if (c_bvec_data_dir(c_bvec) == WRITE)
+        castle_memtable_write(c_bvec);
+    else
+        castle_memtable_read(c_bvec);
+}
+
+/**
+ * Creates an empty memtable for a T0.
+ *
+ * The tree extent of the CT is used for the WAL, no root node is needed.
+ */
+int castle_memtable_create(struct castle_component_tree *ct)
+{
+    struct castle_memtable *mt;
+
+    BUILD_BUG_ON(MEMTABLE_WAL_MAX_REC_LEN > MEMTABLE_WAL_PAGE_SIZE);
+    BUG_ON(ct->memtable);
+    BUG_ON(ct->btree_type != RW_VLBA_TREE_TYPE);
+
+    mt = castle_zalloc(sizeof(struct castle_memtable), GFP_KERNEL);
+    if (!mt)
+        return -ENOMEM;
+    init_rwsem(&mt->lock);
+    mt->root = RB_ROOT;
+    ct->memtable = mt;
+
+    return 0;
+}
+
+void castle_memtable_destroy(struct castle_component_tree *ct)
+{
+    struct castle_memtable *mt = ct->memtable;
+    struct rb_node *n;
+
+    if (!mt)
+        return;
+
+    while ((n = rb_first(&mt->root)))
+    {
+        rb_erase(n, &mt->root);
+        castle_memtable_entry_free(mt, rb_entry(n, struct castle_memtable_entry, rb_node));
+    }
+    BUG_ON(atomic64_read(&mt->nr_bytes));
+    if (mt->wal_c2b)
+        put_c2b(mt->wal_c2b);
+    castle_free(mt);
+    ct->memtable = NULL;
+}
+
+/**
+ * Rebuilds the memtable of a CT read back from disk, from its WAL.
+ *
+ * Replays records from all WAL pages in use. Later records for the same (key, version)
+ * replace earlier ones, as the inserts did. Further inserts (if the CT is still a T0)
+ * go to a fresh WAL page.
+ *
+ * @return -ENOMEM  Out of memory
+ * @return -EIO     WAL page could not be read
+ */
+int castle_memtable_replay(struct castle_component_tree *ct)
+{
+    struct castle_memtable *mt = ct->memtable;
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    struct castle_memtable_wal_record *rec;
+    struct castle_memtable_entry *entry, *old;
+    c_byte_off_t used = atomic64_read(&ct->tree_ext_free.used);
+    c_ext_pos_t cep;
+    c_val_tup_t cvt;
+    c2_block_t *c2b;
+    uint8_t *page;
+    uint32_t off, rec_len;
+    int ret = 0;
+
+    BUG_ON(!mt || mt->nr_entries || mt->wal_c2b);
+
+    cep.ext_id = ct->tree_ext_free.ext_id;
+    for (cep.offset = 0; cep.offset < used; cep.offset += MEMTABLE_WAL_PAGE_SIZE)
+    {
+        c2b = castle_cache_block_get(cep, 1);
+        write_lock_c2b(c2b);
+        if (!c2b_uptodate(c2b) && submit_c2b_sync(READ, c2b))
+        {
+            ret = -EIO;
+            goto out;
+        }
+        page = c2b_buffer(c2b);
+
+        for (off = 0; off + sizeof(struct castle_memtable_wal_record) <= MEMTABLE_WAL_PAGE_SIZE;
+             off += rec_len)
+        {
+            rec = (struct castle_memtable_wal_record *)(page + off);
+            if ((rec->magic != MEMTABLE_WAL_MAGIC) || (rec->seq != ct->seq))
+                break;
+            rec_len = sizeof(struct castle_memtable_wal_record) + rec->key_len + rec->val_len;
+            if ((rec->key_len > MEMTABLE_WAL_MAX_KEY_LEN) ||
+                (rec->val_len > MAX_INLINE_VAL_SIZE) ||
+                (off + rec_len > MEMTABLE_WAL_PAGE_SIZE))
+            {
+                castle_printk(LOG_WARN, "Corrupt WAL record for ct=%d at "cep_fmt_str", off=%u\n",
+                        ct->seq, cep2str(cep), off);
+                break;
+            }
+
+            cvt = INVAL_VAL_TUP;
+            cvt.type   = rec->type;
+            cvt.length = rec->length;
+            if (CVT_INLINE(cvt))
+                cvt.val = rec->payload + rec->key_len;
+            else
+                cvt.cep = rec->cep;
+
+            entry = castle_memtable_entry_alloc(mt, rec->payload, rec->version, rec->val_len);
+            if (!entry)
+            {
+                ret = -ENOMEM;
+                goto out;
+            }
+            castle_memtable_entry_cvt_set(entry, cvt);
+            old = castle_memtable_entry_insert(mt, btree, entry);
+            if (old)
+                castle_memtable_entry_free(mt, old);
+        }
+
+        write_unlock_c2b(c2b);
+        put_c2b(c2b);
+    }
+    atomic64_set(&ct->item_count, mt->nr_entries);
+    castle_printk(LOG_INFO, "Replayed %llu memtable entries for ct=%d from %llu bytes of WAL.\n",
+            mt->nr_entries, ct->seq, used);
+
+    return 0;
+
+out:
+    write_unlock_c2b(c2b);
+    put_c2b(c2b);
+    return ret;
+}
+
+/**********************************************************************************************/
+/* Memtable iterator */
+
+static void castle_memtable_iter_buffer_init(c_mt_iter_t *iter, struct castle_btree_node *buf)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(iter->tree->btree_type);
+
+    /* Buffers are proper btree leaves, see castle_btree_node_buffer_init(). */
+    buf->magic   = BTREE_NODE_MAGIC;
+    buf->type    = iter->tree->btree_type;
+    buf->version = 0;
+    buf->used    = 0;
+    buf->is_leaf = 1;
+    buf->size    = btree->node_size(iter->tree, 0);
+}
+
+/**
+ * Copies the next batch of entries into the spare buffer, and makes it current.
+ *
+ * Carries on after the last entry of the current buffer (after the last key when returning
+ * a single version per key), from start_key if nothing was returned yet, or from from_key
+ * (following skip()) if specified.
+ *
+ * The current buffer is not touched, so that the last entry returned stays valid.
+ */
+static void castle_memtable_iter_fill(c_mt_iter_t *iter, void *from_key)
+{
+    struct castle_component_tree *ct = iter->tree;
+    struct castle_memtable *mt = ct->memtable;
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    struct castle_btree_node *cur = iter->bufs[iter->cur_buf];
+    struct castle_btree_node *buf = iter->bufs[!iter->cur_buf];
+    struct castle_memtable_entry *entry;
+    void *last_key = NULL;
+    c_ver_t last_version;
+    struct rb_node *n;
+    int full = 0;
+
+    castle_memtable_iter_buffer_init(iter, buf);
+
+    down_read(&mt->lock);
+    if (from_key)
+        n = castle_memtable_key_bound(mt, btree, from_key, 0);
+    else if (cur->used == 0)
+        n = castle_memtable_key_bound(mt, btree, iter->start_key, 0);
+    else
+    {
+        btree->entry_get(cur, cur->used - 1, &last_key, &last_version, NULL);
+        if (VERSION_INVAL(iter->version))
+            n = castle_memtable_kv_next(mt, btree, last_key, last_version);
+        else
+            n = castle_memtable_key_bound(mt, btree, last_key, 1);
+        last_key = NULL;
+    }
+
+    for (; n; n = rb_next(n))
+    {
+        entry = rb_entry(n, struct castle_memtable_entry, rb_node);
+        if (btree->key_compare(entry->key, iter->end_key) > 0)
+            break;
+        if (!VERSION_INVAL(iter->version))
+        {
+            /* Only the closest ancestral version of each key is visible. */
+            if (last_key && (btree->key_compare(entry->key, last_key) == 0))
+                continue;
+            if (!castle_version_is_ancestor(entry->version, iter->version))
+                continue;
+        }
+        if (btree->need_split(buf, 0))
+        {
+            full = 1;
+            break;
+        }
+        btree->entry_add(buf, buf->used, entry->key, entry->version, entry->cvt);
+        btree->entry_get(buf, buf->used - 1, &last_key, NULL, NULL);
+    }
+    up_read(&mt->lock);
+
+    iter->completed = !full;
+    iter->cur_buf   = !iter->cur_buf;
+    iter->cur_idx   = 0;
+    debug("Memtable iter %p got %d entries from ct=%d, completed=%d\n",
+            iter, buf->used, ct->seq, iter->completed);
+}
+
+static void castle_memtable_iter_register_cb(c_mt_iter_t *iter,
+                                             castle_iterator_end_io_t cb,
+                                             void *data)
+{
+    iter->end_io  = cb;
+    iter->private = data;
+}
+
+/**
+ * Memtables are in memory, entries are always ready.
+ */
+static int castle_memtable_iter_prep_next(c_mt_iter_t *iter)
+{
+    while ((iter->cur_idx >= iter->bufs[iter->cur_buf]->used) && !iter->completed)
+        castle_memtable_iter_fill(iter, NULL);
+
+    return 1;
+}
+
+static int castle_memtable_iter_has_next(c_mt_iter_t *iter)
+{
+    return (iter->cur_idx < iter->bufs[iter->cur_buf]->used);
+}
+
+static void castle_memtable_iter_next(c_mt_iter_t *iter,
+                                      void **key_p,
+                                      c_ver_t *version_p,
+                                      c_val_tup_t *cvt_p)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(iter->tree->btree_type);
+
+    BUG_ON(!castle_memtable_iter_has_next(iter));
+    btree->entry_get(iter->bufs[iter->cur_buf], iter->cur_idx, key_p, version_p, cvt_p);
+    iter->cur_idx++;
+}
+
+static void castle_memtable_iter_skip(c_mt_iter_t *iter, void *key)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(iter->tree->btree_type);
+    struct castle_btree_node *buf = iter->bufs[iter->cur_buf];
+    void *entry_key;
+
+    for (; iter->cur_idx < buf->used; iter->cur_idx++)
+    {
+        btree->entry_get(buf, iter->cur_idx, &entry_key, NULL, NULL);
+        if (btree->key_compare(entry_key, key) >= 0)
+            return;
+    }
+
+    /* Nothing left in the buffer, look the key up in the memtable. */
+    if (!iter->completed)
+        castle_memtable_iter_fill(iter, key);
+}
+
+void castle_memtable_iter_cancel(c_mt_iter_t *iter)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (iter->bufs[i])
+        {
+            castle_vfree(iter->bufs[i]);
+            iter->bufs[i] = NULL;
+        }
+}
+
+/**
+ * Initialises an iterator over entries of a memtable CT with keys in [start_key, end_key].
+ *
+ * @param version   Only return the entry visible in version, or all entries if INVAL_VERSION
+ */
+void castle_memtable_iter_init(c_mt_iter_t *iter,
+                               struct castle_component_tree *ct,
+                               c_ver_t version,
+                               void *start_key,
+                               void *end_key)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    int i;
+
+    BUG_ON(!ct->memtable);
+    iter->tree      = ct;
+    iter->err       = 0;
+    iter->version   = version;
+    iter->start_key = start_key;
+    iter->end_key   = end_key;
+    iter->cur_buf   = 0;
+    iter->cur_idx   = 0;
+    iter->completed = 0;
+    iter->end_io    = NULL;
+    iter->private   = NULL;
+    iter->bufs[0]   = iter->bufs[1] = NULL;
+
+    for (i = 0; i < 2; i++)
+    {
+        iter->bufs[i] = castle_vmalloc(btree->node_size(ct, 0) * C_BLK_SIZE);
+        if (!iter->bufs[i])
+        {
+            castle_memtable_iter_cancel(iter);
+            iter->err = -ENOMEM;
+            return;
+        }
+        castle_memtable_iter_buffer_init(iter, iter->bufs[i]);
+    }
+}
+
+struct castle_iterator_type castle_memtable_iter = {
+    .register_cb= (castle_iterator_register_cb_t)castle_memtable_iter_register_cb,
+    .prep_next  = (castle_iterator_prep_next_t)  castle_memtable_iter_prep_next,
+    .has_next   = (castle_iterator_has_next_t)   castle_memtable_iter_has_next,
+    .next       = (castle_iterator_next_t)       castle_memtable_iter_next,
+    .skip       = (castle_iterator_skip_t)       castle_memtable_iter_skip,
+    .cancel     = (castle_iterator_cancel_t)     castle_memtable_iter_cancel,
+};
@@ -0,0 +1,23 @@
+#ifndef __CASTLE_MEMTABLE_H__
+#define __CASTLE_MEMTABLE_H__
+
+#include "castle.h"
+
+/* WAL is written a page at a time, a write reserves at most one page. */
+#define MEMTABLE_WAL_PAGE_SIZE      (C_BLK_SIZE)
+
+int  castle_memtable_create      (struct castle_component_tree *ct);
+void castle_memtable_destroy     (struct castle_component_tree *ct);
+int  castle_memtable_replay      (struct castle_component_tree *ct);
+void castle_memtable_submit      (c_bvec_t *c_bvec);
+int  castle_memtable_over_budget (struct castle_component_tree *ct);
+
+void castle_memtable_iter_init   (c_mt_iter_t *iter,
+                                  struct castle_component_tree *ct,
+                                  c_ver_t version,
+                                  void *start_key,
+                                  void *end_key);
+void castle_memtable_iter_cancel (c_mt_iter_t *iter);
+extern struct castle_iterator_type castle_memtable_iter;
+
+#endif /* __CASTLE_MEMTABLE_H__ */
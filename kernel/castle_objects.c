@@ -171,6 +171,135 @@ c_vl_bkey_t* castle_object_key_convert(c_vl_okey_t *obj_key)
     return castle_object_btree_key_construct(NULL, obj_key, 0);
 }
 
+/**
+ * Start building a btree key with nr_dims dimensions in key_size bytes at key.  Dimensions
+ * are then added in order with castle_object_btree_key_dim_append().
+ *
+ * Lets callers build keys straight from their own copy of the dimensions, in memory
+ * of their choosing, without going through an object key.
+ *
+ * @return 0, or -ENAMETOOLONG if the key header doesn't fit
+ */
+int castle_object_btree_key_init(c_vl_bkey_t *key, uint32_t key_size, int nr_dims)
+{
+    uint32_t header_len = sizeof(c_vl_bkey_t) + 4 * nr_dims;
+
+    BUG_ON(nr_dims == 0);
+    if (header_len > key_size)
+        return -ENAMETOOLONG;
+
+    memset(key, 0, sizeof(c_vl_bkey_t));
+    key->length  = header_len - 4; /* Length doesn't include length field */
+    key->nr_dims = nr_dims;
+
+    return 0;
+}
+
+/**
+ * Append dimension dim, len bytes at data, to a key started with castle_object_btree_key_init().
+ * Zero length dimensions are -inf, as in castle_object_key_convert().
+ *
+ * @return 0, or -ENAMETOOLONG if the dimension doesn't fit in key_size or the key gets too long
+ */
+int castle_object_btree_key_dim_append(c_vl_bkey_t *key,
+                                       uint32_t key_size,
+                                       int dim,
+                                       const void *data,
+                                       uint32_t len)
+{
+    uint32_t offset = key->length + 4;
+
+    BUG_ON(dim >= key->nr_dims);
+    if ((len > key_size - offset) || (offset + len - 4 > VLBA_TREE_MAX_KEY_SIZE))
+        return -ENAMETOOLONG;
+
+    key->dim_head[dim] = KEY_DIMENSION_HEADER(offset,
+                                              len ? 0 : KEY_DIMENSION_MINUS_INFINITY_FLAG);
+    memcpy((char *)key + offset, data, len);
+    key->length += len;
+
+    return 0;
+}
+
+/**
+ * Check a flat key (c_vl_fkey_t) of key_len bytes, copied into key, and turn it into a btree
+ * key.  Flat keys share the btree key layout, so only zero length dimensions need flagging
+ * as -inf, as castle_object_key_convert() does.
+ *
+ * @return 0, or -EINVAL if the key is malformed, or has empty dimensions and !empty_dims_ok
+ */
+int castle_object_flat_key_import(c_vl_bkey_t *key, uint32_t key_len, int empty_dims_ok)
+{
+    uint32_t nr_dims, header_len, offset, end;
+    int i;
+
+    BUILD_BUG_ON(sizeof(c_vl_fkey_t) != sizeof(c_vl_bkey_t));
+    BUILD_BUG_ON(CASTLE_FKEY_DIM_OFFSET_SHIFT != KEY_DIMENSION_FLAGS_SHIFT);
+
+    if ((key_len < sizeof(c_vl_bkey_t)) || (key->length != key_len - 4))
+        return -EINVAL;
+    nr_dims = key->nr_dims;
+    if ((nr_dims == 0) || (nr_dims > (key_len - sizeof(c_vl_bkey_t)) / 4))
+        return -EINVAL;
+    header_len = sizeof(c_vl_bkey_t) + 4 * nr_dims;
+    if (KEY_DIMENSION_OFFSET(key->dim_head[0]) != header_len)
+        return -EINVAL;
+
+    for (i = 0; i < nr_dims; i++)
+    {
+        /* Flags are ours to set. */
+        if (KEY_DIMENSION_FLAGS(key->dim_head[i]))
+            return -EINVAL;
+
+        offset = KEY_DIMENSION_OFFSET(key->dim_head[i]);
+        end    = (i+1 < nr_dims) ? KEY_DIMENSION_OFFSET(key->dim_head[i+1]) : key_len;
+        if ((end < offset) || (end > key_len))
+            return -EINVAL;
+        if (end == offset)
+        {
+            if (!empty_dims_ok)
+                return -EINVAL;
+            key->dim_head[i] = KEY_DIMENSION_HEADER(offset, KEY_DIMENSION_MINUS_INFINITY_FLAG);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Object key for btree_key, in a single allocation to be freed with castle_free().
+ *
+ * @also castle_object_btree_key_convert()
+ */
+c_vl_okey_t* castle_object_btree_key_okey_build(c_vl_bkey_t *btree_key)
+{
+    c_vl_okey_t *obj_key;
+    c_vl_key_t *dim;
+    uint32_t size, dim_len;
+    int i;
+
+    size = sizeof(c_vl_okey_t) + btree_key->nr_dims * (sizeof(c_vl_key_t *) + sizeof(c_vl_key_t));
+    for (i = 0; i < btree_key->nr_dims; i++)
+        size += castle_object_btree_key_dim_length(btree_key, i);
+
+    obj_key = castle_malloc(size, GFP_KERNEL);
+    if (!obj_key)
+        return NULL;
+
+    obj_key->nr_dims = btree_key->nr_dims;
+    dim = (c_vl_key_t *)&obj_key->dims[obj_key->nr_dims];
+    for (i = 0; i < btree_key->nr_dims; i++)
+    {
+        dim_len = castle_object_btree_key_dim_length(btree_key, i);
+        dim->length = dim_len;
+        memcpy(dim->key, castle_object_btree_key_dim_get(btree_key, i), dim_len);
+        obj_key->dims[i] = dim;
+        dim = (c_vl_key_t *)(dim->key + dim_len);
+    }
+
+    return obj_key;
+}
+
 c_vl_okey_t* castle_object_btree_key_convert(c_vl_bkey_t *btree_key)
 {
     c_vl_okey_t *obj_key;
@@ -283,6 +412,91 @@ int castle_object_btree_key_compare(c_vl_bkey_t *key1, c_vl_bkey_t *key2)
     return 0;
 }
 
+/**
+ * Checks if the btree key lies within the hypercube spanned by the start and end btree keys,
+ * i.e. if each of its dimensions is within the bounds of the same dimension of the keys.
+ *
+ * @return 1 if it does, 0 otherwise (also for keys with different # of dimensions)
+ */
+int castle_object_btree_key_in_hypercube(c_vl_bkey_t *key, c_vl_bkey_t *start, c_vl_bkey_t *end)
+{
+    int dim;
+
+    if((key->nr_dims != start->nr_dims) || (key->nr_dims != end->nr_dims))
+        return 0;
+
+    for(dim=0; dim<key->nr_dims; dim++)
+    {
+        char *key_dim          = castle_object_btree_key_dim_get(key, dim);
+        uint32_t key_dim_len   = castle_object_btree_key_dim_length(key, dim);
+        uint32_t key_dim_flags = castle_object_btree_key_dim_flags_get(key, dim);
+
+        if(castle_object_key_dim_compare(key_dim,
+                                         key_dim_len,
+                                         key_dim_flags,
+                                         castle_object_btree_key_dim_get(start, dim),
+                                         castle_object_btree_key_dim_length(start, dim),
+                                         castle_object_btree_key_dim_flags_get(start, dim)) < 0)
+            return 0;
+        if(castle_object_key_dim_compare(key_dim,
+                                         key_dim_len,
+                                         key_dim_flags,
+                                         castle_object_btree_key_dim_get(end, dim),
+                                         castle_object_btree_key_dim_length(end, dim),
+                                         castle_object_btree_key_dim_flags_get(end, dim)) > 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Returns a 64-bit prefix of a btree key, which preserves the key order.
+ *
+ * For any keys key1 < key2 (see castle_object_btree_key_compare()), prefix(key1) <=
+ * prefix(key2). Keys with different prefixes can therefore be ordered on their prefixes
+ * alone. The prefix is the number of dimensions (most significant byte), followed by the
+ * first 7 bytes of the first dimension, zero padded.
+ */
+uint64_t castle_object_btree_key_prefix(c_vl_bkey_t *key)
+{
+    uint64_t prefix;
+    uint32_t dim_len, i;
+    uint8_t *dim;
+
+    prefix = (key->nr_dims > 0xFF) ? 0xFF : key->nr_dims;
+    if (key->nr_dims == 0)
+        return prefix << 56;
+
+    /* +inf dimension is greater than any dimension. */
+    if (castle_object_btree_key_dim_flags_get(key, 0) & KEY_DIMENSION_PLUS_INFINITY_FLAG)
+        return (prefix << 56) | 0x00FFFFFFFFFFFFFFULL;
+
+    dim     = (uint8_t *)castle_object_btree_key_dim_get(key, 0);
+    dim_len = castle_object_btree_key_dim_length(key, 0);
+    for (i = 0; i < 7; i++)
+        prefix = (prefix << 8) | ((i < dim_len) ? dim[i] : 0);
+
+    return prefix;
+}
+
+/**
+ * Hash of the dimensions of a btree key, chained in dimension order.  Matches the hash
+ * castle_double_array_okey_cpu_index() works out for the corresponding object key.
+ */
+uint32_t castle_object_btree_key_dims_hash(c_vl_bkey_t *key)
+{
+    uint32_t seed = 0;
+    int i;
+
+    for (i = 0; i < key->nr_dims; i++)
+        seed = murmur_hash_32(castle_object_btree_key_dim_get(key, i),
+                              castle_object_btree_key_dim_length(key, i),
+                              seed);
+
+    return seed;
+}
+
 static void castle_object_btree_key_dim_inc(c_vl_bkey_t *key, int dim)
 {
     uint32_t flags = KEY_DIMENSION_FLAGS(key->dim_head[dim]);
@@ -318,13 +532,153 @@ void *castle_object_btree_key_next(c_vl_bkey_t *key)
     return new_key;
 }
 
+/**
+ * Checks an iterator filter from userspace, for keys with nr_dims dimensions.  The filter is
+ * filter->length + 4 bytes long.
+ */
+static int castle_object_iter_filter_check(castle_iter_filter_t *filter, uint32_t nr_dims)
+{
+    uint64_t filter_len = (uint64_t)filter->length + sizeof(filter->length);
+    struct castle_iter_dim_filter *dim_filter;
+    int i;
+
+    if (filter_len < sizeof(castle_iter_filter_t) ||
+        filter->nr_dims > (filter_len - sizeof(castle_iter_filter_t))
+                            / sizeof(struct castle_iter_dim_filter))
+    {
+        castle_printk(LOG_WARN, "Iterator filter with %u dims doesn't fit in %llu bytes.\n",
+                filter->nr_dims, filter_len);
+        return -EINVAL;
+    }
+
+    if (filter->max_val_len && filter->min_val_len > filter->max_val_len)
+    {
+        castle_printk(LOG_WARN, "Iterator filter value length %llu-%llu is empty.\n",
+                filter->min_val_len, filter->max_val_len);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < filter->nr_dims; i++)
+    {
+        dim_filter = &filter->dims[i];
+        if (dim_filter->dim >= nr_dims ||
+            dim_filter->prefix_len == 0 ||
+            (uint64_t)dim_filter->prefix_offset + dim_filter->prefix_len > filter_len)
+        {
+            castle_printk(LOG_WARN, "Bad iterator filter %d: dim=%u, prefix %u+%u.\n",
+                    i, dim_filter->dim, dim_filter->prefix_offset, dim_filter->prefix_len);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Checks a btree key dimension against the prefix filters on it.  Returns 0 if it starts
+ * with all of the prefixes, otherwise -1 or 1 as the dimension sorts before or after the
+ * keys of the first prefix it doesn't match.
+ */
+static int castle_object_iter_filter_dim_check(castle_iter_filter_t *filter,
+                                               int dim,
+                                               char *key_dim,
+                                               uint32_t key_dim_len,
+                                               uint32_t key_dim_flags)
+{
+    struct castle_iter_dim_filter *dim_filter;
+    char *prefix;
+    int i, cmp;
+
+    for (i = 0; i < filter->nr_dims; i++)
+    {
+        dim_filter = &filter->dims[i];
+        if (dim_filter->dim != dim)
+            continue;
+
+        if (key_dim_flags & KEY_DIMENSION_MINUS_INFINITY_FLAG)
+            return -1;
+        if (key_dim_flags & KEY_DIMENSION_PLUS_INFINITY_FLAG)
+            return 1;
+
+        prefix = (char *)filter + dim_filter->prefix_offset;
+        cmp = memcmp(key_dim, prefix, min(key_dim_len, dim_filter->prefix_len));
+        if (cmp)
+            return cmp < 0 ? -1 : 1;
+        if (key_dim_len < dim_filter->prefix_len)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether the value of an entry passes the filter's value length bounds.
+ */
+static int castle_object_iter_filter_val_check(castle_iter_filter_t *filter, c_val_tup_t *cvt)
+{
+    if (cvt->length < filter->min_val_len)
+        return 0;
+    if (filter->max_val_len && cvt->length > filter->max_val_len)
+        return 0;
+
+    return 1;
+}
+
+/**
+ * Copy of start_key with each filtered dimension raised to its prefix, where it is lower.
+ * Range queries start from this key, and skip to it when a key is below a prefix, so that
+ * keys before the prefixes are never read.
+ */
+static c_vl_okey_t* castle_object_iter_filter_lower_okey(c_vl_okey_t *start_key,
+                                                         castle_iter_filter_t *filter)
+{
+    struct castle_iter_dim_filter *dim_filter;
+    c_vl_okey_t *lower_key;
+    c_vl_key_t *dim;
+    char *prefix;
+    int i;
+
+    lower_key = castle_object_okey_copy(start_key);
+    if (!lower_key)
+        return NULL;
+
+    for (i = 0; i < filter->nr_dims; i++)
+    {
+        dim_filter = &filter->dims[i];
+        dim = lower_key->dims[dim_filter->dim];
+        prefix = (char *)filter + dim_filter->prefix_offset;
+        if (castle_object_key_dim_compare(dim->key,
+                                          dim->length,
+                                          dim->length ? 0 : KEY_DIMENSION_MINUS_INFINITY_FLAG,
+                                          prefix,
+                                          dim_filter->prefix_len,
+                                          0) >= 0)
+            continue;
+
+        dim = castle_malloc(sizeof(c_vl_key_t) + dim_filter->prefix_len, GFP_KERNEL);
+        if (!dim)
+        {
+            castle_object_okey_free(lower_key);
+            return NULL;
+        }
+        dim->length = dim_filter->prefix_len;
+        memcpy(dim->key, prefix, dim_filter->prefix_len);
+        castle_free(lower_key->dims[dim_filter->dim]);
+        lower_key->dims[dim_filter->dim] = dim;
+    }
+
+    return lower_key;
+}
+
 /* Checks if the btree key is within the bounds imposed by start/end object keys.
    Returns 1 if the most significant dimension is greater than the end, -1 if it is
    less then start, or 0 if the key is within bounds. Optionally, the function can
-   be queried about which dimension offeneded */
+   be queried about which dimension offeneded. Dimensions outside of the prefixes of
+   the optional filter are out of bounds too. */
 static int castle_object_btree_key_bounds_check(c_vl_bkey_t *key,
                                                 c_vl_okey_t *start,
                                                 c_vl_okey_t *end,
+                                                castle_iter_filter_t *filter,
                                                 int *offending_dim_p)
 {
     int dim;
@@ -382,6 +736,20 @@ static int castle_object_btree_key_bounds_check(c_vl_bkey_t *key,
             if(offending_dim_p) *offending_dim_p = dim;
             return 1;
         }
+
+        if(filter)
+        {
+            cmp = castle_object_iter_filter_dim_check(filter,
+                                                      dim,
+                                                      key_dim,
+                                                      key_dim_len,
+                                                      key_dim_flags);
+            if(cmp)
+            {
+                if(offending_dim_p) *offending_dim_p = dim;
+                return cmp;
+            }
+        }
     }
 
     return 0;
@@ -501,8 +869,9 @@ static int _castle_objects_rq_iter_prep_next(castle_object_iterator_t *iter,
            Check if that's within the rq hypercube */
         castle_da_rq_iter.next(&iter->da_rq_iter, &k, &v, &cvt);
         out_of_range = castle_object_btree_key_bounds_check(k,
-                                                            iter->start_okey,
+                                                            iter->lower_okey,
                                                             iter->end_okey,
+                                                            iter->filter,
                                                             &offending_dim);
 #ifdef DEBUG
         debug("Got the following key from da_rq iterator. Is in range: %d, offending_dim=%d\n",
@@ -522,7 +891,7 @@ static int _castle_objects_rq_iter_prep_next(castle_object_iterator_t *iter,
             /* We are outside of the rq hypercube, find next intersection point
                and skip to that */
             next_key = castle_object_btree_key_skip(k,
-                                                    iter->start_okey,
+                                                    iter->lower_okey,
                                                     offending_dim,
                                                     out_of_range);
             /* Save the key, to be freed the next time around the loop/on cancel */
@@ -535,6 +904,11 @@ static int _castle_objects_rq_iter_prep_next(castle_object_iterator_t *iter,
 #endif
             castle_da_rq_iter.skip(&iter->da_rq_iter, next_key);
         }
+        else if(iter->filter && !castle_object_iter_filter_val_check(iter->filter, &cvt))
+        {
+            /* In the hypercube, but the value doesn't match, move on to the next key */
+            debug("Value of length %llu filtered out.\n", (uint64_t)cvt.length);
+        }
         else
         {
             /* Found something to cache, save */
@@ -591,6 +965,9 @@ static void castle_objects_rq_iter_cancel(castle_object_iterator_t *iter)
         castle_object_bkey_free(iter->start_bkey);
     if(iter->end_bkey)
         castle_object_bkey_free(iter->end_bkey);
+    if(iter->lower_okey && iter->lower_okey != iter->start_okey)
+        castle_object_okey_free(iter->lower_okey);
+    iter->lower_okey = NULL;
     castle_objects_rq_iter_next_key_free(iter);
 }
 
@@ -605,8 +982,12 @@ static void castle_objects_rq_iter_init(castle_object_iterator_t *iter)
        but will prevent castle_object_rq_iter_cancel from cancelling the
        da_rq_iter unnecessarily */
     iter->da_rq_iter.err = -EINVAL;
+    /* Skip the keys before the filter prefixes straight away */
+    iter->lower_okey    = iter->start_okey;
+    if(iter->filter)
+        iter->lower_okey = castle_object_iter_filter_lower_okey(iter->start_okey, iter->filter);
     /* Construct the btree keys for range-query */
-    iter->start_bkey    = castle_object_key_convert(iter->start_okey);
+    iter->start_bkey    = iter->lower_okey ? castle_object_key_convert(iter->lower_okey) : NULL;
     iter->end_bkey      = castle_object_key_convert(iter->end_okey);
     iter->last_next_key = NULL;
     iter->completed     = 0;
@@ -869,7 +1250,8 @@ static void castle_object_replace_complete(struct castle_bio_vec *c_bvec,
     debug("castle_object_replace_complete\n");
 
     /* Free the key */
-    castle_object_bkey_free(c_bvec->key);
+    if (!test_bit(CBV_KEY_BORROWED, &c_bvec->flags))
+        castle_object_bkey_free(c_bvec->key);
 
     if(err && !cancelled)
         castle_printk(LOG_WARN, "Failed to insert into btree.\n");
@@ -880,8 +1262,8 @@ static void castle_object_replace_complete(struct castle_bio_vec *c_bvec,
     if(err && CVT_LARGE_OBJECT(cvt))
         castle_extent_free(cvt.cep.ext_id);
 
-    /* Reserve kmalloced memory for inline objects. */
-    if(CVT_INLINE(cvt))
+    /* Reserve kmalloced memory for inline objects (unless it is the client's). */
+    if(CVT_INLINE(cvt) && !replace->data_get)
         castle_free(cvt.val);
 
     /* Unreserve any space we may still hold in the CT. Drop the CT ref. */
@@ -917,8 +1299,12 @@ static void castle_object_da_replace_complete(struct castle_bio_vec *c_bvec,
 
 /**
  * Schedules the DA key insertion.
+ *
+ * Also used by batches to insert keys of prepared replaces.
+ *
+ * @also castle_object_replace_batch_queue()
  */
-static void castle_object_replace_key_insert(struct castle_object_replace *replace)
+void castle_object_replace_insert(struct castle_object_replace *replace)
 {
     c_bvec_t *c_bvec = replace->c_bvec;
 
@@ -932,6 +1318,36 @@ static void castle_object_replace_key_insert(struct castle_object_replace *repla
     BUG_ON(replace->data_c2b);
     castle_double_array_submit(c_bvec);
 }
+EXPORT_SYMBOL(castle_object_replace_insert);
+
+/**
+ * Called once the value has been written out. Inserts the key, unless the replace is part
+ * of a batch, which inserts all its keys together.
+ */
+static void castle_object_replace_key_insert(struct castle_object_replace *replace)
+{
+    if (replace->prepared)
+    {
+        replace->prepared(replace);
+        return;
+    }
+
+    castle_object_replace_insert(replace);
+}
+
+/**
+ * Abandons a replace of a batch, before its key got inserted.
+ *
+ * Releases the space reserved for it, and calls back to the client with err.
+ */
+void castle_object_replace_abort(struct castle_object_replace *replace, int err)
+{
+    BUG_ON(!err || (err == -EPIPE));
+    BUG_ON(replace->data_c2b);
+
+    castle_object_replace_complete(replace->c_bvec, err, replace->cvt);
+}
+EXPORT_SYMBOL(castle_object_replace_abort);
 
 int castle_object_replace_continue(struct castle_object_replace *replace)
 {
@@ -1097,6 +1513,14 @@ static int castle_object_replace_space_reserve(struct castle_object_replace *rep
     {
         void *value;
 
+        /* The btree copies inline values into the leaf, insert straight from the client's
+           buffer if it is available for the duration of the replace. */
+        if(replace->data_get)
+        {
+            CVT_INLINE_SET(replace->cvt, value_len, replace->data_get(replace));
+            return 0;
+        }
+
         /* Allocate memory. */
         value = castle_malloc(value_len, GFP_KERNEL);
         if(!value)
@@ -1148,17 +1572,16 @@ static int castle_object_replace_space_reserve(struct castle_object_replace *rep
 }
 
 /**
- * Callback used after the request went through the DA throttling, and btree/medium
- * object extent space has been reserved.
+ * Starts a replace once btree/medium object extent space has been reserved for it.
  *
  * This function allocates memory/extent space, and starts the write.
  *
  * If the write is completed in one shot it schedules the key insert. If not, it notifies
  * the client and exits.
  */
-static void castle_object_replace_queue_complete(struct castle_bio_vec *c_bvec, int err)
+static void castle_object_replace_start(struct castle_object_replace *replace, int err)
 {
-    struct castle_object_replace *replace = c_bvec->c_bio->replace;
+    c_bvec_t *c_bvec = replace->c_bvec;
     int write_complete;
 
     /* Handle the error case first. Notify the client, and exit. */
@@ -1207,6 +1630,24 @@ err_out:
     castle_object_replace_complete(c_bvec, err, replace->cvt);
 }
 
+/**
+ * Callback used after the request went through the DA throttling, and btree/medium
+ * object extent space has been reserved (or failed to be).
+ *
+ * Starts every replace of the chain space was reserved for.
+ */
+static void castle_object_replace_queue_complete(struct castle_bio_vec *c_bvec, int err)
+{
+    struct castle_object_replace *replace = c_bvec->c_bio->replace, *next;
+
+    do {
+        /* The replace may complete, and go away, once started. */
+        next = replace->next;
+        castle_object_replace_start(replace, err);
+        replace = next;
+    } while (replace);
+}
+
 /**
  * Starts object replace.
  * It allocates memory for the BIO and btree key, sets up the requsets, and submits the
@@ -1219,10 +1660,49 @@ int castle_object_replace(struct castle_object_replace *replace,
                           int cpu_index,
                           int tombstone)
 {
-    c_vl_bkey_t *btree_key = NULL;
+    c_vl_bkey_t *btree_key;
+    int i, ret;
+
+    /* Checks on the key. */
+    for (i=0; i<key->nr_dims; i++)
+        if(key->dims[i]->length == 0)
+            return -EINVAL;
+
+    /* Create btree key out of the object key. */
+    btree_key = castle_object_key_convert(key);
+    if(!btree_key)
+        return -EINVAL;
+
+    ret = castle_object_bkey_replace(replace, attachment, btree_key, 0 /*key_borrowed*/,
+                                     cpu_index, tombstone);
+    if(ret)
+        castle_object_bkey_free(btree_key);
+
+    return ret;
+}
+EXPORT_SYMBOL(castle_object_replace);
+
+/**
+ * Sets up object replace, for a key already converted to a btree key, without queueing it.
+ *
+ * Replaces set up this way are queued by castle_object_replace_batch_queue(), or have to be
+ * abandoned with castle_object_replace_abort().
+ *
+ * @param btree_key     Key to insert, freed once the replace completes (but not on error)
+ * @param key_borrowed  btree_key is the caller's, valid until the replace completes, and
+ *                      is never freed
+ *
+ * @also castle_object_bkey_replace()
+ */
+int castle_object_bkey_replace_init(struct castle_object_replace *replace,
+                                    struct castle_attachment *attachment,
+                                    c_vl_bkey_t *btree_key,
+                                    int key_borrowed,
+                                    int cpu_index,
+                                    int tombstone)
+{
     c_bvec_t *c_bvec = NULL;
     c_bio_t *c_bio = NULL;
-    int i, ret;
 
     /* Sanity checks. */
     BUG_ON(!attachment);
@@ -1234,22 +1714,10 @@ int castle_object_replace(struct castle_object_replace *replace,
     if(!castle_fs_inited)
         return -ENODEV;
 
-    /* Checks on the key. */
-    for (i=0; i<key->nr_dims; i++)
-        if(key->dims[i]->length == 0)
-            return -EINVAL;
-
-    /* Create btree key out of the object key. */
-    ret = -EINVAL;
-    btree_key = castle_object_key_convert(key);
-    if(!btree_key)
-        goto err_out;
-
     /* Allocate castle bio with a single bvec. */
-    ret = -ENOMEM;
     c_bio = castle_utils_bio_alloc(1);
     if(!c_bio)
-        goto err_out;
+        return -ENOMEM;
 
     /* Initialise the bio. */
     c_bio->attachment    = attachment;
@@ -1265,6 +1733,8 @@ int castle_object_replace(struct castle_object_replace *replace,
     c_bvec->cpu_index      = cpu_index;
     c_bvec->cpu            = castle_double_array_request_cpu(c_bvec->cpu_index);
     c_bvec->flags          = 0;
+    if(key_borrowed)
+        set_bit(CBV_KEY_BORROWED, &c_bvec->flags);
     c_bvec->cvt_get        = castle_object_replace_cvt_get;
     c_bvec->queue_complete = castle_object_replace_queue_complete;
     c_bvec->orig_complete  = NULL;
@@ -1274,31 +1744,73 @@ int castle_object_replace(struct castle_object_replace *replace,
     replace->c_bvec = c_bvec;
     CVT_INVALID_SET(replace->cvt);
     replace->data_c2b = NULL;
+    replace->next     = NULL;
+    replace->prepared = NULL;
+
+    return 0;
+}
+EXPORT_SYMBOL(castle_object_bkey_replace_init);
+
+/**
+ * Starts object replace, for a key already converted to a btree key.
+ *
+ * @also castle_object_bkey_replace_init()
+ * @also castle_object_replace()
+ */
+int castle_object_bkey_replace(struct castle_object_replace *replace,
+                               struct castle_attachment *attachment,
+                               c_vl_bkey_t *btree_key,
+                               int key_borrowed,
+                               int cpu_index,
+                               int tombstone)
+{
+    int ret;
+
+    ret = castle_object_bkey_replace_init(replace, attachment, btree_key, key_borrowed,
+                                          cpu_index, tombstone);
+    if (ret)
+        return ret;
 
     /* Queue up in the DA. */
-    castle_double_array_queue(c_bvec);
+    castle_double_array_queue(replace->c_bvec);
 
     return 0;
+}
+EXPORT_SYMBOL(castle_object_bkey_replace);
 
-err_out:
-    /* Free up allocated memory on errors. */
-    if(ret)
+/**
+ * Queues a chain of replaces set up by castle_object_bkey_replace_init(), linked through
+ * replace->next, all to the same cpu_index.
+ *
+ * Space in the T0 is reserved for the whole chain at once, values are then written out.
+ * Every replace calls back through replace->prepared() once its value is written out, or
+ * through replace->complete() if it failed. Keys get inserted by the caller, with
+ * castle_object_replace_insert(), or the replaces get abandoned with
+ * castle_object_replace_abort(). Values have to be available in full (no
+ * replace_continue()).
+ *
+ * @also castle_da_reserve()
+ */
+void castle_object_replace_batch_queue(struct castle_object_replace *replace)
+{
+    struct castle_object_replace *r;
+
+    for (r = replace; r; r = r->next)
     {
-        if(btree_key)
-            castle_object_bkey_free(btree_key);
-        if(c_bio)
-            castle_utils_bio_free(c_bio);
+        BUG_ON(!r->prepared);
+        BUG_ON(r->c_bvec->cpu_index != replace->c_bvec->cpu_index);
     }
 
-    return ret;
+    castle_double_array_queue(replace->c_bvec);
 }
-EXPORT_SYMBOL(castle_object_replace);
+EXPORT_SYMBOL(castle_object_replace_batch_queue);
 
 void castle_object_slice_get_end_io(void *obj_iter, int err);
 
 int castle_object_iter_start(struct castle_attachment *attachment,
                             c_vl_okey_t *start_key,
                             c_vl_okey_t *end_key,
+                            castle_iter_filter_t *filter,
                             castle_object_iterator_t **iter)
 {
     castle_object_iterator_t *iterator;
@@ -1309,6 +1821,8 @@ int castle_object_iter_start(struct castle_attachment *attachment,
         castle_printk(LOG_WARN, "Range query with different # of dimensions.\n");
         return -EINVAL;
     }
+    if(filter && castle_object_iter_filter_check(filter, start_key->nr_dims))
+        return -EINVAL;
     /* Mark the key that this is end key. To notify this is infinity and +ve.
      * Assuming that end_key will not used anywhere before converting into
      * btree_key. */
@@ -1330,6 +1844,7 @@ int castle_object_iter_start(struct castle_attachment *attachment,
     /* Initialise the iterator */
     iterator->start_okey = start_key;
     iterator->end_okey   = end_key;
+    iterator->filter     = filter;
     iterator->version    = attachment->version;
     iterator->da_id      = castle_version_da_id_get(iterator->version);
 
@@ -1410,6 +1925,10 @@ int castle_object_iter_next(castle_object_iterator_t *iterator,
         else
         {
             debug_rq("Calling next available callback with key=%p.\n", key);
+            /* Trim inline values to the filter's value prefix */
+            if (iterator->filter && iterator->filter->val_prefix_len && CVT_INLINE(val)
+                    && val.length > iterator->filter->val_prefix_len)
+                val.length = iterator->filter->val_prefix_len;
             continue_iterator = callback(iterator, key, &val, 0, iterator->next_available_data);
             castle_object_okey_free(key);
         }
@@ -1445,6 +1964,159 @@ void castle_object_slice_get_end_io(void *obj_iter, int err)
     queue_work(castle_wq, &iter->work);
 }
 
+/* Entries counted before the walk gives way to other work on castle_wq. */
+#define RANGE_STATS_BATCH           (1024)
+
+static void castle_object_range_stats_walk(struct work_struct *work);
+
+static void castle_object_range_stats_end_io(void *obj_iter, int err)
+{
+    castle_object_iterator_t *iter = obj_iter;
+    castle_object_range_stats_t *stats = iter->data;
+
+    BUG_ON(!castle_objects_rq_iter_prep_next(iter));
+    CASTLE_INIT_WORK(&stats->work, castle_object_range_stats_walk);
+    queue_work(castle_wq, &stats->work);
+}
+
+static void castle_object_range_stats_walk(struct work_struct *work)
+{
+    castle_object_range_stats_t *stats = container_of(work, castle_object_range_stats_t, work);
+    castle_object_iterator_t *iter = stats->iter;
+    c_vl_bkey_t *k;
+    c_val_tup_t cvt;
+    void *key_buf;
+    c_ver_t v;
+    int nr_entries = 0;
+
+    while (castle_objects_rq_iter.prep_next(iter))
+    {
+        if (!castle_objects_rq_iter.has_next(iter))
+        {
+            debug_rq("Range stats done, %llu entries.\n", stats->nr_entries);
+            castle_object_iter_finish(iter);
+            stats->iter = NULL;
+            if (stats->nr_entries == 0)
+                stats->first_key = stats->last_key = NULL;
+            /* stats may be freed by complete() */
+            key_buf = stats->key_buf;
+            stats->complete(stats, 0);
+            if (key_buf)
+                castle_free(key_buf);
+            return;
+        }
+
+        /* The next entry is cached, pick up from it once other work has had a go. */
+        if (++nr_entries > RANGE_STATS_BATCH)
+        {
+            queue_work(castle_wq, &stats->work);
+            return;
+        }
+
+        castle_objects_rq_iter.next(iter, (void **)&k, &v, &cvt);
+        if (CVT_TOMB_STONE(cvt))
+            continue;
+
+        stats->nr_entries++;
+        stats->nr_bytes += cvt.length;
+        if (stats->keys)
+        {
+            BUG_ON(k->length > VLBA_TREE_MAX_KEY_SIZE);
+            if (stats->nr_entries == 1)
+                memcpy(stats->first_key, k, k->length + 4);
+            memcpy(stats->last_key, k, k->length + 4);
+        }
+    }
+
+    /* Waiting for the iterator, castle_object_range_stats_end_io() carries on. */
+}
+
+/**
+ * Count the entries in the start_key - end_key hypercube, and add up the lengths of their
+ * values, without handing any of them to the client.  stats->complete() is called when done,
+ * possibly before this returns.  The keys belong to the caller, and must stay around till
+ * then.
+ */
+int castle_object_range_stats(castle_object_range_stats_t *stats,
+                              struct castle_attachment *attachment,
+                              c_vl_okey_t *start_key,
+                              c_vl_okey_t *end_key)
+{
+    int err;
+
+    stats->nr_entries = 0;
+    stats->nr_bytes   = 0;
+    stats->first_key  = NULL;
+    stats->last_key   = NULL;
+    stats->key_buf    = NULL;
+    if (stats->keys)
+    {
+        stats->key_buf = castle_malloc(2 * (VLBA_TREE_MAX_KEY_SIZE + 4), GFP_KERNEL);
+        if (!stats->key_buf)
+            return -ENOMEM;
+        stats->first_key = stats->key_buf;
+        stats->last_key  = stats->key_buf + VLBA_TREE_MAX_KEY_SIZE + 4;
+    }
+
+    err = castle_object_iter_start(attachment, start_key, end_key, NULL, &stats->iter);
+    if (err)
+    {
+        if (stats->key_buf)
+            castle_free(stats->key_buf);
+        return err;
+    }
+    castle_objects_rq_iter_register_cb(stats->iter, castle_object_range_stats_end_io, stats);
+
+    CASTLE_INIT_WORK(&stats->work, castle_object_range_stats_walk);
+    castle_object_range_stats_walk(&stats->work);
+
+    return 0;
+}
+
+/**
+ * Remove every key in the start_key - end_key hypercube, without the keys going through the
+ * client.  A range tombstone is recorded in the doubling array instead of tombstoning the keys
+ * one by one, @see castle_double_array_range_remove().  The keys belong to the caller.
+ */
+int castle_object_range_remove(struct castle_attachment *attachment,
+                               c_vl_okey_t *start_key,
+                               c_vl_okey_t *end_key)
+{
+    c_vl_bkey_t *start_bkey, *end_bkey;
+    int i, err;
+
+    if(start_key->nr_dims != end_key->nr_dims)
+    {
+        castle_printk(LOG_WARN, "Range remove with different # of dimensions.\n");
+        return -EINVAL;
+    }
+    /* Empty dimensions of the end key are +inf, as for range queries. */
+    for (i=0; i<end_key->nr_dims; i++)
+    {
+        if (end_key->dims[i]->length == 0)
+        {
+            end_key->dims[i]->length = PLUS_INFINITY_DIM_LENGTH;
+            break;
+        }
+    }
+
+    start_bkey = castle_object_key_convert(start_key);
+    end_bkey   = castle_object_key_convert(end_key);
+    err = -EINVAL;
+    if (!start_bkey || !end_bkey)
+        goto out;
+
+    err = castle_double_array_range_remove(attachment->version, start_bkey, end_bkey);
+
+out:
+    if (start_bkey)
+        castle_object_bkey_free(start_bkey);
+    if (end_bkey)
+        castle_object_bkey_free(end_bkey);
+
+    return err;
+}
+
 static int castle_object_reference_get(c_bvec_t    *c_bvec,
                                        c_val_tup_t  cvt)
 {
@@ -1641,7 +2313,8 @@ void castle_object_get_complete(struct castle_bio_vec *c_bvec,
     BUG_ON(c_bio->err != 0);
 
     /* Free the key */
-    castle_object_bkey_free(c_bvec->key);
+    if (!test_bit(CBV_KEY_BORROWED, &c_bvec->flags))
+        castle_object_bkey_free(c_bvec->key);
 
     /* Deal with error case, or non-existant value. */
     if(err || CVT_INVALID(cvt) || CVT_TOMB_STONE(cvt))
@@ -1673,7 +2346,7 @@ void castle_object_get_complete(struct castle_bio_vec *c_bvec,
     }
 
     BUG_ON(CVT_MEDIUM_OBJECT(cvt) &&
-            cvt.cep.ext_id != c_bvec->tree->data_ext_free.ext_id);
+            !castle_ct_value_ext_contains(c_bvec->tree, cvt.cep.ext_id));
 
     debug("Out of line.\n");
     /* Finally, out of line values */
@@ -1704,8 +2377,7 @@ int castle_object_get(struct castle_object_get *get,
                       int cpu_index)
 {
     c_vl_bkey_t *btree_key;
-    c_bvec_t *c_bvec;
-    c_bio_t *c_bio;
+    int ret;
 
     debug("castle_object_get get=%p\n", get);
 
@@ -1716,10 +2388,39 @@ int castle_object_get(struct castle_object_get *get,
     if (!btree_key)
         return -EINVAL;
 
+    ret = castle_object_bkey_get(get, attachment, btree_key, 0 /*key_borrowed*/, cpu_index);
+    if (ret)
+        castle_object_bkey_free(btree_key);
+
+    return ret;
+}
+EXPORT_SYMBOL(castle_object_get);
+
+/**
+ * Lookup and return an object from btree, for a key already converted to a btree key.
+ *
+ * @param btree_key     Key to look up, freed once the lookup completes (but not on error)
+ * @param key_borrowed  btree_key is the caller's, valid until the lookup completes, and
+ *                      is never freed
+ *
+ * @also castle_object_get()
+ */
+int castle_object_bkey_get(struct castle_object_get *get,
+                           struct castle_attachment *attachment,
+                           c_vl_bkey_t *btree_key,
+                           int key_borrowed,
+                           int cpu_index)
+{
+    c_bvec_t *c_bvec;
+    c_bio_t *c_bio;
+
+    if(!castle_fs_inited)
+        return -ENODEV;
+
     /* Single c_bvec for the bio */
     c_bio = castle_utils_bio_alloc(1);
     if(!c_bio)
-        return -ENOMEM; // @TODO leaking btree_key?
+        return -ENOMEM;
     BUG_ON(!attachment);
     c_bio->attachment    = attachment;
     c_bio->get           = get;
@@ -1729,6 +2430,9 @@ int castle_object_get(struct castle_object_get *get,
     c_bvec->key             = btree_key;
     c_bvec->cpu_index       = cpu_index;
     c_bvec->cpu             = castle_double_array_request_cpu(c_bvec->cpu_index);
+    c_bvec->flags           = 0;
+    if (key_borrowed)
+        set_bit(CBV_KEY_BORROWED, &c_bvec->flags);
     c_bvec->ref_get         = castle_object_reference_get;
     c_bvec->submit_complete = castle_object_get_complete;
     c_bvec->orig_complete   = NULL;
@@ -1739,7 +2443,7 @@ int castle_object_get(struct castle_object_get *get,
 
     return 0;
 }
-EXPORT_SYMBOL(castle_object_get);
+EXPORT_SYMBOL(castle_object_bkey_get);
 
 void castle_object_pull_finish(struct castle_object_pull *pull)
 {
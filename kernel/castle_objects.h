@@ -6,8 +6,21 @@ c_vl_okey_t* castle_object_btree_key_convert (c_vl_bkey_t *btree_key);
 void         castle_object_okey_free         (c_vl_okey_t *obj_key);
 c_vl_okey_t *castle_object_okey_copy         (c_vl_okey_t *obj_key);
 void         castle_object_bkey_free         (c_vl_bkey_t *btree_key);
+int          castle_object_btree_key_init    (c_vl_bkey_t *key, uint32_t key_size, int nr_dims);
+int          castle_object_btree_key_dim_append(c_vl_bkey_t *key,
+                                              uint32_t key_size,
+                                              int dim,
+                                              const void *data,
+                                              uint32_t len);
+int          castle_object_flat_key_import   (c_vl_bkey_t *key, uint32_t key_len, int empty_dims_ok);
+c_vl_okey_t* castle_object_btree_key_okey_build(c_vl_bkey_t *btree_key);
 
 int          castle_object_btree_key_compare (c_vl_bkey_t *key1, c_vl_bkey_t *key2);
+int          castle_object_btree_key_in_hypercube(c_vl_bkey_t *key,
+                                                  c_vl_bkey_t *start,
+                                                  c_vl_bkey_t *end);
+uint64_t     castle_object_btree_key_prefix  (c_vl_bkey_t *key);
+uint32_t     castle_object_btree_key_dims_hash(c_vl_bkey_t *key);
 void        *castle_object_btree_key_next    (c_vl_bkey_t *key);
 void        *castle_object_btree_key_duplicate(c_vl_bkey_t *key);
 
@@ -15,19 +28,47 @@ int          castle_object_get               (struct castle_object_get *get,
                                               struct castle_attachment *attachment,
                                               c_vl_okey_t *key,
                                               int cpu_index);
+int          castle_object_bkey_get          (struct castle_object_get *get,
+                                              struct castle_attachment *attachment,
+                                              c_vl_bkey_t *btree_key,
+                                              int key_borrowed,
+                                              int cpu_index);
 int          castle_object_iter_start        (struct castle_attachment *attachment,
                                               c_vl_okey_t *start_key,
                                               c_vl_okey_t *end_key,
+                                              castle_iter_filter_t *filter,
                                               castle_object_iterator_t **iter);
 int          castle_object_iter_next         (castle_object_iterator_t *iterator,
                                               castle_object_iter_next_available_t callback,
                                               void *data);
 int          castle_object_iter_finish       (castle_object_iterator_t *iter);
+int          castle_object_range_stats       (castle_object_range_stats_t *stats,
+                                              struct castle_attachment *attachment,
+                                              c_vl_okey_t *start_key,
+                                              c_vl_okey_t *end_key);
+int          castle_object_range_remove      (struct castle_attachment *attachment,
+                                              c_vl_okey_t *start_key,
+                                              c_vl_okey_t *end_key);
 int          castle_object_replace           (struct castle_object_replace *replace,
                                               struct castle_attachment *attachment,
                                               c_vl_okey_t *key,
                                               int cpu_index,
                                               int tombstone);
+int          castle_object_bkey_replace      (struct castle_object_replace *replace,
+                                              struct castle_attachment *attachment,
+                                              c_vl_bkey_t *btree_key,
+                                              int key_borrowed,
+                                              int cpu_index,
+                                              int tombstone);
+int          castle_object_bkey_replace_init (struct castle_object_replace *replace,
+                                              struct castle_attachment *attachment,
+                                              c_vl_bkey_t *btree_key,
+                                              int key_borrowed,
+                                              int cpu_index,
+                                              int tombstone);
+void         castle_object_replace_batch_queue(struct castle_object_replace *replace);
+void         castle_object_replace_insert    (struct castle_object_replace *replace);
+void         castle_object_replace_abort     (struct castle_object_replace *replace, int err);
 int          castle_object_replace_continue  (struct castle_object_replace *replace);
 int          castle_object_replace_cancel    (struct castle_object_replace *replace);
 void         castle_object_pull_finish       (struct castle_object_pull *pull);
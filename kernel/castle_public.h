@@ -7,7 +7,7 @@
 #include <sys/time.h>
 #endif
 
-#define CASTLE_PROTOCOL_VERSION 10
+#define CASTLE_PROTOCOL_VERSION 15
 
 #define PACKED               __attribute__((packed))
 
@@ -46,6 +46,15 @@ typedef enum {
     LAST_ENV_VAR_ID,
 } c_env_var_t;
 
+/**
+ * Doubling array compaction policies.
+ */
+typedef enum {
+    CASTLE_COMPACTION_DOUBLING  = 0,    /**< Size-tiered, merge two trees per level.    */
+    CASTLE_COMPACTION_LEVELED,          /**< Single sorted run per level.               */
+    CASTLE_COMPACTION_POLICIES,
+} c_compaction_policy_t;
+
 /**
  * Trace providers.
  */
@@ -157,6 +166,7 @@ typedef uint32_t c_da_t;
 #define CASTLE_CTRL_SLAVE_SCAN               30
 #define CASTLE_CTRL_DELETE_VERSION           31
 #define CASTLE_CTRL_VERTREE_COMPACT          32
+#define CASTLE_CTRL_VERTREE_COMPACTION_POLICY 33
 
 typedef struct castle_control_cmd_claim {
     uint32_t       dev;          /* IN  */
@@ -221,6 +231,12 @@ typedef struct castle_control_cmd_vertree_compact {
     int    ret;             /* OUT */
 } cctrl_cmd_vertree_compact_t;
 
+typedef struct castle_control_cmd_vertree_compaction_policy {
+    c_da_t   vertree_id;      /* IN */
+    uint32_t policy;          /* IN, c_compaction_policy_t */
+    int      ret;             /* OUT */
+} cctrl_cmd_vertree_compaction_policy_t;
+
 typedef struct castle_control_cmd_delete_version {
     c_ver_t version;         /* IN */
     int     ret;             /* OUT */
@@ -319,6 +335,7 @@ typedef struct castle_control_ioctl {
         cctrl_cmd_destroy_vertree_t     destroy_vertree;
         cctrl_cmd_delete_version_t      delete_version;
         cctrl_cmd_vertree_compact_t     vertree_compact;
+        cctrl_cmd_vertree_compaction_policy_t vertree_compaction_policy;
         cctrl_cmd_clone_t               clone;
 
         cctrl_cmd_transfer_create_t     transfer_create;
@@ -373,6 +390,8 @@ enum {
         _IOWR(CASTLE_CTRL_IOCTL_TYPE, CASTLE_CTRL_DELETE_VERSION, cctrl_ioctl_t),
     CASTLE_CTRL_VERTREE_COMPACT_IOCTL =
         _IOWR(CASTLE_CTRL_IOCTL_TYPE, CASTLE_CTRL_VERTREE_COMPACT, cctrl_ioctl_t),
+    CASTLE_CTRL_VERTREE_COMPACTION_POLICY_IOCTL =
+        _IOWR(CASTLE_CTRL_IOCTL_TYPE, CASTLE_CTRL_VERTREE_COMPACTION_POLICY, cctrl_ioctl_t),
     CASTLE_CTRL_PROTOCOL_VERSION_IOCTL =
         _IOWR(CASTLE_CTRL_IOCTL_TYPE, CASTLE_CTRL_PROTOCOL_VERSION, cctrl_ioctl_t),
     CASTLE_CTRL_ENVIRONMENT_SET_IOCTL =
@@ -409,6 +428,26 @@ typedef struct castle_var_length_object_key {
     c_vl_key_t *dims[];
 } PACKED c_vl_okey_t;
 
+/*
+ * Flat key, pointer free.  Used in place of c_vl_okey_t by connections that selected
+ * CASTLE_KEY_FORMAT_FLAT, wherever requests take a key pointer and length.
+ *
+ * Laid out like the btree key: the header, one dim_head per dimension, then the dimensions
+ * back to back.  dim_head is the offset of the dimension from the start of the key, built
+ * with CASTLE_FKEY_DIM_HEADER().  A dimension ends where the next one starts, the last one
+ * at the end of the key.  Zero length dimensions are -inf, where those are allowed.
+ */
+typedef struct castle_flat_key {
+    uint32_t length;        /* Length of the key, not counting this field */
+    uint32_t nr_dims;
+    uint8_t  _unused[8];
+    uint32_t dim_head[];
+} PACKED c_vl_fkey_t;
+
+#define CASTLE_FKEY_DIM_OFFSET_SHIFT    (8)
+#define CASTLE_FKEY_DIM_HEADER(_off)    ((uint32_t)(_off) << CASTLE_FKEY_DIM_OFFSET_SHIFT)
+#define CASTLE_FKEY_DIM_OFFSET(_head)   ((_head) >> CASTLE_FKEY_DIM_OFFSET_SHIFT)
+
 #define CASTLE_RING_PAGES (16)                              /**< 64 requests/page.                */
 #define CASTLE_RING_SIZE (CASTLE_RING_PAGES << PAGE_SHIFT)  /**< Must be ^2 or things break.      */
 
@@ -416,6 +455,11 @@ typedef struct castle_var_length_object_key {
 
 #define CASTLE_IOCTL_POKE_RING 2
 #define CASTLE_IOCTL_WAIT 3
+#define CASTLE_IOCTL_POLL 4  /* arg is the max polling window in us, 0 disables polling */
+#define CASTLE_IOCTL_KEY_FORMAT 5  /* arg is a CASTLE_KEY_FORMAT_*, set before queueing requests */
+
+#define CASTLE_KEY_FORMAT_OKEY 0  /* c_vl_okey_t keys, castle_key_value_list iterator replies */
+#define CASTLE_KEY_FORMAT_FLAT 1  /* c_vl_fkey_t keys, castle_iter_reply iterator replies */
 
 #define CASTLE_RING_REPLACE 1
 #define CASTLE_RING_BIG_PUT 2
@@ -428,6 +472,14 @@ typedef struct castle_var_length_object_key {
 #define CASTLE_RING_ITER_FINISH 9
 #define CASTLE_RING_ITER_SKIP 10
 #define CASTLE_RING_REMOVE 11
+#define CASTLE_RING_MULTI_GET 12
+#define CASTLE_RING_WRITE_BATCH 13
+#define CASTLE_RING_RANGE_STATS 14
+#define CASTLE_RING_REMOVE_RANGE 15
+#define CASTLE_RING_UPDATE 16
+
+#define CASTLE_MULTI_GET_MAX_KEYS 1024
+#define CASTLE_WRITE_BATCH_MAX_ENTRIES 1024
 
 typedef uint32_t castle_interface_token_t;
 
@@ -445,6 +497,46 @@ typedef struct castle_request_remove {
     uint32_t              key_len;
 } castle_request_remove_t;
 
+/*
+ * Removes every key in the start_key - end_key hypercube, in one go.  The keys aren't counted,
+ * the response length is 0.
+ */
+typedef struct castle_request_remove_range {
+    c_collection_id_t     collection_id;
+    c_vl_okey_t          *start_key_ptr;
+    uint32_t              start_key_len;
+    c_vl_okey_t          *end_key_ptr;
+    uint32_t              end_key_len;
+} castle_request_remove_range_t;
+
+#define CASTLE_UPDATE_COMPARE_AND_SET 0 /* Replace if the value hashes to expected_hash */
+#define CASTLE_UPDATE_ADD             1 /* Add an int64_t to an int64_t value, 0 if absent */
+#define CASTLE_UPDATE_APPEND          2 /* Append to the value, created if absent */
+
+#define CASTLE_UPDATE_FLAG_ABSENT     0x1 /* Compare and set only if the key doesn't exist */
+
+#define CASTLE_UPDATE_MAX_VALUE_LEN   (16 * 1024)
+
+/*
+ * Read-modify-write of the value of a key, done in the kernel.  Updates of a key are applied
+ * one after the other, in the order they arrive, but aren't ordered against plain replaces and
+ * removes of the key.
+ *
+ * The value hash is murmur_hash_64(value, length, 0).  A compare and set that doesn't match
+ * fails with -ECANCELED.  The response length is the new counter value for an add, the length
+ * of the new value otherwise.
+ */
+typedef struct castle_request_update {
+    c_collection_id_t     collection_id;
+    c_vl_okey_t          *key_ptr;
+    uint32_t              key_len;
+    uint32_t              type;          /* CASTLE_UPDATE_* */
+    void                 *value_ptr;     /* New value, the int64_t to add, or data to append */
+    uint32_t              value_len;
+    uint32_t              flags;
+    uint64_t              expected_hash;
+} castle_request_update_t;
+
 typedef struct castle_request_get {
     c_collection_id_t    collection_id;
     c_vl_okey_t         *key_ptr;
@@ -453,6 +545,41 @@ typedef struct castle_request_get {
     uint32_t             value_len;
 } castle_request_get_t;
 
+typedef struct castle_key_ptr {
+    c_vl_okey_t         *key_ptr;
+    uint32_t             key_len;
+} castle_key_ptr_t;
+
+typedef struct castle_request_multi_get {
+    c_collection_id_t    collection_id;
+    castle_key_ptr_t    *keys_ptr;  /* Array of nr_keys keys */
+    uint32_t             nr_keys;
+    void                *buffer_ptr; /* where to put the results, @see castle_multi_get_val */
+    uint32_t             buffer_len;
+} castle_request_multi_get_t;
+
+#define CASTLE_WRITE_BATCH_REMOVE 0x1
+
+typedef struct castle_write_batch_entry {
+    c_vl_okey_t         *key_ptr;
+    uint32_t             key_len;
+    uint32_t             flags;     /* CASTLE_WRITE_BATCH_REMOVE for a remove */
+    void                *value_ptr; /* In the same buffer as the entries */
+    uint32_t             value_len;
+} castle_write_batch_entry_t;
+
+/*
+ * Entries are applied in key order, the last entry of the batch for a key wins.  The batch is
+ * atomic: if any entry fails before the keys are inserted none of them is, and point lookups
+ * see either all of the batch or none of it.  The response length is the number of entries
+ * applied, the error is that of the first entry that failed.
+ */
+typedef struct castle_request_write_batch {
+    c_collection_id_t            collection_id;
+    castle_write_batch_entry_t  *entries_ptr; /* Array of nr_entries entries */
+    uint32_t                     nr_entries;
+} castle_request_write_batch_t;
+
 typedef struct castle_request_iter_start {
     c_collection_id_t    collection_id;
     c_vl_okey_t         *start_key_ptr;
@@ -460,11 +587,58 @@ typedef struct castle_request_iter_start {
     c_vl_okey_t         *end_key_ptr;
     uint32_t             end_key_len;
     uint64_t             flags;
+    struct castle_iter_filter *filter_ptr; /* NULL for no filter */
 } castle_request_iter_start_t;
 
 #define CASTLE_RING_ITER_FLAG_NONE      0x0
 #define CASTLE_RING_ITER_FLAG_NO_VALUES 0x1
 
+/*
+ * Iterator filters, applied in the kernel so that entries which don't match never cross the
+ * ring.  Pointer free, like c_vl_fkey_t: the header, nr_dims castle_iter_dim_filters, then
+ * the prefixes, each at prefix_offset bytes from the start of the filter.
+ *
+ * Ranges on a dimension are what the start and end keys give already.  A dimension filter
+ * only returns keys whose dimension starts with the prefix, and the iterator skips over the
+ * keys that don't rather than reading through them.  A dimension may have several filters,
+ * all of them have to match.
+ */
+struct castle_iter_dim_filter {
+    uint32_t dim;
+    uint32_t prefix_offset;
+    uint32_t prefix_len;    /* Must not be 0 */
+    uint32_t _unused;
+};
+
+typedef struct castle_iter_filter {
+    uint32_t length;        /* Length of the filter, not counting this field */
+    uint32_t nr_dims;       /* Number of dimension filters */
+    uint64_t min_val_len;   /* Skip values shorter than this */
+    uint64_t max_val_len;   /* Skip values longer than this, 0 for no limit */
+    uint32_t val_prefix_len;/* Return at most this many bytes of inline values, 0 for all */
+    uint32_t _unused;
+    struct castle_iter_dim_filter dims[];
+} PACKED castle_iter_filter_t;
+
+#define CASTLE_ITER_FILTER_MAX_LEN (4096)
+
+#define CASTLE_RANGE_STATS_FLAG_KEYS 0x1 /* Return the first and last keys too */
+
+/*
+ * Counts the entries of a key range in the kernel, and adds up their value lengths.  The
+ * response length is the number of bytes of the buffer used, @see castle_range_stats.
+ */
+typedef struct castle_request_range_stats {
+    c_collection_id_t    collection_id;
+    c_vl_okey_t         *start_key_ptr;
+    uint32_t             start_key_len;
+    c_vl_okey_t         *end_key_ptr;
+    uint32_t             end_key_len;
+    void                *buffer_ptr; /* where to put the results */
+    uint32_t             buffer_len;
+    uint32_t             flags;
+} castle_request_range_stats_t;
+
 typedef struct castle_request_iter_next {
     castle_interface_token_t  token;
     void                     *buffer_ptr;
@@ -506,7 +680,10 @@ typedef struct castle_request {
     union {
         castle_request_replace_t     replace;
         castle_request_remove_t      remove;
+        castle_request_update_t      update;
         castle_request_get_t         get;
+        castle_request_multi_get_t   multi_get;
+        castle_request_write_batch_t write_batch;
 
         castle_request_big_get_t     big_get;
         castle_request_get_chunk_t   get_chunk;
@@ -516,6 +693,9 @@ typedef struct castle_request {
         castle_request_iter_start_t  iter_start;
         castle_request_iter_next_t   iter_next;
         castle_request_iter_finish_t iter_finish;
+
+        castle_request_range_stats_t range_stats;
+        castle_request_remove_range_t remove_range;
     };
 } castle_request_t;
 
@@ -535,12 +715,60 @@ struct castle_iter_val {
     };
 };
 
+/*
+ * Multi get results.  The buffer starts with one of these per key, in the order of the keys.
+ * Values follow, packed in no particular order, each 8 byte aligned.  The response length is
+ * the number of bytes of the buffer used.
+ */
+struct castle_multi_get_val {
+    int32_t                err;     /* 0, -ENOENT if not found, -ENOSPC if the value didn't fit */
+    uint32_t               _unused;
+    uint64_t               length;  /* Length of the value, even if it didn't fit */
+    uint8_t               *val;
+};
+
 struct castle_key_value_list {
     struct castle_key_value_list *next;
     c_vl_okey_t                  *key;
     struct castle_iter_val       *val;
 };
 
+/*
+ * Range stats results.  With CASTLE_RANGE_STATS_FLAG_KEYS the first and last keys of the range
+ * follow, in the key format of the connection, at the given offsets from the start of the
+ * buffer.  A key is left out, with a length of 0, if the range is empty or it didn't fit.
+ */
+struct castle_range_stats {
+    uint64_t               nr_entries;
+    uint64_t               nr_bytes;    /* Total length of the values */
+    uint32_t               first_key_offset;
+    uint32_t               first_key_len;
+    uint32_t               last_key_offset;
+    uint32_t               last_key_len;
+};
+
+/*
+ * Iterator results on CASTLE_KEY_FORMAT_FLAT connections.  The buffer starts with a
+ * castle_iter_reply, followed by nr_items items.  Each item is a castle_iter_item, then the
+ * flat key, then the value if it is inline, padded to a multiple of 8 bytes.
+ */
+struct castle_iter_reply {
+    uint32_t               nr_items;
+    uint32_t               _unused;
+};
+
+struct castle_iter_item {
+    uint32_t               key_len;
+    uint8_t                val_type;    /* 0 with CASTLE_RING_ITER_FLAG_NO_VALUES */
+    uint8_t                _unused[3];
+    uint64_t               val_len;     /* Length of the value, even if it isn't inline,
+                                           after castle_iter_filter.val_prefix_len */
+};
+
+#define CASTLE_ITER_ITEM_SIZE(_item)                                                            \
+    (((sizeof(struct castle_iter_item) + (_item)->key_len                                      \
+       + (((_item)->val_type & CVT_TYPE_INLINE) ? (_item)->val_len : 0)) + 7) & ~7ULL)
+
 
 #define CASTLE_SLAVE_MAGIC1     (0x02061985)
 #define CASTLE_SLAVE_MAGIC2     (0x16071983)
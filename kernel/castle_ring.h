@@ -128,6 +128,9 @@ struct __name##_sring {                                                 \
         struct {                                                        \
             uint8_t msg;                                                \
         } tapif_user;                                                   \
+        struct {                                                        \
+            uint8_t polling; /* back end is polling, no need to poke */ \
+        } castle;                                                       \
         uint8_t pvt_pad[4];                                             \
     } private;                                                          \
     uint8_t __pad[44];                                                  \
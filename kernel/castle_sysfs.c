@@ -13,6 +13,7 @@
 #include "castle_da.h"
 #include "castle_utils.h"
 #include "castle_btree.h"
+#include "castle_bloom.h"
 
 static wait_queue_head_t castle_sysfs_kobj_release_wq;
 static struct kobject    double_arrays_kobj;
@@ -221,6 +222,13 @@ static ssize_t double_array_number_show(struct kobject *kobj,
     return sprintf(buf, "%d\n", castle_da_count());
 }
 
+static ssize_t double_array_merge_queue_show(struct kobject *kobj,
+                                             struct attribute *attr,
+                                             char *buf)
+{
+    return castle_da_merge_sched_print(buf);
+}
+
 static ssize_t da_version_show(struct kobject *kobj,
                                struct attribute *attr,
                                char *buf)
@@ -239,6 +247,24 @@ static ssize_t da_compacting_show(struct kobject *kobj,
     return sprintf(buf, "%u\n", castle_da_compacting(da));
 }
 
+static ssize_t da_admission_show(struct kobject *kobj,
+                                 struct attribute *attr,
+                                 char *buf)
+{
+    struct castle_double_array *da = container_of(kobj, struct castle_double_array, kobj);
+
+    return castle_da_admission_print(da, buf);
+}
+
+static ssize_t da_compaction_show(struct kobject *kobj,
+                                  struct attribute *attr,
+                                  char *buf)
+{
+    struct castle_double_array *da = container_of(kobj, struct castle_double_array, kobj);
+
+    return castle_da_compaction_print(da, buf);
+}
+
 static ssize_t da_size_show(struct kobject *kobj,
                             struct attribute *attr,
                             char *buf)
@@ -281,16 +307,26 @@ static ssize_t da_size_show(struct kobject *kobj,
  * <nr of trees in DA> <Height of DA>
  *
  * " One row for each level contains #trees and one entry for each tree in the level
- * <nr of trees in level> [<item count> <leaf node size> <internal node size> <tree depth> <size of the tree(in chunks)>] [] []
+ * <nr of trees in level> [<item count> <leaf node size> <internal node size> <tree depth> <size of the tree(in chunks)> <tombstones>
+ *                          <bloom queries> <bloom negatives> <bloom false positives> <btree node reads saved>
+ *                          <average bloom lookup time(ns)>] [] []
+ *
+ * " One row with the bloom filter counters summed over all trees
+ * <bloom queries> <bloom negatives> <bloom false positives> <btree node reads saved> <average bloom lookup time(ns)>
+ *
+ * Bloom counters are 0 for trees without a filter.
  */
 static ssize_t da_tree_list_show(struct kobject *kobj,
                                  struct attribute *attr,
                                  char *buf)
 {
     struct castle_double_array *da = container_of(kobj, struct castle_double_array, kobj);
+    struct castle_bloom_stats stats, da_stats;
     int i;
     int ret = 0;
 
+    memset(&da_stats, 0, sizeof(struct castle_bloom_stats));
+
     /* Get READ lock on DA, to make sure DA doesnt disappear while printing stats. */
     read_lock(&da->lock);
 
@@ -315,8 +351,16 @@ static ssize_t da_tree_list_show(struct kobject *kobj,
 
             ct = list_entry(lh, struct castle_component_tree, da_list);
             btree = castle_btree_type_get(ct->btree_type);
+            memset(&stats, 0, sizeof(struct castle_bloom_stats));
+            if (ct->bloom_exists)
+                castle_bloom_stats_get(&ct->bloom, &stats);
+            da_stats.queries         += stats.queries;
+            da_stats.negatives       += stats.negatives;
+            da_stats.false_positives += stats.false_positives;
+            da_stats.ios_saved       += stats.ios_saved;
+            da_stats.lookup_ns       += stats.lookup_ns;
             ret = snprintf(buf, PAGE_SIZE,
-                           "%s[%lu %u %u %u %u] ",
+                           "%s[%lu %u %u %u %u %llu %llu %llu %llu %llu %llu] ",
                            buf,
                            atomic64_read(&ct->item_count),       /* Item count*/
                            (uint32_t)btree->node_size(ct, 0),    /* Leaf node size */
@@ -328,7 +372,14 @@ static ssize_t da_tree_list_show(struct kobject *kobj,
                             CHUNK(ct->data_ext_free.ext_size) +
                             CHUNK(ct->internal_ext_free.ext_size) +
                             ((ct->bloom_exists)?ct->bloom.num_chunks:0) +
-                            atomic64_read(&ct->large_ext_chk_cnt)));           /* Tree size */
+                            atomic64_read(&ct->large_ext_chk_cnt)),            /* Tree size */
+                           ct->nr_tombstones,                    /* Tombstones */
+                           stats.queries,                        /* Bloom queries */
+                           stats.negatives,                      /* Bloom negatives */
+                           stats.false_positives,                /* Bloom false positives */
+                           stats.ios_saved,                      /* Btree node reads saved */
+                           stats.queries ?                       /* Average bloom lookup time */
+                               stats.lookup_ns / stats.queries : 0);
             if (ret >= PAGE_SIZE)
                 goto err;
         }
@@ -336,6 +387,70 @@ static ssize_t da_tree_list_show(struct kobject *kobj,
         if (ret >= PAGE_SIZE)
             goto err;
     }
+    ret = snprintf(buf, PAGE_SIZE, "%s%llu %llu %llu %llu %llu\n",
+                   buf,
+                   da_stats.queries,
+                   da_stats.negatives,
+                   da_stats.false_positives,
+                   da_stats.ios_saved,
+                   da_stats.queries ? da_stats.lookup_ns / da_stats.queries : 0);
+    if (ret >= PAGE_SIZE)
+        goto err;
+    ret = 0;
+
+err:
+    read_unlock(&da->lock);
+
+    if (ret) sprintf(buf + PAGE_SIZE - 20, "Overloaded...\n");
+
+    return strlen(buf);
+}
+
+/**
+ * Bloom filters of the DA's trees, one line per tree:
+ * level, tree seq, bits per element, hashes, expected and measured false positive rates
+ * (parts per million), lookups that consulted the filter, format (0 blocks, 1 cache lines),
+ * whether the filter is held in memory outside the cache.
+ */
+static ssize_t da_bloom_show(struct kobject *kobj,
+                             struct attribute *attr,
+                             char *buf)
+{
+    struct castle_double_array *da = container_of(kobj, struct castle_double_array, kobj);
+    struct castle_bloom_stats stats;
+    int i;
+    int ret = 0;
+
+    buf[0] = '\0';
+    read_lock(&da->lock);
+
+    for(i=0; i<=da->top_level; i++)
+    {
+        struct castle_component_tree *ct;
+        struct list_head *lh;
+
+        list_for_each(lh, &da->levels[i].trees)
+        {
+            ct = list_entry(lh, struct castle_component_tree, da_list);
+            if (!ct->bloom_exists)
+                continue;
+            castle_bloom_stats_get(&ct->bloom, &stats);
+            ret = snprintf(buf, PAGE_SIZE,
+                           "%s%d %u %u %u %u %u %llu %u %d\n",
+                           buf,
+                           i,
+                           ct->seq,
+                           ct->bloom.bits_per_element,
+                           ct->bloom.num_hashes,
+                           castle_bloom_fp_expected(&ct->bloom),
+                           castle_bloom_fp_measured(&ct->bloom),
+                           stats.queries,
+                           ct->bloom.format,
+                           ct->bloom.resident != NULL);
+            if (ret >= PAGE_SIZE)
+                goto err;
+        }
+    }
     ret = 0;
 
 err:
@@ -652,8 +767,12 @@ static struct kobj_type castle_versions_ktype = {
 static struct castle_sysfs_entry double_array_number =
 __ATTR(number, S_IRUGO|S_IWUSR, double_array_number_show, NULL);
 
+static struct castle_sysfs_entry double_array_merge_queue =
+__ATTR(merge_queue, S_IRUGO|S_IWUSR, double_array_merge_queue_show, NULL);
+
 static struct attribute *castle_double_array_attrs[] = {
     &double_array_number.attr,
+    &double_array_merge_queue.attr,
     NULL,
 };
 
@@ -675,11 +794,23 @@ __ATTR(compacting, S_IRUGO|S_IWUSR, da_compacting_show, NULL);
 static struct castle_sysfs_entry da_tree_list =
 __ATTR(component_trees, S_IRUGO|S_IWUSR, da_tree_list_show, NULL);
 
+static struct castle_sysfs_entry da_bloom =
+__ATTR(bloom_filters, S_IRUGO|S_IWUSR, da_bloom_show, NULL);
+
+static struct castle_sysfs_entry da_admission =
+__ATTR(admission, S_IRUGO|S_IWUSR, da_admission_show, NULL);
+
+static struct castle_sysfs_entry da_compaction =
+__ATTR(compaction, S_IRUGO|S_IWUSR, da_compaction_show, NULL);
+
 static struct attribute *castle_da_attrs[] = {
     &da_version.attr,
     &da_size.attr,
     &da_compacting.attr,
     &da_tree_list.attr,
+    &da_bloom.attr,
+    &da_admission.attr,
+    &da_compaction.attr,
     NULL,
 };
 